@@ -45,6 +45,9 @@
 #include "libws.h"
 #include "libws_handshake.h"
 #include "libws_utf8.h"
+#include "libws_cpu.h"
+#include "libws_mask.h"
+#include "libws_random.h"
 
 void ws_set_memory_functions(ws_malloc_replacement_f malloc_replace,
 							 ws_free_replacement_f free_replace,
@@ -52,6 +55,46 @@ void ws_set_memory_functions(ws_malloc_replacement_f malloc_replace,
 {
 	_ws_set_memory_functions(malloc_replace, free_replace, realloc_replace);
 }
+
+///
+/// Creates the random generator used for the frame masks. It must
+/// be done after the random source has been opened.
+///
+static int _ws_global_random_init(ws_base_t b)
+{
+	int fd = -1;
+
+	#ifndef _WIN32
+	fd = b->random_fd;
+	#endif
+
+	if (!(b->random = (ws_random_t *)_ws_malloc(sizeof(ws_random_t))))
+	{
+		LIBWS_LOG(LIBWS_CRIT, "Out of memory!");
+		return -1;
+	}
+
+	if (_ws_random_init(b->random, fd))
+	{
+		LIBWS_LOG(LIBWS_ERR, "Failed to seed the random generator");
+		_ws_free(b->random);
+		b->random = NULL;
+		return -1;
+	}
+
+	return 0;
+}
+
+static void _ws_global_random_destroy(ws_base_t b)
+{
+	if (b->random)
+	{
+		_ws_random_destroy(b->random);
+		_ws_free(b->random);
+		b->random = NULL;
+	}
+}
+
 #ifndef LIBWS_EXTERNAL_LOOP
 int ws_global_init(ws_base_t *base)
 {
@@ -67,6 +110,11 @@ int ws_global_init(ws_base_t *base)
 
 	LIBWS_LOG(LIBWS_INFO, "Libevent version %s", event_get_version());
 
+	_ws_mask_init(_ws_cpu_features());
+	_ws_utf8_init(_ws_cpu_features());
+	LIBWS_LOG(LIBWS_INFO, "Masking implementation %s, UTF8 validator %s", 
+				_ws_mask_impl_name(), _ws_utf8_impl_name());
+
 	if (!(*base = (ws_base_s *)_ws_calloc(1, sizeof(ws_base_s))))
 	{
 		LIBWS_LOG(LIBWS_CRIT, "Out of memory!");
@@ -107,6 +155,11 @@ int ws_global_init(ws_base_t *base)
 	}
 	#endif
 
+	if (_ws_global_random_init(b))
+	{
+		goto fail;
+	}
+
 	// Create Libevent context.
 	{
 		if (!(b->ev_base = event_base_new()))
@@ -135,6 +188,8 @@ int ws_global_init(ws_base_t *base)
 
 	return 0;
 fail:
+	_ws_global_random_destroy(b);
+
 	if (b->ev_base)
 	{
 		event_base_free(b->ev_base);
@@ -175,6 +230,8 @@ void ws_global_destroy(ws_base_t *base)
 
 	#endif // _WIN32
 
+	_ws_global_random_destroy(b);
+
 	if (b->dns_base)
 	{
 		evdns_base_free(b->dns_base, 1);
@@ -203,6 +260,8 @@ int ws_global_init(ws_base_t base, struct event_base* evbase, struct evdns_base*
 {
     assert(base);
     memset(base, 0, sizeof(ws_base_s));
+    _ws_mask_init(_ws_cpu_features());
+    _ws_utf8_init(_ws_cpu_features());
 #ifndef _WIN32
     if ((base->random_fd = open(WS_RANDOM_PATH, O_RDONLY)) < 0)
     {
@@ -211,6 +270,11 @@ int ws_global_init(ws_base_t base, struct event_base* evbase, struct evdns_base*
     }
 #endif
 
+    if (_ws_global_random_init(base))
+    {
+        return -1;
+    }
+
     base->ev_base = evbase;
     base->dns_base = dnsbase;
     struct timeval asap = {0, 0};
@@ -240,6 +304,7 @@ void ws_global_destroy(ws_base_t *base)
         LIBWS_LOG(LIBWS_ERR, "Failed to close random source: %s (%d)", strerror(errno), errno);
     }
 #endif
+    _ws_global_random_destroy(*base);
     _ws_free(*base);
 }
 #endif
@@ -268,6 +333,7 @@ int ws_init(ws_t *ws, ws_base_t ws_base)
 	w->msg_frame_begin_cb = ws_default_msg_frame_begin_cb;
 	w->msg_frame_data_cb = ws_default_msg_frame_data_cb;
 	w->msg_frame_end_cb = ws_default_msg_frame_end_cb;
+	w->coalesce_threshold = WS_DEFAULT_COALESCE_THRESHOLD;
 
 	w->ws_base = ws_base;
 
@@ -281,6 +347,16 @@ int ws_init(ws_t *ws, ws_base_t ws_base)
 	}
 	#endif // LIBWS_WITH_OPENSSL
 
+	if (_ws_threadsafe_init(w))
+	{
+		#ifdef LIBWS_WITH_OPENSSL
+		_ws_openssl_destroy(w);
+		#endif
+		_ws_free(*ws);
+		*ws = NULL;
+		return -1;
+	}
+
 	w->state = WS_STATE_CLOSED_CLEANLY;
 
 	return 0;
@@ -300,6 +376,17 @@ void
 
 	w = *ws;
 
+	// Before the bufferevent is freed, anything not
+	// sent yet is released with the cleanup callback.
+	_ws_threadsafe_destroy(w);
+
+	// Also reports what was never sent, there is
+	// no later loop iteration for this websocket.
+	_ws_sendq_clear(w);
+	_ws_fail_send_completions(w);
+	_ws_flush_send_done(w);
+	_ws_send_stream_end(w);
+
 	if (w->bev)
 	{
 		bufferevent_free(w->bev);
@@ -311,9 +398,34 @@ void
 		_ws_free(w->origin);
 	}
 
+	if (w->recv_buf)
+	{
+		_ws_free(w->recv_buf);
+	}
+
+	if (w->msg_buf)
+	{
+		_ws_free(w->msg_buf);
+	}
+
+	if (w->msg)
+	{
+		evbuffer_free(w->msg);
+	}
+
+	if (w->frame_data)
+	{
+		evbuffer_free(w->frame_data);
+	}
+
         _ws_free_timer(&w->connect_timeout_event);
         _ws_free_timer(&w->close_timeout_event);
         _ws_free_timer(&w->pong_timeout_event);
+        _ws_free_timer(&w->uncork_event);
+        _ws_free_timer(&w->send_blocked_event);
+        _ws_free_timer(&w->pace_event);
+        _ws_free_timer(&w->sendq_deadline_event);
+        _ws_free_timer(&w->send_done_event);
 
 	// Must be done after the bufferevent is freed.
 	if (w->rate_limits)
@@ -398,6 +510,8 @@ int ws_connect(ws_t ws, const char *server, int port, const char *uri)
 	ws->received_close = 0;
 	ws->sent_close = 0;
 	ws->in_msg = 0;
+	ws->recv_aborted = 0;
+	ws->recv_skip_len = 0;
 
 	if (_ws_create_bufferevent_socket(ws))
 	{
@@ -442,6 +556,9 @@ int ws_close_with_status_reason(ws_t ws, ws_close_status_t status,
     ws->state = WS_STATE_CLOSING;
     LIBWS_LOG(LIBWS_TRACE, "Sending close frame %d, %*s", status, reason_len, reason);
 
+    // Don't hold anything back when closing.
+    ws_uncork(ws);
+
     // The underlying TCP connection, in most normal cases, SHOULD be closed
     // first by the server, so that it holds the TIME_WAIT state and not the
     // client (as this would prevent it from re-opening the connection for 2
@@ -542,16 +659,19 @@ void ws_close_immediately(ws_t ws)
     }
 }
 
-static void _ws_close_threadsafe_callback(evutil_socket_t socket, short flags, void *arg)
-{
-    ws_t ws = arg;
-    ws_close(ws);
-}
-
 void ws_close_threadsafe(ws_t ws)
 {
-    ws_timer timer = NULL;
-    _ws_setup_timeout_event(ws, _ws_close_threadsafe_callback, &timer, &ws->ws_base->asap_ordered);
+    ws_threadsafe_req_t *req;
+    assert(ws);
+
+    if (!(req = (ws_threadsafe_req_t *)_ws_calloc(1, sizeof(ws_threadsafe_req_t))))
+    {
+        LIBWS_LOG(LIBWS_CRIT, "Out of memory!");
+        return;
+    }
+
+    req->close = 1;
+    _ws_threadsafe_push(ws, req);
 }
 
 int ws_base_service(ws_base_t base)
@@ -631,22 +751,22 @@ char *ws_get_uri(ws_t ws, char *buf, size_t bufsize)
 
 void ws_mask_payload(uint32_t mask, char *msg, uint64_t len)
 {
-	size_t i;
-	uint8_t *m = (uint8_t *)&mask;
-	uint8_t *p = (uint8_t *)msg;
-	
-	if (!msg || !len)
-		return;
-
-	for (i = 0; i < len; i++)
-	{
-		p[i] ^= m[i % 4];
-	}
+	_ws_mask(mask, 0, msg, msg, len);
 }
 
 void ws_unmask_payload(uint32_t mask, char *msg, uint64_t len)
 {
-	ws_mask_payload(mask, msg, len);
+	_ws_mask(mask, 0, msg, msg, len);
+}
+
+void ws_mask_payload_ex(uint32_t mask, uint64_t offset, char *msg, uint64_t len)
+{
+	_ws_mask(mask, offset, msg, msg, len);
+}
+
+void ws_unmask_payload_ex(uint32_t mask, uint64_t offset, char *msg, uint64_t len)
+{
+	_ws_mask(mask, offset, msg, msg, len);
 }
 
 void ws_set_no_copy_cb(ws_t ws, ws_no_copy_cleanup_f func, void *extra)
@@ -656,6 +776,65 @@ void ws_set_no_copy_cb(ws_t ws, ws_no_copy_cleanup_f func, void *extra)
 	ws->no_copy_extra = extra;
 }
 
+void ws_set_preserve_send_buffers(ws_t ws, int preserve)
+{
+	assert(ws);
+	ws->preserve_send_buffers = preserve;
+}
+
+int ws_cork(ws_t ws)
+{
+	assert(ws);
+
+	// An explicit cork stays until ws_uncork is called.
+	if (ws->uncork_event)
+	{
+		_ws_free_timer(&ws->uncork_event);
+	}
+
+	ws->corked = 1;
+
+	// Before this the handshake is being sent, reading the 
+	// handshake reply then disables writing if still corked.
+	if (ws->bev && (ws->state == WS_STATE_CONNECTED)
+	 && bufferevent_disable(ws->bev, EV_WRITE))
+	{
+		LIBWS_LOG(LIBWS_ERR, "Failed to disable writing");
+		return -1;
+	}
+
+	return 0;
+}
+
+int ws_uncork(ws_t ws)
+{
+	assert(ws);
+
+	if (ws->uncork_event)
+	{
+		_ws_free_timer(&ws->uncork_event);
+	}
+
+	if (!ws->corked)
+		return 0;
+
+	ws->corked = 0;
+
+	if (ws->bev && bufferevent_enable(ws->bev, EV_WRITE))
+	{
+		LIBWS_LOG(LIBWS_ERR, "Failed to enable writing");
+		return -1;
+	}
+
+	return 0;
+}
+
+void ws_set_auto_cork(ws_t ws, int auto_cork)
+{
+	assert(ws);
+	ws->auto_cork = auto_cork;
+}
+
 void ws_set_user_state(ws_t ws, void *user_state)
 {
 	assert(ws);
@@ -677,6 +856,7 @@ void *ws_get_user_state(ws_t ws)
 
 int ws_msg_begin(ws_t ws, int binary)
 {
+	int ret;
 	assert(ws);
 	_WS_MUST_BE_CONNECTED(ws, "message begin");
 
@@ -687,6 +867,18 @@ int ws_msg_begin(ws_t ws, int binary)
 		return -1;
 	}
 
+	if ((ret = _ws_check_send_blocked(ws)))
+	{
+		return ret;
+	}
+
+	_ws_msg_start(ws, binary);
+	
+	return 0;
+}
+
+void _ws_msg_start(ws_t ws, int binary)
+{
 	ws->binary_mode = binary;
 
 	memset(&ws->send_header, 0, sizeof(ws_header_t));
@@ -695,18 +887,28 @@ int ws_msg_begin(ws_t ws, int binary)
 						WS_OPCODE_BINARY_0X2 : WS_OPCODE_TEXT_0X1;
 
 	ws->send_state = WS_SEND_STATE_MESSAGE_BEGIN;
-	
-	return 0;
 }
 
-int ws_msg_frame_data_begin(ws_t ws, uint64_t datalen)
+size_t _ws_send_fragment_size(ws_t ws)
 {
-	uint8_t header_buf[WS_HDR_MAX_SIZE];
-	size_t header_len = 0;
+	size_t size = WS_STREAM_FRAGMENT_SIZE;
 
-	assert(ws);
-	_WS_MUST_BE_CONNECTED(ws, "frame data begin");
+	if (ws->adaptive_fragments)
+	{
+		size = _ws_sendq_adaptive_fragment_size(ws);
+	}
+
+	if ((ws->max_frame_size > 0) && (ws->max_frame_size < size))
+	{
+		return (size_t)ws->max_frame_size;
+	}
+
+	return size;
+}
 
+int _ws_msg_frame_header(ws_t ws, uint64_t datalen, 
+						uint8_t *header_buf, size_t *header_len)
+{
 	LIBWS_LOG(LIBWS_DEBUG, "Message frame data begin, opcode 0x%x "
 			"(send header)", ws->send_header.opcode, datalen);
 
@@ -727,6 +929,8 @@ int ws_msg_frame_data_begin(ws_t ws, uint64_t datalen)
 
 	ws->send_header.mask_bit = 0x1;
 	ws->send_header.payload_len = datalen;
+	ws->frame_size = datalen;
+	ws->frame_data_sent = 0;
 
 	if (_ws_get_random_mask(ws, (char *)&ws->send_header.mask, sizeof(uint32_t)) 
 		!= sizeof(uint32_t))
@@ -748,7 +952,23 @@ int ws_msg_frame_data_begin(ws_t ws, uint64_t datalen)
 		ws->send_header.opcode = WS_OPCODE_CONTINUATION_0X0;
 	}
 
-	ws_pack_header(&ws->send_header, header_buf, sizeof(header_buf), &header_len);
+	ws_pack_header(&ws->send_header, header_buf, WS_HDR_MAX_SIZE, header_len);
+
+	return 0;
+}
+
+int ws_msg_frame_data_begin(ws_t ws, uint64_t datalen)
+{
+	uint8_t header_buf[WS_HDR_MAX_SIZE];
+	size_t header_len = 0;
+
+	assert(ws);
+	_WS_MUST_BE_CONNECTED(ws, "frame data begin");
+
+	if (_ws_msg_frame_header(ws, datalen, header_buf, &header_len))
+	{
+		return -1;
+	}
 	
 	if (_ws_send_data(ws, (char *)header_buf, (uint64_t)header_len, 0))
 	{
@@ -756,6 +976,12 @@ int ws_msg_frame_data_begin(ws_t ws, uint64_t datalen)
 		return -1;
 	}
 
+	// Nothing else can be sent until the payload is done.
+	if (datalen > 0)
+	{
+		ws->send_state = WS_SEND_STATE_IN_MESSAGE_PAYLOAD;
+	}
+
 	return 0;
 }
 
@@ -766,24 +992,35 @@ int ws_msg_frame_data_send(ws_t ws, char *data, uint64_t datalen)
 
 	LIBWS_LOG(LIBWS_DEBUG, "Message frame data send");
 
-	if (ws->send_state != WS_SEND_STATE_IN_MESSAGE)
+	if ((ws->send_state != WS_SEND_STATE_IN_MESSAGE_PAYLOAD)
+	 && (ws->send_state != WS_SEND_STATE_IN_MESSAGE))
 	{
 		LIBWS_LOG(LIBWS_ERR, "Incorrect send state in frame data send");
 		return -1;
 	}
 
-	// TODO: Don't touch original buffer as an option?
-	if (ws->send_header.mask_bit)
-	{	
-		ws_mask_payload(ws->send_header.mask, data, datalen);
+	if ((ws->frame_data_sent + datalen) > ws->frame_size)
+	{
+		LIBWS_LOG(LIBWS_ERR, "Frame data larger than the frame size given "
+							"in frame data begin (%llu)", ws->frame_size);
+		return -1;
 	}
-	
-	if (_ws_send_data(ws, data, datalen, 1))
+
+	// The frame might be sent in several chunks, so we 
+	// have to continue with the mask where we left off.
+	if (_ws_send_payload(ws, data, datalen, ws->frame_data_sent, 1))
 	{
 		LIBWS_LOG(LIBWS_ERR, "Failed to send frame data");
 		return -1;
 	}
 
+	ws->frame_data_sent += datalen;
+
+	if (ws->frame_data_sent == ws->frame_size)
+	{
+		ws->send_state = WS_SEND_STATE_IN_MESSAGE;
+	}
+
 	return 0;
 }
 
@@ -802,6 +1039,29 @@ int ws_msg_frame_send(ws_t ws, char *frame_data, uint64_t datalen)
 		return -1;
 	}
 	
+	// Write small frames together with the header.
+	if (datalen <= ws->coalesce_threshold)
+	{
+		uint8_t header_buf[WS_HDR_MAX_SIZE];
+		size_t header_len = 0;
+
+		if (_ws_msg_frame_header(ws, datalen, header_buf, &header_len))
+		{
+			return -1;
+		}
+
+		if (_ws_send_frame_coalesced(ws, header_buf, header_len, 
+									frame_data, datalen, 1))
+		{
+			LIBWS_LOG(LIBWS_ERR, "Failed to send frame");
+			return -1;
+		}
+
+		ws->frame_data_sent = datalen;
+
+		return 0;
+	}
+
 	if (ws_msg_frame_data_begin(ws, datalen))
 	{
 		return -1;
@@ -844,6 +1104,7 @@ int ws_msg_end(ws_t ws)
 
 int ws_send_msg_ex(ws_t ws, char *msg, uint64_t len, int binary)
 {
+	int ret;
 	uint64_t curlen;
 	uint64_t remaining;
 	assert(ws);
@@ -851,6 +1112,16 @@ int ws_send_msg_ex(ws_t ws, char *msg, uint64_t len, int binary)
 
 	LIBWS_LOG(LIBWS_TRACE, "Send message start");
 
+	if ((ret = _ws_check_send_blocked(ws)))
+	{
+		return ret;
+	}
+
+	if (ws->send_queue_enabled)
+	{
+		return ws_send_msg_prio(ws, msg, len, binary, WS_SEND_PRIORITY_NORMAL);
+	}
+
 	// Use _ws_send_frame_raw if we're not fragmenting the message.
 	if ((len <= ws->max_frame_size) || !ws->max_frame_size)
 	{
@@ -860,9 +1131,9 @@ int ws_send_msg_ex(ws_t ws, char *msg, uint64_t len, int binary)
 	}
 
 	// Split the message into multiple frames.
-	if (ws_msg_begin(ws, binary))
+	if ((ret = ws_msg_begin(ws, binary)))
 	{
-		return -1;
+		return ret;
 	}
 
 	curlen = (len > ws->max_frame_size)
@@ -894,97 +1165,790 @@ int ws_send_msg_ex(ws_t ws, char *msg, uint64_t len, int binary)
 	return 0;
 }
 
-int ws_send_msg(ws_t ws, char *msg)
+int ws_send_msg_tagged(ws_t ws, char *msg, uint64_t len, int binary, void *tag)
 {
-	int ret = 0;
-	size_t len = 0;
-
-	if (msg)
-		len = strlen(msg);
-
-	ret = ws_send_msg_ex(ws, msg, (uint64_t)len, 0);
-
-	return ret;
-}
+	int ret;
+	assert(ws);
 
-typedef struct {
-    struct event *evtimer;
-    ws_t ws;
-    char *msg;
-    uint64_t len;
-    int binary;
-} ws_send_request;
+	if (ws->send_queue_enabled)
+	{
+		ws_sendq_msg_t *m;
+		_WS_MUST_BE_CONNECTED(ws, "send message");
 
-static void deferred_send(evutil_socket_t socket, short flags, void *arg) {
-    ws_send_request *request = arg;
-    LIBWS_LOG(LIBWS_DEBUG, "Performing async send (msg=%p, len=%llu)", request->msg, request->len);
-    if (ws_send_msg_ex(request->ws, request->msg, request->len, request->binary) != 0)
-        LIBWS_LOG(LIBWS_WARN, "deferred_send failed");
-    _ws_free(request);
-}
+		if ((ret = _ws_check_send_blocked(ws)))
+		{
+			return ret;
+		}
 
-int ws_threadsafe_send_msg_ex(ws_t ws, char *msg, uint64_t len, int binary) {
-    assert(ws);
-    assert(ws->no_copy_cleanup_cb);
-    _WS_MUST_BE_CONNECTED(ws, "send message");
+		if (!(m = _ws_sendq_new_msg(ws, msg, len, binary)))
+		{
+			return -1;
+		}
 
-    LIBWS_LOG(LIBWS_DEBUG, "Async send (msg=%p, len=%llu)", msg, len);
-    ws_send_request *request = _ws_malloc(sizeof(ws_send_request));
-    if (request)
-    {
-        request->ws = ws;
-        request->msg = msg;
-        request->len = len;
-        request->binary = binary;
-        if (event_base_once(ws->ws_base->ev_base, -1, EV_TIMEOUT,
-                            deferred_send, (void*)request, &ws->ws_base->asap_ordered) == 0)
-            return 0;
+		// Completed once the last fragment has been framed.
+		m->has_tag = 1;
+		m->tag = tag;
 
-        _ws_free(request);
-    }
-    ws->no_copy_cleanup_cb(ws, msg, len, ws->no_copy_extra);
-    LIBWS_LOG(LIBWS_ERR, "ws_threadsafe_send_msg_ex failed");
-    return -1;
-}
+		return _ws_sendq_push(ws, m);
+	}
 
-int ws_set_max_frame_size(ws_t ws, uint64_t max_frame_size)
-{
-	assert(ws);
+	if ((ret = ws_send_msg_ex(ws, msg, len, binary)))
+	{
+		return ret;
+	}
 
-	if (max_frame_size > WS_MAX_PAYLOAD_LEN)
+	// Without a callback there is no one to tell.
+	if (ws->send_complete_cb && _ws_add_send_completion(ws, tag))
 	{
-		LIBWS_LOG(LIBWS_ERR, "Max frame size cannot exceed max payload length");
 		return -1;
 	}
 
-	ws->max_frame_size = max_frame_size;
-
 	return 0;
 }
 
-uint64_t ws_get_max_frame_size(ws_t ws)
+uint64_t ws_get_send_queue_bytes(ws_t ws)
 {
 	assert(ws);
-	return ws->max_frame_size;
+	return _ws_send_pending_bytes(ws);
 }
 
-void ws_set_onconnect_cb(ws_t ws, ws_connect_callback_f func, void *arg)
+void ws_set_send_queue(ws_t ws, int enable)
 {
 	assert(ws);
-
-	ws->connect_cb = func;
-	ws->connect_arg = arg;
+	ws->send_queue_enabled = enable;
 }
 
-void ws_set_onmsg_cb(ws_t ws, ws_msg_callback_f func, void *arg)
+int ws_send_msg_prio(ws_t ws, char *msg, uint64_t len, int binary, int priority)
 {
+	int ret;
+	ws_sendq_msg_t *m;
 	assert(ws);
+	_WS_MUST_BE_CONNECTED(ws, "send message");
 
-	ws->msg_cb = func;
-	ws->msg_arg = arg;
+	if ((priority < 0) || (priority >= WS_SEND_PRIORITIES))
+	{
+		LIBWS_LOG(LIBWS_ERR, "Invalid send priority %d", priority);
+		return -1;
+	}
+
+	if ((ret = _ws_check_send_blocked(ws)))
+	{
+		return ret;
+	}
+
+	if (!(m = _ws_sendq_new_msg(ws, msg, len, binary)))
+	{
+		return -1;
+	}
+
+	m->priority = priority;
+
+	return _ws_sendq_push(ws, m);
 }
 
-void ws_set_onmsg_begin_cb(ws_t ws, ws_msg_begin_callback_f func, void *arg)
+size_t ws_get_send_queue_msgs(ws_t ws)
+{
+	assert(ws);
+	return ws->sendq_count;
+}
+
+int ws_send_msg_deadline(ws_t ws, char *msg, uint64_t len, int binary,
+						const struct timeval *deadline)
+{
+	int ret;
+	struct timeval now;
+	ws_sendq_msg_t *m;
+	assert(ws);
+	assert(deadline);
+	_WS_MUST_BE_CONNECTED(ws, "send message");
+
+	if ((ret = _ws_check_send_blocked(ws)))
+	{
+		return ret;
+	}
+
+	if (!(m = _ws_sendq_new_msg(ws, msg, len, binary)))
+	{
+		return -1;
+	}
+
+	event_base_gettimeofday_cached(ws->ws_base->ev_base, &now);
+	evutil_timeradd(&now, deadline, &m->deadline);
+	m->has_deadline = 1;
+
+	return _ws_sendq_push(ws, m);
+}
+
+uint64_t ws_get_send_dropped(ws_t ws)
+{
+	assert(ws);
+	return ws->sendq_dropped;
+}
+
+int ws_send_msg_keyed(ws_t ws, char *msg, uint64_t len, int binary, uint64_t key)
+{
+	int ret;
+	ws_sendq_msg_t *m;
+	assert(ws);
+	_WS_MUST_BE_CONNECTED(ws, "send message");
+
+	if ((ret = _ws_check_send_blocked(ws)))
+	{
+		return ret;
+	}
+
+	if (!(m = _ws_sendq_new_msg(ws, msg, len, binary)))
+	{
+		return -1;
+	}
+
+	m->has_key = 1;
+	m->key = key;
+
+	return _ws_sendq_push(ws, m);
+}
+
+uint64_t ws_get_send_conflated(ws_t ws)
+{
+	assert(ws);
+	return ws->sendq_conflated;
+}
+
+void ws_set_send_pacing(ws_t ws, size_t msgs_per_sec, size_t bytes_per_sec)
+{
+	assert(ws);
+
+	ws->pace_msgs_rate = msgs_per_sec;
+	ws->pace_bytes_rate = bytes_per_sec;
+
+	// Start the new schedule from now.
+	evutil_timerclear(&ws->pace_next);
+	ws->pace_waiting = 0;
+
+	if (ws->pace_event)
+	{
+		_ws_free_timer(&ws->pace_event);
+	}
+
+	if (_ws_sendq_pump(ws))
+	{
+		LIBWS_LOG(LIBWS_ERR, "Failed to send queued messages");
+	}
+}
+
+void ws_set_adaptive_fragment_size(ws_t ws, int enable)
+{
+	assert(ws);
+
+	ws->adaptive_fragments = enable;
+
+	if (enable)
+	{
+		ws->send_queue_enabled = 1;
+	}
+}
+
+struct timeval ws_get_send_pacing_delay(ws_t ws)
+{
+	struct timeval now;
+	struct timeval delay = {0, 0};
+	assert(ws);
+
+	if (ws->pace_msgs_rate || ws->pace_bytes_rate)
+	{
+		event_base_gettimeofday_cached(ws->ws_base->ev_base, &now);
+
+		if (evutil_timercmp(&now, &ws->pace_next, <))
+		{
+			evutil_timersub(&ws->pace_next, &now, &delay);
+		}
+	}
+
+	return delay;
+}
+
+///
+/// Sends the #len bytes the stream producer put in its buffer as a frame.
+///
+static int _ws_send_stream_frame(ws_t ws, size_t len, int fin)
+{
+	uint8_t header_buf[WS_HDR_MAX_SIZE];
+	size_t header_len = 0;
+
+	ws->send_header.fin = fin;
+
+	if (_ws_msg_frame_header(ws, len, header_buf, &header_len))
+	{
+		return -1;
+	}
+
+	// The buffer is reused for the next fragment, so it is always copied.
+	if (_ws_send_frame_coalesced(ws, header_buf, header_len, 
+								ws->stream_buf, len, 0))
+	{
+		LIBWS_LOG(LIBWS_ERR, "Failed to send stream frame");
+		return -1;
+	}
+
+	ws->frame_data_sent = len;
+
+	if (fin)
+	{
+		ws->send_state = WS_SEND_STATE_NONE;
+	}
+
+	return 0;
+}
+
+void _ws_send_stream_end(ws_t ws)
+{
+	assert(ws);
+
+	// Whether it finished or not, the stream no longer holds the send 
+	// state. Otherwise nothing could be sent again on this websocket.
+	if (ws->stream_producer)
+	{
+		ws->send_state = WS_SEND_STATE_NONE;
+	}
+
+	if (ws->stream_buf)
+	{
+		_ws_free(ws->stream_buf);
+		ws->stream_buf = NULL;
+	}
+
+	ws->stream_buf_size = 0;
+	ws->stream_producer = NULL;
+	ws->stream_arg = NULL;
+}
+
+int _ws_send_stream_pump(ws_t ws)
+{
+	assert(ws);
+
+	while (ws->stream_producer)
+	{
+		int ret;
+		size_t len = ws->stream_buf_size;
+
+		if (ws->state != WS_STATE_CONNECTED)
+		{
+			LIBWS_LOG(LIBWS_WARN, "Stopped sending stream, not connected");
+			_ws_send_stream_end(ws);
+			return -1;
+		}
+
+		if (!ws->bev || (evbuffer_get_length(bufferevent_get_output(ws->bev)) 
+						> ws->send_lowmark))
+		{
+			// Continued from the write callback.
+			return 0;
+		}
+
+		ret = ws->stream_producer(ws, ws->stream_buf, &len, ws->stream_arg);
+
+		if ((ret < 0) || (len > ws->stream_buf_size))
+		{
+			// Part of the message has already been sent, 
+			// so there is no way to recover.
+			LIBWS_LOG(LIBWS_ERR, "Stream producer failed");
+			_ws_send_stream_end(ws);
+			ws_close_with_status(ws, WS_CLOSE_STATUS_UNEXPECTED_CONDITION_1011);
+			return -1;
+		}
+
+		if (!ret && !len)
+		{
+			// Nothing available right now, continued
+			// when the user calls ws_send_stream_resume.
+			return 0;
+		}
+
+		if (_ws_send_stream_frame(ws, len, ret > 0))
+		{
+			_ws_send_stream_end(ws);
+			return -1;
+		}
+
+		if (ret > 0)
+		{
+			LIBWS_LOG(LIBWS_DEBUG, "Stream sent");
+			_ws_send_stream_end(ws);
+		}
+	}
+
+	return 0;
+}
+
+int ws_send_stream(ws_t ws, int binary, ws_stream_producer_f producer, void *arg)
+{
+	int ret;
+	assert(ws);
+	assert(producer);
+	_WS_MUST_BE_CONNECTED(ws, "send stream");
+
+	// The stream can't be queued, so it would jump ahead.
+	if (ws->sendq_count)
+	{
+		LIBWS_LOG(LIBWS_ERR, "Can't send stream while the send queue holds messages");
+		return -1;
+	}
+
+	if ((ret = ws_msg_begin(ws, binary)))
+	{
+		return ret;
+	}
+
+	ws->stream_buf_size = _ws_send_fragment_size(ws);
+
+	if (!(ws->stream_buf = (char *)_ws_malloc(ws->stream_buf_size)))
+	{
+		LIBWS_LOG(LIBWS_CRIT, "Out of memory!");
+		ws->send_state = WS_SEND_STATE_NONE;
+		ws->stream_buf_size = 0;
+		return -1;
+	}
+
+	ws->stream_producer = producer;
+	ws->stream_arg = arg;
+
+	return _ws_send_stream_pump(ws);
+}
+
+int ws_send_stream_resume(ws_t ws)
+{
+	assert(ws);
+	return _ws_send_stream_pump(ws);
+}
+
+int ws_send_msg_iov(ws_t ws, const ws_iovec_t *iov, int iovcnt, int binary)
+{
+	struct evbuffer *out;
+	uint64_t total = 0;
+	uint64_t remaining;
+	size_t piece_offset = 0;
+	int i;
+	assert(ws);
+	assert(iov || (iovcnt == 0));
+	_WS_MUST_BE_CONNECTED(ws, "send message iov");
+
+	LIBWS_LOG(LIBWS_TRACE, "Send message from %d buffers", iovcnt);
+
+	if (!ws->bev)
+	{
+		LIBWS_LOG(LIBWS_ERR, "Null bufferevent on send");
+		return -1;
+	}
+
+	for (i = 0; i < iovcnt; i++)
+	{
+		total += iov[i].iov_len;
+	}
+
+	if (_ws_check_send_blocked(ws))
+	{
+		return WS_SEND_WOULD_BLOCK;
+	}
+
+	// Keep the message in order with the rest of the queue.
+	if (ws->send_queue_enabled)
+	{
+		ws_sendq_msg_t *m;
+
+		if (!(m = _ws_sendq_new_msg_iov(ws, iov, iovcnt, binary)))
+		{
+			return -1;
+		}
+
+		return _ws_sendq_push(ws, m);
+	}
+
+	if (_ws_auto_cork(ws) || ws_msg_begin(ws, binary))
+	{
+		return -1;
+	}
+
+	out = bufferevent_get_output(ws->bev);
+	remaining = total;
+	i = 0;
+
+	// Each frame is written with its header to a single region of the 
+	// send buffer, masking the pieces that make it up as we go.
+	do
+	{
+		uint8_t header_buf[WS_HDR_MAX_SIZE];
+		size_t header_len = 0;
+		struct evbuffer_iovec vec;
+		char *dst;
+		uint64_t frame_len = remaining;
+
+		if (ws->max_frame_size && (frame_len > ws->max_frame_size))
+		{
+			frame_len = ws->max_frame_size;
+		}
+
+		ws->send_header.fin = (frame_len == remaining);
+
+		if (_ws_msg_frame_header(ws, frame_len, header_buf, &header_len))
+		{
+			goto fail;
+		}
+
+		if (evbuffer_reserve_space(out, (ev_ssize_t)(header_len + frame_len), &vec, 1) != 1)
+		{
+			LIBWS_LOG(LIBWS_ERR, "Failed to reserve space in send buffer");
+			goto fail;
+		}
+
+		dst = (char *)vec.iov_base;
+		memcpy(dst, header_buf, header_len);
+		dst += header_len;
+
+		while (ws->frame_data_sent < frame_len)
+		{
+			size_t n = iov[i].iov_len - piece_offset;
+
+			if (n > (frame_len - ws->frame_data_sent))
+			{
+				n = (size_t)(frame_len - ws->frame_data_sent);
+			}
+
+			// The mask continues across the pieces.
+			_ws_mask(ws->send_header.mask, ws->frame_data_sent, dst, 
+					(const char *)iov[i].iov_base + piece_offset, n);
+
+			dst += n;
+			ws->frame_data_sent += n;
+			piece_offset += n;
+
+			if (piece_offset == iov[i].iov_len)
+			{
+				piece_offset = 0;
+				i++;
+			}
+		}
+
+		vec.iov_len = header_len + (size_t)frame_len;
+
+		if (evbuffer_commit_space(out, &vec, 1))
+		{
+			LIBWS_LOG(LIBWS_ERR, "Failed to write to send buffer");
+			goto fail;
+		}
+
+		remaining -= frame_len;
+	}
+	while (remaining > 0);
+
+	ws->send_state = WS_SEND_STATE_NONE;
+
+	return 0;
+fail:
+	ws->send_state = WS_SEND_STATE_NONE;
+	return -1;
+}
+
+int ws_send_msgs(ws_t ws, const ws_msg_desc_t *msgs, size_t count, size_t *sent)
+{
+	int ret = 0;
+	size_t i = 0;
+	assert(ws);
+	assert(msgs || (count == 0));
+
+	if (sent)
+	{
+		*sent = 0;
+	}
+
+	_WS_MUST_BE_CONNECTED(ws, "send messages");
+
+	LIBWS_LOG(LIBWS_TRACE, "Send %lu messages", count);
+
+	if (_ws_check_send_blocked(ws))
+	{
+		return WS_SEND_WOULD_BLOCK;
+	}
+
+	// Keep the messages in order with the rest of the queue.
+	if (ws->send_queue_enabled)
+	{
+		for (i = 0; i < count; i++)
+		{
+			ws_sendq_msg_t *m;
+
+			if (!(m = _ws_sendq_new_msg(ws, msgs[i].msg, msgs[i].len, msgs[i].binary)))
+			{
+				ret = -1;
+				goto done;
+			}
+
+			// The message belongs to the queue even on failure.
+			if (_ws_sendq_push(ws, m))
+			{
+				i++;
+				ret = -1;
+				goto done;
+			}
+		}
+
+		goto done;
+	}
+
+	if (ws->send_state != WS_SEND_STATE_NONE)
+	{
+		LIBWS_LOG(LIBWS_ERR, "Send state not none");
+		return -1;
+	}
+
+	while (i < count)
+	{
+		size_t end = i;
+
+		// Batch all messages up to one that has to be fragmented.
+		while ((end < count) 
+			&& (!ws->max_frame_size || (msgs[end].len <= ws->max_frame_size)))
+		{
+			end++;
+		}
+
+		if (end > i)
+		{
+			// Either all of the batch is framed or none of it.
+			if ((ret = _ws_send_frames_batch(ws, &msgs[i], end - i)))
+			{
+				goto done;
+			}
+
+			i = end;
+		}
+		else
+		{
+			if ((ret = ws_send_msg_ex(ws, msgs[i].msg, msgs[i].len, msgs[i].binary)))
+			{
+				goto done;
+			}
+
+			i++;
+		}
+	}
+
+done:
+	if (sent)
+	{
+		*sent = i;
+	}
+
+	return ret;
+}
+
+int ws_send_msg(ws_t ws, char *msg)
+{
+	int ret = 0;
+	size_t len = 0;
+
+	if (msg)
+		len = strlen(msg);
+
+	ret = ws_send_msg_ex(ws, msg, (uint64_t)len, 0);
+
+	return ret;
+}
+
+int ws_threadsafe_send_msg_ex(ws_t ws, char *msg, uint64_t len, int binary) {
+    assert(ws);
+    assert(ws->no_copy_cleanup_cb);
+    _WS_MUST_BE_CONNECTED(ws, "send message");
+
+    LIBWS_LOG(LIBWS_DEBUG, "Async send (msg=%p, len=%llu)", msg, len);
+    ws_threadsafe_req_t *request = _ws_malloc(sizeof(ws_threadsafe_req_t));
+    if (request)
+    {
+        request->msg = msg;
+        request->len = len;
+        request->binary = binary;
+        request->close = 0;
+
+        // On failure the message has already been released.
+        if (_ws_threadsafe_push(ws, request))
+        {
+            LIBWS_LOG(LIBWS_ERR, "ws_threadsafe_send_msg_ex failed");
+            return -1;
+        }
+
+        return 0;
+    }
+    ws->no_copy_cleanup_cb(ws, msg, len, ws->no_copy_extra);
+    LIBWS_LOG(LIBWS_ERR, "ws_threadsafe_send_msg_ex failed");
+    return -1;
+}
+
+int ws_set_max_frame_size(ws_t ws, uint64_t max_frame_size)
+{
+	assert(ws);
+
+	if (max_frame_size > WS_MAX_PAYLOAD_LEN)
+	{
+		LIBWS_LOG(LIBWS_ERR, "Max frame size cannot exceed max payload length");
+		return -1;
+	}
+
+	ws->max_frame_size = max_frame_size;
+
+	return 0;
+}
+
+uint64_t ws_get_max_frame_size(ws_t ws)
+{
+	assert(ws);
+	return ws->max_frame_size;
+}
+
+void ws_set_coalesce_threshold(ws_t ws, size_t threshold)
+{
+	assert(ws);
+	ws->coalesce_threshold = threshold;
+}
+
+size_t ws_get_coalesce_threshold(ws_t ws)
+{
+	assert(ws);
+	return ws->coalesce_threshold;
+}
+
+int ws_pause_reading(ws_t ws)
+{
+	assert(ws);
+
+	ws->read_paused = 1;
+
+	if (ws->bev && bufferevent_disable(ws->bev, EV_READ))
+	{
+		LIBWS_LOG(LIBWS_ERR, "Failed to disable reading");
+		return -1;
+	}
+
+	return 0;
+}
+
+int ws_resume_reading(ws_t ws)
+{
+	assert(ws);
+
+	if (!ws->read_paused)
+		return 0;
+
+	ws->read_paused = 0;
+
+	// Before the connection is made, reading is 
+	// enabled once the connection succeeds.
+	if (!ws->bev || (ws->connect_state <= WS_CONNECT_STATE_NONE))
+		return 0;
+
+	if (bufferevent_enable(ws->bev, EV_READ))
+	{
+		LIBWS_LOG(LIBWS_ERR, "Failed to enable reading");
+		return -1;
+	}
+
+	// Data that was already read before pausing won't result in
+	// another read callback by itself. This is deferred so that
+	// we're not reentering any callback we're called from.
+	if (evbuffer_get_length(bufferevent_get_input(ws->bev)) > 0)
+	{
+		bufferevent_trigger(ws->bev, EV_READ, BEV_TRIG_DEFER_CALLBACKS);
+	}
+
+	return 0;
+}
+
+int ws_is_reading_paused(ws_t ws)
+{
+	assert(ws);
+	return ws->read_paused;
+}
+
+int ws_set_recv_watermarks(ws_t ws, size_t lowmark, size_t highmark)
+{
+	assert(ws);
+
+	if (highmark && (lowmark > highmark))
+	{
+		LIBWS_LOG(LIBWS_ERR, "Low watermark cannot exceed the high watermark");
+		return -1;
+	}
+
+	ws->recv_lowmark = lowmark;
+	ws->recv_highmark = highmark;
+
+	if (ws->bev)
+	{
+		bufferevent_setwatermark(ws->bev, EV_READ, lowmark, highmark);
+	}
+
+	return 0;
+}
+
+void ws_set_max_recv_buffered(ws_t ws, size_t max_buffered)
+{
+	assert(ws);
+	ws->max_recv_buffered = max_buffered;
+}
+
+size_t ws_get_max_recv_buffered(ws_t ws)
+{
+	assert(ws);
+	return ws->max_recv_buffered;
+}
+
+void ws_set_max_message_size(ws_t ws, uint64_t max_message_size)
+{
+	assert(ws);
+	ws->max_message_size = max_message_size;
+}
+
+uint64_t ws_get_max_message_size(ws_t ws)
+{
+	assert(ws);
+	return ws->max_message_size;
+}
+
+void ws_set_max_recv_frame_size(ws_t ws, uint64_t max_frame_size)
+{
+	assert(ws);
+	ws->max_recv_frame_size = max_frame_size;
+}
+
+uint64_t ws_get_max_recv_frame_size(ws_t ws)
+{
+	assert(ws);
+	return ws->max_recv_frame_size;
+}
+
+void ws_set_onconnect_cb(ws_t ws, ws_connect_callback_f func, void *arg)
+{
+	assert(ws);
+
+	ws->connect_cb = func;
+	ws->connect_arg = arg;
+}
+
+void ws_set_onmsg_cb(ws_t ws, ws_msg_callback_f func, void *arg)
+{
+	assert(ws);
+
+	ws->msg_cb = func;
+	ws->msg_arg = arg;
+}
+
+void ws_set_onmsg_iov_cb(ws_t ws, ws_msg_iov_callback_f func, void *arg)
+{
+	assert(ws);
+
+	ws->msg_iov_cb = func;
+	ws->msg_iov_arg = arg;
+}
+
+void ws_set_onmsg_begin_cb(ws_t ws, ws_msg_begin_callback_f func, void *arg)
 {
 	assert(ws);
 
@@ -1178,6 +2142,71 @@ void ws_set_onwrite_cb(ws_t ws, ws_write_callback_f func, void *arg)
     ws->write_arg = arg;
 }
 
+int ws_set_send_watermarks(ws_t ws, size_t lowmark, size_t highmark)
+{
+	assert(ws);
+
+	if (highmark && (lowmark > highmark))
+	{
+		LIBWS_LOG(LIBWS_ERR, "Send low watermark cannot exceed the high watermark");
+		return -1;
+	}
+
+	ws->send_lowmark = lowmark;
+	ws->send_highmark = highmark;
+
+	if (ws->bev)
+	{
+		bufferevent_setwatermark(ws->bev, EV_WRITE, lowmark, 0);
+	}
+
+	return 0;
+}
+
+void ws_set_fail_when_send_blocked(ws_t ws, int fail)
+{
+	assert(ws);
+	ws->fail_when_blocked = fail;
+}
+
+int ws_is_send_blocked(ws_t ws)
+{
+	assert(ws);
+	return ws->send_blocked;
+}
+
+void ws_set_onsend_blocked_cb(ws_t ws, ws_write_callback_f func, void *arg)
+{
+	assert(ws);
+
+	ws->send_blocked_cb = func;
+	ws->send_blocked_arg = arg;
+}
+
+void ws_set_onsend_ready_cb(ws_t ws, ws_write_callback_f func, void *arg)
+{
+	assert(ws);
+
+	ws->send_ready_cb = func;
+	ws->send_ready_arg = arg;
+}
+
+void ws_set_onsend_complete_cb(ws_t ws, ws_send_complete_callback_f func, void *arg)
+{
+	assert(ws);
+
+	ws->send_complete_cb = func;
+	ws->send_complete_arg = arg;
+}
+
+void ws_set_onsend_dropped_cb(ws_t ws, ws_send_dropped_callback_f func, void *arg)
+{
+	assert(ws);
+
+	ws->send_dropped_cb = func;
+	ws->send_dropped_arg = arg;
+}
+
 int ws_send_ping_ex(ws_t ws, char *msg, size_t len)
 {
 	assert(ws);
@@ -1313,20 +2342,39 @@ void ws_default_msg_begin_cb(ws_t ws, void *arg)
 	LIBWS_LOG(LIBWS_TRACE, "Default message begin callback "
 							"(setup message buffer)");
 
+	// If only the complete message is wanted it is built
+	// in a contiguous buffer, sized by the first frame. The scatter/gather
+	// callback doesn't need that, it gets the chains of ws_s#msg instead.
+	ws->msg_contiguous = _ws_has_default_msg_callbacks(ws) && !ws->msg_iov_cb;
+
+	if (ws->msg_contiguous)
+	{
+		ws->msg_buf_len = 0;
+
+		// Only trust the announced length so far, the
+		// buffer grows as the payload is actually read.
+		if (_ws_reserve_msg_buf(ws, _ws_recv_reserve_len(ws, ws->header.payload_len)))
+		{
+			_ws_abort_recv(ws);
+		}
+
+		return;
+	}
+
+	// The message buffer is kept for the lifetime of the connection.
 	if (ws->msg)
 	{
-		if (evbuffer_get_length(ws->msg) != 0)
+		size_t len = evbuffer_get_length(ws->msg);
+
+		if (len != 0)
 		{
 			LIBWS_LOG(LIBWS_WARN, "Non-empty message buffer on new message");
+			evbuffer_drain(ws->msg, len);
 		}
-	
-		evbuffer_free(ws->msg);
-		ws->msg = NULL;
 	}
-
-	if (!(ws->msg = evbuffer_new()))
+	else if (!(ws->msg = evbuffer_new()))
 	{
-		// TODO: Close connection. Internal error error code.
+		_ws_abort_recv(ws);
 		return;
 	}
 }
@@ -1349,8 +2397,56 @@ void ws_default_msg_end_cb(ws_t ws, void *arg)
 	LIBWS_LOG(LIBWS_TRACE, "Default message end callback "
                             "(Calls the on message callback)");
 
+	if (ws->msg_contiguous)
+	{
+		ws->msg_contiguous = 0;
+
+		if (ws->msg_iov_cb)
+		{
+			ws_iovec_t iov;
+			iov.iov_base = ws->msg_buf;
+			iov.iov_len = ws->msg_buf_len;
+
+			LIBWS_LOG(LIBWS_DEBUG, "Calling message callback");
+			ws->msg_iov_cb(ws, &iov, 1, ws->msg_buf_len,
+				ws->msg_isbinary, ws->msg_iov_arg);
+		}
+		else if (ws->msg_cb)
+		{
+			LIBWS_LOG(LIBWS_DEBUG, "Calling message callback");
+			ws->msg_cb(ws, ws->msg_buf, ws->msg_buf_len,
+				ws->msg_isbinary, ws->msg_arg);
+		}
+		else
+		{
+			LIBWS_LOG(LIBWS_DEBUG, "No message callback set, drop message");
+		}
+
+		ws->msg_buf_len = 0;
+
+		// Don't hold on to the memory of a huge message.
+		if (ws->msg_buf_size > WS_MSG_BUF_KEEP_SIZE)
+		{
+			_ws_free(ws->msg_buf);
+			ws->msg_buf = NULL;
+			ws->msg_buf_size = 0;
+		}
+
+		return;
+	}
+
     size_t len = evbuffer_get_length(ws->msg);
-    unsigned char* payload = evbuffer_pullup(ws->msg, len);
+    unsigned char* payload;
+
+	// No need to linearize the message for the scatter/gather callback.
+	if (ws->msg_iov_cb)
+	{
+		_ws_call_msg_iov_cb(ws, ws->msg, len);
+		evbuffer_drain(ws->msg, len);
+		return;
+	}
+
+	payload = evbuffer_pullup(ws->msg, len);
 
 	LIBWS_LOG(LIBWS_DEBUG2, "Message received of length %lu:\n%s", len, payload);
 
@@ -1365,8 +2461,7 @@ void ws_default_msg_end_cb(ws_t ws, void *arg)
 		LIBWS_LOG(LIBWS_DEBUG, "No message callback set, drop message");
 	}
 
-	evbuffer_free(ws->msg);
-	ws->msg = NULL;
+	evbuffer_drain(ws->msg, len);
 }
 
 void ws_default_msg_frame_begin_cb(ws_t ws, void *arg)
@@ -1376,23 +2471,33 @@ void ws_default_msg_frame_begin_cb(ws_t ws, void *arg)
 	LIBWS_LOG(LIBWS_TRACE, "Default message frame begin callback "
 							"(Sets up the frame data buffer)");
 
-	// Setup the frame payload buffer.
+	// The message is built in ws_s#msg_buf, make room for the frame.
+	if (ws->msg_contiguous)
+	{
+		if (_ws_reserve_msg_buf(ws, _ws_recv_reserve_len(ws, ws->header.payload_len)))
+		{
+			_ws_abort_recv(ws);
+		}
+
+		return;
+	}
+
+	// Setup the frame payload buffer. This is kept 
+	// for the lifetime of the connection.
 	if (ws->frame_data)
 	{
-		if (evbuffer_get_length(ws->frame_data) != 0)
+		size_t len = evbuffer_get_length(ws->frame_data);
+
+		if (len != 0)
 		{
 			LIBWS_LOG(LIBWS_WARN, "Non-empty message buffer on new frame");
 			// TODO: This should probably fail somehow...
+			evbuffer_drain(ws->frame_data, len);
 		}
-
-		// TODO: Should we really free it? Not just do evbuffer_remove with a NULL dest?
-		evbuffer_free(ws->frame_data);
-		ws->frame_data = NULL;
 	}
-
-	if (!(ws->frame_data = evbuffer_new()))
+	else if (!(ws->frame_data = evbuffer_new()))
 	{
-		// TODO: Close connection. Internal error reason.
+		_ws_abort_recv(ws);
 		return;
 	}
 }
@@ -1406,8 +2511,18 @@ void ws_default_msg_frame_data_cb(ws_t ws, char *payload,
 							"(Append %lld bytes to buffer: now %lld)",
               len, evbuffer_get_length(ws->frame_data) + len);
 
-	// TODO: Instead of using a copied payload buf here, we should 
-	// instead use evbuffer_add_buffer()
+	// Make room for the rest of the frame at once, instead of
+	// growing the buffer for every chunk that is read. Don't trust
+	// the announced length beyond what is reasonable though.
+	// (This has already been added to the received length).
+	if (ws->header.payload_len >= ws->recv_frame_len)
+	{
+		evbuffer_expand(ws->frame_data, (size_t)_ws_recv_reserve_len(ws,
+			ws->header.payload_len - ws->recv_frame_len + len));
+	}
+
+	// Note that when this callback is set, the read path moves
+	// the payload straight into the frame data buffer instead.
 	evbuffer_add(ws->frame_data, payload, (size_t)len);
 }
 
@@ -1418,13 +2533,17 @@ void ws_default_msg_frame_end_cb(ws_t ws, void *arg)
 	LIBWS_LOG(LIBWS_TRACE, "Default message frame end callback "
 							"(Calls the message frame callback)");
 
-	if (ws->msg_frame_cb)
+	// The frame payload is already in the message buffer.
+	if (ws->msg_contiguous)
+		return;
+
+	if (ws->msg_frame_cb && (ws->msg_frame_cb != ws_default_msg_frame_cb))
 	{
 		size_t frame_len = evbuffer_get_length(ws->frame_data);
 		const unsigned char *payload = evbuffer_pullup(ws->frame_data, frame_len);
 		
 		LIBWS_LOG(LIBWS_DEBUG, "Calling message frame callback");
-		ws->msg_frame_cb(ws, (char *)payload, frame_len, arg);
+		ws->msg_frame_cb(ws, (char *)payload, frame_len, ws->msg_frame_arg);
 	}
 	else
 	{
@@ -1434,8 +2553,7 @@ void ws_default_msg_frame_end_cb(ws_t ws, void *arg)
 		ws_default_msg_frame_cb(ws, NULL, 0, arg);
 	}
 
-	evbuffer_free(ws->frame_data);
-	ws->frame_data = NULL;
+	evbuffer_drain(ws->frame_data, evbuffer_get_length(ws->frame_data));
 }
 
 #ifdef LIBWS_WITH_OPENSSL
@@ -223,15 +223,299 @@ void ws_handle_marshall_timer_cb(int fd, short events, void* userp);
 /// @param[in]	len 	The message length in octets.
 /// @param[in]	binary 	If we should send a binary message.
 ///
-/// @returns			0 on success.
+/// @returns			0 on success. #WS_SEND_WOULD_BLOCK if the send 
+///						buffer is full, see #ws_set_send_watermarks.
 ///
 int ws_send_msg_ex(ws_t ws, char *msg, uint64_t len, int binary);
 
 ///
 /// Thread-safe equivalent of ws_send_msg_ex: can be called from any thread.
 ///
+/// The message is pushed onto a lock-free queue, and the event loop is only
+/// woken up once for all messages pushed before it gets to send them. They
+/// are sent in the order they were pushed, also with regards to 
+/// #ws_close_threadsafe. Messages that can't be sent are released using
+/// the no copy cleanup callback, which must be set.
+///
+/// @note Libevent must have been set up for threads, 
+///       see evthread_use_pthreads.
+///
 int ws_threadsafe_send_msg_ex(ws_t ws, char *msg, uint64_t len, int binary);
 
+///
+/// Sends a message like #ws_send_msg_ex, and calls the send
+/// complete callback with #tag once it has been sent.
+///
+/// @see ws_set_onsend_complete_cb
+///
+/// @param[in]	ws 		The websocket session context.
+/// @param[in]	msg 	The message payload.
+/// @param[in]	len 	The length of the message.
+/// @param[in]	binary 	If we should send a binary message.
+/// @param[in]	tag 	User tag for the message.
+///
+/// @returns			0 on success.
+///
+int ws_send_msg_tagged(ws_t ws, char *msg, uint64_t len, int binary, void *tag);
+
+///
+/// Gets the number of bytes queued in the send buffer and in the send
+/// queue, that have not yet been written to the socket.
+///
+/// @param[in]	ws 		The websocket session context.
+///
+/// @returns			The number of queued bytes.
+///
+uint64_t ws_get_send_queue_bytes(ws_t ws);
+
+///
+/// Makes #ws_send_msg_ex and #ws_send_msg_tagged put messages in the send
+/// queue of the library, like #ws_send_msg_prio with normal priority.
+///
+/// @param[in]	ws 		The websocket session context.
+/// @param[in]	enable 	Set to 1 to use the send queue.
+///
+void ws_set_send_queue(ws_t ws, int enable);
+
+///
+/// Puts a message in the send queue of the library. Queued messages are 
+/// only framed into the send buffer, in fragments, as it drains down to
+/// its low watermark (see #ws_set_send_watermarks). It is then filled up
+/// to about a fragment above it, so many small messages go out together.
+///
+/// A message that has begun is always finished before the next one,
+/// which is taken from the highest priority class that has any.
+/// Pings, pongs and close frames are never queued, so at most about two
+/// fragments of queued data above the low watermark are ever ahead of them.
+///
+/// Messages are split into fragments of #ws_set_max_frame_size bytes,
+/// and #WS_STREAM_FRAGMENT_SIZE at most. Unless in no copy mode, the
+/// message is copied.
+///
+/// @param[in]	ws 			The websocket session context.
+/// @param[in]	msg 		The message payload.
+/// @param[in]	len 		The length of the message.
+/// @param[in]	binary 		If we should send a binary message.
+/// @param[in]	priority 	#WS_SEND_PRIORITY_HIGH, #WS_SEND_PRIORITY_NORMAL
+///							or #WS_SEND_PRIORITY_LOW.
+///
+/// @returns				0 on success.
+///
+int ws_send_msg_prio(ws_t ws, char *msg, uint64_t len, int binary, int priority);
+
+///
+/// Gets the number of messages in the send queue that
+/// have not yet been completely framed.
+///
+/// @param[in]	ws 		The websocket session context.
+///
+/// @returns			The number of queued messages.
+///
+size_t ws_get_send_queue_msgs(ws_t ws);
+
+///
+/// Puts a message in the send queue like #ws_send_msg_prio with normal
+/// priority, but drops it if it has not begun being framed into the
+/// send buffer once #deadline has passed. A dropped message is counted
+/// (see #ws_get_send_dropped) and passed to the send dropped callback.
+///
+/// The message uses the send queue even if #ws_set_send_queue has not
+/// been enabled. Enable it to keep the message in order with the
+/// messages sent with #ws_send_msg_ex.
+///
+/// @see ws_set_onsend_dropped_cb
+///
+/// @param[in]	ws 			The websocket session context.
+/// @param[in]	msg 		The message payload.
+/// @param[in]	len 		The length of the message.
+/// @param[in]	binary 		If we should send a binary message.
+/// @param[in]	deadline 	How long the message may wait in the queue.
+///
+/// @returns				0 on success.
+///
+int ws_send_msg_deadline(ws_t ws, char *msg, uint64_t len, int binary,
+						const struct timeval *deadline);
+
+///
+/// Gets the number of queued messages that have been dropped because
+/// their deadline passed.
+///
+/// @see ws_send_msg_deadline
+///
+/// @param[in]	ws 		The websocket session context.
+///
+/// @returns			The number of dropped messages.
+///
+uint64_t ws_get_send_dropped(ws_t ws);
+
+///
+/// Puts a message in the send queue like #ws_send_msg_prio with normal
+/// priority, tagged with #key. If a message with the same key is still
+/// waiting in the queue, the new message takes its place and the old
+/// one is released without being sent. So when the peer reads slowly,
+/// only the latest message for each key is sent, in the position of
+/// the first one that was queued.
+///
+/// A message that has begun being framed into the send buffer is never
+/// replaced. Like #ws_send_msg_deadline this uses the send queue even if
+/// #ws_set_send_queue has not been enabled.
+///
+/// @param[in]	ws 			The websocket session context.
+/// @param[in]	msg 		The message payload.
+/// @param[in]	len 		The length of the message.
+/// @param[in]	binary 		If we should send a binary message.
+/// @param[in]	key 		The key, such as a hash of the topic.
+///
+/// @returns				0 on success.
+///
+int ws_send_msg_keyed(ws_t ws, char *msg, uint64_t len, int binary, uint64_t key);
+
+///
+/// Gets the number of queued messages that have been replaced by a 
+/// newer message with the same key.
+///
+/// @see ws_send_msg_keyed
+///
+/// @param[in]	ws 		The websocket session context.
+///
+/// @returns			The number of replaced messages.
+///
+uint64_t ws_get_send_conflated(ws_t ws);
+
+///
+/// Paces the messages in the send queue of the library, so that bursts
+/// are spread out evenly over time instead of being sent back to back.
+/// Each message may only begin once the previous one has been given 
+/// 1 / #msgs_per_sec seconds, or len / #bytes_per_sec seconds if that 
+/// is longer. Time spent idle is not saved up for a later burst.
+///
+/// Only messages in the send queue are paced (see #ws_set_send_queue),
+/// control frames are not. Unlike #ws_set_rate_limits, which limits
+/// the bytes written to the socket, this never splits the pace of a
+/// message across its fragments.
+///
+/// @see ws_get_send_pacing_delay, ws_get_send_queue_msgs
+///
+/// @param[in]	ws 				The websocket session context.
+/// @param[in]	msgs_per_sec 	Messages per second, 0 for no limit.
+/// @param[in]	bytes_per_sec 	Bytes per second, 0 for no limit.
+///
+void ws_set_send_pacing(ws_t ws, size_t msgs_per_sec, size_t bytes_per_sec);
+
+///
+/// Gets how long it is until the next queued message may begin
+/// according to #ws_set_send_pacing.
+///
+/// @param[in]	ws 		The websocket session context.
+///
+/// @returns			The delay, zero if a message may begin now.
+///
+struct timeval ws_get_send_pacing_delay(ws_t ws);
+
+///
+/// Picks the fragment size of each queued message fragment from the
+/// state of the connection, instead of a fixed size. On Linux it is 
+/// one TCP congestion window (from TCP_INFO), less the bytes already
+/// waiting in the kernel and in the send buffer. So fragments are large
+/// on an idle fast connection, and small while the connection is backed
+/// up, where a control frame otherwise would have to wait behind them.
+/// The size is always between #WS_ADAPTIVE_FRAGMENT_MIN and 
+/// #WS_ADAPTIVE_FRAGMENT_MAX, and never above #ws_set_max_frame_size.
+///
+/// Enabling this also enables #ws_set_send_queue, so that 
+/// #ws_send_msg_ex is fragmented by the scheduler.
+///
+/// @param[in]	ws 		The websocket session context.
+/// @param[in]	enable 	Set to 1 to use adaptive fragment sizes.
+///
+void ws_set_adaptive_fragment_size(ws_t ws, int enable);
+
+///
+/// Sends a message whose payload is pulled from #producer one fragment
+/// at a time, so that a large message never has to be held in memory.
+///
+/// The producer is called to fill the next fragment whenever the send
+/// buffer has drained down to its low watermark (see 
+/// #ws_set_send_watermarks, by default when it is empty). Each call
+/// becomes one frame of at most #ws_set_max_frame_size bytes, 
+/// and #WS_STREAM_FRAGMENT_SIZE at most.
+///
+/// The producer gets the size of the buffer in len, and sets it to the
+/// number of bytes put in the buffer. It returns:
+///   - 1 when this was the end of the message.
+///   - 0 for more to come. If len is 0 nothing is available right now,
+///     and #ws_send_stream_resume must be called once there is.
+///   - -1 on error, which closes the connection since the message 
+///     can't be completed.
+///
+/// No other messages can be sent until the stream has ended. The stream
+/// can't be started while the send queue holds messages (see 
+/// #ws_set_send_queue), since it would go out ahead of them.
+///
+/// @param[in]	ws 			The websocket session context.
+/// @param[in]	binary 		If we should send a binary message.
+/// @param[in]	producer 	The producer callback.
+/// @param[in]	arg 		User context passed to the producer.
+///
+/// @returns				0 on success.
+///
+int ws_send_stream(ws_t ws, int binary, ws_stream_producer_f producer, void *arg);
+
+///
+/// Continues sending a stream after its producer had no data.
+///
+/// @param[in]	ws 		The websocket session context.
+///
+/// @returns			0 on success.
+///
+int ws_send_stream_resume(ws_t ws);
+
+///
+/// Sends a message with a payload made up of several buffers, 
+/// as if they had been concatenated. 
+///
+/// The buffers are masked while being copied to the send buffer, and
+/// are never modified. The no copy cleanup callback is not used.
+///
+/// When the send queue is enabled (see #ws_set_send_queue) the buffers
+/// are copied into a single message that is put in the queue instead.
+///
+/// @param[in]	ws 		The websocket session context.
+/// @param[in]	iov 	The buffers making up the payload.
+/// @param[in]	iovcnt 	The number of buffers.
+/// @param[in]	binary 	If we should send a binary message.
+///
+/// @returns			0 on success.
+///
+int ws_send_msg_iov(ws_t ws, const ws_iovec_t *iov, int iovcnt, int binary);
+
+///
+/// Sends several messages at once. Each message is sent in a single frame,
+/// and all of them are framed and masked into the send buffer in one go.
+/// This is a lot cheaper than calling #ws_send_msg_ex for each of them when
+/// sending many small messages. Messages larger than the max frame size 
+/// (see #ws_set_max_frame_size) are sent using #ws_send_msg_ex instead.
+///
+/// The batched messages are always copied, and never modified. In no copy
+/// mode the cleanup callback is called for each of them once copied.
+///
+/// When the send queue is enabled (see #ws_set_send_queue) the messages
+/// are instead put in the queue in order, like #ws_send_msg_ex would.
+///
+/// On failure the first messages might still have been sent or queued,
+/// #sent tells how many, so that only the rest are retried.
+///
+/// @param[in]	ws 		The websocket session context.
+/// @param[in]	msgs 	The messages to send.
+/// @param[in]	count 	The number of messages.
+/// @param[out]	sent 	Set to the number of messages sent or queued,
+///						also on failure. May be NULL.
+///
+/// @returns			0 on success. #WS_SEND_WOULD_BLOCK if the send 
+///						buffer is full, see #ws_set_send_watermarks.
+///
+int ws_send_msgs(ws_t ws, const ws_msg_desc_t *msgs, size_t count, size_t *sent);
+
 ///
 /// Send a websocket UTF-8 text message.
 ///
@@ -289,7 +573,8 @@ int ws_msg_frame_data_begin(ws_t ws, uint64_t datalen);
 ///
 /// Sends frame data. Note that you're not allowed to send more
 /// data than was specified in the #ws_msg_frame_data_begin call.
-/// You can send in chunks if you wish though.
+/// You can send in chunks if you wish though. Until all of it has been
+/// sent, no other frames can be sent, not even pings, pongs or close.
 ///
 /// @param[in]	ws 		The websocket session context.
 /// @param[in]	data 	The frame payload data to send.
@@ -366,6 +651,140 @@ int ws_set_max_frame_size(ws_t ws, uint64_t max_frame_size);
 ///
 uint64_t ws_get_max_frame_size(ws_t ws);
 
+///
+/// Sets the payload size up to which a frame is written to the send 
+/// buffer together with its header, instead of as separate chunks. 
+/// Small frames are then copied, even in no copy mode, but end up
+/// as a single chain in the send buffer which is cheaper to send.
+///
+/// Defaults to #WS_DEFAULT_COALESCE_THRESHOLD.
+///
+/// @param[in]	ws 			The websocket session context.
+/// @param[in]	threshold 	The max payload size to coalesce. 
+///							0 only coalesces empty frames.
+///
+void ws_set_coalesce_threshold(ws_t ws, size_t threshold);
+
+///
+/// Gets the threshold set using #ws_set_coalesce_threshold.
+///
+/// @param[in]	ws 	The websocket session context.
+///
+/// @returns		The coalesce threshold.
+///
+size_t ws_get_coalesce_threshold(ws_t ws);
+
+///
+/// Stops reading from the socket, so that TCP flow control pushes back on
+/// the server when the user can't keep up with the incoming messages.
+/// No more message callbacks are made until #ws_resume_reading is called,
+/// even for data that has already been received.
+///
+/// @param[in]	ws 	The websocket session context.
+///
+/// @returns		0 on success.
+///
+int ws_pause_reading(ws_t ws);
+
+///
+/// Resumes reading after #ws_pause_reading. Any data that was 
+/// received before pausing is processed from the event loop.
+///
+/// @param[in]	ws 	The websocket session context.
+///
+/// @returns		0 on success.
+///
+int ws_resume_reading(ws_t ws);
+
+///
+/// Checks if reading has been paused using #ws_pause_reading.
+///
+/// @param[in]	ws 	The websocket session context.
+///
+/// @returns		1 if reading is paused.
+///
+int ws_is_reading_paused(ws_t ws);
+
+///
+/// Sets the watermarks of the socket input buffer. Data is not processed 
+/// until at least #lowmark bytes have been read, and no more is read from
+/// the socket while #highmark bytes are buffered.
+///
+/// @note A low watermark delays a message that ends up in less than
+///		  #lowmark bytes until more data arrives.
+///
+/// @param[in]	ws 			The websocket session context.
+/// @param[in]	lowmark 	The low watermark. 0 means no limit.
+/// @param[in]	highmark 	The high watermark. 0 means no limit.
+///
+/// @returns				0 on success.
+///
+int ws_set_recv_watermarks(ws_t ws, size_t lowmark, size_t highmark);
+
+///
+/// Sets the max number of bytes that can be buffered after being received
+/// without having been delivered to the user yet. This includes any data
+/// of a message that has not been fully received. If this is exceeded the
+/// connection is closed with #WS_CLOSE_STATUS_MESSAGE_TOO_BIG_1009.
+///
+/// @note While reading is paused with #ws_pause_reading, nothing more is
+///		  read from the socket, so this is only checked when reading.
+///
+/// @param[in]	ws 				The websocket session context.
+/// @param[in]	max_buffered 	The max number of bytes. 0 means no limit.
+///
+void ws_set_max_recv_buffered(ws_t ws, size_t max_buffered);
+
+///
+/// Gets the limit set using #ws_set_max_recv_buffered.
+///
+/// @param[in]	ws 	The websocket session context.
+///
+/// @returns		The max number of buffered bytes.
+///
+size_t ws_get_max_recv_buffered(ws_t ws);
+
+///
+/// Sets the max size of a received message. When a frame header shows 
+/// that a message will exceed this, the connection is closed with 
+/// #WS_CLOSE_STATUS_MESSAGE_TOO_BIG_1009 before any of its payload is
+/// buffered. The rest of the message is then discarded as it arrives.
+///
+/// @param[in]	ws 					The websocket session context.
+/// @param[in]	max_message_size 	The max message size. 0 means no limit.
+///
+void ws_set_max_message_size(ws_t ws, uint64_t max_message_size);
+
+///
+/// Gets the max message size set using #ws_set_max_message_size.
+///
+/// @param[in]	ws 	The websocket session context.
+///
+/// @returns		The max message size.
+///
+uint64_t ws_get_max_message_size(ws_t ws);
+
+///
+/// Sets the max size of a received frame. This works the same way 
+/// as #ws_set_max_message_size but for each frame of a message.
+///
+/// @note Not to be confused with #ws_set_max_frame_size which is 
+///		  used when sending.
+///
+/// @param[in]	ws 				The websocket session context.
+/// @param[in]	max_frame_size 	The max frame size. 0 means no limit.
+///
+void ws_set_max_recv_frame_size(ws_t ws, uint64_t max_frame_size);
+
+///
+/// Gets the max frame size set using #ws_set_max_recv_frame_size.
+///
+/// @param[in]	ws 	The websocket session context.
+///
+/// @returns		The max received frame size.
+///
+uint64_t ws_get_max_recv_frame_size(ws_t ws);
+
 ///
 /// Get the header for the current websocket frame being read.
 ///
@@ -404,6 +823,23 @@ void ws_set_onconnect_cb(ws_t ws, ws_connect_callback_f func, void *arg);
 /// 
 void ws_set_onmsg_cb(ws_t ws, ws_msg_callback_f func, void *arg);
 
+///
+/// Sets a scatter/gather message callback function. This works like the
+/// callback set with #ws_set_onmsg_cb, but instead of first copying the 
+/// message into one contiguous buffer, it is passed as an array of segments
+/// pointing straight into the buffers it was received in. 
+///
+/// When set, this is called instead of the #ws_set_onmsg_cb callback.
+/// The segments are only valid until the callback returns.
+///
+/// @ingroup MessageAPI Message based API
+///
+/// @param[in]	ws 		The websocket session context.
+/// @param[in]	func 	The callback function, or NULL to unset it.
+/// @param[in]	arg		User context passed to the callback.
+///
+void ws_set_onmsg_iov_cb(ws_t ws, ws_msg_iov_callback_f func, void *arg);
+
 /// @defgroup FrameAPI Frame based API
 /// @{
 
@@ -738,6 +1174,95 @@ void ws_set_connect_timeout_cb(ws_t ws, ws_timeout_callback_f func,
 ///
 void ws_set_onwrite_cb(ws_t ws, ws_write_callback_f func, void *arg);
 
+///
+/// Sets the high and low watermarks for the send buffer. When more than
+/// #highmark bytes are queued, sending is blocked until the buffer has
+/// drained down to #lowmark bytes.
+///
+/// While blocked, new messages either fail with #WS_SEND_WOULD_BLOCK,
+/// see #ws_set_fail_when_send_blocked, or are queued as usual. Frames
+/// of a message that has already begun, and control frames, are never 
+/// refused.
+///
+/// @note The ready-to-write callback set with #ws_set_onwrite_cb
+///       is called when the buffer has drained to #lowmark.
+///
+/// @param[in]	ws 			The websocket session context.
+/// @param[in]	lowmark		The low watermark.
+/// @param[in]	highmark	The high watermark, 0 for no limit (default).
+///
+/// @returns				0 on success.
+///
+int ws_set_send_watermarks(ws_t ws, size_t lowmark, size_t highmark);
+
+///
+/// Makes new messages fail with #WS_SEND_WOULD_BLOCK while the send buffer
+/// is above its high watermark. The message is then not sent, so in no 
+/// copy mode the caller still owns the buffer.
+///
+/// @param[in]	ws 		The websocket session context.
+/// @param[in]	fail 	Set to 1 to fail sends while blocked.
+///
+void ws_set_fail_when_send_blocked(ws_t ws, int fail);
+
+///
+/// Checks if the send buffer is above its high watermark.
+///
+/// @param[in]	ws 		The websocket session context.
+///
+/// @returns			1 if blocked.
+///
+int ws_is_send_blocked(ws_t ws);
+
+///
+/// Sets the callback for when the send buffer goes above its high 
+/// watermark. It is called from the event loop, after the send that 
+/// crossed the watermark has returned.
+///
+/// @param[in]	ws 		The websocket session context.
+/// @param[in]	func 	The callback function.
+/// @param[in]	arg		User context passed to the callback.
+///
+void ws_set_onsend_blocked_cb(ws_t ws, ws_write_callback_f func, void *arg);
+
+///
+/// Sets the callback for when the send buffer has drained
+/// down to its low watermark after having been blocked.
+///
+/// @param[in]	ws 		The websocket session context.
+/// @param[in]	func 	The callback function.
+/// @param[in]	arg		User context passed to the callback.
+///
+void ws_set_onsend_ready_cb(ws_t ws, ws_write_callback_f func, void *arg);
+
+///
+/// Sets the callback for messages sent with #ws_send_msg_tagged.
+/// It is called with sent set to 1 once the last byte of the message
+/// has left the send buffer, which for a plain socket means it has been
+/// written to the kernel. If the connection is closed or destroyed 
+/// before that, it is called with sent set to 0 instead.
+///
+/// The callback is called from the event loop, never from within a send
+/// or close call, so it is safe to send from it. Completions still pending
+/// when the websocket is destroyed are reported from within #ws_destroy.
+///
+/// @param[in]	ws 		The websocket session context.
+/// @param[in]	func 	The callback function.
+/// @param[in]	arg		User context passed to the callback.
+///
+void ws_set_onsend_complete_cb(ws_t ws, ws_send_complete_callback_f func, void *arg);
+
+///
+/// Sets the callback for messages sent with #ws_send_msg_deadline
+/// that are dropped because their deadline passed. The message is 
+/// released once the callback returns.
+///
+/// @param[in]	ws 		The websocket session context.
+/// @param[in]	func 	The callback function.
+/// @param[in]	arg		User context passed to the callback.
+///
+void ws_set_onsend_dropped_cb(ws_t ws, ws_send_dropped_callback_f func, void *arg);
+
 ///
 /// Sets the user context/state for this websocket connection.
 ///
@@ -780,6 +1305,58 @@ char *ws_get_uri(ws_t ws, char *buf, size_t bufsize);
 ///
 void ws_set_no_copy_cb(ws_t ws, ws_no_copy_cleanup_f func, void *extra);
 
+///
+/// Makes sure data passed to the send functions is never modified. 
+/// 
+/// Outgoing frames have to be masked. Normally this is done while copying 
+/// the data into the send buffer, except in no copy mode 
+/// (see #ws_set_no_copy_cb) where the passed buffer is masked in place 
+/// and then sent as is. When this is set, the data is masked while being
+/// copied in no copy mode as well, and the cleanup callback is called as
+/// soon as this is done. This allows the same buffer to be sent on several
+/// websockets, or to be reused.
+///
+/// @param[in]	ws 			The websocket session context.
+/// @param[in]	preserve 	Set to 1 to never modify the data being sent.
+///
+void ws_set_preserve_send_buffers(ws_t ws, int preserve);
+
+///
+/// Holds back writing to the socket, so that several frames can be 
+/// queued and then be written together using as few system calls and
+/// TCP segments as possible. The frames are queued in the send buffer
+/// until #ws_uncork is called.
+///
+/// @note Closing the websocket uncorks it.
+///
+/// @param[in]	ws 	The websocket session context.
+///
+/// @returns		0 on success.
+///
+int ws_cork(ws_t ws);
+
+///
+/// Starts writing to the socket again after #ws_cork.
+///
+/// @param[in]	ws 	The websocket session context.
+///
+/// @returns		0 on success.
+///
+int ws_uncork(ws_t ws);
+
+///
+/// Enables automatic corking. When enabled, the websocket is corked when
+/// something is sent, and uncorked at the end of the event loop iteration.
+/// This way all frames queued from the callbacks in one iteration are 
+/// written together.
+///
+/// @see ws_cork
+///
+/// @param[in]	ws 			The websocket session context.
+/// @param[in]	auto_cork 	Set to 1 to enable automatic corking.
+///
+void ws_set_auto_cork(ws_t ws, int auto_cork);
+
 ///
 /// Gets the websocket state.
 ///
@@ -805,6 +1382,28 @@ void ws_mask_payload(uint32_t mask, char *msg, uint64_t len);
 ///
 void ws_unmask_payload(uint32_t mask, char *msg, uint64_t len);
 
+///
+/// Masks a part of a payload that starts #offset bytes into
+/// the payload, for instance when a frame is sent in chunks.
+///
+/// @param[in]	mask 	The mask to use.
+/// @param[in]	offset 	The offset into the payload where #msg starts.
+/// @param[in]	msg 	The message to mask.
+/// @param[in]	len 	Length of the message buffer.
+///
+void ws_mask_payload_ex(uint32_t mask, uint64_t offset, char *msg, uint64_t len);
+
+///
+/// Unmasks a part of a payload that starts #offset bytes into
+/// the payload, for instance when a frame is read in chunks.
+///
+/// @param[in]	mask 	The mask to use.
+/// @param[in]	offset 	The offset into the payload where #msg starts.
+/// @param[in]	msg 	The message to unmask.
+/// @param[in]	len 	Length of the message buffer.
+///
+void ws_unmask_payload_ex(uint32_t mask, uint64_t offset, char *msg, uint64_t len);
+
 ///
 /// Add a subprotocol that we can speak over the Websocket.
 ///
@@ -1,25 +1,43 @@
-
-#ifndef __LIBWS_COMPAT_H__
-#define __LIBWS_COMPAT_H__
-
-#include "libws_config.h"
-#include <stdarg.h>
-#include <stdint.h>
-#include <inttypes.h>
-
-#ifndef va_copy
-#define va_copy(dest, src) memcpy(&(dest), &(src), sizeof(va_list));
-#endif // va_copy
-
-uint64_t libws_ntoh64(const uint64_t input);
-uint64_t libws_hton64(const uint64_t input);
-
-char *libws_strsep(char **s, const char *del);
-char *ws_rtrim(char *s);
-
-#ifdef _WIN32
-#define strcasecmp _stricmp 
-#define strncasecmp _strnicmp 
-#endif
-
-#endif // __LIBWS_COMPAT_H__
+
+#ifndef __LIBWS_COMPAT_H__
+#define __LIBWS_COMPAT_H__
+
+#include "libws_config.h"
+#include <stdarg.h>
+#include <stdint.h>
+#include <inttypes.h>
+
+#ifndef va_copy
+#define va_copy(dest, src) memcpy(&(dest), &(src), sizeof(va_list));
+#endif // va_copy
+
+uint64_t libws_ntoh64(const uint64_t input);
+uint64_t libws_hton64(const uint64_t input);
+
+char *libws_strsep(char **s, const char *del);
+char *ws_rtrim(char *s);
+
+#ifdef _WIN32
+#define strcasecmp _stricmp 
+#define strncasecmp _strnicmp 
+#endif
+
+///
+/// Atomic pointer operations, with full memory barriers.
+/// libws_atomic_cas_ptr returns non-zero if #ptr was swapped.
+///
+#ifdef _WIN32
+#include <intrin.h>
+#define libws_atomic_cas_ptr(ptr, oldval, newval) \
+	(_InterlockedCompareExchangePointer((void *volatile *)(ptr), \
+										(newval), (oldval)) == (oldval))
+#define libws_atomic_xchg_ptr(ptr, val) \
+	_InterlockedExchangePointer((void *volatile *)(ptr), (val))
+#else
+#define libws_atomic_cas_ptr(ptr, oldval, newval) \
+	__sync_bool_compare_and_swap((ptr), (oldval), (newval))
+#define libws_atomic_xchg_ptr(ptr, val) \
+	__atomic_exchange_n((ptr), (val), __ATOMIC_SEQ_CST)
+#endif
+
+#endif // __LIBWS_COMPAT_H__
@@ -0,0 +1,53 @@
+#include "libws_config.h"
+#include "libws_cpu.h"
+
+#if defined(LIBWS_WITH_SIMD) && defined(LIBWS_CPU_X86) && defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+int _ws_cpu_features()
+{
+	int features = 0;
+
+	#ifdef LIBWS_WITH_SIMD
+
+	#if defined(LIBWS_CPU_X86)
+
+	#if defined(__GNUC__) || defined(__clang__)
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("sse2")) features |= WS_CPU_SSE2;
+	if (__builtin_cpu_supports("sse4.1")) features |= WS_CPU_SSE41;
+	if (__builtin_cpu_supports("avx2")) features |= WS_CPU_AVX2;
+	#elif defined(_MSC_VER)
+	{
+		int info[4];
+		int max_leaf;
+
+		__cpuid(info, 0);
+		max_leaf = info[0];
+
+		__cpuid(info, 1);
+		if (info[3] & (1 << 26)) features |= WS_CPU_SSE2;
+		if (info[2] & (1 << 19)) features |= WS_CPU_SSE41;
+
+		// AVX2 also needs the OS to save the YMM registers (OSXSAVE + XCR0).
+		if ((max_leaf >= 7) && (info[2] & (1 << 27)) 
+		 && ((_xgetbv(0) & 0x6) == 0x6))
+		{
+			__cpuidex(info, 7, 0);
+			if (info[1] & (1 << 5)) features |= WS_CPU_AVX2;
+		}
+	}
+	#endif
+
+	#elif defined(LIBWS_CPU_NEON)
+	// NEON is mandatory on AArch64, and on 32-bit ARM we only
+	// get here if the compiler has been told it is available.
+	features |= WS_CPU_NEON;
+	#endif
+
+	#endif // LIBWS_WITH_SIMD
+
+	return features;
+}
@@ -0,0 +1,37 @@
+#ifndef __LIBWS_CPU_H__
+#define __LIBWS_CPU_H__
+
+#include "libws_config.h"
+
+#if defined(__x86_64__) || defined(__i386__) \
+ || defined(_M_X64) || defined(_M_IX86)
+#define LIBWS_CPU_X86 1
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__) || defined(__aarch64__)
+#define LIBWS_CPU_NEON 1
+#endif
+
+// Lets us compile a single function for a given instruction set,
+// without having to compile the entire library with that flag.
+#if defined(__GNUC__) || defined(__clang__)
+#define LIBWS_TARGET(__target__) __attribute__((target(__target__)))
+#else
+#define LIBWS_TARGET(__target__)
+#endif
+
+#define WS_CPU_SSE2		(1 << 0)
+#define WS_CPU_SSE41	(1 << 1)
+#define WS_CPU_AVX2		(1 << 2)
+#define WS_CPU_NEON		(1 << 3)
+
+///
+/// Detects the SIMD instruction sets supported by the CPU we are
+/// running on. If libws is built without LIBWS_WITH_SIMD this
+/// always returns 0.
+///
+/// @returns A bitmask of WS_CPU_* flags.
+///
+int _ws_cpu_features();
+
+#endif // __LIBWS_CPU_H__
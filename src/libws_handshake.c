@@ -27,7 +27,7 @@ int _ws_generate_handshake_key(ws_t ws)
 
 	// Randomize 16 bytes and base64 encode them for the
 	// Sec-WebSocket-Key field.
-	if (_ws_get_random_mask(ws, rand_key, sizeof(rand_key)) < 0)
+	if (_ws_get_random_bytes(ws, rand_key, sizeof(rand_key)) < 0)
 	{
 		LIBWS_LOG(LIBWS_ERR, "Failed to get random byte sequence "
 							 "for Websocket upgrade handshake key");
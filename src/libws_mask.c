@@ -0,0 +1,221 @@
+#include "libws_config.h"
+#include "libws_cpu.h"
+#include "libws_mask.h"
+#include <string.h>
+
+#ifdef LIBWS_WITH_SIMD
+#if defined(LIBWS_CPU_X86)
+#include <emmintrin.h>
+#include <immintrin.h>
+#elif defined(LIBWS_CPU_NEON)
+#include <arm_neon.h>
+#endif
+#endif // LIBWS_WITH_SIMD
+
+typedef void (*ws_mask_kernel_f)(uint8_t *dst, const uint8_t *src, 
+								size_t len, uint32_t mask);
+
+///
+/// Portable version that masks 8 bytes at a time.
+///
+/// All masking kernels expect the mask to already be rotated
+/// to the correct phase for the first byte of #src.
+///
+static void _ws_mask_word(uint8_t *dst, const uint8_t *src, 
+						size_t len, uint32_t mask)
+{
+	size_t i = 0;
+	uint64_t mask64;
+	uint8_t *m = (uint8_t *)&mask;
+	uint8_t m8[8];
+
+	// Repeat the mask bytes in memory order, this way
+	// we don't need to care about endianness.
+	memcpy(m8, m, 4);
+	memcpy(&m8[4], m, 4);
+	memcpy(&mask64, m8, sizeof(mask64));
+
+	// memcpy lets the compiler use unaligned loads and stores
+	// where that is allowed, without breaking strict aliasing.
+	for (; (i + 32) <= len; i += 32)
+	{
+		uint64_t w[4];
+		memcpy(w, &src[i], sizeof(w));
+		w[0] ^= mask64;
+		w[1] ^= mask64;
+		w[2] ^= mask64;
+		w[3] ^= mask64;
+		memcpy(&dst[i], w, sizeof(w));
+	}
+
+	for (; (i + 8) <= len; i += 8)
+	{
+		uint64_t w;
+		memcpy(&w, &src[i], sizeof(w));
+		w ^= mask64;
+		memcpy(&dst[i], &w, sizeof(w));
+	}
+
+	for (; i < len; i++)
+	{
+		dst[i] = src[i] ^ m[i % 4];
+	}
+}
+
+#ifdef LIBWS_WITH_SIMD
+
+#if defined(LIBWS_CPU_X86)
+
+LIBWS_TARGET("sse2")
+static void _ws_mask_sse2(uint8_t *dst, const uint8_t *src, 
+						size_t len, uint32_t mask)
+{
+	size_t i = 0;
+	__m128i m = _mm_set1_epi32((int)mask);
+
+	for (; (i + 64) <= len; i += 64)
+	{
+		__m128i a = _mm_loadu_si128((const __m128i *)&src[i]);
+		__m128i b = _mm_loadu_si128((const __m128i *)&src[i + 16]);
+		__m128i c = _mm_loadu_si128((const __m128i *)&src[i + 32]);
+		__m128i d = _mm_loadu_si128((const __m128i *)&src[i + 48]);
+		_mm_storeu_si128((__m128i *)&dst[i], _mm_xor_si128(a, m));
+		_mm_storeu_si128((__m128i *)&dst[i + 16], _mm_xor_si128(b, m));
+		_mm_storeu_si128((__m128i *)&dst[i + 32], _mm_xor_si128(c, m));
+		_mm_storeu_si128((__m128i *)&dst[i + 48], _mm_xor_si128(d, m));
+	}
+
+	for (; (i + 16) <= len; i += 16)
+	{
+		__m128i a = _mm_loadu_si128((const __m128i *)&src[i]);
+		_mm_storeu_si128((__m128i *)&dst[i], _mm_xor_si128(a, m));
+	}
+
+	// i is a multiple of 4, so the mask phase is unchanged.
+	_ws_mask_word(&dst[i], &src[i], len - i, mask);
+}
+
+LIBWS_TARGET("avx2")
+static void _ws_mask_avx2(uint8_t *dst, const uint8_t *src, 
+						size_t len, uint32_t mask)
+{
+	size_t i = 0;
+	__m256i m = _mm256_set1_epi32((int)mask);
+
+	for (; (i + 128) <= len; i += 128)
+	{
+		__m256i a = _mm256_loadu_si256((const __m256i *)&src[i]);
+		__m256i b = _mm256_loadu_si256((const __m256i *)&src[i + 32]);
+		__m256i c = _mm256_loadu_si256((const __m256i *)&src[i + 64]);
+		__m256i d = _mm256_loadu_si256((const __m256i *)&src[i + 96]);
+		_mm256_storeu_si256((__m256i *)&dst[i], _mm256_xor_si256(a, m));
+		_mm256_storeu_si256((__m256i *)&dst[i + 32], _mm256_xor_si256(b, m));
+		_mm256_storeu_si256((__m256i *)&dst[i + 64], _mm256_xor_si256(c, m));
+		_mm256_storeu_si256((__m256i *)&dst[i + 96], _mm256_xor_si256(d, m));
+	}
+
+	for (; (i + 32) <= len; i += 32)
+	{
+		__m256i a = _mm256_loadu_si256((const __m256i *)&src[i]);
+		_mm256_storeu_si256((__m256i *)&dst[i], _mm256_xor_si256(a, m));
+	}
+
+	_ws_mask_sse2(&dst[i], &src[i], len - i, mask);
+}
+
+#elif defined(LIBWS_CPU_NEON)
+
+static void _ws_mask_neon(uint8_t *dst, const uint8_t *src, 
+						size_t len, uint32_t mask)
+{
+	size_t i = 0;
+	uint8x16_t m = vreinterpretq_u8_u32(vdupq_n_u32(mask));
+
+	for (; (i + 64) <= len; i += 64)
+	{
+		uint8x16_t a = vld1q_u8(&src[i]);
+		uint8x16_t b = vld1q_u8(&src[i + 16]);
+		uint8x16_t c = vld1q_u8(&src[i + 32]);
+		uint8x16_t d = vld1q_u8(&src[i + 48]);
+		vst1q_u8(&dst[i], veorq_u8(a, m));
+		vst1q_u8(&dst[i + 16], veorq_u8(b, m));
+		vst1q_u8(&dst[i + 32], veorq_u8(c, m));
+		vst1q_u8(&dst[i + 48], veorq_u8(d, m));
+	}
+
+	for (; (i + 16) <= len; i += 16)
+	{
+		vst1q_u8(&dst[i], veorq_u8(vld1q_u8(&src[i]), m));
+	}
+
+	_ws_mask_word(&dst[i], &src[i], len - i, mask);
+}
+
+#endif
+
+#endif // LIBWS_WITH_SIMD
+
+static ws_mask_kernel_f mask_kernel = _ws_mask_word;
+static const char *mask_kernel_name = "word";
+
+void _ws_mask_init(int features)
+{
+	mask_kernel = _ws_mask_word;
+	mask_kernel_name = "word";
+
+	#ifdef LIBWS_WITH_SIMD
+	#if defined(LIBWS_CPU_X86)
+	if (features & WS_CPU_AVX2)
+	{
+		mask_kernel = _ws_mask_avx2;
+		mask_kernel_name = "avx2";
+	}
+	else if (features & WS_CPU_SSE2)
+	{
+		mask_kernel = _ws_mask_sse2;
+		mask_kernel_name = "sse2";
+	}
+	#elif defined(LIBWS_CPU_NEON)
+	if (features & WS_CPU_NEON)
+	{
+		mask_kernel = _ws_mask_neon;
+		mask_kernel_name = "neon";
+	}
+	#endif
+	#endif // LIBWS_WITH_SIMD
+}
+
+const char *_ws_mask_impl_name()
+{
+	return mask_kernel_name;
+}
+
+uint32_t _ws_mask_rotate(uint32_t mask, uint64_t offset)
+{
+	uint8_t *m = (uint8_t *)&mask;
+	uint8_t rotated[4];
+	uint32_t ret;
+	size_t i;
+
+	for (i = 0; i < sizeof(rotated); i++)
+	{
+		rotated[i] = m[(i + offset) % 4];
+	}
+
+	memcpy(&ret, rotated, sizeof(ret));
+	return ret;
+}
+
+void _ws_mask(uint32_t mask, uint64_t offset, char *dst, 
+				const char *src, uint64_t len)
+{
+	if (!dst || !src || !len)
+		return;
+
+	if (offset % 4)
+	{
+		mask = _ws_mask_rotate(mask, offset);
+	}
+
+	mask_kernel((uint8_t *)dst, (const uint8_t *)src, (size_t)len, mask);
+}
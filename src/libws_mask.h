@@ -0,0 +1,46 @@
+#ifndef __LIBWS_MASK_H__
+#define __LIBWS_MASK_H__
+
+#include <stdlib.h>
+#include <inttypes.h>
+
+///
+/// Picks the fastest masking implementation for the CPU.
+/// This is done from #ws_global_init, until it has been
+/// called a portable implementation is used.
+///
+/// @param[in] features The WS_CPU_* flags supported by the CPU.
+///
+void _ws_mask_init(int features);
+
+///
+/// Gets the name of the masking implementation in use.
+///
+const char *_ws_mask_impl_name();
+
+///
+/// Rotates a mask so that it can be applied starting at
+/// #offset bytes into a payload, as if it was phase 0.
+///
+/// @param[in] mask    The mask as found in the frame header.
+/// @param[in] offset  The offset into the payload.
+///
+/// @returns           The rotated mask.
+///
+uint32_t _ws_mask_rotate(uint32_t mask, uint64_t offset);
+
+///
+/// XORs #len bytes from #src with the mask and writes them to #dst.
+/// #dst and #src may point to the same buffer.
+///
+/// @param[in] mask    The mask as found in the frame header.
+/// @param[in] offset  The offset into the payload where #src starts.
+///                    Decides which byte of the mask to start with.
+/// @param[in] dst     The destination buffer.
+/// @param[in] src     The source buffer.
+/// @param[in] len     Number of bytes to mask.
+///
+void _ws_mask(uint32_t mask, uint64_t offset, char *dst, 
+				const char *src, uint64_t len);
+
+#endif // __LIBWS_MASK_H__
@@ -1,1321 +1,2755 @@
-
-#include "libws_config.h"
-
-#include <stdio.h>
-#include <assert.h>
-#include <errno.h>
-
-#ifdef WIN32
-  #define _CRT_RAND_S
-#include <stdlib.h>
-#endif
-
-#ifdef _WIN32
-  #include <time.h>
-#else
-  #include <sys/time.h>
-  #include <unistd.h>
-  #include <arpa/inet.h>
-#endif
-#include <string.h>
-
-#include <event2/event.h>
-#include <event2/bufferevent.h>
-#include <event2/buffer.h>
-
-#include "libws_log.h"
-#include "libws_types.h"
-#include "libws_header.h"
-#include "libws_private.h"
-#include "libws.h"
-#include "libws_handshake.h"
-#include "libws_utf8.h"
-
-#ifdef LIBWS_WITH_OPENSSL
-#include "libws_openssl.h"
-#endif 
-
-static ws_malloc_replacement_f 	replaced_ws_malloc = NULL;
-static ws_free_replacement_f	replaced_ws_free = NULL;
-static ws_realloc_replacement_f	replaced_ws_realloc = NULL;
-
-void *_ws_malloc(size_t size)
-{
-	if (size == 0)
-		return NULL;
-
-	if (replaced_ws_malloc)
-		return replaced_ws_malloc(size);
-	
-	return malloc(size);
-}
-
-void *_ws_realloc(void *ptr, size_t size)
-{
-	return replaced_ws_realloc ? replaced_ws_realloc(ptr, size) : realloc(ptr, size);
-}
-
-void _ws_free(void *ptr)
-{
-	if (replaced_ws_free)
-		replaced_ws_free(ptr);
-	else
-		free(ptr);
-}
-
-void *_ws_calloc(size_t count, size_t size)
-{
-    if (!count || !size)
-        return NULL;
-    void* p;
-    if (replaced_ws_malloc)
-    {
-        size_t sz = count * size;
-        // TODO: If count > (size_t max / size), goto fail.
-        p = replaced_ws_malloc(sz);
-        if (!p)
-            goto fail;
-        memset(p, 0, sz);
-    }
-    else
-    {
-        p = calloc(count, size);
-        if (!p)
-            goto fail;
-    }
-    return p;
-
-fail:
-#ifdef WIN32
-// Windows doesn't set ENOMEM properly.
-    errno = ENOMEM;
-#endif
-    return NULL;
-}
-
-char *_ws_strdup(const char *str)
-{
-	if (!str)
-	{
-		errno = EINVAL;
-		return NULL;
-	}
-
-	if (replaced_ws_malloc)
-	{
-		size_t len = strlen(str);
-		void *p = NULL;
-
-		if (len == ((size_t)-1))
-			goto fail;
-
-		if ((p = replaced_ws_malloc(len + 1)))
-		{
-			return memcpy(p, str, len + 1);
-		}
-	}
-	else
-	{	
-		#ifdef WIN32
-		return _strdup(str);
-		#else
-		return strdup(str);
-		#endif
-	}
-fail:
-	errno = ENOMEM;
-	return NULL;
-}
-
-void _ws_set_memory_functions(ws_malloc_replacement_f malloc_replace,
-							 ws_free_replacement_f free_replace,
-							 ws_realloc_replacement_f realloc_replace)
-{
-
-	replaced_ws_malloc = malloc_replace;
-	replaced_ws_free = free_replace;
-	replaced_ws_realloc = realloc_replace;
-
-	event_set_mem_functions(malloc_replace, realloc_replace, free_replace);
-
-	#ifdef LIBWS_WITH_OPENSSL
-	CRYPTO_set_mem_functions(malloc_replace, realloc_replace, free_replace);
-	#endif
-}
-
-///
-/// Event for when a connection attempt times out.
-///
-static void _ws_connection_timeout_event(evutil_socket_t fd, short what, void *arg)
-{
-	char buf[256];
-	ws_t ws = (ws_t)arg;
-	assert(ws);
-
-	LIBWS_LOG(LIBWS_ERR, "Websocket connection timed out after %ld seconds "
-						 "for %s", ws->connect_timeout.tv_sec, 
-						 ws_get_uri(ws, buf, sizeof(buf)));
-
-	if (ws->connect_timeout_cb)
-	{
-		ws->connect_timeout_cb(ws, ws->connect_timeout, ws->connect_timeout_arg);
-	}
-}
-
-static void _ws_pong_timeout_event(evutil_socket_t fd, short what, void *arg)
-{
-	ws_t ws = (ws_t)arg;
-	assert(ws);
-
-	// TODO: Make sure we delete this event if the ws->pong_timeout_cb is set to NULL while waiting for event to time out.
-
-	if (ws->pong_timeout_cb)
-	{
-		ws->pong_timeout_cb(ws, ws->pong_timeout, ws->pong_arg);
-	}
-}
-
-int _ws_setup_timeout_event(ws_t ws, event_callback_fn func, ws_timer* timer, struct timeval *tv)
-{
-	assert(ws);
-        assert(timer);
-	assert(func);
-	assert(tv);
-
-	LIBWS_LOG(LIBWS_TRACE, "Setting up new timeout event");
-
-        if (*timer)
-	{
-            _ws_free_timer(timer);
-	}
-        ws_base_t base = ws->ws_base;
-#ifdef LIBWS_EXTERNAL_LOOP
-        *timer = _ws_malloc(sizeof(struct ws_timer_s));
-        if (!*timer)
-        {
-            LIBWS_LOG(LIBWS_ERR, "Failed to allocate memory for ws_timer struct");
-            return -1;
-        }
-        if (!((*timer)->evtimer = evtimer_new(base->ev_base, base->marshall_timer_cb, (void*)*timer)))
-        {
-            _ws_free(*timer);
-            *timer = NULL;
-            LIBWS_LOG(LIBWS_ERR, "Failed to create evtimer for timeout event");
-            return -1;
-        }
-        (*timer)->ws = ws;
-        (*timer)->handler = func;
-        (*timer)->canceled = 0;
-        if (evtimer_add((*timer)->evtimer, tv))
-#else
-        *timer = evtimer_new(base->ev_base, func, (void *)ws);
-        if (!*timer)
-	{
-            LIBWS_LOG(LIBWS_ERR, "Failed to create timeout event");
-            return -1;
-	}
-        if (evtimer_add(*timer, tv))
-#endif
-	{
-            LIBWS_LOG(LIBWS_ERR, "Failed to add timeout event");
-            _ws_do_free_timer(timer);
-            return -1;
-	}
-
-	return 0;
-}
-
-#ifdef LIBWS_EXTERNAL_LOOP
-void ws_handle_marshall_timer_cb(int fd, short events, void* userp)
-{
-    ws_timer timer = (ws_timer)userp;
-    if (timer->ws->state == WS_STATE_DESTROYING)
-    {
-        //we should not schedule timers once we are being destroyed
-        LIBWS_LOG(LIBWS_WARN, "BUG: Timer event received, but we are being destroyed. Ignoring");
-    }
-    else if (!timer->canceled)
-    {
-        timer->handler(fd, events, timer->ws);
-    }
-    _ws_do_free_timer(&timer);
-}
-
-/// This is called from within the timer handler, when the timer triggers.
-/// It can be called directly _only_ in case we could not successfully enable the timer,
-/// so it would never trigger and be freed
-inline void _ws_do_free_timer(ws_timer* timer)
-{
-    assert(timer);
-    ws_timer t = *timer;
-    assert(t);
-
-    if (t->evtimer) //in the case of the async destoy message, we don't have an actual evtimer, we just use the timer marshaller to async post a message
-    {
-        event_free(t->evtimer);
-    }
-    _ws_free(t);
-}
-
-///Destroy the timer asynchronously on LIBWS_EXTERNAL_LOOP enabled
-inline void _ws_free_timer(ws_timer* timer)
-{
-// timer will be deleted by the timer handler, when it triggers. It will always trigger, as we don't
-// actually cancel the timer, only flag it as canceled
-    (*timer)->canceled = 1;
-    *timer = NULL;
-}
-
-#else
-
-//We always destroy the timer synchronously if LIBWS_EXTERNAL_LOOP is disabled
-inline void _ws_free_timer(ws_timer* timer)
-{
-    if (!*timer)
-        return;
-    evtimer_del(*timer);
-    event_free(*timer);
-    *timer = NULL;
-}
-
-/// If LIBWS_EXTERNAL_LOOP is not enabled, maps _ws_do_free_timer to _ws_free_timer, as
-/// we always work synchronously
-inline void _ws_do_free_timer(ws_timer* timer)
-{
-    _ws_free_timer(timer);
-}
-
-#endif
-
-int _ws_setup_pong_timeout(ws_t ws)
-{
-	assert(ws);
-	return _ws_setup_timeout_event(ws, _ws_pong_timeout_event,
-				&ws->pong_timeout_event, &ws->pong_timeout);
-}
-
-int _ws_setup_connection_timeout(ws_t ws)
-{	
-	struct timeval tv = {WS_DEFAULT_CONNECT_TIMEOUT, 0};
-	assert(ws);
-	 
-	if (ws->connect_timeout.tv_sec > 0)
-	{
-		tv = ws->connect_timeout;
-	}
-
-	return _ws_setup_timeout_event(ws, _ws_connection_timeout_event, 
-									&ws->connect_timeout_event, &tv);
-}
-
-static int _ws_handle_close_frame(ws_t ws)
-{
-	assert(ws);
-	LIBWS_LOG(LIBWS_TRACE, "Close frame");
-
-	ws->server_close_status = (uint16_t)WS_CLOSE_STATUS_NORMAL_1000;
-	ws->server_reason = NULL;
-	ws->server_reason_len = 0;
-
-	if (ws->close_timeout_event)
-	{
-                _ws_free_timer(&ws->close_timeout_event);
-	}
-
-	ws->state = WS_STATE_CLOSING;
-	ws->received_close = 1;
-
-	// The Close frame MAY contain a body (the "Application data" portion of
-	// the frame) that indicates a reason for closing.
-	// If there is a body, the first two bytes of
-	// the body MUST be a 2-byte unsigned integer (in network byte order)
-	// representing a status code
-	if (ws->ctrl_len > 0)
-	{
-		if (ws->ctrl_len < 2)
-		{
-            LIBWS_LOG(LIBWS_ERR, "Close frame application data missing status code");
-			ws->server_close_status = WS_CLOSE_STATUS_STATUS_CODE_EXPECTED_1005;
-			ws_close_with_status(ws, WS_CLOSE_STATUS_PROTOCOL_ERR_1002);
-			return 0;
-		}
-		else
-		{
-			LIBWS_LOG(LIBWS_DEBUG, "Reading server close status and reason "
-					" (payload length %lu)", ws->ctrl_len);
-
-            uint16_t status;
-            memcpy(&status, ws->ctrl_payload, 2);
-			ws->server_close_status = (ws_close_status_t)ntohs(status);
-            if (ws->ctrl_len > 2)
-            {
-                ws->server_reason = &ws->ctrl_payload[2];
-                ws->server_reason_len = ws->ctrl_len - 2;
-                ws->server_reason[ws->server_reason_len] = '\0';
-            }
-            else
-            {
-                ws->server_reason = NULL;
-            }
-
-			LIBWS_LOG(LIBWS_INFO, "Got close status %d, \"%s\"", 
-				ws->server_close_status, 
-				ws->server_reason);
-
-			if (!WS_IS_PEER_CLOSE_STATUS_VALID(ws->server_close_status))
-			{
-				LIBWS_LOG(LIBWS_ERR, "Invalid close code from peer %d", 
-							ws->server_close_status);
-				ws_close_with_status(ws, WS_CLOSE_STATUS_PROTOCOL_ERR_1002);
-				return 0;
-			}
-
-			// Validate UTF8 text.
-			ws->utf8_state = WS_UTF8_ACCEPT;
-			ws_utf8_validate(&ws->utf8_state, 
-							ws->server_reason, ws->server_reason_len);
-
-			if (ws->utf8_state == WS_UTF8_REJECT)
-			{
-				ws_close_with_status(ws, WS_CLOSE_STATUS_INCONSISTENT_DATA_1007);
-				return 0;
-			}
-		}
-	}
-
-	// If an endpoint receives a Close frame and did not previously send a
-	// Close frame, the endpoint MUST send a Close frame in response.  (When
-	// sending a Close frame in response, the endpoint typically echos the
-	// status code it received.)  It SHOULD do so as soon as practical.  An
-	// endpoint MAY delay sending a Close frame until its current message is
-	// sent (for instance, if the majority of a fragmented message is
-	// already sent, an endpoint MAY send the remaining fragments before
-	// sending a Close frame).  However, there is no guarantee that the
-	// endpoint that has already sent a Close frame will continue to process
-	// data.
-	if (!ws->sent_close)
-	{
-		LIBWS_LOG(LIBWS_INFO, "Echoing status code %d", ws->server_close_status);
-                return ws_close_with_status_reason(ws,
-			ws->server_close_status, 
-			ws->server_reason, 
-			ws->server_reason_len);
-	}
-
-	return 0;
-}
-
-int _ws_handle_ping_frame(ws_t ws)
-{
-	assert(ws);
-	LIBWS_LOG(LIBWS_TRACE, "  Ping frame");
-
-	ws->ping_cb(ws, ws->ctrl_payload, ws->ctrl_len, 1, NULL);
-
-	return 0;
-}
-
-int _ws_handle_pong_frame(ws_t ws)
-{
-	assert(ws);
-	LIBWS_LOG(LIBWS_TRACE, "  Pong frame");
-
-	ws->pong_cb(ws, ws->ctrl_payload, ws->ctrl_len, 0, NULL);
-
-	return 0;
-}
-
-int _ws_handle_control_frame(ws_t ws)
-{
-	ws_header_t *h;
-	assert(ws);
-	LIBWS_LOG(LIBWS_TRACE, "Control frame");
-
-	h = &ws->header;
-
-	assert(WS_OPCODE_IS_CONTROL(h->opcode));
-
-	switch (h->opcode)
-	{
-		case WS_OPCODE_CLOSE_0X8: return _ws_handle_close_frame(ws);
-		case WS_OPCODE_PONG_0XA: return _ws_handle_pong_frame(ws);
-		case WS_OPCODE_PING_0X9: return _ws_handle_ping_frame(ws);
-		default:
-		case WS_OPCODE_CONTROL_RSV_0XB:
-		case WS_OPCODE_CONTROL_RSV_0XC:
-		case WS_OPCODE_CONTROL_RSV_0XD:
-		case WS_OPCODE_CONTROL_RSV_0XE:
-		case WS_OPCODE_CONTROL_RSV_0XF:
-			LIBWS_LOG(LIBWS_ERR, "Got unknown control frame 0x%x", h->opcode);
-			return -1;
-	}
-
-	return 0;
-}
-
-int _ws_handle_frame_begin(ws_t ws)
-{
-	assert(ws);
-
-	LIBWS_LOG(LIBWS_TRACE, "Frame begin, opcode = %d", ws->header.opcode);
-
-	ws->recv_frame_len = 0;
-
-	if (WS_OPCODE_IS_CONTROL(ws->header.opcode))
-	{
-		LIBWS_LOG(LIBWS_DEBUG, "  Control frame");
-		memset(ws->ctrl_payload, 0, sizeof(ws->ctrl_payload));
-		ws->ctrl_len = 0;
-		return 0;
-	}
-
-	LIBWS_LOG(LIBWS_DEBUG, "  Normal frame");
-
-	// Normal frame.
-	if (!ws->in_msg)
-	{
-		ws->in_msg = 1;
-		ws->utf8_state = WS_UTF8_ACCEPT;
-		ws->msg_isbinary = (ws->header.opcode == WS_OPCODE_BINARY_0X2);
-
-		LIBWS_LOG(LIBWS_DEBUG, "Call message begin callback");
-		ws->msg_begin_cb(ws, ws->msg_begin_arg);
-	}
-
-	LIBWS_LOG(LIBWS_DEBUG, "Call frame begin callback");
-	ws->msg_frame_begin_cb(ws, ws->msg_frame_begin_arg);
-
-	return 0;
-}
-
-int _ws_handle_frame_data(ws_t ws, char *buf, size_t len)
-{
-	int ret = 0;
-	assert(ws);
-	LIBWS_LOG(LIBWS_TRACE, "  Handle frame data");
-
-	if (WS_OPCODE_IS_CONTROL(ws->header.opcode))
-	{
-		size_t total_len = (ws->ctrl_len + len);
-
-		if (total_len > WS_CONTROL_MAX_PAYLOAD_LEN)
-		{
-			LIBWS_LOG(LIBWS_ERR, "Control payload too big %u, only %u allowed",
-						total_len, WS_CONTROL_MAX_PAYLOAD_LEN);
-
-			// Copy the remaining data into the buf.
-			len = WS_CONTROL_MAX_PAYLOAD_LEN - ws->ctrl_len;
-			// TODO: Set protocol violation error status here. (This will then be handled in the read callback)
-			ws_close_with_status(ws, WS_CLOSE_STATUS_PROTOCOL_ERR_1002);
-			ret = -1;
-		}
-
-		LIBWS_LOG(LIBWS_DEBUG, "   Append %lu bytes to ctrl payload[%lu]", len, ws->ctrl_len);
-		memcpy(&ws->ctrl_payload[ws->ctrl_len], buf, len);
-		ws->ctrl_len += len;
-
-		return ret;
-	}
-
-	ws->msg_frame_data_cb(ws, buf, len, ws->msg_frame_data_arg);
-
-	return ret;
-}
-
-int _ws_handle_frame_end(ws_t ws)
-{
-	assert(ws);
-	LIBWS_LOG(LIBWS_DEBUG2, "Frame end, opcode = %d", ws->header.opcode);
-
-	if (WS_OPCODE_IS_CONTROL(ws->header.opcode))
-	{
-		ws->has_header = 0;
-		return _ws_handle_control_frame(ws);
-	}
-
-	ws->msg_frame_end_cb(ws, ws->msg_frame_end_arg);
-
-	if (ws->header.fin)
-	{
-		ws->msg_end_cb(ws, ws->msg_end_arg);
-		ws->in_msg = 0;
-	}
-
-	ws->has_header = 0;
-
-	return 0;
-}
-
-int _ws_validate_header(ws_t ws)
-{
-	ws_header_t *h = &ws->header;
-
-	if (h->rsv1 || h->rsv2 || h->rsv3)
-	{
-		LIBWS_LOG(LIBWS_ERR, "Protocol violation, reserve bit set");
-		return -1;
-	}
-
-	if (WS_OPCODE_IS_RESERVED(h->opcode))
-	{
-		LIBWS_LOG(LIBWS_ERR, "Protocol violation, reserved opcode used %d (%s)", 
-				h->opcode, ws_opcode_str(h->opcode));
-		return -1;
-	}
-
-	if (WS_OPCODE_IS_CONTROL(h->opcode) && !h->fin)
-	{
-		LIBWS_LOG(LIBWS_ERR, "Protocol violation, fragmented %s not allowed",
-				ws_opcode_str(h->opcode));
-		return -1;
-	}
-
-	if ((ws->header.opcode == WS_OPCODE_CONTINUATION_0X0)
-		&& !ws->in_msg)
-	{
-		LIBWS_LOG(LIBWS_ERR, "Got continuation frame when not in message");
-		return -1;
-	}
-
-	// If we're in a message, we must either get a continuation frame
-	// or an interjected control frame such as a ping.
-	if (ws->in_msg 
-		&& ((h->opcode != WS_OPCODE_CONTINUATION_0X0) 
-			&& !WS_OPCODE_IS_CONTROL(h->opcode)))
-	{
-		LIBWS_LOG(LIBWS_ERR, "Didn't get continuation frame when "
-							"still in message. opcode %d (%s)",
-							h->opcode,
-							ws_opcode_str(h->opcode));
-		return -1;
-	}
-
-	return 0;
-}
-
-void _ws_read_websocket(ws_t ws, struct evbuffer *in)
-{
-	assert(ws);
-	assert(ws->bev);
-	assert(in);
-
-	LIBWS_LOG(LIBWS_DEBUG2, "Read websocket data");
-
-	while (evbuffer_get_length(in))
-	{
-		// First read the websocket header.
-		if (!ws->has_header)
-		{
-			size_t header_len;
-			ev_ssize_t bytes_read;
-			char header_buf[WS_HDR_MAX_SIZE];
-			ws_parse_state_t state;
-
-			LIBWS_LOG(LIBWS_DEBUG2, "Read websocket header");
-
-			bytes_read = evbuffer_copyout(in, (void *)header_buf, 
-											sizeof(header_buf));
-
-			LIBWS_LOG(LIBWS_DEBUG2, "Copied %d header bytes", bytes_read);
-
-			state = ws_unpack_header(&ws->header, &header_len, 
-					(unsigned char *)header_buf, bytes_read);
-
-			assert(state != WS_PARSE_STATE_USER_ABORT);
-
-			// Look for protocol violations in the header.
-			if (state != WS_PARSE_STATE_NEED_MORE && _ws_validate_header(ws))
-			{
-				state = WS_PARSE_STATE_ERROR;
-			}
-
-			switch (state)
-			{
-				case WS_PARSE_STATE_SUCCESS: 
-				{
-					ws_header_t *h = &ws->header;
-					ws->has_header = 1;
-
-					LIBWS_LOG(LIBWS_DEBUG2, "Got header (%lu bytes):\n"
-						"fin = %d, rsv = {%d,%d,%d}, mask_bit = %d, opcode = 0x%x (%s), "
-						"mask = %x, len = %d",
-						header_len,
-						h->fin, h->rsv1, h->rsv2, h->rsv3, h->mask_bit, 
-						h->opcode, ws_opcode_str(h->opcode), h->mask, (int)h->payload_len);
-
-					if (evbuffer_drain(in, header_len))
-					{
-						// TODO: Error! close
-						LIBWS_LOG(LIBWS_ERR, "Failed to drain header buffer");
-					}
-					break;
-				}
-				case WS_PARSE_STATE_NEED_MORE:
-					LIBWS_LOG(LIBWS_DEBUG2, " Need more header data");
-					return;
-				case WS_PARSE_STATE_ERROR:
-					LIBWS_LOG(LIBWS_ERR, "Error protocol violation in header");
-					ws_close_with_status(ws, WS_CLOSE_STATUS_PROTOCOL_ERR_1002);
-					return;
-				case WS_PARSE_STATE_USER_ABORT:
-					// TODO: What to do here?
-					LIBWS_LOG(LIBWS_ERR, "User abort");
-					break;
-			}
-
-			_ws_handle_frame_begin(ws);
-		}
-
-		if (ws->has_header)
-		{
-			// We're in a frame.
-			size_t recv_len = evbuffer_get_length(in);
-			size_t remaining = (size_t)(ws->header.payload_len - ws->recv_frame_len);
-
-			LIBWS_LOG(LIBWS_DEBUG2, "In frame (remaining %u bytes of %u payload)", 
-					remaining, ws->header.payload_len);
-
-			if (recv_len > remaining)
-			{
-				LIBWS_LOG(LIBWS_DEBUG2, "Received %u of %u remaining bytes", recv_len, remaining);
-				recv_len = remaining;
-			}
-
-			if (remaining == 0)
-			{
-				_ws_handle_frame_end(ws);
-			}
-			else
-			{
-				int bytes_read;
-				char *buf = (char *)_ws_malloc(recv_len);
-
-				// TODO: Maybe we should only do evbuffer_pullup here instead
-				// and pass that pointer on instead.
-				bytes_read = evbuffer_remove(in, buf, recv_len);
-				ws->recv_frame_len += bytes_read;
-
-				if (bytes_read != recv_len)
-				{
-					LIBWS_LOG(LIBWS_ERR, "Wanted to read %u but only got %d", 
-							recv_len, bytes_read);
-				}
-
-				LIBWS_LOG(LIBWS_DEBUG2, "read: %d (%llu of %llu bytes)", 
-						bytes_read, ws->recv_frame_len, ws->header.payload_len);
-
-				if (ws->header.mask_bit)
-				{
-					ws_unmask_payload(ws->header.mask, buf, bytes_read);
-				}
-
-				// Validate UTF8 text. Control frames are handled seperately.
-				if (!ws->msg_isbinary 
-				 && !WS_OPCODE_IS_CONTROL(ws->header.opcode))
-				{
-					LIBWS_LOG(LIBWS_DEBUG2, "About to validate UTF8, state = %d"
-							" len = %d", ws->utf8_state, bytes_read);
-
-					ws_utf8_validate(&ws->utf8_state, 
-										buf, bytes_read);
-
-					// Either the UTF8 is invalid, or a codepoint is not
-					// complete in the finish frame.
-					if ((ws->utf8_state == WS_UTF8_REJECT) 
-					|| ((ws->utf8_state != WS_UTF8_ACCEPT) && (ws->header.fin)))
-					{
-						LIBWS_LOG(LIBWS_ERR, "Invalid UTF8!");
-
-						ws_close_with_status(ws, 
-							WS_CLOSE_STATUS_INCONSISTENT_DATA_1007);
-					}
-
-					LIBWS_LOG(LIBWS_DEBUG2, "Validated UTF8, state = %d", 
-							ws->utf8_state);
-				}
-
-				if (_ws_handle_frame_data(ws, buf, bytes_read))
-				{
-					// TODO: Raise protocol error via error cb.
-					// TODO: Close connection.
-					LIBWS_LOG(LIBWS_ERR, "Failed to handle frame data");
-				}
-				else
-				{
-					// TODO: This is not hit in some cases.
-					LIBWS_LOG(LIBWS_DEBUG2, "recv_frame_len = %llu, payload_len = %llu",
-						 ws->recv_frame_len, ws->header.payload_len);
-					// The entire frame has been received.
-					if (ws->recv_frame_len == ws->header.payload_len)
-					{
-						_ws_handle_frame_end(ws);
-					}
-				}
-
-				_ws_free(buf);
-			}
-		}
-	}
-
-	LIBWS_LOG(LIBWS_DEBUG, "    %lu bytes left after websocket read", 
-			evbuffer_get_length(in));
-}
-
-///
-/// Libevent bufferevent callback for when there is data to be read
-/// on the websocket socket.
-///
-void ws_read_callback(struct bufferevent *bev, void *ptr)
-{
-	ws_t ws = (ws_t)ptr;
-        if (ws->state == WS_STATE_DESTROYING)
-        {
-            LIBWS_LOG(LIBWS_DEBUG, "Read event received, but we are being destroyed. Ignoring");
-            return;
-        }
-        struct evbuffer *in;
-	assert(ws);
-	assert(bev);
-	assert(ws->bev == bev);
-
-	LIBWS_LOG(LIBWS_DEBUG, "Read callback");
-
-	in = bufferevent_get_input(ws->bev);
-
-	if (ws->connect_state != WS_CONNECT_STATE_HANDSHAKE_COMPLETE)
-	{
-		// Complete the connection handshake.
-		ws_parse_state_t state;
-
-		LIBWS_LOG(LIBWS_DEBUG, "Look for handshake reply");
-
-		switch ((state = _ws_read_server_handshake_reply(ws, in)))
-		{
-			case WS_PARSE_STATE_ERROR:
-                ws_close_with_status(ws, WS_CLOSE_STATUS_PROTOCOL_ERR_1002);
-                return;
-			case WS_PARSE_STATE_NEED_MORE: return;
-			case WS_PARSE_STATE_SUCCESS:
-			{
-				ws->state = WS_STATE_CONNECTED;
-
-				if (ws->connect_cb)
-				{
-					LIBWS_LOG(LIBWS_DEBUG, "Calling connect callback");
-					ws->connect_cb(ws, ws->connect_arg);
-				}
-			}
-			case WS_PARSE_STATE_USER_ABORT:
-				// TODO: What to do here?
-				break;
-		}
-	}
-
-	// Connected and completed handshake we can now expect websocket data.
-	_ws_read_websocket(ws, in);
-}
-
-///
-/// Libevent bufferevent callback for when a write is done on
-/// the websocket socket.
-///
-void ws_write_callback(struct bufferevent *bev, void *ptr)
-{
-    ws_t ws = (ws_t)ptr;
-    assert(ws);
-    
-    LIBWS_LOG(LIBWS_DEBUG, "Write callback");
-
-    if (ws->write_cb && ws->state == WS_STATE_CONNECTED)
-    {
-        LIBWS_LOG(LIBWS_DEBUG, "Call write callback");
-        (ws->write_cb)(ws, ws->write_arg);
-    }
-}
-
-static void _ws_connected_event(struct bufferevent *bev, short events, void *arg)
-{
-	ws_t ws = (ws_t)arg;
-	assert(ws);
-	char buf[1024];
-	LIBWS_LOG(LIBWS_DEBUG, "Connected to %s", ws_get_uri(ws, buf, sizeof(buf)));
-
-	if (ws->connect_timeout_event)
-	{
-		LIBWS_LOG(LIBWS_DEBUG, "Freeing connect timeout event");
-                _ws_free_timer(&ws->connect_timeout_event);
-	}
-
-	bufferevent_enable(ws->bev, EV_READ | EV_WRITE);
-
-	#ifdef LIBWS_WITH_OPENSSL
-	{
-		int rc = SSL_get_verify_result(ws->ssl);
-
-		if(rc != X509_V_OK) 
-		{
-  			if (rc == X509_V_ERR_DEPTH_ZERO_SELF_SIGNED_CERT 
-  			 || rc == X509_V_ERR_SELF_SIGNED_CERT_IN_CHAIN)
-  			{
-  				LIBWS_LOG(LIBWS_DEBUG, "Server using a self-signed certificate");
-  				// TODO: Fail if use_ssl is not set to allow self-signed.
-  			}
-  		}
-	}
-	#endif
-
-	// Add the handshake to the send buffer, this will
-	// be sent as soon as we're connected.
-	if (_ws_send_handshake(ws, bufferevent_get_output(ws->bev)))
-	{
-		LIBWS_LOG(LIBWS_ERR, "Failed to assemble handshake");
-		return;
-	}
-}
-
-static void _ws_eof_event(struct bufferevent *bev, short events, void *ptr)
-{
-	ws_t ws = (ws_t)ptr;
-	ws_close_status_t status;
-	struct evbuffer *in;
-	assert(ws);
-
-	LIBWS_LOG(LIBWS_TRACE, "EOF event");
-
-	in = bufferevent_get_input(ws->bev);
-
-	if (evbuffer_get_length(in) > 0)
-	{
-                LIBWS_LOG(LIBWS_DEBUG, "Left %u bytes at EOF", evbuffer_get_length(in));
-
-		_ws_read_websocket(ws, in);
-	}
-
-	status = ws->server_close_status;
-
-	LIBWS_LOG(LIBWS_DEBUG, "Sent close frame %s, received close frame %s", 
-							ws->sent_close ? "TRUE" : "FALSE", 
-							ws->received_close ? "TRUE" : "FALSE");
-
-	_ws_shutdown(ws);
-
-	if (!ws->received_close)
-	{
-		ws->state = WS_STATE_CLOSED_UNCLEANLY;
-        if (status == 0)
-            status = WS_CLOSE_STATUS_ABNORMAL_1006;
-	}
-
-	if (ws->close_cb)
-	{
-		LIBWS_LOG(LIBWS_DEBUG, "Call close callback");
-        ws->close_cb(ws,
-                     status,
-                     WS_ERRTYPE_PROTOCOL,
-                     ws->server_reason,
-                     ws->server_reason_len,
-                     ws->close_arg);
-	}
-	else
-	{
-		LIBWS_LOG(LIBWS_DEBUG, "No close callback");
-	}
-}
-
-static void _ws_error_event(struct bufferevent *bev, short events, void *ptr)
-{
-	const char *err_msg;
-	int err;
-	ws_t ws = (ws_t)ptr;
-	assert(ws);
-
-	LIBWS_LOG(LIBWS_DEBUG, "Error raised");
-
-        if ((ws->state == WS_STATE_CONNECTING) && ((err = bufferevent_socket_get_dns_error(ws->bev))))
-        {
-            err_msg = evutil_gai_strerror(err);
-            LIBWS_LOG(LIBWS_ERR, "DNS error %d: %s", err, err_msg);
-            if (ws->close_cb)
-            {
-                ws->close_cb(ws, err, WS_ERRTYPE_DNS, err_msg, strlen(err_msg), ws->close_arg);
-            }
-	}
-	else
-	{
-            // See if the server closed on us.
-            _ws_read_websocket(ws, bufferevent_get_input(ws->bev));
-            if (!ws->received_close)
-            {
-                ws->server_close_status = WS_CLOSE_STATUS_ABNORMAL_1006;
-            }
-
-            err = EVUTIL_SOCKET_ERROR();
-            err_msg = evutil_socket_error_to_string(err);
-            LIBWS_LOG(LIBWS_ERR, "Bufferevent error: %s (%d)", err_msg, err);
-            if (ws->close_cb)
-            {
-                ws->close_cb(ws, err, WS_ERRTYPE_LIB, err_msg, strlen(err_msg), ws->close_arg);
-            }
-        }
-
-        _ws_shutdown(ws);
-}
-
-///
-/// Libevent bufferevent callback for when an event occurs on
-/// the websocket socket.
-///
-void ws_event_callback(struct bufferevent *bev, short events, void *ptr)
-{
-    ws_t ws = (ws_t)ptr;
-    assert(ws);
-    if (ws->state == WS_STATE_DESTROYING)
-    {
-        LIBWS_LOG(LIBWS_DEBUG, "Event callback called, but we are being destroyed. Ignoring");
-        return;
-    }
-
-    if (events & BEV_EVENT_CONNECTED)
-    {
-        _ws_connected_event(bev, events, ws);
-    }
-
-    else if (events & BEV_EVENT_EOF)
-    {
-        _ws_eof_event(bev, events, ws);
-    }
-    else if (events & BEV_EVENT_ERROR)
-    {
-        _ws_error_event(bev, events, ws);
-    }
-
-    else if (events & BEV_EVENT_TIMEOUT)
-    {
-        if (ws->close_cb)
-        {
-            char msg[] = "I/O timeout";
-            ws->close_cb(ws, ETIMEDOUT, WS_ERRTYPE_LIB, msg, sizeof(msg)-1, ws->close_arg);
-            LIBWS_LOG(LIBWS_DEBUG, "Bufferevent timeout");
-        }
-    }
-
-    if (events & BEV_EVENT_WRITING)
-    {
-        LIBWS_LOG(LIBWS_DEBUG, "   Writing");
-    }
-
-    if (events & BEV_EVENT_READING)
-    {
-        LIBWS_LOG(LIBWS_DEBUG, "   Reading");
-    }
-}
-
-int _ws_create_bufferevent_socket(ws_t ws)
-{
-	int ret = 0;
-	assert(ws);
-        ws_base_t base = ws->ws_base;
-	LIBWS_LOG(LIBWS_DEBUG, "Create bufferevent socket");
-
-	#ifdef LIBWS_WITH_OPENSSL
-	if (ws->use_ssl)
-	{
-		if (!(ws->bev = _ws_create_bufferevent_openssl_socket(ws))) 
-		{
-			LIBWS_LOG(LIBWS_ERR, "Failed to create SSL socket");
-			ret = -1;
-			goto fail;
-		}
-	}
-	else
-	#endif // LIBWS_WITH_OPENSSL
-	{
-                if (!(ws->bev = bufferevent_socket_new(base->ev_base, -1,
-                        _LIBWS_LE2_OPT_THREADSAFE | BEV_OPT_CLOSE_ON_FREE)))
-		{
-			LIBWS_LOG(LIBWS_ERR, "Failed to create socket");
-			ret = -1;
-			goto fail;
-		}
-	}
-#ifdef LIBWS_EXTERNAL_LOOP
-    assert(base->marshall_read_cb && base->marshall_event_cb && base->marshall_timer_cb);
-    bufferevent_setcb(ws->bev, base->marshall_read_cb, base_marshall_write_cb,
-                      base->marshall_event_cb, (void*)ws);
-#else
-    bufferevent_setcb(ws->bev, ws_read_callback, ws_write_callback,
-                      ws_event_callback, (void*)ws);
-#endif
-	return ret;
-fail:
-	if (ws->bev)
-	{
-		bufferevent_free(ws->bev);
-		ws->bev = NULL;
-	}
-
-	return ret;
-}
-
-static void _ws_builtin_no_copy_cleanup_wrapper(const void *data, 
-										size_t datalen, void *extra)
-{
-	ws_t ws = (ws_t)extra;
-	assert(ws);
-	assert(ws->no_copy_cleanup_cb);
-
-	// We wrap this so we can pass the websocket context.
-	// (Also, we don't want to expose any bufferevent types to the
-	//  external API so we're free to replace it).
-	ws->no_copy_cleanup_cb(ws, data, datalen, ws->no_copy_extra);
-}
-
-int _ws_send_data(ws_t ws, char *msg, uint64_t len, int no_copy)
-{
-	// TODO: We supply a len of uint64_t, evbuffer_add uses size_t...
-	assert(ws);
-
-	LIBWS_LOG(LIBWS_TRACE, " Send the data (%llu bytes)", len);
-
-	if (!ws->bev)
-	{
-		LIBWS_LOG(LIBWS_ERR, "Null bufferevent on send");
-		return -1;
-	}
-
-	// If in no copy mode we only add a reference to the passed
-	// buffer to the underlying bufferevent, and let it use the
-	// user supplied cleanup function when it has sent the data.
-	// (Note that the header will never be sent like this).
-	if (no_copy && ws->no_copy_cleanup_cb)
-	{
-		if (evbuffer_add_reference(bufferevent_get_output(ws->bev), 
-			(void *)msg, (size_t)len, _ws_builtin_no_copy_cleanup_wrapper, (void *)ws))
-		{
-			LIBWS_LOG(LIBWS_ERR, "Failed to write reference to send buffer");
-			return -1;
-		}
-	}
-	else
-	{
-		// Send like normal (this will copy the data).
-		if (evbuffer_add(bufferevent_get_output(ws->bev), 
-						msg, (size_t)len))
-		{
-			LIBWS_LOG(LIBWS_ERR, "Failed to write to send buffer");
-			return -1;
-		}
-	}
-
-	return 0;
-}
-
-int _ws_send_frame_raw(ws_t ws, ws_opcode_t opcode, char *data, uint64_t datalen)
-{
-	uint8_t header_buf[WS_HDR_MAX_SIZE];
-	size_t header_len = 0;
-
-	assert(ws);
-
-	LIBWS_LOG(LIBWS_TRACE, " Send frame raw 0x%x", opcode);
-
-	if (ws->send_state != WS_SEND_STATE_NONE)
-	{
-		LIBWS_LOG(LIBWS_ERR, "Send state not none");
-		return -1;
-	}
-
-	// All control frames MUST have a payload length of 125 bytes or less
-	// and MUST NOT be fragmented.
-	if (WS_OPCODE_IS_CONTROL(opcode) && (datalen > 125))
-	{
-		LIBWS_LOG(LIBWS_ERR, "Control frame payload cannot be "
-							 "larger than 125 bytes");
-		return -1;
-	}
-
-	// Pack and send header.
-	{
-		memset(&ws->send_header, 0, sizeof(ws_header_t));
-
-		ws->send_header.fin = 0x1;
-		ws->send_header.opcode = opcode;
-		
-		if (datalen > WS_MAX_PAYLOAD_LEN)
-		{
-			LIBWS_LOG(LIBWS_ERR, "Payload length (0x%x) larger than max allowed "
-								 "websocket payload (0x%x)",
-								 datalen, WS_MAX_PAYLOAD_LEN);
-			return -1;
-		}
-
-		ws->send_header.mask_bit = 0x1;
-		ws->send_header.payload_len = datalen;
-
-		if (_ws_get_random_mask(ws, (char *)&ws->send_header.mask, sizeof(uint32_t)) 
-			!= sizeof(uint32_t))
-		{
-		 	return -1;
-		}
-
-		ws_pack_header(&ws->send_header, header_buf, sizeof(header_buf), &header_len);
-		
-		if (_ws_send_data(ws, (char *)header_buf, (uint64_t)header_len, 0))
-		{
-			LIBWS_LOG(LIBWS_ERR, "Failed to send frame header");
-			return -1;
-		}
-	}
-
-	// Send the data.
-	{
-		ws_mask_payload(ws->send_header.mask, data, datalen);
-
-        int nocopy = (opcode == WS_OPCODE_TEXT_0X1 || opcode == WS_OPCODE_BINARY_0X2);
-		if (_ws_send_data(ws, data, datalen, nocopy))
-		{
-			LIBWS_LOG(LIBWS_ERR, "Failed to send frame data");
-			return -1;
-		}
-	}
-
-	return 0;
-}
-
-void _ws_shutdown(ws_t ws)
-{
-	assert(ws);
-
-	LIBWS_LOG(LIBWS_TRACE, "Websocket shutdown");
-
-	if (ws->connect_timeout_event)
-	{
-                _ws_free_timer(&ws->connect_timeout_event);
-	}
-
-	#ifdef LIBWS_WITH_OPENSSL
-	_ws_openssl_close(ws);
-	#endif
-
-	if (ws->bev)
-	{
-		bufferevent_free(ws->bev);
-		ws->bev = NULL;
-		LIBWS_LOG(LIBWS_DEBUG, "Freed bufferevent");
-	}
-
-	// TODO: Only quit when the base has no more connections.
-	//ws_base_quit(ws->ws_base, 1);
-
-	LIBWS_LOG(LIBWS_TRACE, "End");
-}
-
-void _ws_close_timeout_cb(evutil_socket_t fd, short what, void *arg)
-{
-    LIBWS_LOG(LIBWS_TRACE, "Close timeout");
-    ws_t ws = (ws_t)arg;
-    assert(ws);
-    if (ws->state != WS_STATE_CLOSING)
-    {
-        LIBWS_LOG(LIBWS_ERR, "Close timeout callback called, but socket is not in closing state (state = %d)", ws->state);
-        return;
-    }
-
-    // This callback should only ever be called after sending a close frame.
-    assert(ws->sent_close);
-
-    // We sent a close frame to the server but it hasn't initiated
-    // the TCP close.
-    if (ws->received_close)
-    {
-        LIBWS_LOG(LIBWS_ERR, "Timeout! Server sent a Websocket close frame but did not close the TCP session");
-    }
-    else
-    {
-        LIBWS_LOG(LIBWS_ERR, "Timeout! Server did not reply to Websocket close frame");
-    }
-
-    LIBWS_LOG(LIBWS_ERR, "Initiating an unclean close");
-    if (ws->close_cb)
-    {
-        char msg[] = "Timed out waiting for server-side close frame or TCP connection close";
-        ws->close_cb(ws, ETIMEDOUT, WS_ERRTYPE_PROTOCOL, msg, sizeof(msg)-1, ws->close_arg);
-    }
-    _ws_shutdown(ws);
-}
-
-int _ws_send_close(ws_t ws, ws_close_status_t status_code, const char *reason, size_t reason_len)
-{
-	char close_payload[WS_CONTROL_MAX_PAYLOAD_LEN];
-	assert(ws);
-
-	if (WS_IS_CLOSE_STATUS_NOT_USED(status_code))
-	{
-		LIBWS_LOG(LIBWS_ERR, "Invalid websocket close status code. "
-							 "Must be between 1000 and 4999. %u given", 
-							 (uint16_t)status_code);
-		return -1;
-	}
-
-	// (Status code is a uint16_t == 2 bytes)
-	if ((reason_len + 2) > WS_CONTROL_MAX_PAYLOAD_LEN)
-	{
-		LIBWS_LOG(LIBWS_ERR, "Close reason too big to fit max control "
-							 "frame payload size %u + 2 byte status (max %d)", 
-							 reason_len, WS_CONTROL_MAX_PAYLOAD_LEN);
-		return -1;
-	}
-
-    uint16_t code = htons((uint16_t)status_code);
-    memcpy(close_payload, &code, sizeof(code));
-    memcpy(close_payload+2, reason, reason_len);
-
-	if (_ws_send_frame_raw(ws, WS_OPCODE_CLOSE_0X8, 
-							close_payload, reason_len + 2))
-	{
-		LIBWS_LOG(LIBWS_ERR, "Failed to send close frame");
-		return -1;
-	}
-
-	return 0;
-}
-
-int _ws_get_random_mask(ws_t ws, char *buf, size_t len)
-{
-	#ifdef _WIN32
-	size_t i;
-	unsigned int tmp;
-
-	// http://msdn.microsoft.com/en-us/library/sxtz2fa8(VS.80).aspx
-	for (i = 0; i < len; i++)
-	{
-		if (rand_s(&tmp))
-		{
-			return -1;
-		}
-
-		buf[i] = (char)tmp;
-	}
-	#else
-	int i;
-	i = (int)read(ws->ws_base->random_fd, buf, len);
-	#endif 
-
-	return i;
-}
-
-void _ws_set_timeouts(ws_t ws)
-{
-	assert(ws);
-	assert(ws->bev);
-
-	// TODO: Maybe a workaround for this problem?:
-	// Setting a timeout to NULL is supposed to remove it; 
-	// however before Libevent 2.1.2-alpha this wouldn’t work 
-	// with all event types. (As a workaround for older versions, 
-	// you can try setting the timeout to a multi-day interval 
-	// and/or having your eventcb function ignore BEV_TIMEOUT 
-	// events when you don’t want them.)
-
-	bufferevent_set_timeouts(ws->bev, &ws->recv_timeout, &ws->send_timeout);
-}
+
+#include "libws_config.h"
+
+#include <stdio.h>
+#include <assert.h>
+#include <errno.h>
+
+#ifdef WIN32
+  #define _CRT_RAND_S
+#include <stdlib.h>
+#endif
+
+#ifdef _WIN32
+  #include <time.h>
+#else
+  #include <sys/time.h>
+  #include <unistd.h>
+  #include <arpa/inet.h>
+#endif
+#include <string.h>
+
+#include <event2/event.h>
+#include <event2/bufferevent.h>
+#include <event2/buffer.h>
+
+#include "libws_log.h"
+#include "libws_types.h"
+#include "libws_header.h"
+#include "libws_private.h"
+#include "libws.h"
+#include "libws_handshake.h"
+#include "libws_utf8.h"
+#include "libws_mask.h"
+#include "libws_random.h"
+
+#ifdef LIBWS_WITH_OPENSSL
+#include "libws_openssl.h"
+#endif 
+
+static ws_malloc_replacement_f 	replaced_ws_malloc = NULL;
+static ws_free_replacement_f	replaced_ws_free = NULL;
+static ws_realloc_replacement_f	replaced_ws_realloc = NULL;
+
+void *_ws_malloc(size_t size)
+{
+	if (size == 0)
+		return NULL;
+
+	if (replaced_ws_malloc)
+		return replaced_ws_malloc(size);
+	
+	return malloc(size);
+}
+
+void *_ws_realloc(void *ptr, size_t size)
+{
+	return replaced_ws_realloc ? replaced_ws_realloc(ptr, size) : realloc(ptr, size);
+}
+
+void _ws_free(void *ptr)
+{
+	if (replaced_ws_free)
+		replaced_ws_free(ptr);
+	else
+		free(ptr);
+}
+
+void *_ws_calloc(size_t count, size_t size)
+{
+    if (!count || !size)
+        return NULL;
+    void* p;
+    if (replaced_ws_malloc)
+    {
+        size_t sz = count * size;
+        // TODO: If count > (size_t max / size), goto fail.
+        p = replaced_ws_malloc(sz);
+        if (!p)
+            goto fail;
+        memset(p, 0, sz);
+    }
+    else
+    {
+        p = calloc(count, size);
+        if (!p)
+            goto fail;
+    }
+    return p;
+
+fail:
+#ifdef WIN32
+// Windows doesn't set ENOMEM properly.
+    errno = ENOMEM;
+#endif
+    return NULL;
+}
+
+char *_ws_strdup(const char *str)
+{
+	if (!str)
+	{
+		errno = EINVAL;
+		return NULL;
+	}
+
+	if (replaced_ws_malloc)
+	{
+		size_t len = strlen(str);
+		void *p = NULL;
+
+		if (len == ((size_t)-1))
+			goto fail;
+
+		if ((p = replaced_ws_malloc(len + 1)))
+		{
+			return memcpy(p, str, len + 1);
+		}
+	}
+	else
+	{	
+		#ifdef WIN32
+		return _strdup(str);
+		#else
+		return strdup(str);
+		#endif
+	}
+fail:
+	errno = ENOMEM;
+	return NULL;
+}
+
+void _ws_set_memory_functions(ws_malloc_replacement_f malloc_replace,
+							 ws_free_replacement_f free_replace,
+							 ws_realloc_replacement_f realloc_replace)
+{
+
+	replaced_ws_malloc = malloc_replace;
+	replaced_ws_free = free_replace;
+	replaced_ws_realloc = realloc_replace;
+
+	event_set_mem_functions(malloc_replace, realloc_replace, free_replace);
+
+	#ifdef LIBWS_WITH_OPENSSL
+	CRYPTO_set_mem_functions(malloc_replace, realloc_replace, free_replace);
+	#endif
+}
+
+///
+/// Event for when a connection attempt times out.
+///
+static void _ws_connection_timeout_event(evutil_socket_t fd, short what, void *arg)
+{
+	char buf[256];
+	ws_t ws = (ws_t)arg;
+	assert(ws);
+
+	LIBWS_LOG(LIBWS_ERR, "Websocket connection timed out after %ld seconds "
+						 "for %s", ws->connect_timeout.tv_sec, 
+						 ws_get_uri(ws, buf, sizeof(buf)));
+
+	if (ws->connect_timeout_cb)
+	{
+		ws->connect_timeout_cb(ws, ws->connect_timeout, ws->connect_timeout_arg);
+	}
+}
+
+static void _ws_pong_timeout_event(evutil_socket_t fd, short what, void *arg)
+{
+	ws_t ws = (ws_t)arg;
+	assert(ws);
+
+	// TODO: Make sure we delete this event if the ws->pong_timeout_cb is set to NULL while waiting for event to time out.
+
+	if (ws->pong_timeout_cb)
+	{
+		ws->pong_timeout_cb(ws, ws->pong_timeout, ws->pong_arg);
+	}
+}
+
+int _ws_setup_timeout_event(ws_t ws, event_callback_fn func, ws_timer* timer, struct timeval *tv)
+{
+	assert(ws);
+        assert(timer);
+	assert(func);
+	assert(tv);
+
+	LIBWS_LOG(LIBWS_TRACE, "Setting up new timeout event");
+
+        if (*timer)
+	{
+            _ws_free_timer(timer);
+	}
+        ws_base_t base = ws->ws_base;
+#ifdef LIBWS_EXTERNAL_LOOP
+        *timer = _ws_malloc(sizeof(struct ws_timer_s));
+        if (!*timer)
+        {
+            LIBWS_LOG(LIBWS_ERR, "Failed to allocate memory for ws_timer struct");
+            return -1;
+        }
+        if (!((*timer)->evtimer = evtimer_new(base->ev_base, base->marshall_timer_cb, (void*)*timer)))
+        {
+            _ws_free(*timer);
+            *timer = NULL;
+            LIBWS_LOG(LIBWS_ERR, "Failed to create evtimer for timeout event");
+            return -1;
+        }
+        (*timer)->ws = ws;
+        (*timer)->handler = func;
+        (*timer)->canceled = 0;
+        if (evtimer_add((*timer)->evtimer, tv))
+#else
+        *timer = evtimer_new(base->ev_base, func, (void *)ws);
+        if (!*timer)
+	{
+            LIBWS_LOG(LIBWS_ERR, "Failed to create timeout event");
+            return -1;
+	}
+        if (evtimer_add(*timer, tv))
+#endif
+	{
+            LIBWS_LOG(LIBWS_ERR, "Failed to add timeout event");
+            _ws_do_free_timer(timer);
+            return -1;
+	}
+
+	return 0;
+}
+
+#ifdef LIBWS_EXTERNAL_LOOP
+void ws_handle_marshall_timer_cb(int fd, short events, void* userp)
+{
+    ws_timer timer = (ws_timer)userp;
+    if (timer->ws->state == WS_STATE_DESTROYING)
+    {
+        //we should not schedule timers once we are being destroyed
+        LIBWS_LOG(LIBWS_WARN, "BUG: Timer event received, but we are being destroyed. Ignoring");
+    }
+    else if (!timer->canceled)
+    {
+        timer->handler(fd, events, timer->ws);
+    }
+    _ws_do_free_timer(&timer);
+}
+
+/// This is called from within the timer handler, when the timer triggers.
+/// It can be called directly _only_ in case we could not successfully enable the timer,
+/// so it would never trigger and be freed
+inline void _ws_do_free_timer(ws_timer* timer)
+{
+    assert(timer);
+    ws_timer t = *timer;
+    assert(t);
+
+    if (t->evtimer) //in the case of the async destoy message, we don't have an actual evtimer, we just use the timer marshaller to async post a message
+    {
+        event_free(t->evtimer);
+    }
+    _ws_free(t);
+}
+
+///Destroy the timer asynchronously on LIBWS_EXTERNAL_LOOP enabled
+inline void _ws_free_timer(ws_timer* timer)
+{
+// timer will be deleted by the timer handler, when it triggers. It will always trigger, as we don't
+// actually cancel the timer, only flag it as canceled
+    (*timer)->canceled = 1;
+    *timer = NULL;
+}
+
+#else
+
+//We always destroy the timer synchronously if LIBWS_EXTERNAL_LOOP is disabled
+inline void _ws_free_timer(ws_timer* timer)
+{
+    if (!*timer)
+        return;
+    evtimer_del(*timer);
+    event_free(*timer);
+    *timer = NULL;
+}
+
+/// If LIBWS_EXTERNAL_LOOP is not enabled, maps _ws_do_free_timer to _ws_free_timer, as
+/// we always work synchronously
+inline void _ws_do_free_timer(ws_timer* timer)
+{
+    _ws_free_timer(timer);
+}
+
+#endif
+
+int _ws_setup_pong_timeout(ws_t ws)
+{
+	assert(ws);
+	return _ws_setup_timeout_event(ws, _ws_pong_timeout_event,
+				&ws->pong_timeout_event, &ws->pong_timeout);
+}
+
+int _ws_setup_connection_timeout(ws_t ws)
+{	
+	struct timeval tv = {WS_DEFAULT_CONNECT_TIMEOUT, 0};
+	assert(ws);
+	 
+	if (ws->connect_timeout.tv_sec > 0)
+	{
+		tv = ws->connect_timeout;
+	}
+
+	return _ws_setup_timeout_event(ws, _ws_connection_timeout_event, 
+									&ws->connect_timeout_event, &tv);
+}
+
+static int _ws_handle_close_frame(ws_t ws)
+{
+	assert(ws);
+	LIBWS_LOG(LIBWS_TRACE, "Close frame");
+
+	ws->server_close_status = (uint16_t)WS_CLOSE_STATUS_NORMAL_1000;
+	ws->server_reason = NULL;
+	ws->server_reason_len = 0;
+
+	if (ws->close_timeout_event)
+	{
+                _ws_free_timer(&ws->close_timeout_event);
+	}
+
+	ws->state = WS_STATE_CLOSING;
+	ws->received_close = 1;
+
+	// The Close frame MAY contain a body (the "Application data" portion of
+	// the frame) that indicates a reason for closing.
+	// If there is a body, the first two bytes of
+	// the body MUST be a 2-byte unsigned integer (in network byte order)
+	// representing a status code
+	if (ws->ctrl_len > 0)
+	{
+		if (ws->ctrl_len < 2)
+		{
+            LIBWS_LOG(LIBWS_ERR, "Close frame application data missing status code");
+			ws->server_close_status = WS_CLOSE_STATUS_STATUS_CODE_EXPECTED_1005;
+			ws_close_with_status(ws, WS_CLOSE_STATUS_PROTOCOL_ERR_1002);
+			return 0;
+		}
+		else
+		{
+			LIBWS_LOG(LIBWS_DEBUG, "Reading server close status and reason "
+					" (payload length %lu)", ws->ctrl_len);
+
+            uint16_t status;
+            memcpy(&status, ws->ctrl_payload, 2);
+			ws->server_close_status = (ws_close_status_t)ntohs(status);
+            if (ws->ctrl_len > 2)
+            {
+                ws->server_reason = &ws->ctrl_payload[2];
+                ws->server_reason_len = ws->ctrl_len - 2;
+                ws->server_reason[ws->server_reason_len] = '\0';
+            }
+            else
+            {
+                ws->server_reason = NULL;
+            }
+
+			LIBWS_LOG(LIBWS_INFO, "Got close status %d, \"%s\"", 
+				ws->server_close_status, 
+				ws->server_reason);
+
+			if (!WS_IS_PEER_CLOSE_STATUS_VALID(ws->server_close_status))
+			{
+				LIBWS_LOG(LIBWS_ERR, "Invalid close code from peer %d", 
+							ws->server_close_status);
+				ws_close_with_status(ws, WS_CLOSE_STATUS_PROTOCOL_ERR_1002);
+				return 0;
+			}
+
+			// Validate UTF8 text.
+			ws->utf8_state = WS_UTF8_ACCEPT;
+			ws_utf8_validate(&ws->utf8_state, 
+							ws->server_reason, ws->server_reason_len);
+
+			if (ws->utf8_state == WS_UTF8_REJECT)
+			{
+				ws_close_with_status(ws, WS_CLOSE_STATUS_INCONSISTENT_DATA_1007);
+				return 0;
+			}
+		}
+	}
+
+	// If an endpoint receives a Close frame and did not previously send a
+	// Close frame, the endpoint MUST send a Close frame in response.  (When
+	// sending a Close frame in response, the endpoint typically echos the
+	// status code it received.)  It SHOULD do so as soon as practical.  An
+	// endpoint MAY delay sending a Close frame until its current message is
+	// sent (for instance, if the majority of a fragmented message is
+	// already sent, an endpoint MAY send the remaining fragments before
+	// sending a Close frame).  However, there is no guarantee that the
+	// endpoint that has already sent a Close frame will continue to process
+	// data.
+	if (!ws->sent_close)
+	{
+		LIBWS_LOG(LIBWS_INFO, "Echoing status code %d", ws->server_close_status);
+                return ws_close_with_status_reason(ws,
+			ws->server_close_status, 
+			ws->server_reason, 
+			ws->server_reason_len);
+	}
+
+	return 0;
+}
+
+int _ws_handle_ping_frame(ws_t ws)
+{
+	assert(ws);
+	LIBWS_LOG(LIBWS_TRACE, "  Ping frame");
+
+	ws->ping_cb(ws, ws->ctrl_payload, ws->ctrl_len, 1, NULL);
+
+	return 0;
+}
+
+int _ws_handle_pong_frame(ws_t ws)
+{
+	assert(ws);
+	LIBWS_LOG(LIBWS_TRACE, "  Pong frame");
+
+	ws->pong_cb(ws, ws->ctrl_payload, ws->ctrl_len, 0, NULL);
+
+	return 0;
+}
+
+int _ws_handle_control_frame(ws_t ws)
+{
+	ws_header_t *h;
+	assert(ws);
+	LIBWS_LOG(LIBWS_TRACE, "Control frame");
+
+	h = &ws->header;
+
+	assert(WS_OPCODE_IS_CONTROL(h->opcode));
+
+	switch (h->opcode)
+	{
+		case WS_OPCODE_CLOSE_0X8: return _ws_handle_close_frame(ws);
+		case WS_OPCODE_PONG_0XA: return _ws_handle_pong_frame(ws);
+		case WS_OPCODE_PING_0X9: return _ws_handle_ping_frame(ws);
+		default:
+		case WS_OPCODE_CONTROL_RSV_0XB:
+		case WS_OPCODE_CONTROL_RSV_0XC:
+		case WS_OPCODE_CONTROL_RSV_0XD:
+		case WS_OPCODE_CONTROL_RSV_0XE:
+		case WS_OPCODE_CONTROL_RSV_0XF:
+			LIBWS_LOG(LIBWS_ERR, "Got unknown control frame 0x%x", h->opcode);
+			return -1;
+	}
+
+	return 0;
+}
+
+int _ws_handle_frame_begin(ws_t ws)
+{
+	assert(ws);
+
+	LIBWS_LOG(LIBWS_TRACE, "Frame begin, opcode = %d", ws->header.opcode);
+
+	ws->recv_frame_len = 0;
+
+	if (WS_OPCODE_IS_CONTROL(ws->header.opcode))
+	{
+		LIBWS_LOG(LIBWS_DEBUG, "  Control frame");
+		memset(ws->ctrl_payload, 0, sizeof(ws->ctrl_payload));
+		ws->ctrl_len = 0;
+		return 0;
+	}
+
+	LIBWS_LOG(LIBWS_DEBUG, "  Normal frame");
+
+	// Normal frame.
+	if (!ws->in_msg)
+	{
+		ws->in_msg = 1;
+		ws->utf8_state = WS_UTF8_ACCEPT;
+		ws->msg_isbinary = (ws->header.opcode == WS_OPCODE_BINARY_0X2);
+
+		LIBWS_LOG(LIBWS_DEBUG, "Call message begin callback");
+		ws->msg_begin_cb(ws, ws->msg_begin_arg);
+	}
+
+	LIBWS_LOG(LIBWS_DEBUG, "Call frame begin callback");
+	ws->msg_frame_begin_cb(ws, ws->msg_frame_begin_arg);
+
+	return 0;
+}
+
+int _ws_handle_frame_data(ws_t ws, char *buf, size_t len)
+{
+	int ret = 0;
+	assert(ws);
+	LIBWS_LOG(LIBWS_TRACE, "  Handle frame data");
+
+	if (WS_OPCODE_IS_CONTROL(ws->header.opcode))
+	{
+		size_t total_len = (ws->ctrl_len + len);
+
+		if (total_len > WS_CONTROL_MAX_PAYLOAD_LEN)
+		{
+			LIBWS_LOG(LIBWS_ERR, "Control payload too big %u, only %u allowed",
+						total_len, WS_CONTROL_MAX_PAYLOAD_LEN);
+
+			// Copy the remaining data into the buf.
+			len = WS_CONTROL_MAX_PAYLOAD_LEN - ws->ctrl_len;
+			// TODO: Set protocol violation error status here. (This will then be handled in the read callback)
+			ws_close_with_status(ws, WS_CLOSE_STATUS_PROTOCOL_ERR_1002);
+			ret = -1;
+		}
+
+		LIBWS_LOG(LIBWS_DEBUG, "   Append %lu bytes to ctrl payload[%lu]", len, ws->ctrl_len);
+		memcpy(&ws->ctrl_payload[ws->ctrl_len], buf, len);
+		ws->ctrl_len += len;
+
+		return ret;
+	}
+
+	ws->msg_frame_data_cb(ws, buf, len, ws->msg_frame_data_arg);
+
+	return ret;
+}
+
+int _ws_handle_frame_end(ws_t ws)
+{
+	assert(ws);
+	LIBWS_LOG(LIBWS_DEBUG2, "Frame end, opcode = %d", ws->header.opcode);
+
+	if (WS_OPCODE_IS_CONTROL(ws->header.opcode))
+	{
+		ws->has_header = 0;
+		return _ws_handle_control_frame(ws);
+	}
+
+	ws->msg_frame_end_cb(ws, ws->msg_frame_end_arg);
+
+	if (ws->header.fin)
+	{
+		ws->msg_end_cb(ws, ws->msg_end_arg);
+		ws->in_msg = 0;
+	}
+
+	ws->has_header = 0;
+
+	return 0;
+}
+
+int _ws_validate_header(ws_t ws)
+{
+	ws_header_t *h = &ws->header;
+
+	if (h->rsv1 || h->rsv2 || h->rsv3)
+	{
+		LIBWS_LOG(LIBWS_ERR, "Protocol violation, reserve bit set");
+		return -1;
+	}
+
+	if (WS_OPCODE_IS_RESERVED(h->opcode))
+	{
+		LIBWS_LOG(LIBWS_ERR, "Protocol violation, reserved opcode used %d (%s)", 
+				h->opcode, ws_opcode_str(h->opcode));
+		return -1;
+	}
+
+	if (WS_OPCODE_IS_CONTROL(h->opcode) && !h->fin)
+	{
+		LIBWS_LOG(LIBWS_ERR, "Protocol violation, fragmented %s not allowed",
+				ws_opcode_str(h->opcode));
+		return -1;
+	}
+
+	if ((ws->header.opcode == WS_OPCODE_CONTINUATION_0X0)
+		&& !ws->in_msg)
+	{
+		LIBWS_LOG(LIBWS_ERR, "Got continuation frame when not in message");
+		return -1;
+	}
+
+	// If we're in a message, we must either get a continuation frame
+	// or an interjected control frame such as a ping.
+	if (ws->in_msg 
+		&& ((h->opcode != WS_OPCODE_CONTINUATION_0X0) 
+			&& !WS_OPCODE_IS_CONTROL(h->opcode)))
+	{
+		LIBWS_LOG(LIBWS_ERR, "Didn't get continuation frame when "
+							"still in message. opcode %d (%s)",
+							h->opcode,
+							ws_opcode_str(h->opcode));
+		return -1;
+	}
+
+	return 0;
+}
+
+///
+/// Checks the payload length of a new data frame against the limits set by
+/// #ws_set_max_recv_frame_size and #ws_set_max_message_size. This is done 
+/// as soon as the header has been read, before any payload is buffered.
+/// If the frame is too big, the connection is closed.
+///
+/// @returns           0 if the frame is within the limits.
+///
+static int _ws_check_recv_size(ws_t ws)
+{
+	ws_header_t *h = &ws->header;
+	uint64_t msg_len = h->payload_len;
+
+	if (ws->max_recv_frame_size && (h->payload_len > ws->max_recv_frame_size))
+	{
+		LIBWS_LOG(LIBWS_ERR, "Frame of %llu bytes exceeds the max frame size %llu",
+				h->payload_len, ws->max_recv_frame_size);
+		goto fail;
+	}
+
+	if (ws->in_msg)
+	{
+		msg_len += ws->recv_msg_len;
+	}
+
+	if (ws->max_message_size && (msg_len > ws->max_message_size))
+	{
+		LIBWS_LOG(LIBWS_ERR, "Message of at least %llu bytes exceeds the "
+				"max message size %llu", msg_len, ws->max_message_size);
+		goto fail;
+	}
+
+	ws->recv_msg_len = msg_len;
+
+	return 0;
+fail:
+	ws_close_with_status(ws, WS_CLOSE_STATUS_MESSAGE_TOO_BIG_1009);
+	return -1;
+}
+
+///
+/// Unmasks a chunk of frame payload from #src into #dst (which can be the
+/// same buffer), and validates it as UTF8 if this is a text message.
+/// This is done in a single pass over the data.
+///
+static void _ws_process_frame_chunk(ws_t ws, char *dst, const char *src, 
+									size_t len, uint64_t offset)
+{
+	int validate = !ws->msg_isbinary 
+				&& !WS_OPCODE_IS_CONTROL(ws->header.opcode);
+
+	LIBWS_LOG(LIBWS_DEBUG2, "Process %lu bytes of frame data, validate UTF8 = %d,"
+			" state = %d", len, validate, ws->utf8_state);
+
+	if (ws->header.mask_bit)
+	{
+		// The chunk starts offset bytes into the payload.
+		if (validate)
+		{
+			_ws_utf8_unmask_validate(&ws->utf8_state, ws->header.mask, 
+									offset, dst, src, len);
+		}
+		else
+		{
+			_ws_mask(ws->header.mask, offset, dst, src, len);
+		}
+	}
+	else
+	{
+		if (dst != src)
+		{
+			memcpy(dst, src, len);
+		}
+
+		if (validate)
+		{
+			ws_utf8_validate(&ws->utf8_state, dst, len);
+		}
+	}
+
+	LIBWS_LOG(LIBWS_DEBUG2, "Processed frame data, UTF8 state = %d", 
+			ws->utf8_state);
+}
+
+///
+/// Closes the connection if the text read so far is not valid UTF8.
+///
+static void _ws_check_utf8(ws_t ws)
+{
+	if (ws->msg_isbinary || WS_OPCODE_IS_CONTROL(ws->header.opcode))
+		return;
+
+	// Either the UTF8 is invalid, or a codepoint is not
+	// complete at the end of the finish frame.
+	if ((ws->utf8_state == WS_UTF8_REJECT) 
+	|| ((ws->utf8_state != WS_UTF8_ACCEPT) && ws->header.fin
+		&& (ws->recv_frame_len == ws->header.payload_len)))
+	{
+		LIBWS_LOG(LIBWS_ERR, "Invalid UTF8!");
+
+		ws_close_with_status(ws, 
+			WS_CLOSE_STATUS_INCONSISTENT_DATA_1007);
+	}
+}
+
+int _ws_has_default_msg_callbacks(ws_t ws)
+{
+	return (ws->msg_frame_begin_cb == ws_default_msg_frame_begin_cb)
+		&& (ws->msg_frame_data_cb == ws_default_msg_frame_data_cb)
+		&& (ws->msg_frame_end_cb == ws_default_msg_frame_end_cb)
+		&& (!ws->msg_frame_cb || (ws->msg_frame_cb == ws_default_msg_frame_cb))
+		&& (ws->msg_end_cb == ws_default_msg_end_cb);
+}
+
+int _ws_reserve_msg_buf(ws_t ws, uint64_t len)
+{
+	char *buf;
+	size_t size;
+	uint64_t needed = ws->msg_buf_len + len;
+
+	if (needed <= ws->msg_buf_size)
+		return 0;
+
+	if ((needed < ws->msg_buf_len) || (needed > (size_t)-1))
+	{
+		LIBWS_LOG(LIBWS_ERR, "Message too big (%llu bytes)", needed);
+		return -1;
+	}
+
+	// Grow geometrically, so that a message with many
+	// frames doesn't reallocate for every frame.
+	size = (ws->msg_buf_size > ((size_t)-1 / 2)) ? (size_t)-1 : (ws->msg_buf_size * 2);
+
+	if (size < needed)
+	{
+		size = (size_t)needed;
+	}
+
+	if (!(buf = (char *)_ws_realloc(ws->msg_buf, size)))
+	{
+		LIBWS_LOG(LIBWS_CRIT, "Out of memory!");
+		return -1;
+	}
+
+	LIBWS_LOG(LIBWS_DEBUG2, "Message buffer grown from %lu to %lu bytes", 
+			ws->msg_buf_size, size);
+
+	ws->msg_buf = buf;
+	ws->msg_buf_size = size;
+
+	return 0;
+}
+
+uint64_t _ws_recv_reserve_len(ws_t ws, uint64_t len)
+{
+	uint64_t max = ws->max_message_size ? ws->max_message_size : WS_RECV_RESERVE_MAX;
+
+	return (len < max) ? len : max;
+}
+
+void _ws_abort_recv(ws_t ws)
+{
+	assert(ws);
+
+	LIBWS_LOG(LIBWS_ERR, "Failed to receive message");
+
+	ws->recv_aborted = 1;
+	ws->has_header = 0;
+
+	if (ws->header.payload_len > ws->recv_frame_len)
+	{
+		ws->recv_skip_len = ws->header.payload_len - ws->recv_frame_len;
+	}
+
+	if (ws->bev && (ws->state != WS_STATE_CLOSING))
+	{
+		ws_close_with_status(ws, WS_CLOSE_STATUS_UNEXPECTED_CONDITION_1011);
+	}
+}
+
+int _ws_call_msg_iov_cb(ws_t ws, struct evbuffer *buf, size_t len)
+{
+	struct evbuffer_iovec stack_vecs[8];
+	ws_iovec_t stack_iov[8];
+	struct evbuffer_iovec *vecs = stack_vecs;
+	ws_iovec_t *iov = stack_iov;
+	size_t remaining = len;
+	int ret = 0;
+	int n;
+	int i;
+
+	n = evbuffer_peek(buf, len, NULL, NULL, 0);
+
+	if (n > (int)(sizeof(stack_vecs) / sizeof(stack_vecs[0])))
+	{
+		vecs = (struct evbuffer_iovec *)_ws_malloc(n * sizeof(*vecs));
+		iov = (ws_iovec_t *)_ws_malloc(n * sizeof(*iov));
+
+		if (!vecs || !iov)
+		{
+			LIBWS_LOG(LIBWS_CRIT, "Out of memory!");
+			ret = -1;
+			goto fail;
+		}
+	}
+
+	n = evbuffer_peek(buf, len, NULL, vecs, n);
+
+	// The last chain might hold more than the message.
+	for (i = 0; i < n; i++)
+	{
+		iov[i].iov_base = vecs[i].iov_base;
+		iov[i].iov_len = (vecs[i].iov_len < remaining) ? vecs[i].iov_len : remaining;
+		remaining -= iov[i].iov_len;
+	}
+
+	LIBWS_LOG(LIBWS_DEBUG, "Calling message callback with %d segments", n);
+	ws->msg_iov_cb(ws, iov, (n > 0) ? n : 0, len, 
+		ws->msg_isbinary, ws->msg_iov_arg);
+
+fail:
+	if (vecs && (vecs != stack_vecs))
+	{
+		_ws_free(vecs);
+	}
+
+	if (iov && (iov != stack_iov))
+	{
+		_ws_free(iov);
+	}
+
+	return ret;
+}
+
+///
+/// Makes sure ws_s#recv_buf can hold at least #len bytes.
+///
+static int _ws_reserve_recv_buf(ws_t ws, size_t len)
+{
+	char *buf;
+
+	if (ws->recv_buf_size >= len)
+		return 0;
+
+	if (!(buf = (char *)_ws_realloc(ws->recv_buf, len)))
+	{
+		LIBWS_LOG(LIBWS_CRIT, "Out of memory!");
+		return -1;
+	}
+
+	ws->recv_buf = buf;
+	ws->recv_buf_size = len;
+
+	return 0;
+}
+
+///
+/// Unmasks and validates #len bytes of payload for the current frame
+/// at the start of the input buffer, without removing them.
+///
+/// @param[in]  ws          The websocket context.
+/// @param[in]  in          The input buffer.
+/// @param[in]  len         The number of bytes to process.
+/// @param[out] contiguous  If NULL the payload is processed in place in 
+///                         the chains of the input buffer. Otherwise this
+///                         is set to point to the payload as a contiguous
+///                         buffer. If the payload is already contiguous 
+///                         it is processed in place, otherwise it is 
+///                         unmasked into ws_s#recv_buf in the same pass.
+///
+/// @returns                0 on success.
+///
+static int _ws_process_frame_payload(ws_t ws, struct evbuffer *in, 
+									size_t len, char **contiguous)
+{
+	int ret = 0;
+	uint64_t offset = ws->recv_frame_len;
+	struct evbuffer_iovec stack_vecs[8];
+	struct evbuffer_iovec *vecs = stack_vecs;
+	size_t remaining = len;
+	char *dst = NULL;
+	int n;
+	int i;
+
+	n = evbuffer_peek(in, len, NULL, NULL, 0);
+
+	if ((n > (int)(sizeof(stack_vecs) / sizeof(stack_vecs[0])))
+	 && !(vecs = (struct evbuffer_iovec *)_ws_malloc(n * sizeof(*vecs))))
+	{
+		LIBWS_LOG(LIBWS_CRIT, "Out of memory!");
+		return -1;
+	}
+
+	n = evbuffer_peek(in, len, NULL, vecs, n);
+
+	if (contiguous)
+	{
+		if (n <= 0)
+		{
+			*contiguous = NULL;
+		}
+		else if (vecs[0].iov_len >= len)
+		{
+			*contiguous = (char *)vecs[0].iov_base;
+		}
+		else
+		{
+			if (_ws_reserve_recv_buf(ws, len))
+			{
+				ret = -1;
+				goto fail;
+			}
+
+			*contiguous = dst = ws->recv_buf;
+		}
+	}
+
+	// The input buffer of a bufferevent only consists of chains
+	// that it owns itself, so it is fine to modify them.
+	for (i = 0; (i < n) && (remaining > 0); i++)
+	{
+		size_t chunk_len = (vecs[i].iov_len < remaining) 
+						 ? vecs[i].iov_len : remaining;
+		char *src = (char *)vecs[i].iov_base;
+
+		_ws_process_frame_chunk(ws, dst ? dst : src, src, chunk_len, offset);
+		offset += chunk_len;
+		remaining -= chunk_len;
+
+		if (dst)
+		{
+			dst += chunk_len;
+		}
+	}
+
+	ws->recv_frame_len += len;
+	_ws_check_utf8(ws);
+
+fail:
+	if (vecs != stack_vecs)
+	{
+		_ws_free(vecs);
+	}
+
+	return ret;
+}
+
+///
+/// Reads #len bytes of payload for the current frame from the input buffer.
+///
+/// When all the default callbacks that build a message are used, the payload
+/// is unmasked straight into ws_s#msg_buf which is what is passed to the
+/// message callback in the end.
+///
+/// When the default frame data callback is used, all it would do is to copy
+/// the payload into ws_s#frame_data. So instead we unmask and validate the
+/// payload in place in the chains of the input buffer, and then move those
+/// chains over to ws_s#frame_data without copying anything.
+///
+/// Otherwise the payload is made contiguous (see #_ws_process_frame_payload)
+/// and passed to the frame data callback.
+///
+static int _ws_read_frame_payload(ws_t ws, struct evbuffer *in, size_t len)
+{
+	int ret = 0;
+	char *buf = NULL;
+
+	if (!WS_OPCODE_IS_CONTROL(ws->header.opcode) && ws->msg_contiguous)
+	{
+		// The message is built in ws_s#msg_buf, which has been 
+		// sized for this frame when it began. Unmask straight into it.
+		struct evbuffer_iovec vec;
+		char *dst;
+		size_t done = 0;
+
+		if (_ws_reserve_msg_buf(ws, len))
+		{
+			return -1;
+		}
+
+		dst = &ws->msg_buf[ws->msg_buf_len];
+
+		while (done < len)
+		{
+			size_t chunk_len;
+
+			if (evbuffer_peek(in, -1, NULL, &vec, 1) != 1)
+			{
+				LIBWS_LOG(LIBWS_ERR, "Failed to read %lu bytes of frame data", len);
+				return -1;
+			}
+
+			chunk_len = (vec.iov_len < (len - done)) ? vec.iov_len : (len - done);
+			_ws_process_frame_chunk(ws, &dst[done], (char *)vec.iov_base, 
+									chunk_len, ws->recv_frame_len);
+			ws->recv_frame_len += chunk_len;
+			done += chunk_len;
+			evbuffer_drain(in, chunk_len);
+		}
+
+		ws->msg_buf_len += len;
+		_ws_check_utf8(ws);
+
+		LIBWS_LOG(LIBWS_DEBUG2, "read: %lu (%llu of %llu bytes) into message buffer", 
+				len, ws->recv_frame_len, ws->header.payload_len);
+	}
+	else if (!WS_OPCODE_IS_CONTROL(ws->header.opcode)
+	 && (ws->msg_frame_data_cb == ws_default_msg_frame_data_cb)
+	 && ws->frame_data)
+	{
+		if (_ws_process_frame_payload(ws, in, len, NULL))
+		{
+			return -1;
+		}
+
+		LIBWS_LOG(LIBWS_DEBUG2, "Moving %lu bytes to frame data (%llu of %llu bytes)", 
+				len, ws->recv_frame_len, ws->header.payload_len);
+
+		if (evbuffer_remove_buffer(in, ws->frame_data, len) != (int)len)
+		{
+			LIBWS_LOG(LIBWS_ERR, "Failed to move %lu bytes of frame data", len);
+			return -1;
+		}
+	}
+	else
+	{
+		if (_ws_process_frame_payload(ws, in, len, &buf))
+		{
+			return -1;
+		}
+
+		LIBWS_LOG(LIBWS_DEBUG2, "read: %lu (%llu of %llu bytes)", 
+				len, ws->recv_frame_len, ws->header.payload_len);
+
+		ret = _ws_handle_frame_data(ws, buf, len);
+
+		// The callback might have shut down the connection.
+		if (!ws->bev)
+		{
+			return -1;
+		}
+
+		evbuffer_drain(in, len);
+	}
+
+	return ret;
+}
+
+///
+/// Checks if the frame we just got the header for is a complete message
+/// that can be passed straight to the message callback. This is the case
+/// for an unfragmented message that has been fully received, when none of 
+/// the default callbacks that build the message have been replaced.
+///
+static int _ws_can_deliver_message(ws_t ws, struct evbuffer *in)
+{
+	ws_header_t *h = &ws->header;
+
+	return h->fin
+		&& !ws->in_msg
+		&& ((h->opcode == WS_OPCODE_TEXT_0X1) || (h->opcode == WS_OPCODE_BINARY_0X2))
+		&& (evbuffer_get_length(in) >= h->payload_len)
+		&& (ws->msg_begin_cb == ws_default_msg_begin_cb)
+		&& _ws_has_default_msg_callbacks(ws);
+}
+
+///
+/// Passes a complete unfragmented message straight from the input 
+/// buffer to the message callback. This skips building the message in
+/// the ws_s#frame_data and ws_s#msg buffers.
+///
+/// If ws_s#msg_iov_cb is set, the payload is unmasked in place and the 
+/// callback gets the chains of the input buffer.
+///
+static int _ws_deliver_message(ws_t ws, struct evbuffer *in)
+{
+	char *payload = NULL;
+	size_t len = (size_t)ws->header.payload_len;
+
+	LIBWS_LOG(LIBWS_DEBUG, "Deliver complete message of %lu bytes", len);
+
+	ws->recv_frame_len = 0;
+	ws->utf8_state = WS_UTF8_ACCEPT;
+	ws->msg_isbinary = (ws->header.opcode == WS_OPCODE_BINARY_0X2);
+
+	// The scatter/gather callback gets the chains of the input buffer 
+	// as they are, so there is no need to make the payload contiguous.
+	if (_ws_process_frame_payload(ws, in, len, ws->msg_iov_cb ? NULL : &payload))
+	{
+		return -1;
+	}
+
+	ws->has_header = 0;
+
+	// Invalid UTF8 closes the connection, and if the close frame
+	// could not be sent the input buffer is gone as well.
+	if (!ws->bev)
+	{
+		return -1;
+	}
+
+	if (!ws->msg_isbinary && (ws->utf8_state != WS_UTF8_ACCEPT))
+	{
+		evbuffer_drain(in, len);
+		return -1;
+	}
+
+	if (ws->msg_iov_cb)
+	{
+		if (_ws_call_msg_iov_cb(ws, in, len))
+		{
+			return -1;
+		}
+	}
+	else if (ws->msg_cb)
+	{
+		LIBWS_LOG(LIBWS_DEBUG, "Calling message callback");
+		ws->msg_cb(ws, payload, len, ws->msg_isbinary, ws->msg_arg);
+	}
+	else
+	{
+		LIBWS_LOG(LIBWS_DEBUG, "No message callback set, drop message");
+	}
+
+	// The callback might have shut down the connection.
+	if (!ws->bev)
+	{
+		return -1;
+	}
+
+	evbuffer_drain(in, len);
+
+	return 0;
+}
+
+///
+/// Gets the number of received bytes that have not yet been 
+/// delivered to the user. 
+///
+static size_t _ws_get_recv_buffered(ws_t ws, struct evbuffer *in)
+{
+	size_t len = evbuffer_get_length(in);
+
+	if (ws->msg_contiguous)
+	{
+		len += ws->msg_buf_len;
+	}
+
+	if (ws->msg)
+	{
+		len += evbuffer_get_length(ws->msg);
+	}
+
+	if (ws->frame_data)
+	{
+		len += evbuffer_get_length(ws->frame_data);
+	}
+
+	return len;
+}
+
+///
+/// Closes the connection if more received data is held on to than
+/// allowed by #ws_set_max_recv_buffered. When reading is paused the
+/// socket isn't read from, so the data buffered then is bounded anyway.
+///
+static void _ws_check_recv_buffered(ws_t ws, struct evbuffer *in)
+{
+	size_t len;
+
+	if (!ws->max_recv_buffered || ws->read_paused)
+		return;
+
+	if ((len = _ws_get_recv_buffered(ws, in)) > ws->max_recv_buffered)
+	{
+		LIBWS_LOG(LIBWS_ERR, "%lu bytes of received data buffered, max is %lu", 
+				len, ws->max_recv_buffered);
+
+		ws_close_with_status(ws, WS_CLOSE_STATUS_MESSAGE_TOO_BIG_1009);
+	}
+}
+
+void _ws_read_websocket(ws_t ws, struct evbuffer *in)
+{
+	assert(ws);
+	assert(ws->bev);
+	assert(in);
+
+	LIBWS_LOG(LIBWS_DEBUG2, "Read websocket data");
+
+	// Callbacks might shut down the connection (freeing the input buffer),
+	// or pause reading, in which case the rest is left in the input buffer.
+	while (ws->bev && !ws->read_paused && evbuffer_get_length(in))
+	{
+		// Throw away the payload of a frame that was too big.
+		if (ws->recv_skip_len)
+		{
+			size_t len = evbuffer_get_length(in);
+
+			if (len > ws->recv_skip_len)
+			{
+				len = (size_t)ws->recv_skip_len;
+			}
+
+			evbuffer_drain(in, len);
+			ws->recv_skip_len -= len;
+			continue;
+		}
+
+		// First read the websocket header.
+		if (!ws->has_header)
+		{
+			size_t header_len;
+			ev_ssize_t bytes_read;
+			char header_buf[WS_HDR_MAX_SIZE];
+			ws_parse_state_t state;
+
+			LIBWS_LOG(LIBWS_DEBUG2, "Read websocket header");
+
+			bytes_read = evbuffer_copyout(in, (void *)header_buf, 
+											sizeof(header_buf));
+
+			LIBWS_LOG(LIBWS_DEBUG2, "Copied %d header bytes", bytes_read);
+
+			state = ws_unpack_header(&ws->header, &header_len, 
+					(unsigned char *)header_buf, bytes_read);
+
+			assert(state != WS_PARSE_STATE_USER_ABORT);
+
+			// Look for protocol violations in the header.
+			if (state != WS_PARSE_STATE_NEED_MORE && _ws_validate_header(ws))
+			{
+				state = WS_PARSE_STATE_ERROR;
+			}
+
+			switch (state)
+			{
+				case WS_PARSE_STATE_SUCCESS: 
+				{
+					ws_header_t *h = &ws->header;
+					ws->has_header = 1;
+
+					LIBWS_LOG(LIBWS_DEBUG2, "Got header (%lu bytes):\n"
+						"fin = %d, rsv = {%d,%d,%d}, mask_bit = %d, opcode = 0x%x (%s), "
+						"mask = %x, len = %d",
+						header_len,
+						h->fin, h->rsv1, h->rsv2, h->rsv3, h->mask_bit, 
+						h->opcode, ws_opcode_str(h->opcode), h->mask, (int)h->payload_len);
+
+					if (evbuffer_drain(in, header_len))
+					{
+						// TODO: Error! close
+						LIBWS_LOG(LIBWS_ERR, "Failed to drain header buffer");
+					}
+
+					// Once a frame has been too big, we only wait for the
+					// close reply, and skip any data frames without buffering them.
+					if (!WS_OPCODE_IS_CONTROL(h->opcode) 
+					 && (ws->recv_aborted || _ws_check_recv_size(ws)))
+					{
+						ws->recv_aborted = 1;
+						ws->recv_skip_len = h->payload_len;
+						ws->has_header = 0;
+						continue;
+					}
+
+					if (_ws_can_deliver_message(ws, in))
+					{
+						if (_ws_deliver_message(ws, in))
+						{
+							LIBWS_LOG(LIBWS_ERR, "Failed to deliver message");
+						}
+
+						continue;
+					}
+					break;
+				}
+				case WS_PARSE_STATE_NEED_MORE:
+					LIBWS_LOG(LIBWS_DEBUG2, " Need more header data");
+					return;
+				case WS_PARSE_STATE_ERROR:
+					LIBWS_LOG(LIBWS_ERR, "Error protocol violation in header");
+					ws_close_with_status(ws, WS_CLOSE_STATUS_PROTOCOL_ERR_1002);
+					return;
+				case WS_PARSE_STATE_USER_ABORT:
+					// TODO: What to do here?
+					LIBWS_LOG(LIBWS_ERR, "User abort");
+					break;
+			}
+
+			_ws_handle_frame_begin(ws);
+		}
+
+		if (ws->has_header)
+		{
+			// We're in a frame.
+			size_t recv_len = evbuffer_get_length(in);
+			size_t remaining = (size_t)(ws->header.payload_len - ws->recv_frame_len);
+
+			LIBWS_LOG(LIBWS_DEBUG2, "In frame (remaining %u bytes of %u payload)", 
+					remaining, ws->header.payload_len);
+
+			if (recv_len > remaining)
+			{
+				LIBWS_LOG(LIBWS_DEBUG2, "Received %u of %u remaining bytes", recv_len, remaining);
+				recv_len = remaining;
+			}
+
+			if (remaining == 0)
+			{
+				_ws_handle_frame_end(ws);
+			}
+			else
+			{
+				if (_ws_read_frame_payload(ws, in, recv_len))
+				{
+					// The data is still in the input buffer, so trying
+					// again would only fail the same way.
+					LIBWS_LOG(LIBWS_ERR, "Failed to handle frame data");
+
+					if (ws->bev && (ws->state != WS_STATE_CLOSING))
+					{
+						ws_close_with_status(ws, WS_CLOSE_STATUS_UNEXPECTED_CONDITION_1011);
+					}
+
+					return;
+				}
+				else
+				{
+					// TODO: This is not hit in some cases.
+					LIBWS_LOG(LIBWS_DEBUG2, "recv_frame_len = %llu, payload_len = %llu",
+						 ws->recv_frame_len, ws->header.payload_len);
+					// The entire frame has been received.
+					if (ws->recv_frame_len == ws->header.payload_len)
+					{
+						_ws_handle_frame_end(ws);
+					}
+				}
+			}
+		}
+	}
+
+	if (ws->bev)
+	{
+		LIBWS_LOG(LIBWS_DEBUG, "    %lu bytes left after websocket read", 
+				evbuffer_get_length(in));
+
+		_ws_check_recv_buffered(ws, in);
+	}
+}
+
+///
+/// Libevent bufferevent callback for when there is data to be read
+/// on the websocket socket.
+///
+void ws_read_callback(struct bufferevent *bev, void *ptr)
+{
+	ws_t ws = (ws_t)ptr;
+        if (ws->state == WS_STATE_DESTROYING)
+        {
+            LIBWS_LOG(LIBWS_DEBUG, "Read event received, but we are being destroyed. Ignoring");
+            return;
+        }
+        struct evbuffer *in;
+	assert(ws);
+	assert(bev);
+	assert(ws->bev == bev);
+
+	LIBWS_LOG(LIBWS_DEBUG, "Read callback");
+
+	in = bufferevent_get_input(ws->bev);
+
+	if (ws->connect_state != WS_CONNECT_STATE_HANDSHAKE_COMPLETE)
+	{
+		// Complete the connection handshake.
+		ws_parse_state_t state;
+
+		LIBWS_LOG(LIBWS_DEBUG, "Look for handshake reply");
+
+		switch ((state = _ws_read_server_handshake_reply(ws, in)))
+		{
+			case WS_PARSE_STATE_ERROR:
+                ws_close_with_status(ws, WS_CLOSE_STATUS_PROTOCOL_ERR_1002);
+                return;
+			case WS_PARSE_STATE_NEED_MORE: return;
+			case WS_PARSE_STATE_SUCCESS:
+			{
+				ws->state = WS_STATE_CONNECTED;
+
+				// Corked before the handshake completed.
+				if (ws->corked)
+				{
+					bufferevent_disable(ws->bev, EV_WRITE);
+				}
+
+				if (ws->connect_cb)
+				{
+					LIBWS_LOG(LIBWS_DEBUG, "Calling connect callback");
+					ws->connect_cb(ws, ws->connect_arg);
+				}
+			}
+			case WS_PARSE_STATE_USER_ABORT:
+				// TODO: What to do here?
+				break;
+		}
+	}
+
+	// Connected and completed handshake we can now expect websocket data.
+	_ws_read_websocket(ws, in);
+}
+
+///
+/// Libevent bufferevent callback for when a write is done on
+/// the websocket socket.
+///
+void ws_write_callback(struct bufferevent *bev, void *ptr)
+{
+    ws_t ws = (ws_t)ptr;
+    assert(ws);
+    
+    LIBWS_LOG(LIBWS_DEBUG, "Write callback");
+
+    _ws_check_send_ready(ws);
+
+    if (_ws_send_stream_pump(ws))
+    {
+        LIBWS_LOG(LIBWS_ERR, "Failed to send stream");
+    }
+
+    if (_ws_sendq_pump(ws))
+    {
+        LIBWS_LOG(LIBWS_ERR, "Failed to send queued messages");
+    }
+
+    if (ws->write_cb && ws->state == WS_STATE_CONNECTED)
+    {
+        LIBWS_LOG(LIBWS_DEBUG, "Call write callback");
+        (ws->write_cb)(ws, ws->write_arg);
+    }
+}
+
+static void _ws_connected_event(struct bufferevent *bev, short events, void *arg)
+{
+	ws_t ws = (ws_t)arg;
+	assert(ws);
+	char buf[1024];
+	LIBWS_LOG(LIBWS_DEBUG, "Connected to %s", ws_get_uri(ws, buf, sizeof(buf)));
+
+	if (ws->connect_timeout_event)
+	{
+		LIBWS_LOG(LIBWS_DEBUG, "Freeing connect timeout event");
+                _ws_free_timer(&ws->connect_timeout_event);
+	}
+
+	bufferevent_enable(ws->bev, ws->read_paused ? EV_WRITE : (EV_READ | EV_WRITE));
+
+	#ifdef LIBWS_WITH_OPENSSL
+	{
+		int rc = SSL_get_verify_result(ws->ssl);
+
+		if(rc != X509_V_OK) 
+		{
+  			if (rc == X509_V_ERR_DEPTH_ZERO_SELF_SIGNED_CERT 
+  			 || rc == X509_V_ERR_SELF_SIGNED_CERT_IN_CHAIN)
+  			{
+  				LIBWS_LOG(LIBWS_DEBUG, "Server using a self-signed certificate");
+  				// TODO: Fail if use_ssl is not set to allow self-signed.
+  			}
+  		}
+	}
+	#endif
+
+	// Add the handshake to the send buffer, this will
+	// be sent as soon as we're connected.
+	if (_ws_send_handshake(ws, bufferevent_get_output(ws->bev)))
+	{
+		LIBWS_LOG(LIBWS_ERR, "Failed to assemble handshake");
+		return;
+	}
+}
+
+static void _ws_eof_event(struct bufferevent *bev, short events, void *ptr)
+{
+	ws_t ws = (ws_t)ptr;
+	ws_close_status_t status;
+	struct evbuffer *in;
+	assert(ws);
+
+	LIBWS_LOG(LIBWS_TRACE, "EOF event");
+
+	in = bufferevent_get_input(ws->bev);
+
+	if (evbuffer_get_length(in) > 0)
+	{
+                LIBWS_LOG(LIBWS_DEBUG, "Left %u bytes at EOF", evbuffer_get_length(in));
+
+		_ws_read_websocket(ws, in);
+	}
+
+	status = ws->server_close_status;
+
+	LIBWS_LOG(LIBWS_DEBUG, "Sent close frame %s, received close frame %s", 
+							ws->sent_close ? "TRUE" : "FALSE", 
+							ws->received_close ? "TRUE" : "FALSE");
+
+	_ws_shutdown(ws);
+
+	if (!ws->received_close)
+	{
+		ws->state = WS_STATE_CLOSED_UNCLEANLY;
+        if (status == 0)
+            status = WS_CLOSE_STATUS_ABNORMAL_1006;
+	}
+
+	if (ws->close_cb)
+	{
+		LIBWS_LOG(LIBWS_DEBUG, "Call close callback");
+        ws->close_cb(ws,
+                     status,
+                     WS_ERRTYPE_PROTOCOL,
+                     ws->server_reason,
+                     ws->server_reason_len,
+                     ws->close_arg);
+	}
+	else
+	{
+		LIBWS_LOG(LIBWS_DEBUG, "No close callback");
+	}
+}
+
+static void _ws_error_event(struct bufferevent *bev, short events, void *ptr)
+{
+	const char *err_msg;
+	int err;
+	ws_t ws = (ws_t)ptr;
+	assert(ws);
+
+	LIBWS_LOG(LIBWS_DEBUG, "Error raised");
+
+        if ((ws->state == WS_STATE_CONNECTING) && ((err = bufferevent_socket_get_dns_error(ws->bev))))
+        {
+            err_msg = evutil_gai_strerror(err);
+            LIBWS_LOG(LIBWS_ERR, "DNS error %d: %s", err, err_msg);
+            if (ws->close_cb)
+            {
+                ws->close_cb(ws, err, WS_ERRTYPE_DNS, err_msg, strlen(err_msg), ws->close_arg);
+            }
+	}
+	else
+	{
+            // See if the server closed on us.
+            _ws_read_websocket(ws, bufferevent_get_input(ws->bev));
+            if (!ws->received_close)
+            {
+                ws->server_close_status = WS_CLOSE_STATUS_ABNORMAL_1006;
+            }
+
+            err = EVUTIL_SOCKET_ERROR();
+            err_msg = evutil_socket_error_to_string(err);
+            LIBWS_LOG(LIBWS_ERR, "Bufferevent error: %s (%d)", err_msg, err);
+            if (ws->close_cb)
+            {
+                ws->close_cb(ws, err, WS_ERRTYPE_LIB, err_msg, strlen(err_msg), ws->close_arg);
+            }
+        }
+
+        _ws_shutdown(ws);
+}
+
+///
+/// Libevent bufferevent callback for when an event occurs on
+/// the websocket socket.
+///
+void ws_event_callback(struct bufferevent *bev, short events, void *ptr)
+{
+    ws_t ws = (ws_t)ptr;
+    assert(ws);
+    if (ws->state == WS_STATE_DESTROYING)
+    {
+        LIBWS_LOG(LIBWS_DEBUG, "Event callback called, but we are being destroyed. Ignoring");
+        return;
+    }
+
+    if (events & BEV_EVENT_CONNECTED)
+    {
+        _ws_connected_event(bev, events, ws);
+    }
+
+    else if (events & BEV_EVENT_EOF)
+    {
+        _ws_eof_event(bev, events, ws);
+    }
+    else if (events & BEV_EVENT_ERROR)
+    {
+        _ws_error_event(bev, events, ws);
+    }
+
+    else if (events & BEV_EVENT_TIMEOUT)
+    {
+        if (ws->close_cb)
+        {
+            char msg[] = "I/O timeout";
+            ws->close_cb(ws, ETIMEDOUT, WS_ERRTYPE_LIB, msg, sizeof(msg)-1, ws->close_arg);
+            LIBWS_LOG(LIBWS_DEBUG, "Bufferevent timeout");
+        }
+    }
+
+    if (events & BEV_EVENT_WRITING)
+    {
+        LIBWS_LOG(LIBWS_DEBUG, "   Writing");
+    }
+
+    if (events & BEV_EVENT_READING)
+    {
+        LIBWS_LOG(LIBWS_DEBUG, "   Reading");
+    }
+}
+
+int _ws_create_bufferevent_socket(ws_t ws)
+{
+	int ret = 0;
+	assert(ws);
+        ws_base_t base = ws->ws_base;
+	LIBWS_LOG(LIBWS_DEBUG, "Create bufferevent socket");
+
+	#ifdef LIBWS_WITH_OPENSSL
+	if (ws->use_ssl)
+	{
+		if (!(ws->bev = _ws_create_bufferevent_openssl_socket(ws))) 
+		{
+			LIBWS_LOG(LIBWS_ERR, "Failed to create SSL socket");
+			ret = -1;
+			goto fail;
+		}
+	}
+	else
+	#endif // LIBWS_WITH_OPENSSL
+	{
+                if (!(ws->bev = bufferevent_socket_new(base->ev_base, -1,
+                        _LIBWS_LE2_OPT_THREADSAFE | BEV_OPT_CLOSE_ON_FREE)))
+		{
+			LIBWS_LOG(LIBWS_ERR, "Failed to create socket");
+			ret = -1;
+			goto fail;
+		}
+	}
+	if (_ws_track_send_completions(ws))
+	{
+		ret = -1;
+		goto fail;
+	}
+
+#ifdef LIBWS_EXTERNAL_LOOP
+    assert(base->marshall_read_cb && base->marshall_event_cb && base->marshall_timer_cb);
+    bufferevent_setcb(ws->bev, base->marshall_read_cb, base_marshall_write_cb,
+                      base->marshall_event_cb, (void*)ws);
+#else
+    bufferevent_setcb(ws->bev, ws_read_callback, ws_write_callback,
+                      ws_event_callback, (void*)ws);
+#endif
+    bufferevent_setwatermark(ws->bev, EV_READ, 
+                      ws->recv_lowmark, ws->recv_highmark);
+
+    // The write callback is called when drained down to this.
+    bufferevent_setwatermark(ws->bev, EV_WRITE, ws->send_lowmark, 0);
+	return ret;
+fail:
+	if (ws->bev)
+	{
+		_ws_fail_send_completions(ws);
+		bufferevent_free(ws->bev);
+		ws->bev = NULL;
+	}
+
+	return ret;
+}
+
+///
+/// Timeout callback for telling the user that the send
+/// buffer has gone above the high watermark.
+///
+static void _ws_send_blocked_event(evutil_socket_t fd, short what, void *arg)
+{
+	ws_t ws = (ws_t)arg;
+	assert(ws);
+
+	if (ws->send_blocked && ws->send_blocked_cb)
+	{
+		ws->send_blocked_cb(ws, ws->send_blocked_arg);
+	}
+}
+
+int _ws_check_send_blocked(ws_t ws)
+{
+	assert(ws);
+
+	if (ws->fail_when_blocked && ws->send_blocked)
+	{
+		LIBWS_LOG(LIBWS_DEBUG, "Send would block");
+		return WS_SEND_WOULD_BLOCK;
+	}
+
+	return 0;
+}
+
+uint64_t _ws_send_pending_bytes(ws_t ws)
+{
+	uint64_t bytes = ws->sendq_bytes;
+	assert(ws);
+
+	if (ws->bev)
+	{
+		bytes += evbuffer_get_length(bufferevent_get_output(ws->bev));
+	}
+
+	return bytes;
+}
+
+void _ws_check_send_highmark(ws_t ws)
+{
+	assert(ws);
+
+	if (!ws->send_highmark || ws->send_blocked
+	 || (_ws_send_pending_bytes(ws) <= ws->send_highmark))
+	{
+		return;
+	}
+
+	LIBWS_LOG(LIBWS_DEBUG, "Send buffer above high watermark");
+	ws->send_blocked = 1;
+
+	// Let the send that got us here finish before telling the user.
+	if (ws->send_blocked_cb
+	 && _ws_setup_timeout_event(ws, _ws_send_blocked_event, 
+			&ws->send_blocked_event, &ws->ws_base->asap_ordered))
+	{
+		LIBWS_LOG(LIBWS_ERR, "Failed to schedule send blocked callback");
+	}
+}
+
+void _ws_check_send_ready(ws_t ws)
+{
+	assert(ws);
+
+	if (!ws->send_blocked || !ws->bev
+	 || (_ws_send_pending_bytes(ws) > ws->send_lowmark))
+	{
+		return;
+	}
+
+	LIBWS_LOG(LIBWS_DEBUG, "Send buffer drained to low watermark");
+	ws->send_blocked = 0;
+
+	if (ws->send_ready_cb)
+	{
+		ws->send_ready_cb(ws, ws->send_ready_arg);
+	}
+}
+
+///
+/// Timeout callback for reporting completed sends.
+///
+static void _ws_send_done_event(evutil_socket_t fd, short what, void *arg)
+{
+	ws_t ws = (ws_t)arg;
+	assert(ws);
+
+	_ws_flush_send_done(ws);
+}
+
+///
+/// Adds a completion to the ones to report in the next
+/// event loop iteration.
+///
+static void _ws_queue_send_done(ws_t ws, ws_send_completion_t *c)
+{
+	c->next = NULL;
+
+	if (ws->send_done_tail)
+	{
+		ws->send_done_tail->next = c;
+		ws->send_done_tail = c;
+		return;
+	}
+
+	ws->send_done = c;
+	ws->send_done_tail = c;
+
+	if (_ws_setup_timeout_event(ws, _ws_send_done_event, 
+			&ws->send_done_event, &ws->ws_base->asap_ordered))
+	{
+		LIBWS_LOG(LIBWS_ERR, "Failed to set up send complete event");
+	}
+}
+
+int _ws_send_done(ws_t ws, void *tag, int sent)
+{
+	ws_send_completion_t *c;
+	assert(ws);
+
+	if (!(c = (ws_send_completion_t *)_ws_malloc(sizeof(ws_send_completion_t))))
+	{
+		LIBWS_LOG(LIBWS_CRIT, "Out of memory!");
+		return -1;
+	}
+
+	c->end = 0;
+	c->tag = tag;
+	c->sent = sent;
+	_ws_queue_send_done(ws, c);
+
+	return 0;
+}
+
+void _ws_flush_send_done(ws_t ws)
+{
+	ws_send_completion_t *c;
+	ws_send_completion_t *done;
+	ws_send_complete_callback_f cb = ws->send_complete_cb;
+	void *cb_arg = ws->send_complete_arg;
+	assert(ws);
+
+	// Take them all, the callback might send and report more.
+	done = ws->send_done;
+	ws->send_done = NULL;
+	ws->send_done_tail = NULL;
+
+	while ((c = done))
+	{
+		done = c->next;
+
+		if (cb)
+		{
+			cb(ws, c->tag, c->sent, cb_arg);
+		}
+
+		_ws_free(c);
+	}
+}
+
+///
+/// Send buffer callback that reports the messages that have
+/// been completely drained from it.
+///
+static void _ws_send_buffer_cb(struct evbuffer *buf, 
+						const struct evbuffer_cb_info *info, void *arg)
+{
+	ws_t ws = (ws_t)arg;
+	ws_send_completion_t *c;
+	assert(ws);
+
+	if (info->n_added)
+	{
+		_ws_check_send_highmark(ws);
+	}
+
+	if (!info->n_deleted)
+		return;
+
+	ws->send_drained += info->n_deleted;
+
+	while ((c = ws->send_completions) && (c->end <= ws->send_drained))
+	{
+		if (!(ws->send_completions = c->next))
+		{
+			ws->send_completions_tail = NULL;
+		}
+
+		c->sent = 1;
+		_ws_queue_send_done(ws, c);
+	}
+}
+
+int _ws_track_send_completions(ws_t ws)
+{
+	assert(ws);
+	assert(ws->bev);
+
+	// Anything left belongs to the previous bufferevent.
+	_ws_fail_send_completions(ws);
+	ws->send_drained = 0;
+	ws->send_blocked = 0;
+
+	if (!(ws->send_cb_entry = evbuffer_add_cb(bufferevent_get_output(ws->bev),
+										_ws_send_buffer_cb, (void *)ws)))
+	{
+		LIBWS_LOG(LIBWS_ERR, "Failed to add send buffer callback");
+		return -1;
+	}
+
+	return 0;
+}
+
+int _ws_add_send_completion(ws_t ws, void *tag)
+{
+	ws_send_completion_t *c;
+	assert(ws);
+
+	if (!ws->bev || !ws->send_cb_entry)
+	{
+		LIBWS_LOG(LIBWS_ERR, "Send completions are not tracked");
+		return -1;
+	}
+
+	if (!(c = (ws_send_completion_t *)_ws_malloc(sizeof(ws_send_completion_t))))
+	{
+		LIBWS_LOG(LIBWS_CRIT, "Out of memory!");
+		return -1;
+	}
+
+	c->next = NULL;
+	c->tag = tag;
+	c->end = ws->send_drained 
+		   + evbuffer_get_length(bufferevent_get_output(ws->bev));
+
+	if (ws->send_completions_tail)
+	{
+		ws->send_completions_tail->next = c;
+	}
+	else
+	{
+		ws->send_completions = c;
+	}
+
+	ws->send_completions_tail = c;
+
+	return 0;
+}
+
+void _ws_fail_send_completions(ws_t ws)
+{
+	ws_send_completion_t *c;
+	assert(ws);
+
+	if (ws->send_cb_entry)
+	{
+		if (ws->bev)
+		{
+			evbuffer_remove_cb_entry(bufferevent_get_output(ws->bev), 
+									ws->send_cb_entry);
+		}
+
+		ws->send_cb_entry = NULL;
+	}
+
+	while ((c = ws->send_completions))
+	{
+		ws->send_completions = c->next;
+		c->sent = 0;
+		_ws_queue_send_done(ws, c);
+	}
+
+	ws->send_completions_tail = NULL;
+}
+
+static void _ws_builtin_no_copy_cleanup_wrapper(const void *data, 
+										size_t datalen, void *extra)
+{
+	ws_t ws = (ws_t)extra;
+	assert(ws);
+	assert(ws->no_copy_cleanup_cb);
+
+	// We wrap this so we can pass the websocket context.
+	// (Also, we don't want to expose any bufferevent types to the
+	//  external API so we're free to replace it).
+	ws->no_copy_cleanup_cb(ws, data, datalen, ws->no_copy_extra);
+}
+
+///
+/// Timeout callback that uncorks the websocket after an automatic cork.
+///
+static void _ws_uncork_event(evutil_socket_t fd, short what, void *arg)
+{
+	ws_t ws = (ws_t)arg;
+	assert(ws);
+
+	LIBWS_LOG(LIBWS_TRACE, "Automatic uncork");
+
+	ws_uncork(ws);
+}
+
+int _ws_auto_cork(ws_t ws)
+{
+	assert(ws);
+
+	// Never hold back the handshake or the close frame.
+	if (!ws->auto_cork || ws->corked || (ws->state != WS_STATE_CONNECTED))
+		return 0;
+
+	if (ws_cork(ws))
+	{
+		return -1;
+	}
+
+	// The asap timeout fires after all other events that are 
+	// active in this iteration of the event loop.
+	if (_ws_setup_timeout_event(ws, _ws_uncork_event, &ws->uncork_event,
+								&ws->ws_base->asap_ordered))
+	{
+		LIBWS_LOG(LIBWS_ERR, "Failed to schedule uncork");
+		ws_uncork(ws);
+		return -1;
+	}
+
+	return 0;
+}
+
+int _ws_send_data(ws_t ws, char *msg, uint64_t len, int no_copy)
+{
+	// TODO: We supply a len of uint64_t, evbuffer_add uses size_t...
+	assert(ws);
+
+	LIBWS_LOG(LIBWS_TRACE, " Send the data (%llu bytes)", len);
+
+	if (!ws->bev)
+	{
+		LIBWS_LOG(LIBWS_ERR, "Null bufferevent on send");
+		return -1;
+	}
+
+	if (_ws_auto_cork(ws))
+	{
+		return -1;
+	}
+
+	// If in no copy mode we only add a reference to the passed
+	// buffer to the underlying bufferevent, and let it use the
+	// user supplied cleanup function when it has sent the data.
+	// (Note that the header will never be sent like this).
+	if (no_copy && ws->no_copy_cleanup_cb)
+	{
+		if (evbuffer_add_reference(bufferevent_get_output(ws->bev), 
+			(void *)msg, (size_t)len, _ws_builtin_no_copy_cleanup_wrapper, (void *)ws))
+		{
+			LIBWS_LOG(LIBWS_ERR, "Failed to write reference to send buffer");
+			return -1;
+		}
+	}
+	else
+	{
+		// Send like normal (this will copy the data).
+		if (evbuffer_add(bufferevent_get_output(ws->bev), 
+						msg, (size_t)len))
+		{
+			LIBWS_LOG(LIBWS_ERR, "Failed to write to send buffer");
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+int _ws_send_data_masked(ws_t ws, const char *msg, uint64_t len, 
+						uint32_t mask, uint64_t offset)
+{
+	struct evbuffer *out;
+	struct evbuffer_iovec vecs[2];
+	size_t pos = 0;
+	int n;
+	int i;
+
+	assert(ws);
+
+	LIBWS_LOG(LIBWS_TRACE, " Send the data masked (%llu bytes)", len);
+
+	if (!ws->bev)
+	{
+		LIBWS_LOG(LIBWS_ERR, "Null bufferevent on send");
+		return -1;
+	}
+
+	if (_ws_auto_cork(ws))
+	{
+		return -1;
+	}
+
+	if (len == 0)
+		return 0;
+
+	out = bufferevent_get_output(ws->bev);
+
+	if ((n = evbuffer_reserve_space(out, (ev_ssize_t)len, vecs, 2)) <= 0)
+	{
+		LIBWS_LOG(LIBWS_ERR, "Failed to reserve space in send buffer");
+		return -1;
+	}
+
+	// Mask straight into the send buffer, instead of 
+	// first masking and then copying the data.
+	for (i = 0; i < n; i++)
+	{
+		size_t chunk_len = (vecs[i].iov_len < (len - pos)) 
+						 ? vecs[i].iov_len : (size_t)(len - pos);
+
+		_ws_mask(mask, offset + pos, (char *)vecs[i].iov_base, &msg[pos], chunk_len);
+		vecs[i].iov_len = chunk_len;
+		pos += chunk_len;
+	}
+
+	if (evbuffer_commit_space(out, vecs, n))
+	{
+		LIBWS_LOG(LIBWS_ERR, "Failed to write to send buffer");
+		return -1;
+	}
+
+	return 0;
+}
+
+int _ws_send_payload(ws_t ws, char *data, uint64_t len, 
+					uint64_t offset, int no_copy)
+{
+	uint32_t mask = ws->send_header.mask;
+
+	assert(ws);
+
+	no_copy = no_copy && ws->no_copy_cleanup_cb;
+
+	if (no_copy && !ws->preserve_send_buffers)
+	{
+		// The buffer itself is sent, so it must be masked in place.
+		_ws_mask(mask, offset, data, data, (size_t)len);
+
+		return _ws_send_data(ws, data, len, 1);
+	}
+
+	if (_ws_send_data_masked(ws, data, len, mask, offset))
+	{
+		return -1;
+	}
+
+	// The data has been copied, so we're done with the buffer.
+	if (no_copy && data)
+	{
+		ws->no_copy_cleanup_cb(ws, data, len, ws->no_copy_extra);
+	}
+
+	return 0;
+}
+
+int _ws_send_frame_coalesced(ws_t ws, const uint8_t *header, size_t header_len,
+							char *data, uint64_t len, int no_copy)
+{
+	struct evbuffer *out;
+	struct evbuffer_iovec vec;
+	char *dst;
+
+	assert(ws);
+
+	LIBWS_LOG(LIBWS_TRACE, " Send the frame coalesced (%lu + %llu bytes)", 
+			header_len, len);
+
+	if (!ws->bev)
+	{
+		LIBWS_LOG(LIBWS_ERR, "Null bufferevent on send");
+		return -1;
+	}
+
+	if (_ws_auto_cork(ws))
+	{
+		return -1;
+	}
+
+	out = bufferevent_get_output(ws->bev);
+
+	// A single vector makes sure the region is contiguous.
+	if (evbuffer_reserve_space(out, (ev_ssize_t)(header_len + len), &vec, 1) != 1)
+	{
+		LIBWS_LOG(LIBWS_ERR, "Failed to reserve space in send buffer");
+		return -1;
+	}
+
+	dst = (char *)vec.iov_base;
+	memcpy(dst, header, header_len);
+
+	if (len > 0)
+	{
+		_ws_mask(ws->send_header.mask, 0, &dst[header_len], data, (size_t)len);
+	}
+
+	vec.iov_len = header_len + (size_t)len;
+
+	if (evbuffer_commit_space(out, &vec, 1))
+	{
+		LIBWS_LOG(LIBWS_ERR, "Failed to write to send buffer");
+		return -1;
+	}
+
+	if (no_copy && data && ws->no_copy_cleanup_cb)
+	{
+		ws->no_copy_cleanup_cb(ws, data, len, ws->no_copy_extra);
+	}
+
+	return 0;
+}
+
+///
+/// Gets the size of a masked frame with a payload of #len bytes.
+///
+static uint64_t _ws_frame_size(uint64_t len)
+{
+	uint64_t header_len = WS_HDR_BASE_SIZE + WS_HDR_MASK_SIZE;
+
+	if (len > 0xFFFF)
+	{
+		header_len += 8;
+	}
+	else if (len > 125)
+	{
+		header_len += 2;
+	}
+
+	return header_len + len;
+}
+
+int _ws_send_frames_batch(ws_t ws, const ws_msg_desc_t *msgs, size_t count)
+{
+	struct evbuffer *out;
+	struct evbuffer_iovec vec;
+	uint32_t masks[64];
+	uint64_t total = 0;
+	char *dst;
+	size_t i;
+
+	assert(ws);
+
+	LIBWS_LOG(LIBWS_TRACE, " Send %lu messages batched", count);
+
+	if (!ws->bev)
+	{
+		LIBWS_LOG(LIBWS_ERR, "Null bufferevent on send");
+		return -1;
+	}
+
+	if (_ws_auto_cork(ws))
+	{
+		return -1;
+	}
+
+	for (i = 0; i < count; i++)
+	{
+		total += _ws_frame_size(msgs[i].len);
+	}
+
+	if (total > (uint64_t)EV_SSIZE_MAX)
+	{
+		LIBWS_LOG(LIBWS_ERR, "Batch too big (%llu bytes)", total);
+		return -1;
+	}
+
+	out = bufferevent_get_output(ws->bev);
+
+	// Reserve room for all of the frames at once.
+	if (evbuffer_reserve_space(out, (ev_ssize_t)total, &vec, 1) != 1)
+	{
+		LIBWS_LOG(LIBWS_ERR, "Failed to reserve space in send buffer");
+		return -1;
+	}
+
+	dst = (char *)vec.iov_base;
+
+	for (i = 0; i < count; i++)
+	{
+		uint8_t header_buf[WS_HDR_MAX_SIZE];
+		size_t header_len = 0;
+		size_t mask_idx = i % (sizeof(masks) / sizeof(masks[0]));
+
+		// Get the random masks for many frames at once.
+		if ((mask_idx == 0)
+		 && (_ws_get_random_mask(ws, (char *)masks, sizeof(masks)) != sizeof(masks)))
+		{
+			LIBWS_LOG(LIBWS_ERR, "Failed to get random masks");
+			return -1;
+		}
+
+		memset(&ws->send_header, 0, sizeof(ws_header_t));
+		ws->send_header.fin = 0x1;
+		ws->send_header.opcode = msgs[i].binary ? 
+							WS_OPCODE_BINARY_0X2 : WS_OPCODE_TEXT_0X1;
+		ws->send_header.mask_bit = 0x1;
+		ws->send_header.payload_len = msgs[i].len;
+		ws->send_header.mask = masks[mask_idx];
+
+		ws_pack_header(&ws->send_header, header_buf, sizeof(header_buf), &header_len);
+		memcpy(dst, header_buf, header_len);
+		dst += header_len;
+
+		if (msgs[i].len > 0)
+		{
+			_ws_mask(ws->send_header.mask, 0, dst, msgs[i].msg, (size_t)msgs[i].len);
+			dst += msgs[i].len;
+		}
+	}
+
+	vec.iov_len = (size_t)total;
+
+	if (evbuffer_commit_space(out, &vec, 1))
+	{
+		LIBWS_LOG(LIBWS_ERR, "Failed to write to send buffer");
+		return -1;
+	}
+
+	// Everything has been copied.
+	if (ws->no_copy_cleanup_cb)
+	{
+		for (i = 0; i < count; i++)
+		{
+			if (msgs[i].msg)
+			{
+				ws->no_copy_cleanup_cb(ws, msgs[i].msg, msgs[i].len, ws->no_copy_extra);
+			}
+		}
+	}
+
+	return 0;
+}
+
+///
+/// Packs the header for a single frame message into ws_s#send_header
+/// and writes the frame to the send buffer.
+///
+static int _ws_write_frame_raw(ws_t ws, ws_opcode_t opcode, 
+								char *data, uint64_t datalen)
+{
+	uint8_t header_buf[WS_HDR_MAX_SIZE];
+	size_t header_len = 0;
+
+	// All control frames MUST have a payload length of 125 bytes or less
+	// and MUST NOT be fragmented.
+	if (WS_OPCODE_IS_CONTROL(opcode) && (datalen > 125))
+	{
+		LIBWS_LOG(LIBWS_ERR, "Control frame payload cannot be "
+							 "larger than 125 bytes");
+		return -1;
+	}
+
+	// Pack header.
+	{
+		memset(&ws->send_header, 0, sizeof(ws_header_t));
+
+		ws->send_header.fin = 0x1;
+		ws->send_header.opcode = opcode;
+		
+		if (datalen > WS_MAX_PAYLOAD_LEN)
+		{
+			LIBWS_LOG(LIBWS_ERR, "Payload length (0x%x) larger than max allowed "
+								 "websocket payload (0x%x)",
+								 datalen, WS_MAX_PAYLOAD_LEN);
+			return -1;
+		}
+
+		ws->send_header.mask_bit = 0x1;
+		ws->send_header.payload_len = datalen;
+
+		if (_ws_get_random_mask(ws, (char *)&ws->send_header.mask, sizeof(uint32_t)) 
+			!= sizeof(uint32_t))
+		{
+		 	return -1;
+		}
+
+		ws_pack_header(&ws->send_header, header_buf, sizeof(header_buf), &header_len);
+	}
+
+	// Send the header and the data.
+	{
+		int nocopy = (opcode == WS_OPCODE_TEXT_0X1 || opcode == WS_OPCODE_BINARY_0X2);
+
+		if (datalen <= ws->coalesce_threshold)
+		{
+			if (_ws_send_frame_coalesced(ws, header_buf, header_len, 
+										data, datalen, nocopy))
+			{
+				LIBWS_LOG(LIBWS_ERR, "Failed to send frame");
+				return -1;
+			}
+
+			return 0;
+		}
+
+		if (_ws_send_data(ws, (char *)header_buf, (uint64_t)header_len, 0))
+		{
+			LIBWS_LOG(LIBWS_ERR, "Failed to send frame header");
+			return -1;
+		}
+
+		if (_ws_send_payload(ws, data, datalen, 0, nocopy))
+		{
+			LIBWS_LOG(LIBWS_ERR, "Failed to send frame data");
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+int _ws_send_frame_raw(ws_t ws, ws_opcode_t opcode, char *data, uint64_t datalen)
+{
+	int ret;
+	ws_header_t msg_header;
+
+	assert(ws);
+
+	LIBWS_LOG(LIBWS_TRACE, " Send frame raw 0x%x", opcode);
+
+	if (ws->send_state == WS_SEND_STATE_NONE)
+	{
+		return _ws_write_frame_raw(ws, opcode, data, datalen);
+	}
+
+	// Control frames may be sent in between the frames of a
+	// fragmented message, but not in the middle of a frame.
+	if (!WS_OPCODE_IS_CONTROL(opcode) 
+	 || (ws->send_state == WS_SEND_STATE_IN_MESSAGE_PAYLOAD))
+	{
+		LIBWS_LOG(LIBWS_ERR, "Send state not none");
+		return -1;
+	}
+
+	// Keep the header of the message being sent.
+	msg_header = ws->send_header;
+	ret = _ws_write_frame_raw(ws, opcode, data, datalen);
+	ws->send_header = msg_header;
+
+	return ret;
+}
+
+void _ws_shutdown(ws_t ws)
+{
+	assert(ws);
+
+	LIBWS_LOG(LIBWS_TRACE, "Websocket shutdown");
+
+	if (ws->connect_timeout_event)
+	{
+                _ws_free_timer(&ws->connect_timeout_event);
+	}
+
+	#ifdef LIBWS_WITH_OPENSSL
+	_ws_openssl_close(ws);
+	#endif
+
+	// Never sent, since the connection is gone.
+	_ws_sendq_clear(ws);
+	_ws_send_stream_end(ws);
+	ws->send_state = WS_SEND_STATE_NONE;
+
+	if (ws->bev)
+	{
+		_ws_fail_send_completions(ws);
+		bufferevent_free(ws->bev);
+		ws->bev = NULL;
+		LIBWS_LOG(LIBWS_DEBUG, "Freed bufferevent");
+	}
+
+	// TODO: Only quit when the base has no more connections.
+	//ws_base_quit(ws->ws_base, 1);
+
+	LIBWS_LOG(LIBWS_TRACE, "End");
+}
+
+void _ws_close_timeout_cb(evutil_socket_t fd, short what, void *arg)
+{
+    LIBWS_LOG(LIBWS_TRACE, "Close timeout");
+    ws_t ws = (ws_t)arg;
+    assert(ws);
+    if (ws->state != WS_STATE_CLOSING)
+    {
+        LIBWS_LOG(LIBWS_ERR, "Close timeout callback called, but socket is not in closing state (state = %d)", ws->state);
+        return;
+    }
+
+    // This callback should only ever be called after sending a close frame.
+    assert(ws->sent_close);
+
+    // We sent a close frame to the server but it hasn't initiated
+    // the TCP close.
+    if (ws->received_close)
+    {
+        LIBWS_LOG(LIBWS_ERR, "Timeout! Server sent a Websocket close frame but did not close the TCP session");
+    }
+    else
+    {
+        LIBWS_LOG(LIBWS_ERR, "Timeout! Server did not reply to Websocket close frame");
+    }
+
+    LIBWS_LOG(LIBWS_ERR, "Initiating an unclean close");
+    if (ws->close_cb)
+    {
+        char msg[] = "Timed out waiting for server-side close frame or TCP connection close";
+        ws->close_cb(ws, ETIMEDOUT, WS_ERRTYPE_PROTOCOL, msg, sizeof(msg)-1, ws->close_arg);
+    }
+    _ws_shutdown(ws);
+}
+
+int _ws_send_close(ws_t ws, ws_close_status_t status_code, const char *reason, size_t reason_len)
+{
+	char close_payload[WS_CONTROL_MAX_PAYLOAD_LEN];
+	assert(ws);
+
+	if (WS_IS_CLOSE_STATUS_NOT_USED(status_code))
+	{
+		LIBWS_LOG(LIBWS_ERR, "Invalid websocket close status code. "
+							 "Must be between 1000 and 4999. %u given", 
+							 (uint16_t)status_code);
+		return -1;
+	}
+
+	// (Status code is a uint16_t == 2 bytes)
+	if ((reason_len + 2) > WS_CONTROL_MAX_PAYLOAD_LEN)
+	{
+		LIBWS_LOG(LIBWS_ERR, "Close reason too big to fit max control "
+							 "frame payload size %u + 2 byte status (max %d)", 
+							 reason_len, WS_CONTROL_MAX_PAYLOAD_LEN);
+		return -1;
+	}
+
+    uint16_t code = htons((uint16_t)status_code);
+    memcpy(close_payload, &code, sizeof(code));
+    memcpy(close_payload+2, reason, reason_len);
+
+	if (_ws_send_frame_raw(ws, WS_OPCODE_CLOSE_0X8, 
+							close_payload, reason_len + 2))
+	{
+		LIBWS_LOG(LIBWS_ERR, "Failed to send close frame");
+		return -1;
+	}
+
+	return 0;
+}
+
+int _ws_get_random_bytes(ws_t ws, char *buf, size_t len)
+{
+	#ifdef _WIN32
+	size_t i;
+	unsigned int tmp;
+
+	// http://msdn.microsoft.com/en-us/library/sxtz2fa8(VS.80).aspx
+	for (i = 0; i < len; i++)
+	{
+		if (rand_s(&tmp))
+		{
+			return -1;
+		}
+
+		buf[i] = (char)tmp;
+	}
+	#else
+	int i;
+	i = (int)read(ws->ws_base->random_fd, buf, len);
+	#endif 
+
+	return i;
+}
+
+int _ws_get_random_mask(ws_t ws, char *buf, size_t len)
+{
+	assert(ws);
+	assert(ws->ws_base->random);
+
+	// No system calls here, the generator is only
+	// reseeded from the kernel once in a while.
+	if (_ws_random_bytes(ws->ws_base->random, buf, len))
+	{
+		return -1;
+	}
+
+	return (int)len;
+}
+
+///
+/// Event callback that drains the queue of requests from other threads.
+///
+static void _ws_threadsafe_event(evutil_socket_t fd, short what, void *arg)
+{
+	ws_t ws = (ws_t)arg;
+	_ws_threadsafe_drain(ws, 0);
+}
+
+///
+/// Releases a message that will not be sent.
+///
+static void _ws_threadsafe_discard(ws_t ws, ws_threadsafe_req_t *req)
+{
+	if (!req->close && ws->no_copy_cleanup_cb)
+	{
+		ws->no_copy_cleanup_cb(ws, req->msg, req->len, ws->no_copy_extra);
+	}
+}
+
+///
+/// Wakes up the event loop to drain the queue of requests from other threads.
+///
+static int _ws_threadsafe_wakeup(ws_t ws)
+{
+	#ifdef LIBWS_EXTERNAL_LOOP
+	{
+		// Goes through the marshaller, and frees itself.
+		ws_timer timer = NULL;
+
+		if (!_ws_setup_timeout_event(ws, _ws_threadsafe_event, 
+							&timer, &ws->ws_base->asap_ordered))
+		{
+			return 0;
+		}
+	}
+	#else
+	if (ws->threadsafe_event)
+	{
+		event_active(ws->threadsafe_event, EV_TIMEOUT, 1);
+		return 0;
+	}
+	#endif
+
+	return -1;
+}
+
+int _ws_threadsafe_push(ws_t ws, ws_threadsafe_req_t *req)
+{
+	ws_threadsafe_req_t *head;
+	assert(ws);
+	assert(req);
+
+	do
+	{
+		head = ws->threadsafe_queue;
+		req->next = head;
+	}
+	while (!libws_atomic_cas_ptr(&ws->threadsafe_queue, head, req));
+
+	// Someone else has already woken up the event loop, 
+	// and it hasn't taken the queue yet.
+	if (head)
+	{
+		return 0;
+	}
+
+	if (!_ws_threadsafe_wakeup(ws))
+	{
+		return 0;
+	}
+
+	LIBWS_LOG(LIBWS_ERR, "Failed to wake up the event loop");
+
+	// Only take back our own request. If others have been pushed on top 
+	// of it they have already been accepted, so leave it all for the 
+	// next drain, which at the latest is when the websocket is destroyed.
+	if (!libws_atomic_cas_ptr(&ws->threadsafe_queue, req, NULL))
+	{
+		return 0;
+	}
+
+	_ws_threadsafe_discard(ws, req);
+	_ws_free(req);
+	return -1;
+}
+
+void _ws_threadsafe_drain(ws_t ws, int discard)
+{
+	ws_threadsafe_req_t *req;
+	ws_threadsafe_req_t *next;
+	ws_threadsafe_req_t *fifo = NULL;
+	assert(ws);
+
+	req = (ws_threadsafe_req_t *)libws_atomic_xchg_ptr(&ws->threadsafe_queue, NULL);
+
+	// The queue is newest first.
+	while (req)
+	{
+		next = req->next;
+		req->next = fifo;
+		fifo = req;
+		req = next;
+	}
+
+	for (req = fifo; req; req = next)
+	{
+		next = req->next;
+
+		if (discard)
+		{
+			_ws_threadsafe_discard(ws, req);
+		}
+		else if (req->close)
+		{
+			ws_close(ws);
+		}
+		else if (ws->state != WS_STATE_CONNECTED)
+		{
+			LIBWS_LOG(LIBWS_WARN, "Not connected, dropping message from other thread");
+			_ws_threadsafe_discard(ws, req);
+		}
+		else
+		{
+			LIBWS_LOG(LIBWS_DEBUG, "Performing async send (msg=%p, len=%llu)", 
+								req->msg, req->len);
+
+			int ret = ws_send_msg_ex(ws, req->msg, req->len, req->binary);
+
+			if (ret == WS_SEND_WOULD_BLOCK)
+			{
+				LIBWS_LOG(LIBWS_WARN, "Send buffer full, dropping message from other thread");
+				_ws_threadsafe_discard(ws, req);
+			}
+			else if (ret)
+			{
+				LIBWS_LOG(LIBWS_WARN, "deferred_send failed");
+			}
+		}
+
+		_ws_free(req);
+	}
+}
+
+int _ws_threadsafe_init(ws_t ws)
+{
+	assert(ws);
+
+	#ifndef LIBWS_EXTERNAL_LOOP
+	if (!(ws->threadsafe_event = event_new(ws->ws_base->ev_base, -1, 0,
+									_ws_threadsafe_event, (void *)ws)))
+	{
+		LIBWS_LOG(LIBWS_ERR, "Failed to create event for other threads");
+		return -1;
+	}
+	#endif
+
+	return 0;
+}
+
+void _ws_threadsafe_destroy(ws_t ws)
+{
+	assert(ws);
+
+	#ifndef LIBWS_EXTERNAL_LOOP
+	if (ws->threadsafe_event)
+	{
+		event_free(ws->threadsafe_event);
+		ws->threadsafe_event = NULL;
+	}
+	#endif
+
+	_ws_threadsafe_drain(ws, 1);
+}
+
+void _ws_set_timeouts(ws_t ws)
+{
+	assert(ws);
+	assert(ws->bev);
+
+	// TODO: Maybe a workaround for this problem?:
+	// Setting a timeout to NULL is supposed to remove it; 
+	// however before Libevent 2.1.2-alpha this wouldn’t work 
+	// with all event types. (As a workaround for older versions, 
+	// you can try setting the timeout to a multi-day interval 
+	// and/or having your eventcb function ignore BEV_TIMEOUT 
+	// events when you don’t want them.)
+
+	bufferevent_set_timeouts(ws->bev, &ws->recv_timeout, &ws->send_timeout);
+}
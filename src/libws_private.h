@@ -1,409 +1,890 @@
-
-#ifndef __LIBWS_PRIVATE_H__
-#define __LIBWS_PRIVATE_H__
-
-///
-/// @internal
-/// @file libws_private.h
-///
-/// @author Joakim Söderberg <joakim.soderberg@gmail.com>
-///
-///
-
-#include "libws_config.h"
-#include "libws_log.h"
-#include "libws_types.h"
-#include "libws_header.h"
-#include "libws_utf8.h"
-#include "libws_handshake.h"
-
-#ifdef _WIN32
-#include <time.h>
-#else
-#include <sys/time.h>
-#endif
-
-#include <event2/event.h>
-#include <event2/bufferevent.h>
-
-#ifdef LIBWS_WITH_OPENSSL
-#include <openssl/bio.h>
-#include <openssl/ssl.h>
-#include <openssl/err.h>
-#include <event2/bufferevent_ssl.h>
-#endif // LIBWS_WITH_OPENSSL
-
-#ifdef LIBWS_EXTERNAL_LOOP
-//The option to add to bufferevent creation to enable thread safety of bufferevent
-    #define _LIBWS_LE2_OPT_THREADSAFE BEV_OPT_THREADSAFE
-#else
-    #define _LIBWS_LE2_OPT_THREADSAFE 0
-#endif
-
-typedef enum ws_send_state_e
-{
-    WS_SEND_STATE_NONE,
-    WS_SEND_STATE_MESSAGE_BEGIN,
-    WS_SEND_STATE_IN_MESSAGE,
-    WS_SEND_STATE_IN_MESSAGE_PAYLOAD
-} ws_send_state_t;
-
-typedef enum ws_connect_state_e
-{
-    WS_CONNECT_STATE_ERROR = -1,
-    WS_CONNECT_STATE_NONE = 0,
-    WS_CONNECT_STATE_SENT_REQ,
-    WS_CONNECT_STATE_PARSED_STATUS,
-    WS_CONNECT_STATE_PARSED_HEADERS,
-    WS_CONNECT_STATE_HANDSHAKE_COMPLETE
-} ws_connect_state_t;
-
-///
-/// Context for a websocket connection.
-///
-typedef struct ws_s
-{
-    struct ws_base_s *ws_base; ///< Base context that this
-                               /// websocket session belongs to.
-
-    ///
-    /// @defgroup StateVariables State Variables
-    /// @{
-    ///
-    ws_state_t state;                 ///< Websocket state.
-    ws_connect_state_t connect_state; ///< Connection handshake state.
-    void *user_state;
-    /// @}
- 
-    ///
-    /// @defgroup LibeventVariables Libevent Variables
-    /// @{
-    ///
-    struct bufferevent *bev;    ///< Buffer event socket.
-    /// @}
-
-    ///
-    /// @defgroup Callbacks Callback functions
-    /// @{
-    ///
-    ws_msg_callback_f msg_cb;   ///< Callback for when a message
-                                /// is received on the websocket.
-    void *msg_arg;              ///< The user supplied argument to pass to the
-                                /// the ws_s#msg_cb callback.
-    ws_msg_begin_callback_f msg_begin_cb; ///< Message begin callback.
-    void *msg_begin_arg;        ///< User supplied argument for
-                                /// the ws_s#msg_begin_cb.
-    ws_msg_frame_callback_f msg_frame_cb;
-                                ///< Callback for when a frame in a message 
-                                /// has arrived.
-    void *msg_frame_arg;        ///< User supplied argument for
-                                /// the ws_s#msg_frame_cb.
-    ws_msg_end_callback_f msg_end_cb; ///< Callback for when a message ends.
-    void *msg_end_arg;          ///< User supplied argument for
-                                /// the ws_s#msg_end_cb.
-    ws_msg_frame_begin_callback_f msg_frame_begin_cb; 
-                                ///< Callback for when a frame begins (when the
-                                /// header has been read).
-    void *msg_frame_begin_arg;  ///< User supplied argument
-                                /// for the ws_s#msg_frame_begin_cb
-    ws_msg_frame_data_callback_f msg_frame_data_cb;
-                                ///< Callback for when data
-                                /// in a frame is received.
-    void *msg_frame_data_arg;   ///< User supplied argument for
-                                /// the ws_s#msg_frame_data_cb.
-    ws_msg_frame_end_callback_f msg_frame_end_cb;
-                                ///< Callback for when a frame ends.
-    void *msg_frame_end_arg;    ///< User supplied argument for
-                                /// the ws_s#msg_frame_end_cb.
-    ws_write_callback_f write_cb; ///< Callback for when the socket is ready to write.
-    void *write_arg;            ///< User supplied argument for the ws_s#write_cb.
-    ws_close_callback_f close_cb;
-                                ///< Callback for when the websocket connection
-                                /// is closed.
-    void *close_arg;            ///< The user supplied argument
-                                /// to pass to the ws_s#close_cb
-                                /// callback.
-
-    ///
-    /// @defgroup ConnectionCallback Connection callback
-    /// @{
-    ///
-    ws_connect_callback_f connect_cb;
-                                ///< Callback for when the
-                                /// connection is complete.
-    void *connect_arg;          ///< The user supplied argument
-    ws_timeout_callback_f connect_timeout_cb;
-                                ///< Connection timeout callback.
-    struct timeval connect_timeout;
-                                ///< Connection timeout.
-    void *connect_timeout_arg;  ///< The user supplied argument that is passed
-                                /// to the ws_s#connect_timeout_cb callback.
-    ws_timer connect_timeout_event;
-                                ///< Libevent event that is fired when the
-                                /// connection times out.
-    /// @}
-
-    ws_timeout_callback_f recv_timeout_cb;
-    struct timeval recv_timeout;
-    void *recv_timeout_arg;
-
-    ws_timeout_callback_f send_timeout_cb;
-    struct timeval send_timeout;
-    void *send_timeout_arg;
-
-    ///
-    /// @defgroup PongCallback Pong callback
-    /// @{
-    ///
-    ws_msg_callback_f pong_cb;  ///< User supplied callback for
-                                /// when a pong frame is received.
-    void *pong_arg;             ///< The user supplied argument that will be 
-                                /// passed to the pong callback.
-    ws_timeout_callback_f pong_timeout_cb;
-    void *pong_timeout_arg;
-    struct timeval pong_timeout;
-    ws_timer pong_timeout_event;
-    /// @}
-
-    ///
-    /// @defgroup PingCallback Ping callback
-    /// @{
-    ///
-    ws_msg_callback_f ping_cb;
-    void *ping_arg;
-    /// @}
-
-    ws_header_callback_f header_cb;
-    void *header_arg;
-    ws_http_header_flags_t http_header_flags;
-    /// @}
-
-    ///
-    /// @defgroup ConnectionVariables    Connection variables
-    /// @{
-    ///
-    char *server;
-    char *uri;
-    int port;
-    char *handshake_key_base64;
-    char *origin;
-    char **subprotocols;
-    size_t num_subprotocols;
-    /// @}
-
-    int binary_mode;            ///< If this is set messages
-                                /// will be sent as binary.
-    int debug_level;
-    uint64_t max_frame_size;    ///< The max frame size to allow before chunking.
-
-    ///
-    /// @defgroup FrameReceive Frame receive variables
-    /// @{
-    ///
-    struct evbuffer *msg;       ///< Buffer that is used to
-                                /// build an incoming message.
-    struct evbuffer *frame_data;///< Data for the current frame.
-    uint64_t recv_frame_len;    ///< The amount of bytes that have been read
-                                /// for the current frame so far.
-    int has_header;             ///< Has the websocket header been read yet?
-    ws_header_t header;         ///< Header for received websocket frame.
-    int in_msg;                 ///< Are we inside a message?
-    int msg_isbinary;           ///< The opcode of the current message.
-    ws_utf8_state_t utf8_state; ///< Current state of utf8 validator.
-    char ctrl_payload[WS_CONTROL_MAX_PAYLOAD_LEN];
-                                ///< Control frame payload.
-    size_t ctrl_len;            ///< Length of the control payload.
-    int received_close;         ///< Did we receive a close frame?
-    int sent_close;             ///< Have we sent a close frame?
-    ws_timer close_timeout_event;
-                                ///< Timeout even for waiting for a close reply.
-    ws_close_status_t server_close_status; 
-                                ///< The Close status the server sent.
-    char *server_reason;        ///< Server close reason data.
-    size_t server_reason_len;   ///< Server close reason length.
-    /// @}
-    
-    ///
-    /// @defgroup FrameSend Frame send variables
-    /// @{
-    ///
-    uint64_t frame_size;        ///< The frame size of the frame
-                                /// currently being sent.
-    uint64_t frame_data_sent;   ///< The number of bytes sent so
-                                /// far of the current frame.
-    ws_send_state_t send_state; ///< The state for sending data.
-    ws_header_t send_header;    ///< Header for outgoing websocket frame.
-    ws_no_copy_cleanup_f no_copy_cleanup_cb;
-                                ///< If set, any data written to
-                                /// the websocket will be freed 
-                                /// using this callback.
-    void *no_copy_extra;        ///< User supplied argument for
-                                /// the ws_s#no_copy_cleanup_cb
-    /// @}
-
-    struct ev_token_bucket_cfg *rate_limits;
-                                ///< Rate limits.
-    #ifdef LIBWS_WITH_OPENSSL
-    ///
-    /// @defgroup OpenSSL OpenSSL variables
-    ///
-    libws_ssl_state_t use_ssl;  ///< If SSL should be used or not.
-    SSL_CTX *ssl_ctx;
-    SSL *ssl;                   ///< SSL session.
-    #endif // LIBWS_WITH_OPENSSL
-} ws_s;
-
-///
-/// Creates a timeout timer
-///
-int _ws_setup_timeout_event(ws_t ws, event_callback_fn func, ws_timer* timer, struct timeval *tv);
-
-///
-/// Frees and NULLs an timer - asynchronously (i.e. just marks it as canceled - when it triggers,
-/// the callback deletes it) if LIBWS_EXTERNAL_LOOP is enabled,
-/// and synchronously otherwise.
-void _ws_free_timer(ws_timer *timer);
-
-/// Synchronously frees a timer - always performs the actual deletion immediately. Not to be used
-/// directly on a registered timer when LIBWS_EXTERNAL_LOOP, as if the timer has already fired and
-/// its message is queued on the marshalled, when its received the timer struct will be already freed
-void _ws_do_free_timer(ws_timer* timer);
-///
-/// Creates a timeout event for when connecting.
-///
-/// @param[in] ws   The websocket context.
-///
-/// @returns        0 on success.
-///
-int _ws_setup_connection_timeout(ws_t ws);
-
-///
-/// Creates a timeout event for an expected pong reply.
-///
-/// @param[in] ws   The websocket context.
-///
-/// @returns        0 on success.
-///
-int _ws_setup_pong_timeout(ws_t ws);
-
-/// 
-/// Creates the libevent bufferevent socket.
-///
-/// @param[in] ws   The websocket context.
-///
-/// @returns        0 on success.
-///
-int _ws_create_bufferevent_socket(ws_t ws);
-
-///
-/// Sends data over the bufferevent socket.
-///
-/// @param[in] ws      The websocket context.
-/// @param[in] msg     The buffer to send.
-/// @param[in] len     Length of the buffer to send.
-/// @param[in] no_copy Should we copy the contents of the buffer
-///                    or simply use a reference? Used for zero copy.
-///                    This requires that the buffer is still valid
-///                    until the bufferevent sends it. To enable this
-///                    you have to set a cleanup function using
-///                    #ws_set_no_copy_cb that frees the data.
-///
-/// @returns            0 on success.
-/// 
-int _ws_send_data(ws_t ws, char *msg, uint64_t len, int no_copy);
-
-///
-/// Sends a raw websocket frame.
-///
-/// @param[in] ws       The websocket context.
-/// @param[in] opcode   The websocket operation code.
-/// @param[in] data     Application data for the websocket frame.
-/// @param[in] datalen  Length of the data.
-///
-/// @returns            0 on success.
-///
-int _ws_send_frame_raw(ws_t ws, ws_opcode_t opcode, 
-                        char *data, uint64_t datalen);
-
-///
-/// Sends a close frame.
-///
-/// @param[in] ws          The websocket context.
-/// @param[in] status_code The status code to send.
-/// @param[in] reason      The reason data.
-/// @param[in] reason_len  The length of the #reason buffer.
-///                        Must not be larger than 123 bytes.
-///
-/// @returns               0 on success.
-///
-int _ws_send_close(ws_t ws, ws_close_status_t status_code, 
-                    const char *reason, size_t reason_len);
-
-///
-/// Closes the socket for the underlying TCP session used for the websocket.
-///
-/// @param[in] ws         The websocket context.
-///
-void _ws_shutdown(ws_t ws);
-
-///
-/// Timeout callback function for when we have sent the close frame to the
-/// server. If this times out, we will initiate an unclean shutdown since
-/// the servern hasn't initiated the TCP close.
-///
-void _ws_close_timeout_cb(evutil_socket_t fd, short what, void *arg);
-
-///
-/// Randomizes the contents of #buf. This is used for generating
-/// the 32-bit payload mask.
-///
-/// @param[in] ws      The websocket context.
-/// @param[in] buf     The buffer to randomize.
-/// @param[in] len     Size of #buf.
-///
-/// @returns           The number of bytes successfully randomized.
-///                    Negative on error.
-///
-int _ws_get_random_mask(ws_t ws, char *buf, size_t len);
-
-///
-/// Sets timeouts for read and write events of the underlying bufferevent.
-///
-/// @param[in] ws      The websocket context.
-/// 
-void _ws_set_timeouts(ws_t ws);
-
-///
-/// Replacement malloc.
-///
-void *_ws_malloc(size_t size);
-
-///
-/// Replacement realloc.
-///
-void *_ws_realloc(void *ptr, size_t size);
-
-///
-/// Replacement free.
-///
-void _ws_free(void *ptr);
-
-///
-/// Replacement calloc.
-///
-void *_ws_calloc(size_t count, size_t size);
-
-///
-/// Replacement strdup.
-///
-char *_ws_strdup(const char *str);
-
-///
-/// Internal function to replace memory functions.
-///
-void _ws_set_memory_functions(ws_malloc_replacement_f malloc_replace,
-                             ws_free_replacement_f free_replace,
-                             ws_realloc_replacement_f realloc_replace);
-
-
-#endif // __LIBWS_PRIVATE_H__
+
+#ifndef __LIBWS_PRIVATE_H__
+#define __LIBWS_PRIVATE_H__
+
+///
+/// @internal
+/// @file libws_private.h
+///
+/// @author Joakim Söderberg <joakim.soderberg@gmail.com>
+///
+///
+
+#include "libws_config.h"
+#include "libws_log.h"
+#include "libws_types.h"
+#include "libws_header.h"
+#include "libws_utf8.h"
+#include "libws_handshake.h"
+#include "libws_send_queue.h"
+
+#ifdef _WIN32
+#include <time.h>
+#else
+#include <sys/time.h>
+#endif
+
+#include <event2/event.h>
+#include <event2/bufferevent.h>
+
+#ifdef LIBWS_WITH_OPENSSL
+#include <openssl/bio.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <event2/bufferevent_ssl.h>
+#endif // LIBWS_WITH_OPENSSL
+
+#ifdef LIBWS_EXTERNAL_LOOP
+//The option to add to bufferevent creation to enable thread safety of bufferevent
+    #define _LIBWS_LE2_OPT_THREADSAFE BEV_OPT_THREADSAFE
+#else
+    #define _LIBWS_LE2_OPT_THREADSAFE 0
+#endif
+
+///
+/// The contiguous buffer that incoming messages are built in is kept
+/// between messages, unless it has grown larger than this.
+///
+#define WS_MSG_BUF_KEEP_SIZE (64 * 1024)
+
+///
+/// A send or close pushed from another thread, see
+/// #_ws_threadsafe_push.
+///
+typedef struct ws_threadsafe_req_s
+{
+    struct ws_threadsafe_req_s *next;
+    char *msg;
+    uint64_t len;
+    int binary;
+    int close;                  ///< Close instead of sending.
+} ws_threadsafe_req_t;
+
+///
+/// A message sent with #ws_send_msg_tagged that has
+/// not yet been fully drained from the send buffer.
+///
+typedef struct ws_send_completion_s
+{
+    struct ws_send_completion_s *next;
+    uint64_t end;               ///< ws_s#send_drained when it is done.
+    void *tag;
+    int sent;                   ///< Once reported, if it was sent.
+} ws_send_completion_t;
+
+typedef enum ws_send_state_e
+{
+    WS_SEND_STATE_NONE,
+    WS_SEND_STATE_MESSAGE_BEGIN,
+    WS_SEND_STATE_IN_MESSAGE,
+    WS_SEND_STATE_IN_MESSAGE_PAYLOAD
+} ws_send_state_t;
+
+typedef enum ws_connect_state_e
+{
+    WS_CONNECT_STATE_ERROR = -1,
+    WS_CONNECT_STATE_NONE = 0,
+    WS_CONNECT_STATE_SENT_REQ,
+    WS_CONNECT_STATE_PARSED_STATUS,
+    WS_CONNECT_STATE_PARSED_HEADERS,
+    WS_CONNECT_STATE_HANDSHAKE_COMPLETE
+} ws_connect_state_t;
+
+///
+/// Context for a websocket connection.
+///
+typedef struct ws_s
+{
+    struct ws_base_s *ws_base; ///< Base context that this
+                               /// websocket session belongs to.
+
+    ///
+    /// @defgroup StateVariables State Variables
+    /// @{
+    ///
+    ws_state_t state;                 ///< Websocket state.
+    ws_connect_state_t connect_state; ///< Connection handshake state.
+    void *user_state;
+    /// @}
+ 
+    ///
+    /// @defgroup LibeventVariables Libevent Variables
+    /// @{
+    ///
+    struct bufferevent *bev;    ///< Buffer event socket.
+    /// @}
+
+    ///
+    /// @defgroup Callbacks Callback functions
+    /// @{
+    ///
+    ws_msg_callback_f msg_cb;   ///< Callback for when a message
+                                /// is received on the websocket.
+    void *msg_arg;              ///< The user supplied argument to pass to the
+                                /// the ws_s#msg_cb callback.
+    ws_msg_iov_callback_f msg_iov_cb;
+                                ///< Scatter/gather variant of ws_s#msg_cb, 
+                                /// called instead of it when set.
+    void *msg_iov_arg;          ///< User supplied argument for
+                                /// the ws_s#msg_iov_cb.
+    ws_msg_begin_callback_f msg_begin_cb; ///< Message begin callback.
+    void *msg_begin_arg;        ///< User supplied argument for
+                                /// the ws_s#msg_begin_cb.
+    ws_msg_frame_callback_f msg_frame_cb;
+                                ///< Callback for when a frame in a message 
+                                /// has arrived.
+    void *msg_frame_arg;        ///< User supplied argument for
+                                /// the ws_s#msg_frame_cb.
+    ws_msg_end_callback_f msg_end_cb; ///< Callback for when a message ends.
+    void *msg_end_arg;          ///< User supplied argument for
+                                /// the ws_s#msg_end_cb.
+    ws_msg_frame_begin_callback_f msg_frame_begin_cb; 
+                                ///< Callback for when a frame begins (when the
+                                /// header has been read).
+    void *msg_frame_begin_arg;  ///< User supplied argument
+                                /// for the ws_s#msg_frame_begin_cb
+    ws_msg_frame_data_callback_f msg_frame_data_cb;
+                                ///< Callback for when data
+                                /// in a frame is received.
+    void *msg_frame_data_arg;   ///< User supplied argument for
+                                /// the ws_s#msg_frame_data_cb.
+    ws_msg_frame_end_callback_f msg_frame_end_cb;
+                                ///< Callback for when a frame ends.
+    void *msg_frame_end_arg;    ///< User supplied argument for
+                                /// the ws_s#msg_frame_end_cb.
+    ws_write_callback_f write_cb; ///< Callback for when the socket is ready to write.
+    void *write_arg;            ///< User supplied argument for the ws_s#write_cb.
+    ws_close_callback_f close_cb;
+                                ///< Callback for when the websocket connection
+                                /// is closed.
+    void *close_arg;            ///< The user supplied argument
+                                /// to pass to the ws_s#close_cb
+                                /// callback.
+
+    ///
+    /// @defgroup ConnectionCallback Connection callback
+    /// @{
+    ///
+    ws_connect_callback_f connect_cb;
+                                ///< Callback for when the
+                                /// connection is complete.
+    void *connect_arg;          ///< The user supplied argument
+    ws_timeout_callback_f connect_timeout_cb;
+                                ///< Connection timeout callback.
+    struct timeval connect_timeout;
+                                ///< Connection timeout.
+    void *connect_timeout_arg;  ///< The user supplied argument that is passed
+                                /// to the ws_s#connect_timeout_cb callback.
+    ws_timer connect_timeout_event;
+                                ///< Libevent event that is fired when the
+                                /// connection times out.
+    /// @}
+
+    ws_timeout_callback_f recv_timeout_cb;
+    struct timeval recv_timeout;
+    void *recv_timeout_arg;
+
+    ws_timeout_callback_f send_timeout_cb;
+    struct timeval send_timeout;
+    void *send_timeout_arg;
+
+    ///
+    /// @defgroup PongCallback Pong callback
+    /// @{
+    ///
+    ws_msg_callback_f pong_cb;  ///< User supplied callback for
+                                /// when a pong frame is received.
+    void *pong_arg;             ///< The user supplied argument that will be 
+                                /// passed to the pong callback.
+    ws_timeout_callback_f pong_timeout_cb;
+    void *pong_timeout_arg;
+    struct timeval pong_timeout;
+    ws_timer pong_timeout_event;
+    /// @}
+
+    ///
+    /// @defgroup PingCallback Ping callback
+    /// @{
+    ///
+    ws_msg_callback_f ping_cb;
+    void *ping_arg;
+    /// @}
+
+    ws_header_callback_f header_cb;
+    void *header_arg;
+    ws_http_header_flags_t http_header_flags;
+    /// @}
+
+    ///
+    /// @defgroup ConnectionVariables    Connection variables
+    /// @{
+    ///
+    char *server;
+    char *uri;
+    int port;
+    char *handshake_key_base64;
+    char *origin;
+    char **subprotocols;
+    size_t num_subprotocols;
+    /// @}
+
+    int binary_mode;            ///< If this is set messages
+                                /// will be sent as binary.
+    int debug_level;
+    uint64_t max_frame_size;    ///< The max frame size to allow before chunking.
+
+    ///
+    /// @defgroup FrameReceive Frame receive variables
+    /// @{
+    ///
+    struct evbuffer *msg;       ///< Buffer that is used to
+                                /// build an incoming message.
+    struct evbuffer *frame_data;///< Data for the current frame.
+    uint64_t recv_frame_len;    ///< The amount of bytes that have been read
+                                /// for the current frame so far.
+    int has_header;             ///< Has the websocket header been read yet?
+    ws_header_t header;         ///< Header for received websocket frame.
+    int in_msg;                 ///< Are we inside a message?
+    int msg_isbinary;           ///< The opcode of the current message.
+    ws_utf8_state_t utf8_state; ///< Current state of utf8 validator.
+    int msg_contiguous;         ///< Is the current message being built in
+                                /// ws_s#msg_buf instead of ws_s#msg?
+    char *msg_buf;              ///< Contiguous buffer for the current message.
+    size_t msg_buf_len;         ///< Bytes of the message in ws_s#msg_buf.
+    size_t msg_buf_size;        ///< Allocated size of ws_s#msg_buf.
+    char *recv_buf;             ///< Scratch buffer that frame data spread
+                                /// over several chains is unmasked into.
+    size_t recv_buf_size;       ///< Size of ws_s#recv_buf.
+    int read_paused;            ///< Has reading been paused 
+                                /// using #ws_pause_reading?
+    size_t recv_lowmark;        ///< Read low watermark for the bufferevent.
+    size_t recv_highmark;       ///< Read high watermark for the bufferevent.
+    size_t max_recv_buffered;   ///< Max received bytes that are not yet
+                                /// delivered to the user. 0 means no limit.
+    uint64_t max_message_size;  ///< Max size of a received message.
+    uint64_t max_recv_frame_size; ///< Max size of a received frame.
+    uint64_t recv_msg_len;      ///< Payload length of the frames received
+                                /// so far for the current message.
+    int recv_aborted;           ///< Set when a too big frame has been
+                                /// received and we're closing.
+    uint64_t recv_skip_len;     ///< Bytes left to skip of a too big frame.
+    char ctrl_payload[WS_CONTROL_MAX_PAYLOAD_LEN];
+                                ///< Control frame payload.
+    size_t ctrl_len;            ///< Length of the control payload.
+    int received_close;         ///< Did we receive a close frame?
+    int sent_close;             ///< Have we sent a close frame?
+    ws_timer close_timeout_event;
+                                ///< Timeout even for waiting for a close reply.
+    ws_close_status_t server_close_status; 
+                                ///< The Close status the server sent.
+    char *server_reason;        ///< Server close reason data.
+    size_t server_reason_len;   ///< Server close reason length.
+    /// @}
+    
+    ///
+    /// @defgroup FrameSend Frame send variables
+    /// @{
+    ///
+    uint64_t frame_size;        ///< The frame size of the frame
+                                /// currently being sent.
+    uint64_t frame_data_sent;   ///< The number of bytes sent so
+                                /// far of the current frame.
+    ws_send_state_t send_state; ///< The state for sending data.
+    ws_header_t send_header;    ///< Header for outgoing websocket frame.
+    ws_no_copy_cleanup_f no_copy_cleanup_cb;
+                                ///< If set, any data written to
+                                /// the websocket will be freed 
+                                /// using this callback.
+    void *no_copy_extra;        ///< User supplied argument for
+                                /// the ws_s#no_copy_cleanup_cb
+    int preserve_send_buffers;  ///< If set, data passed to the send functions
+                                /// is never masked in place, even when the
+                                /// ws_s#no_copy_cleanup_cb is set.
+    size_t coalesce_threshold;  ///< Frames with a payload up to this size are
+                                /// written together with their header.
+    int corked;                 ///< Is writing to the socket held back?
+    int auto_cork;              ///< Cork when sending, and uncork at the end
+                                /// of the event loop iteration.
+    ws_timer uncork_event;      ///< Uncorks after an automatic cork.
+    /// @}
+
+    ///
+    /// @defgroup SendCompletion Send completion tracking
+    /// @{
+    ///
+    ws_send_complete_callback_f send_complete_cb;
+    void *send_complete_arg;
+    struct evbuffer_cb_entry *send_cb_entry;
+                                ///< Callback on the send buffer.
+    uint64_t send_drained;      ///< Total bytes drained from the send buffer.
+    ws_send_completion_t *send_completions;
+                                ///< Pending completions, oldest first.
+    ws_send_completion_t *send_completions_tail;
+    ws_send_completion_t *send_done;
+                                ///< Completions to report, oldest first.
+    ws_send_completion_t *send_done_tail;
+    ws_timer send_done_event;   ///< Reports ws_s#send_done.
+    /// @}
+
+    ///
+    /// @defgroup SendFlowControl Send flow control
+    /// @{
+    ///
+    size_t send_lowmark;        ///< Ready again when drained to this.
+    size_t send_highmark;       ///< Blocked when above this, 0 for no limit.
+    int send_blocked;           ///< Is the send buffer above the high mark?
+    int fail_when_blocked;      ///< Fail sends with #WS_SEND_WOULD_BLOCK
+                                /// while blocked.
+    ws_write_callback_f send_blocked_cb;
+    void *send_blocked_arg;
+    ws_write_callback_f send_ready_cb;
+    void *send_ready_arg;
+    ws_timer send_blocked_event;
+                                ///< Calls ws_s#send_blocked_cb outside of the
+                                /// send that crossed the high mark.
+    /// @}
+
+    ///
+    /// @defgroup SendStream Streamed message being sent
+    /// @{
+    ///
+    ws_stream_producer_f stream_producer;
+                                ///< Set while a stream is being sent.
+    void *stream_arg;
+    char *stream_buf;           ///< Buffer the producer fills.
+    size_t stream_buf_size;
+    /// @}
+
+    ///
+    /// @defgroup SendQueue Messages queued in the library
+    /// @{
+    ///
+    int send_queue_enabled;     ///< Does ws_send_msg_ex use the queue?
+    int adaptive_fragments;     ///< Size fragments after the connection.
+    ws_sendq_t sendq[WS_SEND_PRIORITIES];
+                                ///< A queue for each priority class.
+    ws_sendq_msg_t *sendq_current;
+                                ///< The message being framed.
+    uint64_t sendq_bytes;       ///< Payload bytes not yet framed.
+    size_t sendq_count;         ///< Messages not yet fully framed.
+    size_t sendq_deadlines;     ///< Messages waiting that have a deadline.
+    struct timeval sendq_next_deadline;
+                                ///< The earliest of their deadlines.
+    ws_timer sendq_deadline_event;
+                                ///< Drops messages at #sendq_next_deadline.
+    uint64_t sendq_dropped;     ///< Messages dropped at their deadline.
+    uint64_t sendq_conflated;   ///< Messages replaced by a newer one
+                                /// with the same key.
+    size_t pace_msgs_rate;      ///< Messages per second, 0 for no limit.
+    size_t pace_bytes_rate;     ///< Bytes per second, 0 for no limit.
+    struct timeval pace_next;   ///< When the next message may begin.
+    int pace_waiting;           ///< Is #pace_event pending?
+    ws_timer pace_event;        ///< Runs the scheduler at #pace_next.
+    ws_send_dropped_callback_f send_dropped_cb;
+    void *send_dropped_arg;
+    /// @}
+
+    ///
+    /// @defgroup ThreadsafeQueue Requests from other threads
+    /// @{
+    ///
+    ws_threadsafe_req_t *volatile threadsafe_queue;
+                                ///< Lock-free stack of requests pushed from
+                                /// other threads, newest first.
+    #ifndef LIBWS_EXTERNAL_LOOP
+    struct event *threadsafe_event;
+                                ///< Activated to drain the queue.
+    #endif
+    /// @}
+
+    struct ev_token_bucket_cfg *rate_limits;
+                                ///< Rate limits.
+    #ifdef LIBWS_WITH_OPENSSL
+    ///
+    /// @defgroup OpenSSL OpenSSL variables
+    ///
+    libws_ssl_state_t use_ssl;  ///< If SSL should be used or not.
+    SSL_CTX *ssl_ctx;
+    SSL *ssl;                   ///< SSL session.
+    #endif // LIBWS_WITH_OPENSSL
+} ws_s;
+
+///
+/// Creates a timeout timer
+///
+int _ws_setup_timeout_event(ws_t ws, event_callback_fn func, ws_timer* timer, struct timeval *tv);
+
+///
+/// Frees and NULLs an timer - asynchronously (i.e. just marks it as canceled - when it triggers,
+/// the callback deletes it) if LIBWS_EXTERNAL_LOOP is enabled,
+/// and synchronously otherwise.
+void _ws_free_timer(ws_timer *timer);
+
+/// Synchronously frees a timer - always performs the actual deletion immediately. Not to be used
+/// directly on a registered timer when LIBWS_EXTERNAL_LOOP, as if the timer has already fired and
+/// its message is queued on the marshalled, when its received the timer struct will be already freed
+void _ws_do_free_timer(ws_timer* timer);
+///
+/// Creates a timeout event for when connecting.
+///
+/// @param[in] ws   The websocket context.
+///
+/// @returns        0 on success.
+///
+int _ws_setup_connection_timeout(ws_t ws);
+
+///
+/// Creates a timeout event for an expected pong reply.
+///
+/// @param[in] ws   The websocket context.
+///
+/// @returns        0 on success.
+///
+int _ws_setup_pong_timeout(ws_t ws);
+
+/// 
+/// Creates the libevent bufferevent socket.
+///
+/// @param[in] ws   The websocket context.
+///
+/// @returns        0 on success.
+///
+int _ws_create_bufferevent_socket(ws_t ws);
+
+///
+/// Sends data over the bufferevent socket.
+///
+/// @param[in] ws      The websocket context.
+/// @param[in] msg     The buffer to send.
+/// @param[in] len     Length of the buffer to send.
+/// @param[in] no_copy Should we copy the contents of the buffer
+///                    or simply use a reference? Used for zero copy.
+///                    This requires that the buffer is still valid
+///                    until the bufferevent sends it. To enable this
+///                    you have to set a cleanup function using
+///                    #ws_set_no_copy_cb that frees the data.
+///
+/// @returns            0 on success.
+/// 
+int _ws_send_data(ws_t ws, char *msg, uint64_t len, int no_copy);
+
+///
+/// Masks data while copying it into the send buffer of the bufferevent.
+/// The passed buffer is not modified.
+///
+/// @param[in] ws      The websocket context.
+/// @param[in] msg     The buffer to send.
+/// @param[in] len     Length of the buffer to send.
+/// @param[in] mask    The mask from the frame header.
+/// @param[in] offset  The offset into the frame payload where #msg starts.
+///
+/// @returns           0 on success.
+///
+int _ws_send_data_masked(ws_t ws, const char *msg, uint64_t len, 
+						uint32_t mask, uint64_t offset);
+
+///
+/// If automatic corking is enabled (see #ws_set_auto_cork), this corks
+/// the websocket and schedules it to be uncorked at the end of the 
+/// current event loop iteration. Called before anything is sent.
+///
+/// @param[in] ws      The websocket context.
+///
+/// @returns           0 on success.
+///
+int _ws_auto_cork(ws_t ws);
+
+///
+/// Sends frame payload masked with the mask of ws_s#send_header.
+///
+/// In no copy mode the buffer is masked in place and added by reference,
+/// unless ws_s#preserve_send_buffers is set. Otherwise it is masked while
+/// being copied to the send buffer, and left untouched. The no copy 
+/// cleanup callback is then called right away, as the buffer is no 
+/// longer needed.
+///
+/// @param[in] ws      The websocket context.
+/// @param[in] data    The payload to send.
+/// @param[in] len     Length of the payload.
+/// @param[in] offset  The offset into the frame payload where #data starts.
+/// @param[in] no_copy Send the data in no copy mode if enabled.
+///
+/// @returns           0 on success.
+///
+int _ws_send_payload(ws_t ws, char *data, uint64_t len, 
+					uint64_t offset, int no_copy);
+
+///
+/// Writes a frame header and its payload masked with the mask of 
+/// ws_s#send_header to one contiguous region of the send buffer.
+/// This is used for small frames, so that they don't end up as 
+/// separate chains in the send buffer. 
+///
+/// The payload is never modified. In no copy mode the cleanup callback
+/// is called right away.
+///
+/// @param[in] ws          The websocket context.
+/// @param[in] header      The packed frame header.
+/// @param[in] header_len  Length of the header.
+/// @param[in] data        The frame payload.
+/// @param[in] len         Length of the payload.
+/// @param[in] no_copy     If the data was passed in no copy mode.
+///
+/// @returns               0 on success.
+///
+int _ws_send_frame_coalesced(ws_t ws, const uint8_t *header, size_t header_len,
+							char *data, uint64_t len, int no_copy);
+
+///
+/// Frames and masks several messages, each in a single frame, into one
+/// contiguous region of the send buffer. None of the messages are modified.
+/// In no copy mode the cleanup callback is called for each message.
+///
+/// @param[in] ws          The websocket context.
+/// @param[in] msgs        The messages to send.
+/// @param[in] count       The number of messages.
+///
+/// @returns               0 on success.
+///
+int _ws_send_frames_batch(ws_t ws, const ws_msg_desc_t *msgs, size_t count);
+
+///
+/// Sends a raw websocket frame. Control frames can be sent in 
+/// between the frames of a message that is being sent.
+///
+/// @param[in] ws       The websocket context.
+/// @param[in] opcode   The websocket operation code.
+/// @param[in] data     Application data for the websocket frame.
+/// @param[in] datalen  Length of the data.
+///
+/// @returns            0 on success.
+///
+int _ws_send_frame_raw(ws_t ws, ws_opcode_t opcode, 
+                        char *data, uint64_t datalen);
+
+///
+/// Sends a close frame.
+///
+/// @param[in] ws          The websocket context.
+/// @param[in] status_code The status code to send.
+/// @param[in] reason      The reason data.
+/// @param[in] reason_len  The length of the #reason buffer.
+///                        Must not be larger than 123 bytes.
+///
+/// @returns               0 on success.
+///
+int _ws_send_close(ws_t ws, ws_close_status_t status_code, 
+                    const char *reason, size_t reason_len);
+
+///
+/// Parses websocket frames from the input buffer and passes
+/// the payload on to the message and frame callbacks.
+///
+/// @param[in] ws      The websocket context.
+/// @param[in] in      The input buffer to read from. Any
+///                    complete frame data is drained from it.
+///
+void _ws_read_websocket(ws_t ws, struct evbuffer *in);
+
+///
+/// Checks if the default callbacks are used for building an incoming 
+/// message, that is, the user only wants the complete message via
+/// ws_s#msg_cb. This means that the message can be built in a faster way.
+///
+/// @param[in] ws      The websocket context.
+///
+/// @returns           1 if the default callbacks are used.
+///
+int _ws_has_default_msg_callbacks(ws_t ws);
+
+///
+/// Makes sure there is room for another #len bytes of the message
+/// in ws_s#msg_buf. The buffer is grown geometrically.
+///
+/// @param[in] ws      The websocket context.
+/// @param[in] len     The number of bytes that will be added.
+///
+/// @returns           0 on success.
+///
+int _ws_reserve_msg_buf(ws_t ws, uint64_t len);
+
+///
+/// Gets how much to reserve up front for #len announced payload bytes,
+/// at most the max message size if set, otherwise #WS_RECV_RESERVE_MAX.
+///
+/// @param[in] ws      The websocket context.
+/// @param[in] len     The announced payload length.
+///
+/// @returns           The number of bytes to reserve.
+///
+uint64_t _ws_recv_reserve_len(ws_t ws, uint64_t len);
+
+///
+/// Gives up on the message being received because of an internal
+/// error. The rest of the frame and any further data frames are
+/// skipped like for a too big frame, and the connection is closed
+/// with #WS_CLOSE_STATUS_UNEXPECTED_CONDITION_1011.
+///
+/// @param[in] ws      The websocket context.
+///
+void _ws_abort_recv(ws_t ws);
+
+///
+/// Passes a complete message of #len bytes at the start of #buf to 
+/// ws_s#msg_iov_cb, as one segment per chain of the buffer.
+///
+/// @param[in] ws      The websocket context.
+/// @param[in] buf     The buffer holding the unmasked message.
+/// @param[in] len     The length of the message.
+///
+/// @returns           0 on success.
+///
+int _ws_call_msg_iov_cb(ws_t ws, struct evbuffer *buf, size_t len);
+
+///
+/// Closes the socket for the underlying TCP session used for the websocket.
+///
+/// @param[in] ws         The websocket context.
+///
+void _ws_shutdown(ws_t ws);
+
+///
+/// Timeout callback function for when we have sent the close frame to the
+/// server. If this times out, we will initiate an unclean shutdown since
+/// the servern hasn't initiated the TCP close.
+///
+void _ws_close_timeout_cb(evutil_socket_t fd, short what, void *arg);
+
+///
+/// Pushes a request from any thread. Only the thread that pushes onto
+/// an empty queue wakes up the event loop, which then handles all the
+/// requests queued by then in one go, see #_ws_threadsafe_drain.
+///
+/// @param[in] ws      The websocket context.
+/// @param[in] req     The request, allocated with #_ws_malloc.
+///
+/// @returns           0 on success. On failure the request 
+///                    has been discarded.
+///
+int _ws_threadsafe_push(ws_t ws, ws_threadsafe_req_t *req);
+
+///
+/// Starts counting the bytes drained from the send buffer of
+/// the bufferevent, so that send completions can be reported.
+///
+/// @param[in] ws      The websocket context.
+///
+/// @returns           0 on success.
+///
+int _ws_track_send_completions(ws_t ws);
+
+///
+/// Adds a completion for everything written to the send buffer so far.
+///
+/// @param[in] ws      The websocket context.
+/// @param[in] tag     The user tag to pass to the callback.
+///
+/// @returns           0 on success.
+///
+int _ws_add_send_completion(ws_t ws, void *tag);
+
+///
+/// Stops tracking the send buffer, and reports all pending completions 
+/// as not sent. Must be done before the bufferevent is freed.
+///
+/// @param[in] ws      The websocket context.
+///
+void _ws_fail_send_completions(ws_t ws);
+
+///
+/// Reports a completion to the send complete callback. This is deferred
+/// to the next event loop iteration, since it happens in the middle of
+/// writing to or draining the send buffer.
+///
+/// @param[in] ws      The websocket context.
+/// @param[in] tag     The user tag to pass to the callback.
+/// @param[in] sent    If the message was sent.
+///
+/// @returns           0 on success.
+///
+int _ws_send_done(ws_t ws, void *tag, int sent);
+
+///
+/// Calls the send complete callback for the reported completions
+/// right away. Used when the websocket is destroyed.
+///
+/// @param[in] ws      The websocket context.
+///
+void _ws_flush_send_done(ws_t ws);
+
+///
+/// Checks if a new message can be sent.
+///
+/// @param[in] ws      The websocket context.
+///
+/// @returns           0 if it can be sent, #WS_SEND_WOULD_BLOCK if sends
+///                    should fail since the send buffer is above the high
+///                    watermark.
+///
+int _ws_check_send_blocked(ws_t ws);
+
+///
+/// Gets the number of bytes waiting to be sent, both in the send
+/// buffer and in the send queue.
+///
+/// @param[in] ws      The websocket context.
+///
+uint64_t _ws_send_pending_bytes(ws_t ws);
+
+///
+/// Blocks sending if more than the high watermark is waiting to be sent,
+/// and schedules ws_s#send_blocked_cb.
+///
+/// @param[in] ws      The websocket context.
+///
+void _ws_check_send_highmark(ws_t ws);
+
+///
+/// Unblocks sending and calls ws_s#send_ready_cb if the send buffer
+/// has drained down to the low watermark.
+///
+/// @param[in] ws      The websocket context.
+///
+void _ws_check_send_ready(ws_t ws);
+
+///
+/// Starts a new message, see #ws_msg_begin. The send state must be none.
+///
+/// @param[in] ws      The websocket context.
+/// @param[in] binary  If it is a binary message.
+///
+void _ws_msg_start(ws_t ws, int binary);
+
+///
+/// Starts a new frame of #datalen bytes in the current message,
+/// and packs its header into #header_buf.
+///
+/// @param[in] ws          The websocket context.
+/// @param[in] datalen     The payload length of the frame.
+/// @param[out] header_buf Buffer of at least #WS_HDR_MAX_SIZE bytes.
+/// @param[out] header_len The length of the packed header.
+///
+/// @returns               0 on success.
+///
+int _ws_msg_frame_header(ws_t ws, uint64_t datalen, 
+						uint8_t *header_buf, size_t *header_len);
+
+///
+/// Gets the size of the fragments that the library splits messages
+/// into when it does the fragmenting itself. That is the max frame
+/// size, but at most #WS_STREAM_FRAGMENT_SIZE.
+///
+/// @param[in] ws      The websocket context.
+///
+size_t _ws_send_fragment_size(ws_t ws);
+
+///
+/// Asks the producer of the stream being sent for more fragments, as
+/// long as the send buffer is at or below its low watermark.
+///
+/// @param[in] ws      The websocket context.
+///
+/// @returns           0 on success, or if no stream is being sent.
+///
+int _ws_send_stream_pump(ws_t ws);
+
+///
+/// Stops sending a stream, and frees its buffer.
+///
+/// @param[in] ws      The websocket context.
+///
+void _ws_send_stream_end(ws_t ws);
+
+///
+/// Sets up what is needed to wake up the event loop from other threads.
+///
+int _ws_threadsafe_init(ws_t ws);
+
+///
+/// Discards all requests that were never handled.
+///
+void _ws_threadsafe_destroy(ws_t ws);
+
+///
+/// Handles all the requests pushed from other threads in the
+/// order they were pushed.
+///
+/// @param[in] ws      The websocket context.
+/// @param[in] discard Don't send anything, only release the messages
+///                    using the no copy cleanup callback.
+///
+void _ws_threadsafe_drain(ws_t ws, int discard);
+
+///
+/// Randomizes the contents of #buf straight from the kernel random
+/// source. This is used for the handshake key.
+///
+/// @param[in] ws      The websocket context.
+/// @param[in] buf     The buffer to randomize.
+/// @param[in] len     Size of #buf.
+///
+/// @returns           The number of bytes successfully randomized.
+///                    Negative on error.
+///
+int _ws_get_random_bytes(ws_t ws, char *buf, size_t len);
+
+///
+/// Randomizes the contents of #buf. This is used for generating
+/// the 32-bit payload mask. The bytes come from the random generator
+/// of the base without any system calls, see #_ws_random_bytes.
+///
+/// @param[in] ws      The websocket context.
+/// @param[in] buf     The buffer to randomize.
+/// @param[in] len     Size of #buf.
+///
+/// @returns           The number of bytes successfully randomized.
+///                    Negative on error.
+///
+int _ws_get_random_mask(ws_t ws, char *buf, size_t len);
+
+///
+/// Sets timeouts for read and write events of the underlying bufferevent.
+///
+/// @param[in] ws      The websocket context.
+/// 
+void _ws_set_timeouts(ws_t ws);
+
+///
+/// Replacement malloc.
+///
+void *_ws_malloc(size_t size);
+
+///
+/// Replacement realloc.
+///
+void *_ws_realloc(void *ptr, size_t size);
+
+///
+/// Replacement free.
+///
+void _ws_free(void *ptr);
+
+///
+/// Replacement calloc.
+///
+void *_ws_calloc(size_t count, size_t size);
+
+///
+/// Replacement strdup.
+///
+char *_ws_strdup(const char *str);
+
+///
+/// Internal function to replace memory functions.
+///
+void _ws_set_memory_functions(ws_malloc_replacement_f malloc_replace,
+                             ws_free_replacement_f free_replace,
+                             ws_realloc_replacement_f realloc_replace);
+
+
+#endif // __LIBWS_PRIVATE_H__
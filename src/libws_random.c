@@ -0,0 +1,247 @@
+#include "libws_config.h"
+
+#ifdef _WIN32
+  #define _CRT_RAND_S
+#include <stdlib.h>
+#else
+  #include <unistd.h>
+  #include <pthread.h>
+#endif
+
+#include <string.h>
+#include <errno.h>
+#include "libws_random.h"
+
+#define WS_ROTL32(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+
+#define WS_QUARTERROUND(a, b, c, d) \
+	a += b; d ^= a; d = WS_ROTL32(d, 16); \
+	c += d; b ^= c; b = WS_ROTL32(b, 12); \
+	a += b; d ^= a; d = WS_ROTL32(d, 8);  \
+	c += d; b ^= c; b = WS_ROTL32(b, 7);
+
+void _ws_chacha20_block(const uint32_t key[8], uint32_t counter,
+						const uint32_t nonce[3], uint8_t out[64])
+{
+	int i;
+	uint32_t s[16];
+	uint32_t x[16];
+
+	// "expand 32-byte k"
+	s[0] = 0x61707865;
+	s[1] = 0x3320646e;
+	s[2] = 0x79622d32;
+	s[3] = 0x6b206574;
+	memcpy(&s[4], key, 8 * sizeof(uint32_t));
+	s[12] = counter;
+	s[13] = nonce[0];
+	s[14] = nonce[1];
+	s[15] = nonce[2];
+
+	memcpy(x, s, sizeof(x));
+
+	for (i = 0; i < 10; i++)
+	{
+		WS_QUARTERROUND(x[0], x[4], x[8],  x[12]);
+		WS_QUARTERROUND(x[1], x[5], x[9],  x[13]);
+		WS_QUARTERROUND(x[2], x[6], x[10], x[14]);
+		WS_QUARTERROUND(x[3], x[7], x[11], x[15]);
+		WS_QUARTERROUND(x[0], x[5], x[10], x[15]);
+		WS_QUARTERROUND(x[1], x[6], x[11], x[12]);
+		WS_QUARTERROUND(x[2], x[7], x[8],  x[13]);
+		WS_QUARTERROUND(x[3], x[4], x[9],  x[14]);
+	}
+
+	// Serialize little endian regardless of the host.
+	for (i = 0; i < 16; i++)
+	{
+		uint32_t v = x[i] + s[i];
+		out[i * 4 + 0] = (uint8_t)(v);
+		out[i * 4 + 1] = (uint8_t)(v >> 8);
+		out[i * 4 + 2] = (uint8_t)(v >> 16);
+		out[i * 4 + 3] = (uint8_t)(v >> 24);
+	}
+}
+
+#ifndef _WIN32
+static volatile unsigned int _ws_fork_generation;
+static int _ws_atfork_registered;
+
+static void _ws_random_atfork_child()
+{
+	_ws_fork_generation++;
+}
+#endif
+
+///
+/// Reads #len bytes from the kernel random source.
+///
+static int _ws_random_kernel_bytes(ws_random_t *r, uint8_t *buf, size_t len)
+{
+	#ifdef _WIN32
+	size_t i;
+	unsigned int tmp;
+
+	for (i = 0; i < len; i++)
+	{
+		if (rand_s(&tmp))
+		{
+			return -1;
+		}
+
+		buf[i] = (uint8_t)tmp;
+	}
+	#else
+	size_t pos = 0;
+
+	while (pos < len)
+	{
+		ssize_t n = read(r->fd, &buf[pos], len - pos);
+
+		if (n <= 0)
+		{
+			if ((n < 0) && (errno == EINTR))
+				continue;
+
+			return -1;
+		}
+
+		pos += (size_t)n;
+	}
+	#endif
+
+	return 0;
+}
+
+///
+/// Mixes new kernel entropy into the key, and throws away
+/// whatever is left of the generated bytes.
+///
+static int _ws_random_reseed(ws_random_t *r)
+{
+	int i;
+	uint8_t seed[32];
+
+	if (_ws_random_kernel_bytes(r, seed, sizeof(seed)))
+	{
+		return -1;
+	}
+
+	for (i = 0; i < 8; i++)
+	{
+		r->key[i] ^= (uint32_t)seed[i * 4]
+				  | ((uint32_t)seed[i * 4 + 1] << 8)
+				  | ((uint32_t)seed[i * 4 + 2] << 16)
+				  | ((uint32_t)seed[i * 4 + 3] << 24);
+	}
+
+	memset(seed, 0, sizeof(seed));
+	r->pos = sizeof(r->buf);
+	r->generated = 0;
+
+	#ifndef _WIN32
+	r->fork_generation = _ws_fork_generation;
+	#endif
+
+	return 0;
+}
+
+///
+/// Generates a new buffer of bytes. The first 32 bytes
+/// replace the key, and are never handed out.
+///
+static void _ws_random_refill(ws_random_t *r)
+{
+	uint32_t i;
+	const uint32_t nonce[3] = { 0, 0, 0 };
+
+	// Since the key is replaced for every refill
+	// the counter can always start from 0.
+	for (i = 0; i < (sizeof(r->buf) / 64); i++)
+	{
+		_ws_chacha20_block(r->key, i, nonce, &r->buf[i * 64]);
+	}
+
+	for (i = 0; i < 8; i++)
+	{
+		r->key[i] = (uint32_t)r->buf[i * 4]
+				  | ((uint32_t)r->buf[i * 4 + 1] << 8)
+				  | ((uint32_t)r->buf[i * 4 + 2] << 16)
+				  | ((uint32_t)r->buf[i * 4 + 3] << 24);
+	}
+
+	memset(r->buf, 0, sizeof(r->key));
+	r->pos = sizeof(r->key);
+}
+
+int _ws_random_init(ws_random_t *r, int fd)
+{
+	memset(r, 0, sizeof(*r));
+	r->fd = fd;
+
+	#ifndef _WIN32
+	if (!_ws_atfork_registered)
+	{
+		if (pthread_atfork(NULL, NULL, _ws_random_atfork_child))
+		{
+			return -1;
+		}
+
+		_ws_atfork_registered = 1;
+	}
+	#endif
+
+	return _ws_random_reseed(r);
+}
+
+void _ws_random_destroy(ws_random_t *r)
+{
+	memset(r, 0, sizeof(*r));
+}
+
+int _ws_random_bytes(ws_random_t *r, char *buf, size_t len)
+{
+	size_t pos = 0;
+
+	#ifndef _WIN32
+	if (r->fork_generation != _ws_fork_generation)
+	{
+		if (_ws_random_reseed(r))
+		{
+			return -1;
+		}
+	}
+	#endif
+
+	while (pos < len)
+	{
+		size_t chunk;
+
+		if (r->pos == sizeof(r->buf))
+		{
+			if ((r->generated >= WS_RANDOM_RESEED_BYTES)
+			  && _ws_random_reseed(r))
+			{
+				return -1;
+			}
+
+			_ws_random_refill(r);
+		}
+
+		chunk = sizeof(r->buf) - r->pos;
+
+		if (chunk > (len - pos))
+		{
+			chunk = len - pos;
+		}
+
+		// Wipe the bytes once handed out.
+		memcpy(&buf[pos], &r->buf[r->pos], chunk);
+		memset(&r->buf[r->pos], 0, chunk);
+		r->pos += chunk;
+		r->generated += chunk;
+		pos += chunk;
+	}
+
+	return 0;
+}
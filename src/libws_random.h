@@ -0,0 +1,72 @@
+
+#ifndef __LIBWS_RANDOM_H__
+#define __LIBWS_RANDOM_H__
+
+#include <stdlib.h>
+#include <inttypes.h>
+
+/// Size of the buffer of random bytes generated at a time.
+#define WS_RANDOM_BUF_SIZE (16 * 64)
+
+/// Number of bytes handed out before mixing in new kernel entropy.
+#define WS_RANDOM_RESEED_BYTES (1024 * 1024)
+
+///
+/// ChaCha20 based random generator, used for the frame masks.
+/// It is seeded from the kernel and then hands out random bytes
+/// without any system calls.
+///
+/// Each refill of the buffer overwrites the key with the first
+/// output block, so earlier output can't be recovered from the state.
+///
+typedef struct ws_random_s
+{
+	uint32_t key[8];					///< The current ChaCha20 key.
+	uint8_t buf[WS_RANDOM_BUF_SIZE];	///< Generated bytes.
+	size_t pos;							///< Bytes of #buf already used.
+	uint64_t generated;					///< Bytes handed out since reseeding.
+	unsigned int fork_generation;		///< Forks seen at the last reseed.
+	int fd;								///< The kernel random source.
+} ws_random_t;
+
+///
+/// Computes one ChaCha20 block as described in RFC 8439.
+///
+/// @param[in] key      The 256-bit key.
+/// @param[in] counter  The block counter.
+/// @param[in] nonce    The 96-bit nonce.
+/// @param[out] out     The 64 byte key stream block.
+///
+void _ws_chacha20_block(const uint32_t key[8], uint32_t counter,
+						const uint32_t nonce[3], uint8_t out[64]);
+
+///
+/// Seeds the generator from the kernel.
+///
+/// @param[in] r   The generator.
+/// @param[in] fd  An open file descriptor for the kernel random
+///                source. Not used on Windows.
+///
+/// @returns       0 on success.
+///
+int _ws_random_init(ws_random_t *r, int fd);
+
+///
+/// Wipes the state of the generator.
+///
+void _ws_random_destroy(ws_random_t *r);
+
+///
+/// Fills #buf with random bytes. New kernel entropy is mixed in after
+/// #WS_RANDOM_RESEED_BYTES bytes, and in a child process after a fork,
+/// so that it doesn't repeat the output of the parent.
+///
+/// @param[in] r    The generator.
+/// @param[in] buf  The buffer to randomize.
+/// @param[in] len  Size of #buf.
+///
+/// @returns        0 on success.
+///
+int _ws_random_bytes(ws_random_t *r, char *buf, size_t len);
+
+#endif // __LIBWS_RANDOM_H__
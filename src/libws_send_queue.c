@@ -0,0 +1,650 @@
+#include "libws_config.h"
+
+#include <assert.h>
+#include <string.h>
+
+#include <event2/event.h>
+#include <event2/bufferevent.h>
+#include <event2/buffer.h>
+
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <linux/sockios.h>
+#endif
+
+#include "libws_log.h"
+#include "libws_private.h"
+#include "libws_send_queue.h"
+
+ws_sendq_msg_t *_ws_sendq_new_msg(ws_t ws, char *msg, uint64_t len, int binary)
+{
+	ws_sendq_msg_t *m;
+	int no_copy = (ws->no_copy_cleanup_cb != NULL);
+	size_t size = sizeof(ws_sendq_msg_t) + (no_copy ? 0 : (size_t)len);
+
+	assert(ws);
+	assert(msg || (len == 0));
+
+	if (!(m = (ws_sendq_msg_t *)_ws_malloc(size)))
+	{
+		LIBWS_LOG(LIBWS_CRIT, "Out of memory!");
+		return NULL;
+	}
+
+	memset(m, 0, sizeof(ws_sendq_msg_t));
+	m->len = len;
+	m->binary = binary;
+	m->priority = WS_SEND_PRIORITY_NORMAL;
+	m->no_copy = no_copy;
+
+	if (no_copy)
+	{
+		m->data = msg;
+	}
+	else
+	{
+		m->data = (char *)(m + 1);
+
+		if (len > 0)
+		{
+			memcpy(m->data, msg, (size_t)len);
+		}
+	}
+
+	return m;
+}
+
+ws_sendq_msg_t *_ws_sendq_new_msg_iov(ws_t ws, const ws_iovec_t *iov, 
+									int iovcnt, int binary)
+{
+	int i;
+	uint64_t len = 0;
+	ws_sendq_msg_t *m;
+
+	assert(ws);
+	assert(iov || (iovcnt == 0));
+
+	for (i = 0; i < iovcnt; i++)
+	{
+		len += iov[i].iov_len;
+	}
+
+	if (!(m = (ws_sendq_msg_t *)_ws_malloc(sizeof(ws_sendq_msg_t) + (size_t)len)))
+	{
+		LIBWS_LOG(LIBWS_CRIT, "Out of memory!");
+		return NULL;
+	}
+
+	memset(m, 0, sizeof(ws_sendq_msg_t));
+	m->len = len;
+	m->binary = binary;
+	m->priority = WS_SEND_PRIORITY_NORMAL;
+	m->data = (char *)(m + 1);
+
+	for (i = 0, len = 0; i < iovcnt; i++)
+	{
+		if (iov[i].iov_len > 0)
+		{
+			memcpy(&m->data[len], iov[i].iov_base, iov[i].iov_len);
+			len += iov[i].iov_len;
+		}
+	}
+
+	return m;
+}
+
+void _ws_sendq_free_msg(ws_t ws, ws_sendq_msg_t *m, int sent)
+{
+	assert(ws);
+	assert(m);
+
+	if (m->no_copy && m->data && ws->no_copy_cleanup_cb)
+	{
+		ws->no_copy_cleanup_cb(ws, m->data, m->len, ws->no_copy_extra);
+	}
+
+	if (!sent && m->has_tag && ws->send_complete_cb)
+	{
+		_ws_send_done(ws, m->tag, 0);
+	}
+
+	_ws_free(m);
+}
+
+static size_t _ws_sendq_expire(ws_t ws);
+static void _ws_sendq_arm_deadline(ws_t ws);
+
+///
+/// Timeout callback for dropping the messages whose deadline has
+/// passed, even if the send buffer isn't draining.
+///
+static void _ws_sendq_deadline_event(evutil_socket_t fd, short what, void *arg)
+{
+	ws_t ws = (ws_t)arg;
+	assert(ws);
+
+	// The timer may fire a little early.
+	if (!_ws_sendq_expire(ws))
+	{
+		_ws_sendq_arm_deadline(ws);
+	}
+
+	// The drop callback may have queued something.
+	if (_ws_sendq_pump(ws))
+	{
+		LIBWS_LOG(LIBWS_ERR, "Failed to send queued messages");
+	}
+}
+
+///
+/// Makes sure the deadline timer fires at the earliest 
+/// deadline of the waiting messages, if any.
+///
+static void _ws_sendq_arm_deadline(ws_t ws)
+{
+	struct timeval now;
+	struct timeval delay;
+
+	if (!ws->sendq_deadlines)
+	{
+		return;
+	}
+
+	event_base_gettimeofday_cached(ws->ws_base->ev_base, &now);
+	evutil_timerclear(&delay);
+
+	if (evutil_timercmp(&now, &ws->sendq_next_deadline, <))
+	{
+		evutil_timersub(&ws->sendq_next_deadline, &now, &delay);
+	}
+
+	if (_ws_setup_timeout_event(ws, _ws_sendq_deadline_event,
+								&ws->sendq_deadline_event, &delay))
+	{
+		LIBWS_LOG(LIBWS_ERR, "Failed to set up send deadline timeout");
+	}
+}
+
+///
+/// Puts #m in the place of the waiting message with the same key,
+/// and releases that one.
+///
+/// @returns           1 if a message was replaced.
+///
+static int _ws_sendq_replace(ws_t ws, ws_sendq_msg_t *m)
+{
+	int i;
+	ws_sendq_msg_t *old;
+
+	for (i = 0; i < WS_SEND_PRIORITIES; i++)
+	{
+		ws_sendq_t *q = &ws->sendq[i];
+		ws_sendq_msg_t **prev = &q->head;
+
+		while ((old = *prev))
+		{
+			if (!old->has_key || (old->key != m->key))
+			{
+				prev = &old->next;
+				continue;
+			}
+
+			m->next = old->next;
+			m->priority = old->priority;
+			*prev = m;
+
+			if (q->tail == old)
+			{
+				q->tail = m;
+			}
+
+			if (old->has_deadline)
+			{
+				// The earliest deadline might be too early now,
+				// which only costs an extra scan.
+				ws->sendq_deadlines--;
+			}
+
+			ws->sendq_bytes -= old->len;
+			ws->sendq_bytes += m->len;
+			ws->sendq_conflated++;
+
+			_ws_sendq_free_msg(ws, old, 0);
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+int _ws_sendq_push(ws_t ws, ws_sendq_msg_t *m)
+{
+	ws_sendq_t *q;
+	assert(ws);
+	assert(m);
+	assert((m->priority >= 0) && (m->priority < WS_SEND_PRIORITIES));
+
+	if (!m->has_key || !_ws_sendq_replace(ws, m))
+	{
+		q = &ws->sendq[m->priority];
+		m->next = NULL;
+
+		if (q->tail)
+		{
+			q->tail->next = m;
+		}
+		else
+		{
+			q->head = m;
+		}
+
+		q->tail = m;
+		ws->sendq_bytes += m->len;
+		ws->sendq_count++;
+	}
+
+	if (m->has_deadline)
+	{
+		int earliest = !ws->sendq_deadlines
+			|| evutil_timercmp(&m->deadline, &ws->sendq_next_deadline, <);
+
+		ws->sendq_deadlines++;
+
+		if (earliest)
+		{
+			ws->sendq_next_deadline = m->deadline;
+			_ws_sendq_arm_deadline(ws);
+		}
+	}
+
+	if (_ws_sendq_pump(ws))
+	{
+		return -1;
+	}
+
+	_ws_check_send_highmark(ws);
+
+	return 0;
+}
+
+///
+/// Takes the oldest message of the highest priority class.
+///
+static ws_sendq_msg_t *_ws_sendq_pop(ws_t ws)
+{
+	int i;
+	ws_sendq_msg_t *m;
+
+	for (i = 0; i < WS_SEND_PRIORITIES; i++)
+	{
+		ws_sendq_t *q = &ws->sendq[i];
+
+		if ((m = q->head))
+		{
+			if (!(q->head = m->next))
+			{
+				q->tail = NULL;
+			}
+
+			m->next = NULL;
+
+			if (m->has_deadline)
+			{
+				ws->sendq_deadlines--;
+			}
+
+			return m;
+		}
+	}
+
+	return NULL;
+}
+
+///
+/// Drops the waiting messages whose deadline has passed.
+///
+/// @returns           The number of dropped messages.
+///
+static size_t _ws_sendq_expire(ws_t ws)
+{
+	int i;
+	size_t count = 0;
+	int have_next = 0;
+	struct timeval now;
+	struct timeval next;
+	ws_sendq_msg_t *m;
+	ws_sendq_msg_t *expired = NULL;
+	ws_sendq_msg_t **expired_tail = &expired;
+
+	if (!ws->sendq_deadlines)
+	{
+		return 0;
+	}
+
+	event_base_gettimeofday_cached(ws->ws_base->ev_base, &now);
+
+	if (evutil_timercmp(&now, &ws->sendq_next_deadline, <))
+	{
+		return 0;
+	}
+
+	evutil_timerclear(&next);
+
+	// Unlink them all first, the drop callback might send.
+	for (i = 0; i < WS_SEND_PRIORITIES; i++)
+	{
+		ws_sendq_t *q = &ws->sendq[i];
+		ws_sendq_msg_t **prev = &q->head;
+		q->tail = NULL;
+
+		while ((m = *prev))
+		{
+			if (!m->has_deadline)
+			{
+				q->tail = m;
+				prev = &m->next;
+				continue;
+			}
+
+			if (evutil_timercmp(&now, &m->deadline, <))
+			{
+				if (!have_next || evutil_timercmp(&m->deadline, &next, <))
+				{
+					next = m->deadline;
+					have_next = 1;
+				}
+
+				q->tail = m;
+				prev = &m->next;
+				continue;
+			}
+
+			*prev = m->next;
+			m->next = NULL;
+			*expired_tail = m;
+			expired_tail = &m->next;
+
+			ws->sendq_deadlines--;
+			ws->sendq_bytes -= m->len;
+			ws->sendq_count--;
+		}
+	}
+
+	ws->sendq_next_deadline = next;
+	_ws_sendq_arm_deadline(ws);
+
+	while ((m = expired))
+	{
+		expired = m->next;
+		ws->sendq_dropped++;
+		count++;
+
+		LIBWS_LOG(LIBWS_DEBUG, "Dropped queued message of %llu bytes "
+								"at its deadline", m->len);
+
+		if (ws->send_dropped_cb)
+		{
+			ws->send_dropped_cb(ws, m->data, m->len, m->binary,
+								ws->send_dropped_arg);
+		}
+
+		_ws_sendq_free_msg(ws, m, 0);
+	}
+
+	return count;
+}
+
+///
+/// Timeout callback for running the scheduler once the
+/// next message may begin.
+///
+static void _ws_sendq_pace_event(evutil_socket_t fd, short what, void *arg)
+{
+	ws_t ws = (ws_t)arg;
+	assert(ws);
+
+	ws->pace_waiting = 0;
+
+	if (_ws_sendq_pump(ws))
+	{
+		LIBWS_LOG(LIBWS_ERR, "Failed to send queued messages");
+	}
+}
+
+///
+/// Checks if the next message may begin yet, and if not makes
+/// sure the scheduler runs again when it may.
+///
+/// @returns           1 if the next message has to wait.
+///
+static int _ws_sendq_pace_wait(ws_t ws)
+{
+	struct timeval now;
+	struct timeval delay;
+
+	if (!ws->pace_msgs_rate && !ws->pace_bytes_rate)
+	{
+		return 0;
+	}
+
+	event_base_gettimeofday_cached(ws->ws_base->ev_base, &now);
+
+	if (!evutil_timercmp(&now, &ws->pace_next, <))
+	{
+		return 0;
+	}
+
+	if (!ws->pace_waiting)
+	{
+		evutil_timersub(&ws->pace_next, &now, &delay);
+
+		if (_ws_setup_timeout_event(ws, _ws_sendq_pace_event,
+									&ws->pace_event, &delay))
+		{
+			LIBWS_LOG(LIBWS_ERR, "Failed to set up send pacing timeout");
+			return 0;
+		}
+
+		ws->pace_waiting = 1;
+	}
+
+	return 1;
+}
+
+///
+/// Moves the time the next message may begin past #m, evenly
+/// spaced according to the message and byte rates.
+///
+static void _ws_sendq_pace_msg(ws_t ws, ws_sendq_msg_t *m)
+{
+	uint64_t usec = 0;
+	struct timeval now;
+	struct timeval interval;
+
+	if (!ws->pace_msgs_rate && !ws->pace_bytes_rate)
+	{
+		return;
+	}
+
+	if (ws->pace_msgs_rate)
+	{
+		usec = 1000000 / ws->pace_msgs_rate;
+	}
+
+	if (ws->pace_bytes_rate
+	 && ((m->len * 1000000 / ws->pace_bytes_rate) > usec))
+	{
+		usec = m->len * 1000000 / ws->pace_bytes_rate;
+	}
+
+	interval.tv_sec = (long)(usec / 1000000);
+	interval.tv_usec = (long)(usec % 1000000);
+
+	// Time spent idle is not saved up for a burst later.
+	event_base_gettimeofday_cached(ws->ws_base->ev_base, &now);
+
+	if (evutil_timercmp(&ws->pace_next, &now, <))
+	{
+		ws->pace_next = now;
+	}
+
+	evutil_timeradd(&ws->pace_next, &interval, &ws->pace_next);
+}
+
+int _ws_sendq_pump(ws_t ws)
+{
+	struct evbuffer *out;
+	size_t fragment_size;
+	assert(ws);
+
+	if (!ws->bev || (ws->state != WS_STATE_CONNECTED))
+	{
+		return 0;
+	}
+
+	out = bufferevent_get_output(ws->bev);
+
+	// Fill up to a fragment above the low watermark, so that many small
+	// messages go out in one write, while control frames still only wait
+	// behind a bounded amount of data.
+	while (evbuffer_get_length(out) 
+			< (ws->send_lowmark + _ws_send_fragment_size(ws)))
+	{
+		uint8_t header_buf[WS_HDR_MAX_SIZE];
+		size_t header_len = 0;
+		uint64_t chunk;
+		ws_sendq_msg_t *m = ws->sendq_current;
+
+		if (!m)
+		{
+			// A message is being sent some other way.
+			if (ws->send_state != WS_SEND_STATE_NONE)
+				return 0;
+
+			// Start over, the drop callback may have sent something.
+			if (_ws_sendq_expire(ws))
+				continue;
+
+			if (!ws->sendq_count || _ws_sendq_pace_wait(ws))
+				return 0;
+
+			if (!(m = _ws_sendq_pop(ws)))
+				return 0;
+
+			_ws_sendq_pace_msg(ws, m);
+			ws->sendq_current = m;
+			_ws_msg_start(ws, m->binary);
+		}
+
+		chunk = m->len - m->sent;
+		fragment_size = _ws_send_fragment_size(ws);
+
+		if (chunk > fragment_size)
+		{
+			chunk = fragment_size;
+		}
+
+		ws->send_header.fin = ((m->sent + chunk) == m->len);
+
+		if (_ws_msg_frame_header(ws, chunk, header_buf, &header_len)
+		 || _ws_send_frame_coalesced(ws, header_buf, header_len,
+									&m->data[m->sent], chunk, 0))
+		{
+			LIBWS_LOG(LIBWS_ERR, "Failed to send queued message");
+			return -1;
+		}
+
+		m->sent += chunk;
+		ws->sendq_bytes -= chunk;
+
+		if (m->sent == m->len)
+		{
+			ws->send_state = WS_SEND_STATE_NONE;
+			ws->sendq_current = NULL;
+			ws->sendq_count--;
+
+			if (m->has_tag && ws->send_complete_cb)
+			{
+				_ws_add_send_completion(ws, m->tag);
+			}
+
+			_ws_sendq_free_msg(ws, m, 1);
+		}
+	}
+
+	return 0;
+}
+
+size_t _ws_sendq_adaptive_fragment_size(ws_t ws)
+{
+	uint64_t window = WS_STREAM_FRAGMENT_SIZE;
+	uint64_t queued = 0;
+	assert(ws);
+
+	if (!ws->bev)
+	{
+		return WS_ADAPTIVE_FRAGMENT_MIN;
+	}
+
+	#ifdef __linux__
+	{
+		struct tcp_info ti;
+		socklen_t ti_len = sizeof(ti);
+		int unsent = 0;
+		evutil_socket_t fd = bufferevent_getfd(ws->bev);
+
+		if ((fd >= 0)
+		 && !getsockopt(fd, IPPROTO_TCP, TCP_INFO, &ti, &ti_len)
+		 && ti.tcpi_snd_cwnd && ti.tcpi_snd_mss)
+		{
+			window = (uint64_t)ti.tcpi_snd_cwnd * ti.tcpi_snd_mss;
+
+			// Sent but not acknowledged, or not sent yet.
+			if (!ioctl(fd, SIOCOUTQ, &unsent) && (unsent > 0))
+			{
+				queued += (uint64_t)unsent;
+			}
+		}
+	}
+	#endif
+
+	queued += evbuffer_get_length(bufferevent_get_output(ws->bev));
+
+	if (window <= (queued + WS_ADAPTIVE_FRAGMENT_MIN))
+	{
+		return WS_ADAPTIVE_FRAGMENT_MIN;
+	}
+
+	if ((window - queued) > WS_ADAPTIVE_FRAGMENT_MAX)
+	{
+		return WS_ADAPTIVE_FRAGMENT_MAX;
+	}
+
+	return (size_t)(window - queued);
+}
+
+void _ws_sendq_clear(ws_t ws)
+{
+	ws_sendq_msg_t *m;
+	assert(ws);
+
+	if ((m = ws->sendq_current))
+	{
+		// The message won't be finished.
+		ws->sendq_current = NULL;
+		ws->send_state = WS_SEND_STATE_NONE;
+		_ws_sendq_free_msg(ws, m, 0);
+	}
+
+	while ((m = _ws_sendq_pop(ws)))
+	{
+		_ws_sendq_free_msg(ws, m, 0);
+	}
+
+	ws->sendq_bytes = 0;
+	ws->sendq_count = 0;
+	ws->sendq_deadlines = 0;
+}
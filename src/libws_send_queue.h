@@ -0,0 +1,130 @@
+
+#ifndef __LIBWS_SEND_QUEUE_H__
+#define __LIBWS_SEND_QUEUE_H__
+
+#include <stdlib.h>
+#include <inttypes.h>
+#include "libws_types.h"
+
+///
+/// A message held in the send queue of the library, until the
+/// scheduler frames it into the send buffer.
+///
+typedef struct ws_sendq_msg_s
+{
+	struct ws_sendq_msg_s *next;
+	char *data;				///< The payload. Points right after the
+							/// struct if copied.
+	uint64_t len;			///< Payload length.
+	uint64_t sent;			///< Bytes of the payload already framed.
+	int binary;
+	int priority;			///< One of the WS_SEND_PRIORITY_* classes.
+	int no_copy;			///< Released with the no copy cleanup callback.
+	int has_tag;			///< Report completion with #tag.
+	void *tag;
+	int has_deadline;		///< Drop the message if it has not begun
+							/// by #deadline.
+	struct timeval deadline;
+	int has_key;			///< Replaced by a newer message with the
+							/// same #key while still waiting.
+	uint64_t key;
+} ws_sendq_msg_t;
+
+///
+/// The messages of one priority class, oldest first.
+///
+typedef struct ws_sendq_s
+{
+	ws_sendq_msg_t *head;
+	ws_sendq_msg_t *tail;
+} ws_sendq_t;
+
+///
+/// Creates a message for the send queue. In no copy mode the message
+/// refers to #msg, otherwise #msg is copied.
+///
+/// @param[in] ws      The websocket context.
+/// @param[in] msg     The payload.
+/// @param[in] len     The payload length.
+/// @param[in] binary  If it is a binary message.
+///
+/// @returns           The message, or NULL when out of memory.
+///
+ws_sendq_msg_t *_ws_sendq_new_msg(ws_t ws, char *msg, uint64_t len, int binary);
+
+///
+/// Creates a message for the send queue from several buffers,
+/// which are always copied.
+///
+/// @param[in] ws      The websocket context.
+/// @param[in] iov     The buffers making up the payload.
+/// @param[in] iovcnt  The number of buffers.
+/// @param[in] binary  If it is a binary message.
+///
+/// @returns           The message, or NULL when out of memory.
+///
+ws_sendq_msg_t *_ws_sendq_new_msg_iov(ws_t ws, const ws_iovec_t *iov, 
+									int iovcnt, int binary);
+
+///
+/// Frees a message. If #sent is 0 and it has a tag, its
+/// completion is reported as not sent.
+///
+/// @param[in] ws      The websocket context.
+/// @param[in] m       The message.
+/// @param[in] sent    If the message was fully framed.
+///
+void _ws_sendq_free_msg(ws_t ws, ws_sendq_msg_t *m, int sent);
+
+///
+/// Adds a message last in the queue of its priority class and lets
+/// the scheduler run. A message with a key instead takes the place of
+/// a waiting message with the same key, if there is one.
+///
+/// @param[in] ws      The websocket context.
+/// @param[in] m       The message, created with #_ws_sendq_new_msg.
+///
+/// @returns           0 on success. The message belongs to the
+///                    queue afterwards even on failure.
+///
+int _ws_sendq_push(ws_t ws, ws_sendq_msg_t *m);
+
+///
+/// Frames queued messages into the send buffer, one fragment at a time
+/// as long as the send buffer holds less than a fragment above its low
+/// watermark.
+///
+/// A message that has begun is always finished before the next one,
+/// which is then taken from the highest priority class that has any.
+/// Messages that have not begun by their deadline are dropped first.
+/// Control frames are written directly to the send buffer, so at most
+/// about two fragments of data above the low watermark are ever ahead 
+/// of them.
+///
+/// @param[in] ws      The websocket context.
+///
+/// @returns           0 on success.
+///
+int _ws_sendq_pump(ws_t ws);
+
+///
+/// Picks a fragment size from the state of the connection. That is
+/// about what TCP can have in flight, one congestion window, less what
+/// is already waiting in the kernel and in the send buffer. So a control
+/// frame written after the fragment waits about one round trip at most.
+///
+/// @param[in] ws      The websocket context.
+///
+/// @returns           A size between #WS_ADAPTIVE_FRAGMENT_MIN 
+///                    and #WS_ADAPTIVE_FRAGMENT_MAX.
+///
+size_t _ws_sendq_adaptive_fragment_size(ws_t ws);
+
+///
+/// Releases all queued messages without sending them.
+///
+/// @param[in] ws      The websocket context.
+///
+void _ws_sendq_clear(ws_t ws);
+
+#endif // __LIBWS_SEND_QUEUE_H__
@@ -23,6 +23,8 @@ typedef struct ws_base_s
     int random_fd;
     #endif
 
+    struct ws_random_s *random;  ///< Random generator for frame masks.
+
     struct event_base *ev_base;  ///< Libevent event base.
     struct evdns_base *dns_base; ///< Libevent DNS base.
 
@@ -259,6 +261,33 @@ typedef struct ws_header_s
 
 #define WS_MAX_FRAME_SIZE 0x7FFFFFFFFFFFFFFF
 #define WS_DEFAULT_CONNECT_TIMEOUT 60
+#define WS_DEFAULT_COALESCE_THRESHOLD 1024
+
+/// Most memory reserved for a received frame before its payload has
+/// arrived, unless a max message size is set. Beyond this buffers grow
+/// as the data is read, so a peer can't make us allocate just by
+/// announcing a huge payload length.
+#define WS_RECV_RESERVE_MAX (256 * 1024)
+
+/// Largest fragment a #ws_send_stream producer is asked to fill,
+/// and that messages in the send queue are split into.
+#define WS_STREAM_FRAGMENT_SIZE (16 * 1024)
+
+/// Bounds of the fragment size picked by #ws_set_adaptive_fragment_size.
+#define WS_ADAPTIVE_FRAGMENT_MIN (1024)
+#define WS_ADAPTIVE_FRAGMENT_MAX (256 * 1024)
+
+///
+/// Priority classes for messages in the send queue, see #ws_send_msg_prio.
+///
+#define WS_SEND_PRIORITY_HIGH 0
+#define WS_SEND_PRIORITY_NORMAL 1
+#define WS_SEND_PRIORITY_LOW 2
+#define WS_SEND_PRIORITIES 3
+
+/// Returned by the send functions when the send buffer is above its
+/// high watermark, see #ws_set_send_watermarks.
+#define WS_SEND_WOULD_BLOCK -2
 
 typedef enum ws_state_e
 {
@@ -314,6 +343,28 @@ typedef struct ws_timer_s* ws_timer;
 
 typedef void (*ws_msg_callback_f)(ws_t ws, char *msg, uint64_t len, int binary, void *arg);
 
+///
+/// A segment of a message passed to a #ws_msg_iov_callback_f.
+///
+typedef struct ws_iovec_s
+{
+	const void *iov_base;	///< Start of the segment.
+	size_t iov_len;			///< Length of the segment.
+} ws_iovec_t;
+
+typedef void (*ws_msg_iov_callback_f)(ws_t ws, const ws_iovec_t *iov, int iovcnt,
+									uint64_t len, int binary, void *arg);
+
+///
+/// Describes a message passed to #ws_send_msgs.
+///
+typedef struct ws_msg_desc_s
+{
+	char *msg;				///< The message payload.
+	uint64_t len;			///< Length of the payload.
+	int binary;				///< Send as a binary message if set.
+} ws_msg_desc_t;
+
 typedef void (*ws_msg_begin_callback_f)(ws_t ws, void *arg);
 typedef void (*ws_msg_frame_callback_f)(ws_t ws, char *payload, uint64_t len, void *arg);
 typedef void (*ws_msg_end_callback_f)(ws_t ws, void *arg);
@@ -327,6 +378,9 @@ typedef void (*ws_close_callback_f)(ws_t ws, int code, int type,
 typedef void (*ws_connect_callback_f)(ws_t ws, void *arg);
 typedef void (*ws_timeout_callback_f)(ws_t ws, struct timeval timeout, void *arg);
 typedef void (*ws_write_callback_f)(ws_t ws, void *arg);
+typedef void (*ws_send_complete_callback_f)(ws_t ws, void *tag, int sent, void *arg);
+typedef void (*ws_send_dropped_callback_f)(ws_t ws, char *msg, uint64_t len, int binary, void *arg);
+typedef int (*ws_stream_producer_f)(ws_t ws, char *buf, size_t *len, void *arg);
 typedef void (*ws_no_copy_cleanup_f)(ws_t ws, const void *data, uint64_t datalen, void *extra);
 typedef int (*ws_header_callback_f)(ws_t ws, const char *header_name, const char *header_val, void *arg);
 
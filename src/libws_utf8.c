@@ -1,7 +1,15 @@
+#include "libws_config.h"
+#include "libws_cpu.h"
 #include "libws_utf8.h"
+#include "libws_mask.h"
 #include <inttypes.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+
+#if defined(LIBWS_WITH_SIMD) && defined(LIBWS_CPU_X86)
+#include <immintrin.h>
+#endif
 
 // Copyright (c) 2008-2009 Bjoern Hoehrmann <bjoern@hoehrmann.de>
 // See http://bjoern.hoehrmann.de/utf-8/decoder/dfa/ for details.
@@ -36,15 +44,30 @@ uint32_t libws_utf8_decode(uint32_t *state, uint32_t *codep, uint32_t byte)
 	return *state;
 }
 
-ws_utf8_state_t ws_utf8_validate(ws_utf8_state_t *state, 
-				const char *str, size_t len)
+///
+/// Runs the DFA over #len bytes. Whenever the state is ACCEPT
+/// we skip over ASCII 8 bytes at a time.
+///
+static ws_utf8_state_t _ws_utf8_validate_dfa(ws_utf8_state_t *state, 
+				const uint8_t *s, size_t len)
 {
-	size_t i;
+	size_t i = 0;
 	uint32_t type;
-	const uint8_t *s = (uint8_t *)str;
 
-	for (i = 0; i < len; i++)
+	while (i < len)
 	{
+		if ((*state == WS_UTF8_ACCEPT) && ((i + 8) <= len))
+		{
+			uint64_t w;
+			memcpy(&w, &s[i], sizeof(w));
+
+			if (!(w & 0x8080808080808080ULL))
+			{
+				i += 8;
+				continue;
+			}
+		}
+
 		// We don't care about the codepoint, so this is
 		// a simplified version of the decode function.
 		type = utf8d[s[i]];
@@ -54,7 +77,442 @@ ws_utf8_state_t ws_utf8_validate(ws_utf8_state_t *state,
 		{
 			break;
 		}
+
+		i++;
+	}
+
+	return *state;
+}
+
+///
+/// Unmasks #len bytes from #s into #d while running the DFA over them.
+/// Works like #_ws_utf8_validate_dfa but unmasks 8 bytes at a time.
+/// Everything is unmasked, even if the string turns out to be invalid.
+///
+/// @param[in] mask  The mask, rotated so that it starts at #s[0].
+///
+static ws_utf8_state_t _ws_utf8_unmask_validate_dfa(ws_utf8_state_t *state, 
+				uint8_t *d, const uint8_t *s, size_t len, uint32_t mask)
+{
+	size_t i = 0;
+	size_t j;
+	uint64_t masks[4];
+	uint8_t *m = (uint8_t *)&mask;
+
+	// The mask for a word, for each mask phase the word can start at.
+	for (j = 0; j < 4; j++)
+	{
+		uint32_t rotated = _ws_mask_rotate(mask, j);
+		uint8_t m8[8];
+		memcpy(m8, &rotated, 4);
+		memcpy(&m8[4], &rotated, 4);
+		memcpy(&masks[j], m8, sizeof(uint64_t));
+	}
+
+	for (; (i + 8) <= len; i += 8)
+	{
+		uint64_t w;
+		memcpy(&w, &s[i], sizeof(w));
+		w ^= masks[i % 4];
+		memcpy(&d[i], &w, sizeof(w));
+
+		if ((*state == WS_UTF8_ACCEPT) && !(w & 0x8080808080808080ULL))
+		{
+			continue;
+		}
+
+		for (j = i; j < (i + 8); j++)
+		{
+			*state = utf8d[256 + (*state) * 16 + utf8d[d[j]]];
+
+			if (*state == WS_UTF8_REJECT)
+			{
+				i += 8;
+				_ws_mask(mask, i, (char *)&d[i], (const char *)&s[i], len - i);
+				return *state;
+			}
+		}
+	}
+
+	for (; i < len; i++)
+	{
+		d[i] = s[i] ^ m[i % 4];
+
+		if (*state != WS_UTF8_REJECT)
+		{
+			*state = utf8d[256 + (*state) * 16 + utf8d[d[i]]];
+		}
 	}
 
 	return *state;
 }
+
+///
+/// Validates whole blocks of #s starting on a character boundary.
+/// Any bytes after the last whole block are left untouched.
+///
+/// @param[in]  d     If not NULL, #s is unmasked into this buffer
+///                   and the unmasked data is validated.
+/// @param[in]  s     The string to validate.
+/// @param[in]  len   Length of #s.
+/// @param[in]  mask  The mask to use if #d is set, rotated so that 
+///                   it starts at #s[0].
+/// @param[out] done  The offset where the last character that might 
+///                   continue beyond the validated blocks begins.
+///                   The DFA is used from here on.
+///
+/// @returns          0 if valid so far, -1 if invalid.
+///
+typedef int (*ws_utf8_kernel_f)(uint8_t *d, const uint8_t *s, size_t len, 
+								uint32_t mask, size_t *done);
+
+#ifdef LIBWS_WITH_SIMD
+#if defined(LIBWS_CPU_X86)
+
+///
+/// Gets where the last character in a block begins, if it
+/// is not complete within the block. Otherwise #end.
+///
+static size_t _ws_utf8_last_incomplete(const uint8_t *s, size_t end)
+{
+	if (s[end - 1] >= 0xc0) return end - 1;
+	if (s[end - 2] >= 0xe0) return end - 2;
+	if (s[end - 3] >= 0xf0) return end - 3;
+	return end;
+}
+
+// The SIMD validators are based on the lookup algorithm by
+// John Keiser and Daniel Lemire, "Validating UTF-8 In Less Than
+// One Instruction Per Byte" (2020). Every pair of consecutive
+// bytes is classified with three table lookups, one per nibble,
+// the AND of which is the set of errors for the pair. On top of 
+// that, 3 and 4 byte sequences must have continuations in the
+// right places.
+
+#define WS_UTF8_TOO_SHORT	(1 << 0)
+#define WS_UTF8_TOO_LONG	(1 << 1)
+#define WS_UTF8_OVERLONG_3	(1 << 2)
+#define WS_UTF8_TOO_LARGE	(1 << 3)
+#define WS_UTF8_SURROGATE	(1 << 4)
+#define WS_UTF8_OVERLONG_2	(1 << 5)
+#define WS_UTF8_TOO_LARGE_1000 (1 << 6)
+#define WS_UTF8_OVERLONG_4	(1 << 6)
+#define WS_UTF8_TWO_CONTS	(1 << 7)
+#define WS_UTF8_CARRY (WS_UTF8_TOO_SHORT | WS_UTF8_TOO_LONG | WS_UTF8_TWO_CONTS)
+
+// Indexed by the high nibble of the first byte.
+#define WS_UTF8_BYTE_1_HIGH \
+	WS_UTF8_TOO_LONG, WS_UTF8_TOO_LONG, WS_UTF8_TOO_LONG, WS_UTF8_TOO_LONG, \
+	WS_UTF8_TOO_LONG, WS_UTF8_TOO_LONG, WS_UTF8_TOO_LONG, WS_UTF8_TOO_LONG, \
+	WS_UTF8_TWO_CONTS, WS_UTF8_TWO_CONTS, WS_UTF8_TWO_CONTS, WS_UTF8_TWO_CONTS, \
+	WS_UTF8_TOO_SHORT | WS_UTF8_OVERLONG_2, \
+	WS_UTF8_TOO_SHORT, \
+	WS_UTF8_TOO_SHORT | WS_UTF8_OVERLONG_3 | WS_UTF8_SURROGATE, \
+	WS_UTF8_TOO_SHORT | WS_UTF8_TOO_LARGE | WS_UTF8_TOO_LARGE_1000 | WS_UTF8_OVERLONG_4
+
+// Indexed by the low nibble of the first byte.
+#define WS_UTF8_BYTE_1_LOW \
+	WS_UTF8_CARRY | WS_UTF8_OVERLONG_3 | WS_UTF8_OVERLONG_2 | WS_UTF8_OVERLONG_4, \
+	WS_UTF8_CARRY | WS_UTF8_OVERLONG_2, \
+	WS_UTF8_CARRY, \
+	WS_UTF8_CARRY, \
+	WS_UTF8_CARRY | WS_UTF8_TOO_LARGE, \
+	WS_UTF8_CARRY | WS_UTF8_TOO_LARGE | WS_UTF8_TOO_LARGE_1000, \
+	WS_UTF8_CARRY | WS_UTF8_TOO_LARGE | WS_UTF8_TOO_LARGE_1000, \
+	WS_UTF8_CARRY | WS_UTF8_TOO_LARGE | WS_UTF8_TOO_LARGE_1000, \
+	WS_UTF8_CARRY | WS_UTF8_TOO_LARGE | WS_UTF8_TOO_LARGE_1000, \
+	WS_UTF8_CARRY | WS_UTF8_TOO_LARGE | WS_UTF8_TOO_LARGE_1000, \
+	WS_UTF8_CARRY | WS_UTF8_TOO_LARGE | WS_UTF8_TOO_LARGE_1000, \
+	WS_UTF8_CARRY | WS_UTF8_TOO_LARGE | WS_UTF8_TOO_LARGE_1000, \
+	WS_UTF8_CARRY | WS_UTF8_TOO_LARGE | WS_UTF8_TOO_LARGE_1000, \
+	WS_UTF8_CARRY | WS_UTF8_TOO_LARGE | WS_UTF8_TOO_LARGE_1000 | WS_UTF8_SURROGATE, \
+	WS_UTF8_CARRY | WS_UTF8_TOO_LARGE | WS_UTF8_TOO_LARGE_1000, \
+	WS_UTF8_CARRY | WS_UTF8_TOO_LARGE | WS_UTF8_TOO_LARGE_1000
+
+// Indexed by the high nibble of the second byte.
+#define WS_UTF8_BYTE_2_HIGH \
+	WS_UTF8_TOO_SHORT, WS_UTF8_TOO_SHORT, WS_UTF8_TOO_SHORT, WS_UTF8_TOO_SHORT, \
+	WS_UTF8_TOO_SHORT, WS_UTF8_TOO_SHORT, WS_UTF8_TOO_SHORT, WS_UTF8_TOO_SHORT, \
+	WS_UTF8_TOO_LONG | WS_UTF8_OVERLONG_2 | WS_UTF8_TWO_CONTS \
+		| WS_UTF8_OVERLONG_3 | WS_UTF8_TOO_LARGE_1000 | WS_UTF8_OVERLONG_4, \
+	WS_UTF8_TOO_LONG | WS_UTF8_OVERLONG_2 | WS_UTF8_TWO_CONTS \
+		| WS_UTF8_OVERLONG_3 | WS_UTF8_TOO_LARGE, \
+	WS_UTF8_TOO_LONG | WS_UTF8_OVERLONG_2 | WS_UTF8_TWO_CONTS \
+		| WS_UTF8_SURROGATE | WS_UTF8_TOO_LARGE, \
+	WS_UTF8_TOO_LONG | WS_UTF8_OVERLONG_2 | WS_UTF8_TWO_CONTS \
+		| WS_UTF8_SURROGATE | WS_UTF8_TOO_LARGE, \
+	WS_UTF8_TOO_SHORT, WS_UTF8_TOO_SHORT, WS_UTF8_TOO_SHORT, WS_UTF8_TOO_SHORT
+
+// Anything above these at the end of a block is the start
+// of a character that continues in the next block.
+#define WS_UTF8_INCOMPLETE_MAX \
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, \
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xf0 - 1, 0xe0 - 1, 0xc0 - 1
+
+LIBWS_TARGET("sse4.1")
+static int _ws_utf8_validate_sse41(uint8_t *d, const uint8_t *s, size_t len, 
+								uint32_t mask, size_t *done)
+{
+	size_t i;
+	const __m128i m = _mm_set1_epi32((int)mask);
+	const __m128i nibble = _mm_set1_epi8(0x0f);
+	const __m128i byte_1_high = _mm_setr_epi8(WS_UTF8_BYTE_1_HIGH);
+	const __m128i byte_1_low = _mm_setr_epi8(WS_UTF8_BYTE_1_LOW);
+	const __m128i byte_2_high = _mm_setr_epi8(WS_UTF8_BYTE_2_HIGH);
+	const __m128i incomplete_max = _mm_setr_epi8(WS_UTF8_INCOMPLETE_MAX);
+	__m128i prev = _mm_setzero_si128();
+	__m128i prev_incomplete = _mm_setzero_si128();
+	__m128i error = _mm_setzero_si128();
+
+	for (i = 0; (i + 16) <= len; i += 16)
+	{
+		__m128i in = _mm_loadu_si128((const __m128i *)&s[i]);
+
+		if (d)
+		{
+			in = _mm_xor_si128(in, m);
+			_mm_storeu_si128((__m128i *)&d[i], in);
+		}
+
+		// ASCII fast path. We only need to make sure 
+		// the previous block didn't end mid character.
+		if (!_mm_movemask_epi8(in))
+		{
+			error = _mm_or_si128(error, prev_incomplete);
+		}
+		else
+		{
+			__m128i prev1 = _mm_alignr_epi8(in, prev, 16 - 1);
+			__m128i prev2 = _mm_alignr_epi8(in, prev, 16 - 2);
+			__m128i prev3 = _mm_alignr_epi8(in, prev, 16 - 3);
+			__m128i sc;
+			__m128i must23;
+
+			sc = _mm_and_si128(
+				_mm_and_si128(
+					_mm_shuffle_epi8(byte_1_high, 
+						_mm_and_si128(_mm_srli_epi16(prev1, 4), nibble)),
+					_mm_shuffle_epi8(byte_1_low, 
+						_mm_and_si128(prev1, nibble))),
+				_mm_shuffle_epi8(byte_2_high, 
+					_mm_and_si128(_mm_srli_epi16(in, 4), nibble)));
+
+			// The high bit is set if 2 or 3 bytes back is a 3 or 4 byte lead.
+			must23 = _mm_or_si128(
+				_mm_subs_epu8(prev2, _mm_set1_epi8((char)(0xe0 - 0x80))),
+				_mm_subs_epu8(prev3, _mm_set1_epi8((char)(0xf0 - 0x80))));
+			must23 = _mm_and_si128(must23, _mm_set1_epi8((char)0x80));
+
+			error = _mm_or_si128(error, _mm_xor_si128(must23, sc));
+			prev_incomplete = _mm_subs_epu8(in, incomplete_max);
+		}
+
+		prev = in;
+	}
+
+	if (!_mm_testz_si128(error, error))
+	{
+		return -1;
+	}
+
+	*done = (i > 0) ? _ws_utf8_last_incomplete(d ? d : s, i) : 0;
+	return 0;
+}
+
+LIBWS_TARGET("avx2")
+static int _ws_utf8_validate_avx2(uint8_t *d, const uint8_t *s, size_t len, 
+								uint32_t mask, size_t *done)
+{
+	size_t i;
+	const __m256i m = _mm256_set1_epi32((int)mask);
+	const __m256i nibble = _mm256_set1_epi8(0x0f);
+	const __m256i byte_1_high = _mm256_setr_epi8(WS_UTF8_BYTE_1_HIGH, WS_UTF8_BYTE_1_HIGH);
+	const __m256i byte_1_low = _mm256_setr_epi8(WS_UTF8_BYTE_1_LOW, WS_UTF8_BYTE_1_LOW);
+	const __m256i byte_2_high = _mm256_setr_epi8(WS_UTF8_BYTE_2_HIGH, WS_UTF8_BYTE_2_HIGH);
+	const __m256i incomplete_max = _mm256_setr_epi8(
+		0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 
+		0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 
+		WS_UTF8_INCOMPLETE_MAX);
+	__m256i prev = _mm256_setzero_si256();
+	__m256i prev_incomplete = _mm256_setzero_si256();
+	__m256i error = _mm256_setzero_si256();
+
+	for (i = 0; (i + 32) <= len; i += 32)
+	{
+		__m256i in = _mm256_loadu_si256((const __m256i *)&s[i]);
+
+		if (d)
+		{
+			in = _mm256_xor_si256(in, m);
+			_mm256_storeu_si256((__m256i *)&d[i], in);
+		}
+
+		if (!_mm256_movemask_epi8(in))
+		{
+			error = _mm256_or_si256(error, prev_incomplete);
+		}
+		else
+		{
+			// alignr works per 128-bit lane, so first line up the
+			// high lane of the previous block with the low lane.
+			__m256i shifted = _mm256_permute2x128_si256(prev, in, 0x21);
+			__m256i prev1 = _mm256_alignr_epi8(in, shifted, 16 - 1);
+			__m256i prev2 = _mm256_alignr_epi8(in, shifted, 16 - 2);
+			__m256i prev3 = _mm256_alignr_epi8(in, shifted, 16 - 3);
+			__m256i sc;
+			__m256i must23;
+
+			sc = _mm256_and_si256(
+				_mm256_and_si256(
+					_mm256_shuffle_epi8(byte_1_high, 
+						_mm256_and_si256(_mm256_srli_epi16(prev1, 4), nibble)),
+					_mm256_shuffle_epi8(byte_1_low, 
+						_mm256_and_si256(prev1, nibble))),
+				_mm256_shuffle_epi8(byte_2_high, 
+					_mm256_and_si256(_mm256_srli_epi16(in, 4), nibble)));
+
+			must23 = _mm256_or_si256(
+				_mm256_subs_epu8(prev2, _mm256_set1_epi8((char)(0xe0 - 0x80))),
+				_mm256_subs_epu8(prev3, _mm256_set1_epi8((char)(0xf0 - 0x80))));
+			must23 = _mm256_and_si256(must23, _mm256_set1_epi8((char)0x80));
+
+			error = _mm256_or_si256(error, _mm256_xor_si256(must23, sc));
+			prev_incomplete = _mm256_subs_epu8(in, incomplete_max);
+		}
+
+		prev = in;
+	}
+
+	if (!_mm256_testz_si256(error, error))
+	{
+		return -1;
+	}
+
+	*done = (i > 0) ? _ws_utf8_last_incomplete(d ? d : s, i) : 0;
+	return 0;
+}
+
+#endif // LIBWS_CPU_X86
+#endif // LIBWS_WITH_SIMD
+
+static ws_utf8_kernel_f utf8_kernel = NULL;
+static size_t utf8_kernel_block = 0;
+
+void _ws_utf8_init(int features)
+{
+	utf8_kernel = NULL;
+	utf8_kernel_block = 0;
+
+	#if defined(LIBWS_WITH_SIMD) && defined(LIBWS_CPU_X86)
+	if (features & WS_CPU_AVX2)
+	{
+		utf8_kernel = _ws_utf8_validate_avx2;
+		utf8_kernel_block = 32;
+	}
+	else if (features & WS_CPU_SSE41)
+	{
+		utf8_kernel = _ws_utf8_validate_sse41;
+		utf8_kernel_block = 16;
+	}
+	#endif
+}
+
+const char *_ws_utf8_impl_name()
+{
+	switch (utf8_kernel_block)
+	{
+		case 32: return "avx2";
+		case 16: return "sse4.1";
+		default: return "dfa";
+	}
+}
+
+ws_utf8_state_t ws_utf8_validate(ws_utf8_state_t *state, 
+				const char *str, size_t len)
+{
+	size_t i = 0;
+	size_t done;
+	const uint8_t *s = (uint8_t *)str;
+
+	if (!utf8_kernel || (len < utf8_kernel_block))
+	{
+		return _ws_utf8_validate_dfa(state, s, len);
+	}
+
+	// Finish any character left over from the last call.
+	// The SIMD validator must start on a character boundary.
+	while ((i < len) && (*state != WS_UTF8_ACCEPT))
+	{
+		*state = utf8d[256 + (*state) * 16 + utf8d[s[i]]];
+
+		if (*state == WS_UTF8_REJECT)
+		{
+			return *state;
+		}
+
+		i++;
+	}
+
+	if (utf8_kernel(NULL, &s[i], len - i, 0, &done))
+	{
+		*state = WS_UTF8_REJECT;
+		return *state;
+	}
+
+	// The DFA takes care of the end that doesn't fill
+	// a whole block, and the state passed on to the next call.
+	i += done;
+
+	return _ws_utf8_validate_dfa(state, &s[i], len - i);
+}
+
+ws_utf8_state_t _ws_utf8_unmask_validate(ws_utf8_state_t *state, 
+				uint32_t mask, uint64_t offset, 
+				char *dst, const char *src, size_t len)
+{
+	size_t i = 0;
+	size_t done;
+	size_t blocks;
+	int ret;
+	uint8_t *m;
+	uint8_t *d = (uint8_t *)dst;
+	const uint8_t *s = (const uint8_t *)src;
+
+	// From here on the mask starts at s[0].
+	mask = _ws_mask_rotate(mask, offset);
+	m = (uint8_t *)&mask;
+
+	if (!utf8_kernel || (len < utf8_kernel_block))
+	{
+		return _ws_utf8_unmask_validate_dfa(state, d, s, len, mask);
+	}
+
+	while ((i < len) && (*state != WS_UTF8_ACCEPT))
+	{
+		d[i] = s[i] ^ m[i % 4];
+		*state = utf8d[256 + (*state) * 16 + utf8d[d[i]]];
+		i++;
+
+		if (*state == WS_UTF8_REJECT)
+		{
+			_ws_mask(mask, i, (char *)&d[i], (const char *)&s[i], len - i);
+			return *state;
+		}
+	}
+
+	ret = utf8_kernel(&d[i], &s[i], len - i, _ws_mask_rotate(mask, i), &done);
+
+	// Unmask what didn't fill a whole block.
+	blocks = i + (((len - i) / utf8_kernel_block) * utf8_kernel_block);
+	_ws_mask(mask, blocks, (char *)&d[blocks], (const char *)&s[blocks], len - blocks);
+
+	if (ret)
+	{
+		*state = WS_UTF8_REJECT;
+		return *state;
+	}
+
+	i += done;
+
+	return _ws_utf8_validate_dfa(state, &d[i], len - i);
+}
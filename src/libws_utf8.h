@@ -14,5 +14,38 @@ ws_utf8_state_t ws_utf8_decode(ws_utf8_state_t *state, uint32_t *codep, uint32_t
 
 ws_utf8_state_t ws_utf8_validate(ws_utf8_state_t *state, const char *str, size_t len);
 
+///
+/// Unmasks #len bytes from #src into #dst and validates them as UTF8
+/// in a single pass over the data. Just like #ws_utf8_validate this 
+/// can be called incrementally. The data is always fully unmasked,
+/// even if it is found to be invalid.
+///
+/// @param[in] state   The state from the previous call, or WS_UTF8_ACCEPT.
+/// @param[in] mask    The mask as found in the frame header.
+/// @param[in] offset  The offset into the payload where #src starts.
+/// @param[in] dst     Destination for the unmasked data. 
+///                    Can be the same as #src.
+/// @param[in] src     The masked data.
+/// @param[in] len     Length of #src.
+///
+/// @returns           The new state.
+///
+ws_utf8_state_t _ws_utf8_unmask_validate(ws_utf8_state_t *state, 
+				uint32_t mask, uint64_t offset, 
+				char *dst, const char *src, size_t len);
+
+///
+/// Picks the fastest UTF8 validator for the CPU. This is done
+/// from #ws_global_init, until then only the DFA is used.
+///
+/// @param[in] features The WS_CPU_* flags supported by the CPU.
+///
+void _ws_utf8_init(int features);
+
+///
+/// Gets the name of the UTF8 validator in use.
+///
+const char *_ws_utf8_impl_name();
+
 
 #endif // __LIBWS_UTF8__
@@ -0,0 +1,112 @@
+#include "libws_test_helpers.h"
+#include "libws.h"
+#include "libws_cpu.h"
+#include "libws_mask.h"
+#include <string.h>
+
+static void reference_mask(uint32_t mask, uint64_t offset, 
+						unsigned char *buf, size_t len)
+{
+	size_t i;
+	uint8_t *m = (uint8_t *)&mask;
+
+	for (i = 0; i < len; i++)
+	{
+		buf[i] ^= m[(offset + i) % 4];
+	}
+}
+
+static int test_impl(int features)
+{
+	size_t len;
+	size_t start;
+	uint64_t offset;
+	unsigned char orig[300];
+	unsigned char expected[300];
+	unsigned char buf[300];
+	unsigned char copy[300];
+	const uint32_t mask = 0x8badf00d;
+
+	_ws_mask_init(features);
+
+	for (len = 0; len < sizeof(orig); len++)
+	{
+		orig[len] = (unsigned char)(len * 7 + 3);
+	}
+
+	for (start = 0; start < 8; start++)
+	{
+		for (len = 0; len <= (sizeof(orig) - start); len += 1 + (len / 16))
+		{
+			for (offset = 0; offset < 5; offset++)
+			{
+				memcpy(expected, orig, sizeof(orig));
+				memcpy(buf, orig, sizeof(orig));
+				memset(copy, 0, sizeof(copy));
+
+				reference_mask(mask, offset, &expected[start], len);
+				_ws_mask(mask, offset, (char *)&copy[start], 
+						(const char *)&buf[start], len);
+				ws_mask_payload_ex(mask, offset, (char *)&buf[start], len);
+
+				if (memcmp(buf, expected, sizeof(buf))
+				 || memcmp(&copy[start], &expected[start], len))
+				{
+					libws_test_FAILURE("%s: Wrong result at start %lu, "
+										"length %lu and offset %llu",
+										_ws_mask_impl_name(), start, len, offset);
+					return -1;
+				}
+			}
+		}
+	}
+
+	// Unmasking in two parts must give back the original.
+	memcpy(buf, orig, sizeof(orig));
+	ws_mask_payload(mask, (char *)buf, sizeof(buf));
+	ws_unmask_payload_ex(mask, 0, (char *)buf, 123);
+	ws_unmask_payload_ex(mask, 123, (char *)&buf[123], sizeof(buf) - 123);
+
+	if (memcmp(buf, orig, sizeof(buf)))
+	{
+		libws_test_FAILURE("%s: Failed to unmask in two parts", 
+							_ws_mask_impl_name());
+		return -1;
+	}
+
+	libws_test_SUCCESS("%s: Masked correctly", _ws_mask_impl_name());
+	return 0;
+}
+
+int TEST_ws_mask_payload(int argc, char *argv[])
+{
+	int ret = 0;
+	int features;
+
+	libws_test_HEADLINE("TEST_ws_mask_payload");
+
+	if (libws_test_init(argc, argv)) return -1;
+
+	features = _ws_cpu_features();
+
+	ret |= test_impl(0);
+
+	if (features & WS_CPU_SSE2)
+	{
+		ret |= test_impl(WS_CPU_SSE2);
+	}
+
+	if (features & WS_CPU_AVX2)
+	{
+		ret |= test_impl(WS_CPU_SSE2 | WS_CPU_AVX2);
+	}
+
+	if (features & WS_CPU_NEON)
+	{
+		ret |= test_impl(WS_CPU_NEON);
+	}
+
+	_ws_mask_init(features);
+
+	return ret;
+}
@@ -0,0 +1,811 @@
+#include "libws_test_helpers.h"
+#include "libws.h"
+#include "libws_private.h"
+#include "libws_log.h"
+#include <string.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/event.h>
+
+static int cleanup_count;
+static int completed_count;
+static int failed_count;
+static void *last_tag;
+static int blocked_count;
+static int ready_count;
+static const unsigned char *stream_data;
+static size_t stream_len;
+static size_t stream_pos;
+static int stream_stalled;
+
+static void oncleanup(ws_t ws, const void *data, uint64_t datalen, void *extra)
+{
+	cleanup_count++;
+}
+
+static void oncomplete(ws_t ws, void *tag, int sent, void *arg)
+{
+	if (sent)
+	{
+		completed_count++;
+	}
+	else
+	{
+		failed_count++;
+	}
+
+	last_tag = tag;
+}
+
+static void onblocked(ws_t ws, void *arg)
+{
+	blocked_count++;
+}
+
+static void onready(ws_t ws, void *arg)
+{
+	ready_count++;
+}
+
+static int onproduce(ws_t ws, char *buf, size_t *len, void *arg)
+{
+	size_t remaining = stream_len - stream_pos;
+
+	// Pretend to run dry once half way.
+	if (!stream_stalled && (stream_pos >= (stream_len / 2)))
+	{
+		stream_stalled = 1;
+		*len = 0;
+		return 0;
+	}
+
+	if (*len > remaining)
+	{
+		*len = remaining;
+	}
+
+	memcpy(buf, &stream_data[stream_pos], *len);
+	stream_pos += *len;
+
+	return (stream_pos == stream_len);
+}
+
+static int onproduce_fail(ws_t ws, char *buf, size_t *len, void *arg)
+{
+	return -1;
+}
+
+///
+/// Reads the frames in the send buffer, and checks that the
+/// unmasked payloads add up to #expected.
+///
+static int check_sent(ws_t ws, const unsigned char *expected, size_t len)
+{
+	struct evbuffer *out = bufferevent_get_output(ws->bev);
+	unsigned char *buf = evbuffer_pullup(out, -1);
+	size_t buf_len = evbuffer_get_length(out);
+	size_t pos = 0;
+	size_t payload_len = 0;
+	unsigned char payload[512];
+
+	while (pos < buf_len)
+	{
+		ws_header_t h;
+		size_t header_len;
+		size_t i;
+
+		if (ws_unpack_header(&h, &header_len, &buf[pos], buf_len - pos)
+			!= WS_PARSE_STATE_SUCCESS)
+		{
+			libws_test_FAILURE("Failed to parse sent frame header");
+			return -1;
+		}
+
+		pos += header_len;
+
+		if (!h.mask_bit || ((pos + h.payload_len) > buf_len)
+		 || ((payload_len + h.payload_len) > sizeof(payload)))
+		{
+			libws_test_FAILURE("Unexpected frame header");
+			return -1;
+		}
+
+		for (i = 0; i < h.payload_len; i++)
+		{
+			payload[payload_len++] = buf[pos++] ^ ((uint8_t *)&h.mask)[i % 4];
+		}
+	}
+
+	evbuffer_drain(out, buf_len);
+
+	if ((payload_len != len) || memcmp(payload, expected, len))
+	{
+		libws_test_FAILURE("Sent %lu bytes of payload, expected %lu",
+							payload_len, len);
+		return -1;
+	}
+
+	libws_test_SUCCESS("Sent the expected %lu bytes", len);
+	return 0;
+}
+
+static int check_unmodified(const unsigned char *data,
+							const unsigned char *orig, size_t len)
+{
+	if (memcmp(data, orig, len))
+	{
+		libws_test_FAILURE("The data passed to send was modified");
+		return -1;
+	}
+
+	libws_test_SUCCESS("The data passed to send was not modified");
+	return 0;
+}
+
+int TEST_ws_msg_frame_data_send(int argc, char *argv[])
+{
+	int ret = 0;
+	size_t i;
+	size_t pos;
+	size_t chunk;
+	ws_base_t base = NULL;
+	ws_t ws = NULL;
+	unsigned char orig[300];
+	unsigned char data[300];
+
+	libws_test_HEADLINE("TEST_ws_msg_frame_data_send");
+
+	if (libws_test_init(argc, argv)) return -1;
+
+	if (ws_global_init(&base))
+	{
+		libws_test_FAILURE("Failed to init global state");
+		return -1;
+	}
+
+	if (ws_init(&ws, base))
+	{
+		libws_test_FAILURE("Failed to init websocket state");
+		ret = -1;
+		goto fail;
+	}
+
+	if (!(ws->bev = bufferevent_socket_new(base->ev_base, -1, 0)))
+	{
+		libws_test_FAILURE("Failed to create bufferevent");
+		ret = -1;
+		goto fail;
+	}
+
+	ws->state = WS_STATE_CONNECTED;
+
+	if (_ws_track_send_completions(ws))
+	{
+		libws_test_FAILURE("Failed to track send completions");
+		ret = -1;
+		goto fail;
+	}
+
+	// Only the socket may remove data from the send buffer otherwise.
+	evbuffer_unfreeze(bufferevent_get_output(ws->bev), 1);
+
+	for (i = 0; i < sizeof(orig); i++)
+	{
+		orig[i] = (unsigned char)(i * 7 + 3);
+	}
+
+	memcpy(data, orig, sizeof(data));
+
+	libws_test_STATUS("Frame data sent in chunks not aligned to the mask");
+	if (ws_msg_begin(ws, 1) || ws_msg_frame_data_begin(ws, sizeof(data)))
+	{
+		libws_test_FAILURE("Failed to begin frame");
+		ret = -1;
+		goto fail;
+	}
+
+	for (pos = 0, chunk = 1; pos < sizeof(data); pos += chunk, chunk += 2)
+	{
+		if (chunk > (sizeof(data) - pos))
+		{
+			chunk = sizeof(data) - pos;
+		}
+
+		if (ws_msg_frame_data_send(ws, (char *)&data[pos], chunk))
+		{
+			libws_test_FAILURE("Failed to send frame data");
+			ret = -1;
+			goto fail;
+		}
+	}
+
+	if (ws_msg_end(ws))
+	{
+		libws_test_FAILURE("Failed to end message");
+		ret = -1;
+		goto fail;
+	}
+
+	ret |= check_unmodified(data, orig, sizeof(data));
+	ret |= check_sent(ws, orig, sizeof(orig));
+
+	libws_test_STATUS("No copy message when preserving send buffers");
+	cleanup_count = 0;
+	ws_set_no_copy_cb(ws, oncleanup, NULL);
+	ws_set_preserve_send_buffers(ws, 1);
+
+	if (ws_send_msg_ex(ws, (char *)data, sizeof(data), 1))
+	{
+		libws_test_FAILURE("Failed to send message");
+		ret = -1;
+		goto fail;
+	}
+
+	ret |= check_unmodified(data, orig, sizeof(data));
+	ret |= check_sent(ws, orig, sizeof(orig));
+
+	if (cleanup_count != 1)
+	{
+		libws_test_FAILURE("Expected the cleanup callback to be called once, "
+							"got %d", cleanup_count);
+		ret |= -1;
+	}
+
+	libws_test_STATUS("Same buffer sent fragmented to several frames");
+	ws_set_max_frame_size(ws, 64);
+
+	for (i = 0; i < 2; i++)
+	{
+		if (ws_send_msg_ex(ws, (char *)data, sizeof(data), 1))
+		{
+			libws_test_FAILURE("Failed to send message");
+			ret = -1;
+			goto fail;
+		}
+
+		ret |= check_unmodified(data, orig, sizeof(data));
+		ret |= check_sent(ws, orig, sizeof(orig));
+	}
+
+	libws_test_STATUS("Small no copy message is written with its header");
+	ws_set_max_frame_size(ws, 0);
+	ws_set_preserve_send_buffers(ws, 0);
+	cleanup_count = 0;
+
+	if (ws_send_msg_ex(ws, (char *)data, 10, 1))
+	{
+		libws_test_FAILURE("Failed to send message");
+		ret = -1;
+		goto fail;
+	}
+
+	if ((evbuffer_peek(bufferevent_get_output(ws->bev), -1, NULL, NULL, 0) != 1)
+	 || (cleanup_count != 1))
+	{
+		libws_test_FAILURE("Expected the frame in a single chain");
+		ret |= -1;
+	}
+
+	ret |= check_unmodified(data, orig, sizeof(data));
+	ret |= check_sent(ws, orig, 10);
+
+	libws_test_STATUS("Small frames in a fragmented message");
+	ws_set_no_copy_cb(ws, NULL, NULL);
+	
+	if (ws_msg_begin(ws, 0)
+	 || ws_msg_frame_send(ws, (char *)data, 3)
+	 || ws_msg_frame_send(ws, (char *)&data[3], 50)
+	 || ws_msg_end(ws))
+	{
+		libws_test_FAILURE("Failed to send message");
+		ret = -1;
+		goto fail;
+	}
+
+	ret |= check_unmodified(data, orig, sizeof(data));
+	ret |= check_sent(ws, orig, 53);
+
+	libws_test_STATUS("Several messages sent in one batch");
+	{
+		ws_msg_desc_t msgs[5];
+		size_t sizes[5] = { 10, 0, 130, 1, 100 };
+
+		for (i = 0, pos = 0; i < 5; pos += sizes[i], i++)
+		{
+			msgs[i].msg = (char *)&data[pos];
+			msgs[i].len = sizes[i];
+			msgs[i].binary = (int)(i & 1);
+		}
+
+		if (ws_send_msgs(ws, msgs, 5, NULL))
+		{
+			libws_test_FAILURE("Failed to send messages");
+			ret = -1;
+			goto fail;
+		}
+
+		ret |= check_unmodified(data, orig, sizeof(data));
+		ret |= check_sent(ws, orig, pos);
+
+		libws_test_STATUS("Batch with a message that has to be fragmented");
+		ws_set_max_frame_size(ws, 64);
+
+		if (ws_send_msgs(ws, msgs, 5, NULL))
+		{
+			libws_test_FAILURE("Failed to send messages");
+			ret = -1;
+			goto fail;
+		}
+
+		ret |= check_unmodified(data, orig, sizeof(data));
+		ret |= check_sent(ws, orig, pos);
+
+		libws_test_STATUS("A batch that is cut short tells how many were sent");
+		{
+			size_t sent = 0;
+
+			ws_set_fail_when_send_blocked(ws, 1);
+			ws_set_send_watermarks(ws, 0, 20);
+
+			// The first two end up above the high watermark,
+			// so the fragmented one after them would block.
+			if ((ws_send_msgs(ws, msgs, 5, &sent) != WS_SEND_WOULD_BLOCK)
+			 || (sent != 2))
+			{
+				libws_test_FAILURE("Expected 2 messages to be sent, got %lu", sent);
+				ret |= -1;
+			}
+
+			ret |= check_sent(ws, orig, 10);
+			_ws_check_send_ready(ws);
+			ws_set_send_watermarks(ws, 0, 0);
+			ws_set_fail_when_send_blocked(ws, 0);
+
+			if (ws_send_msgs(ws, &msgs[2], 3, &sent) || (sent != 3))
+			{
+				libws_test_FAILURE("Failed to send the rest of the messages");
+				ret |= -1;
+			}
+			else
+			{
+				ret |= check_sent(ws, &orig[10], pos - 10);
+			}
+		}
+	}
+
+	libws_test_STATUS("Message sent from several buffers");
+	{
+		ws_iovec_t iov[4];
+		size_t sizes[4] = { 3, 0, 61, 150 };
+
+		for (i = 0, pos = 0; i < 4; pos += sizes[i], i++)
+		{
+			iov[i].iov_base = &data[pos];
+			iov[i].iov_len = sizes[i];
+		}
+
+		ws_set_max_frame_size(ws, 0);
+
+		if (ws_send_msg_iov(ws, iov, 4, 1))
+		{
+			libws_test_FAILURE("Failed to send message");
+			ret = -1;
+			goto fail;
+		}
+
+		ret |= check_unmodified(data, orig, sizeof(data));
+		ret |= check_sent(ws, orig, pos);
+
+		libws_test_STATUS("Message sent from several buffers in several frames");
+		ws_set_max_frame_size(ws, 50);
+
+		if (ws_send_msg_iov(ws, iov, 4, 1))
+		{
+			libws_test_FAILURE("Failed to send message");
+			ret = -1;
+			goto fail;
+		}
+
+		ret |= check_unmodified(data, orig, sizeof(data));
+		ret |= check_sent(ws, orig, pos);
+	}
+
+	libws_test_STATUS("Corked frames are held back until uncorked");
+	ws_set_max_frame_size(ws, 0);
+
+	if (ws_cork(ws)
+	 || ws_send_msg_ex(ws, (char *)data, 10, 1)
+	 || ws_send_msg_ex(ws, (char *)&data[10], 20, 1))
+	{
+		libws_test_FAILURE("Failed to send corked messages");
+		ret = -1;
+		goto fail;
+	}
+
+	if (bufferevent_get_enabled(ws->bev) & EV_WRITE)
+	{
+		libws_test_FAILURE("Writing is enabled while corked");
+		ret |= -1;
+	}
+
+	if (ws_uncork(ws) || !(bufferevent_get_enabled(ws->bev) & EV_WRITE))
+	{
+		libws_test_FAILURE("Writing is not enabled after uncorking");
+		ret |= -1;
+	}
+
+	ret |= check_sent(ws, orig, 30);
+
+	libws_test_STATUS("Automatic cork is released by the event loop");
+	ws_set_auto_cork(ws, 1);
+
+	if (ws_send_msg_ex(ws, (char *)data, 10, 1)
+	 || ws_send_msg_ex(ws, (char *)&data[10], 20, 1))
+	{
+		libws_test_FAILURE("Failed to send messages");
+		ret = -1;
+		goto fail;
+	}
+
+	if (!ws->corked || (bufferevent_get_enabled(ws->bev) & EV_WRITE))
+	{
+		libws_test_FAILURE("Expected to be corked after sending");
+		ret |= -1;
+	}
+
+	event_base_loop(base->ev_base, EVLOOP_NONBLOCK);
+
+	if (ws->corked || !(bufferevent_get_enabled(ws->bev) & EV_WRITE))
+	{
+		libws_test_FAILURE("Expected to be uncorked after the loop iteration");
+		ret |= -1;
+	}
+	else
+	{
+		libws_test_SUCCESS("Uncorked after the loop iteration");
+	}
+
+	// Don't let the loop try to write to the missing socket.
+	bufferevent_disable(ws->bev, EV_WRITE);
+	ret |= check_sent(ws, orig, 30);
+
+	libws_test_STATUS("Tagged messages complete when drained from the send buffer");
+	ws_set_auto_cork(ws, 0);
+	ws_set_onsend_complete_cb(ws, oncomplete, NULL);
+	completed_count = 0;
+	failed_count = 0;
+
+	if (ws_send_msg_tagged(ws, (char *)data, 10, 1, &data[0])
+	 || ws_send_msg_tagged(ws, (char *)&data[10], 20, 1, &data[10]))
+	{
+		libws_test_FAILURE("Failed to send tagged messages");
+		ret = -1;
+		goto fail;
+	}
+
+	// 2 byte header and 4 byte mask for each.
+	if (ws_get_send_queue_bytes(ws) != (16 + 26))
+	{
+		libws_test_FAILURE("Expected 42 queued bytes, got %llu", 
+							ws_get_send_queue_bytes(ws));
+		ret |= -1;
+	}
+
+	evbuffer_drain(bufferevent_get_output(ws->bev), 15);
+
+	if (completed_count != 0)
+	{
+		libws_test_FAILURE("Completed before the last byte was drained");
+		ret |= -1;
+	}
+
+	evbuffer_drain(bufferevent_get_output(ws->bev), 1);
+
+	if (completed_count != 0)
+	{
+		libws_test_FAILURE("Completed from within the send buffer callback");
+		ret |= -1;
+	}
+
+	event_base_loop(base->ev_base, EVLOOP_NONBLOCK);
+
+	if ((completed_count != 1) || (last_tag != &data[0]))
+	{
+		libws_test_FAILURE("Expected the first message to be completed");
+		ret |= -1;
+	}
+
+	evbuffer_drain(bufferevent_get_output(ws->bev), 26);
+	event_base_loop(base->ev_base, EVLOOP_NONBLOCK);
+
+	if ((completed_count != 2) || (last_tag != &data[10]) || failed_count)
+	{
+		libws_test_FAILURE("Expected the second message to be completed");
+		ret |= -1;
+	}
+	else
+	{
+		libws_test_SUCCESS("Both messages completed in order");
+	}
+
+	libws_test_STATUS("Sends fail while the send buffer is above the high watermark");
+	{
+		struct evbuffer *out = bufferevent_get_output(ws->bev);
+
+		ws_set_onsend_blocked_cb(ws, onblocked, NULL);
+		ws_set_onsend_ready_cb(ws, onready, NULL);
+		ws_set_fail_when_send_blocked(ws, 1);
+
+		if (ws_set_send_watermarks(ws, 50, 20) != -1)
+		{
+			libws_test_FAILURE("Expected a low watermark above the high one to fail");
+			ret |= -1;
+		}
+
+		if (ws_set_send_watermarks(ws, 20, 50)
+		 || ws_send_msg_ex(ws, (char *)data, 30, 1)
+		 || ws_is_send_blocked(ws)
+		 || ws_send_msg_ex(ws, (char *)data, 30, 1)
+		 || !ws_is_send_blocked(ws))
+		{
+			libws_test_FAILURE("Expected to be blocked after the second message");
+			ret |= -1;
+		}
+
+		if (ws_send_msg_ex(ws, (char *)data, 30, 1) != WS_SEND_WOULD_BLOCK)
+		{
+			libws_test_FAILURE("Expected the send to fail with would block");
+			ret |= -1;
+		}
+
+		if (blocked_count != 0)
+		{
+			libws_test_FAILURE("Blocked callback called from within the send");
+			ret |= -1;
+		}
+
+		event_base_loop(base->ev_base, EVLOOP_NONBLOCK);
+
+		if (blocked_count != 1)
+		{
+			libws_test_FAILURE("Expected the blocked callback to be called once");
+			ret |= -1;
+		}
+
+		evbuffer_drain(out, 51);
+		_ws_check_send_ready(ws);
+
+		if (ready_count || !ws_is_send_blocked(ws))
+		{
+			libws_test_FAILURE("Unblocked before reaching the low watermark");
+			ret |= -1;
+		}
+
+		evbuffer_drain(out, 1);
+		_ws_check_send_ready(ws);
+
+		if ((ready_count != 1) || ws_is_send_blocked(ws))
+		{
+			libws_test_FAILURE("Expected to be unblocked at the low watermark");
+			ret |= -1;
+		}
+		else
+		{
+			libws_test_SUCCESS("Blocked and unblocked at the watermarks");
+		}
+
+		evbuffer_drain(out, evbuffer_get_length(out));
+		ws_set_send_watermarks(ws, 0, 0);
+	}
+
+	libws_test_STATUS("Streamed message is produced as the send buffer drains");
+	{
+		size_t sent = 0;
+		int frames = 0;
+
+		ws_set_max_frame_size(ws, 64);
+		stream_data = orig;
+		stream_len = 300;
+		stream_pos = 0;
+		stream_stalled = 0;
+
+		if (ws_send_stream(ws, 1, onproduce, NULL))
+		{
+			libws_test_FAILURE("Failed to start stream");
+			ret = -1;
+			goto fail;
+		}
+
+		while (sent < stream_len)
+		{
+			size_t queued = (size_t)ws_get_send_queue_bytes(ws);
+
+			// Only a single frame at a time.
+			if ((queued == 0) && stream_stalled && ws->stream_producer)
+			{
+				ws_send_stream_resume(ws);
+				continue;
+			}
+
+			if ((queued == 0) || (queued > (64 + 6)) || (frames > 10))
+			{
+				libws_test_FAILURE("Unexpected %lu queued bytes after %lu "
+									"bytes of the stream", queued, sent);
+				ret = -1;
+				goto fail;
+			}
+
+			ret |= check_sent(ws, &orig[sent], queued - 6);
+			sent += queued - 6;
+			frames++;
+			_ws_send_stream_pump(ws);
+		}
+
+		if (ws->stream_producer || (ws->send_state != WS_SEND_STATE_NONE)
+		 || ws_get_send_queue_bytes(ws))
+		{
+			libws_test_FAILURE("Expected the stream to be done");
+			ret |= -1;
+		}
+
+		ws_set_max_frame_size(ws, 0);
+	}
+
+	libws_test_STATUS("A failed stream lets other messages be sent");
+	{
+		if (ws_send_stream(ws, 1, onproduce_fail, NULL) != -1)
+		{
+			libws_test_FAILURE("Expected the stream to fail");
+			ret |= -1;
+		}
+
+		// Pretend to have reconnected.
+		evbuffer_drain(bufferevent_get_output(ws->bev), 
+					evbuffer_get_length(bufferevent_get_output(ws->bev)));
+		ws->state = WS_STATE_CONNECTED;
+		ws->sent_close = 0;
+
+		if (ws->stream_producer || (ws->send_state != WS_SEND_STATE_NONE)
+		 || ws_send_msg_ex(ws, (char *)data, 10, 1))
+		{
+			libws_test_FAILURE("Expected to send a message after the stream failed");
+			ret |= -1;
+		}
+		else
+		{
+			ret |= check_sent(ws, data, 10);
+		}
+	}
+
+	libws_test_STATUS("Control frames are refused in the middle of a frame");
+	{
+		if (ws_msg_begin(ws, 1) || ws_msg_frame_data_begin(ws, 300)
+		 || ws_msg_frame_data_send(ws, (char *)data, 150))
+		{
+			libws_test_FAILURE("Failed to begin frame");
+			ret = -1;
+			goto fail;
+		}
+
+		if (!ws_send_pong(ws, NULL, 0))
+		{
+			libws_test_FAILURE("Sent a pong in the middle of the frame payload");
+			ret |= -1;
+		}
+
+		if (ws_msg_frame_data_send(ws, (char *)&data[150], 150))
+		{
+			libws_test_FAILURE("Failed to send frame data");
+			ret = -1;
+			goto fail;
+		}
+
+		// Fine in between the frames of a message.
+		if (ws_send_pong(ws, NULL, 0))
+		{
+			libws_test_FAILURE("Failed to send a pong after the frame payload");
+			ret |= -1;
+		}
+
+		if (ws_msg_end(ws))
+		{
+			libws_test_FAILURE("Failed to end message");
+			ret = -1;
+			goto fail;
+		}
+
+		ret |= check_sent(ws, orig, 300);
+	}
+
+	libws_test_STATUS("Messages from other threads are sent in order in one go");
+	ws_set_no_copy_cb(ws, oncleanup, NULL);
+	ws_set_preserve_send_buffers(ws, 1);
+	cleanup_count = 0;
+
+	if (ws_threadsafe_send_msg_ex(ws, (char *)data, 10, 1)
+	 || ws_threadsafe_send_msg_ex(ws, (char *)&data[10], 20, 1)
+	 || ws_threadsafe_send_msg_ex(ws, (char *)&data[30], 70, 1))
+	{
+		libws_test_FAILURE("Failed to queue messages");
+		ret = -1;
+		goto fail;
+	}
+
+	if (evbuffer_get_length(bufferevent_get_output(ws->bev)) != 0)
+	{
+		libws_test_FAILURE("Expected nothing to be sent before the loop runs");
+		ret |= -1;
+	}
+
+	event_base_loop(base->ev_base, EVLOOP_NONBLOCK);
+	bufferevent_disable(ws->bev, EV_WRITE);
+
+	if (cleanup_count != 3)
+	{
+		libws_test_FAILURE("Expected all 3 messages to be released, got %d",
+							cleanup_count);
+		ret |= -1;
+	}
+
+	ret |= check_unmodified(data, orig, sizeof(data));
+	ret |= check_sent(ws, orig, 100);
+
+	#ifndef LIBWS_EXTERNAL_LOOP
+	libws_test_STATUS("A message from another thread is released if the loop can't be woken up");
+	{
+		struct event *threadsafe_event = ws->threadsafe_event;
+		ws->threadsafe_event = NULL;
+		cleanup_count = 0;
+
+		if (ws_threadsafe_send_msg_ex(ws, (char *)data, 10, 1) != -1)
+		{
+			libws_test_FAILURE("Expected the send to fail");
+			ret |= -1;
+		}
+
+		ws->threadsafe_event = threadsafe_event;
+
+		if ((cleanup_count != 1) || ws->threadsafe_queue)
+		{
+			libws_test_FAILURE("Expected only the failed message to be released");
+			ret |= -1;
+		}
+		else
+		{
+			libws_test_SUCCESS("The failed message was released");
+		}
+	}
+	#endif
+
+	libws_test_STATUS("Messages never sent are released on destroy");
+	cleanup_count = 0;
+	failed_count = 0;
+
+	if (ws_threadsafe_send_msg_ex(ws, (char *)data, 10, 1)
+	 || ws_send_msg_tagged(ws, (char *)data, 10, 1, NULL))
+	{
+		libws_test_FAILURE("Failed to queue message");
+		ret = -1;
+		goto fail;
+	}
+
+	ws_destroy(&ws);
+
+	if (cleanup_count != 2)
+	{
+		libws_test_FAILURE("Expected the messages to be released on destroy");
+		ret |= -1;
+	}
+
+	if (failed_count != 1)
+	{
+		libws_test_FAILURE("Expected the tagged message to be reported as not sent");
+		ret |= -1;
+	}
+
+fail:
+	ws_destroy(&ws);
+	ws_global_destroy(&base);
+
+	return ret;
+}
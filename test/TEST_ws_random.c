@@ -0,0 +1,174 @@
+#include "libws_test_helpers.h"
+#include "libws.h"
+#include "libws_random.h"
+#include <string.h>
+#include <fcntl.h>
+
+#ifndef _WIN32
+#include <unistd.h>
+#include <sys/wait.h>
+#endif
+
+static int test_chacha20_block()
+{
+	// RFC 8439 section 2.3.2.
+	const uint32_t key[8] =
+	{
+		0x03020100, 0x07060504, 0x0b0a0908, 0x0f0e0d0c,
+		0x13121110, 0x17161514, 0x1b1a1918, 0x1f1e1d1c
+	};
+	const uint32_t nonce[3] = { 0x09000000, 0x4a000000, 0x00000000 };
+	const uint8_t expected[64] =
+	{
+		0x10, 0xf1, 0xe7, 0xe4, 0xd1, 0x3b, 0x59, 0x15,
+		0x50, 0x0f, 0xdd, 0x1f, 0xa3, 0x20, 0x71, 0xc4,
+		0xc7, 0xd1, 0xf4, 0xc7, 0x33, 0xc0, 0x68, 0x03,
+		0x04, 0x22, 0xaa, 0x9a, 0xc3, 0xd4, 0x6c, 0x4e,
+		0xd2, 0x82, 0x64, 0x46, 0x07, 0x9f, 0xaa, 0x09,
+		0x14, 0xc2, 0xd7, 0x05, 0xd9, 0x8b, 0x02, 0xa2,
+		0xb5, 0x12, 0x9c, 0xd1, 0xde, 0x16, 0x4e, 0xb9,
+		0xcb, 0xd0, 0x83, 0xe8, 0xa2, 0x50, 0x3c, 0x4e
+	};
+	uint8_t out[64];
+
+	_ws_chacha20_block(key, 1, nonce, out);
+
+	if (memcmp(out, expected, sizeof(out)))
+	{
+		libws_test_FAILURE("ChaCha20 block does not match the RFC 8439 test vector");
+		return -1;
+	}
+
+	libws_test_SUCCESS("ChaCha20 block matches the RFC 8439 test vector");
+	return 0;
+}
+
+int TEST_ws_random(int argc, char *argv[])
+{
+	int ret = 0;
+	int fd = -1;
+	size_t i;
+	size_t repeats;
+	ws_random_t r;
+	uint32_t masks[1000];
+	char prev[16];
+	char buf[16];
+
+	libws_test_HEADLINE("TEST_ws_random");
+
+	if (libws_test_init(argc, argv)) return -1;
+
+	ret |= test_chacha20_block();
+
+	#ifndef _WIN32
+	if ((fd = open(WS_RANDOM_PATH, O_RDONLY)) < 0)
+	{
+		libws_test_FAILURE("Failed to open %s", WS_RANDOM_PATH);
+		return -1;
+	}
+	#endif
+
+	libws_test_STATUS("Generate masks across several refills and a reseed");
+	if (_ws_random_init(&r, fd))
+	{
+		libws_test_FAILURE("Failed to init random generator");
+		ret = -1;
+		goto fail;
+	}
+
+	// Make the next refill reseed.
+	r.generated = WS_RANDOM_RESEED_BYTES;
+
+	if (_ws_random_bytes(&r, (char *)masks, sizeof(masks)))
+	{
+		libws_test_FAILURE("Failed to get random bytes");
+		ret = -1;
+		goto fail;
+	}
+
+	if (r.generated >= WS_RANDOM_RESEED_BYTES)
+	{
+		libws_test_FAILURE("Expected the generator to be reseeded");
+		ret |= -1;
+	}
+
+	for (i = 1, repeats = 0; i < (sizeof(masks) / sizeof(masks[0])); i++)
+	{
+		if (masks[i] == masks[i - 1])
+		{
+			repeats++;
+		}
+	}
+
+	// Not impossible, but very unlikely.
+	if (repeats > 1)
+	{
+		libws_test_FAILURE("Got %lu repeated masks", repeats);
+		ret |= -1;
+	}
+
+	if (_ws_random_bytes(&r, prev, sizeof(prev))
+	 || _ws_random_bytes(&r, buf, sizeof(buf))
+	 || !memcmp(prev, buf, sizeof(buf)))
+	{
+		libws_test_FAILURE("Expected different random bytes");
+		ret |= -1;
+	}
+	else
+	{
+		libws_test_SUCCESS("Got different random bytes");
+	}
+
+	#ifndef _WIN32
+	libws_test_STATUS("A forked child does not repeat the output of the parent");
+	{
+		int fds[2];
+		int status;
+		pid_t pid;
+
+		if (pipe(fds))
+		{
+			libws_test_FAILURE("Failed to create pipe");
+			ret = -1;
+			goto fail;
+		}
+
+		if ((pid = fork()) == 0)
+		{
+			_ws_random_bytes(&r, buf, sizeof(buf));
+			(void)!write(fds[1], buf, sizeof(buf));
+			_exit(0);
+		}
+
+		if ((pid < 0)
+		 || (read(fds[0], prev, sizeof(prev)) != sizeof(prev))
+		 || _ws_random_bytes(&r, buf, sizeof(buf))
+		 || !memcmp(prev, buf, sizeof(buf)))
+		{
+			libws_test_FAILURE("The child got the same random bytes as the parent");
+			ret |= -1;
+		}
+		else
+		{
+			libws_test_SUCCESS("The child got other random bytes than the parent");
+		}
+
+		if (pid > 0)
+		{
+			waitpid(pid, &status, 0);
+		}
+
+		close(fds[0]);
+		close(fds[1]);
+	}
+	#endif
+
+fail:
+	_ws_random_destroy(&r);
+
+	#ifndef _WIN32
+	close(fd);
+	#endif
+
+	return ret;
+}
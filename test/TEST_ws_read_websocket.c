@@ -0,0 +1,470 @@
+#include "libws_test_helpers.h"
+#include "libws.h"
+#include "libws_private.h"
+#include "libws_log.h"
+#include <string.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+
+typedef struct test_msg_s
+{
+	int count;
+	int binary;
+	int pause;
+	char *msg;
+	uint64_t len;
+	char data[512];
+} test_msg_t;
+
+static void onmsg(ws_t ws, char *msg, uint64_t len, int binary, void *arg)
+{
+	test_msg_t *m = (test_msg_t *)arg;
+
+	m->count++;
+	m->binary = binary;
+	m->msg = msg;
+	m->len = len;
+
+	if (m->pause)
+	{
+		ws_pause_reading(ws);
+	}
+
+	if (msg && (len <= sizeof(m->data)))
+	{
+		memcpy(m->data, msg, (size_t)len);
+	}
+}
+
+static void onframe_data(ws_t ws, char *payload, uint64_t len, void *arg)
+{
+	test_msg_t *m = (test_msg_t *)arg;
+
+	if ((m->len + len) <= sizeof(m->data))
+	{
+		memcpy(&m->data[m->len], payload, (size_t)len);
+	}
+
+	m->len += len;
+}
+
+static void onmsg_iov(ws_t ws, const ws_iovec_t *iov, int iovcnt, 
+					uint64_t len, int binary, void *arg)
+{
+	test_msg_t *m = (test_msg_t *)arg;
+	int i;
+
+	m->count++;
+	m->binary = binary;
+	m->msg = (char *)iov[0].iov_base;
+	m->len = 0;
+
+	for (i = 0; i < iovcnt; i++)
+	{
+		if ((m->len + iov[i].iov_len) <= sizeof(m->data))
+		{
+			memcpy(&m->data[m->len], iov[i].iov_base, iov[i].iov_len);
+		}
+
+		m->len += iov[i].iov_len;
+	}
+
+	if (m->len != len)
+	{
+		libws_test_FAILURE("Segments add up to %llu bytes, expected %llu", m->len, len);
+		m->len = 0;
+	}
+
+	m->binary |= (iovcnt > 1) << 1;
+}
+
+static void onread(struct bufferevent *bev, void *arg)
+{
+	_ws_read_websocket((ws_t)arg, bufferevent_get_input(bev));
+}
+
+static size_t pack_frame(unsigned char *b, int fin, ws_opcode_t opcode, 
+						const char *payload, size_t len, const unsigned char *mask)
+{
+	size_t i;
+	size_t header_len = 2;
+
+	b[0] = (unsigned char)((fin << 7) | opcode);
+	b[1] = 0x80;
+
+	if (len < 126)
+	{
+		b[1] |= (unsigned char)len;
+	}
+	else
+	{
+		b[1] |= 126;
+		b[2] = (unsigned char)(len >> 8);
+		b[3] = (unsigned char)(len & 0xff);
+		header_len += 2;
+	}
+
+	memcpy(&b[header_len], mask, 4);
+	header_len += 4;
+
+	for (i = 0; i < len; i++)
+	{
+		b[header_len + i] = (unsigned char)payload[i] ^ mask[i % 4];
+	}
+
+	return header_len + len;
+}
+
+///
+/// Feeds #data to the websocket in #parts pieces of equal size. Each piece 
+/// is added as a separate chain, so that the payload is spread over
+/// several chains at offsets that are not aligned to the mask. If #read_each
+/// is not set, all pieces are added before reading.
+///
+static void feed(ws_t ws, const unsigned char *data, size_t len, 
+				size_t parts, int read_each)
+{
+	size_t offset = 0;
+	size_t step = (len + parts - 1) / parts;
+	struct evbuffer *in = bufferevent_get_input(ws->bev);
+
+	// The socket bufferevent only lets itself add to the input buffer.
+	evbuffer_unfreeze(in, 0);
+
+	while (offset < len)
+	{
+		size_t n = ((len - offset) < step) ? (len - offset) : step;
+		struct evbuffer *piece = evbuffer_new();
+
+		evbuffer_add(piece, &data[offset], n);
+		evbuffer_add_buffer(in, piece);
+		evbuffer_free(piece);
+		offset += n;
+
+		if (read_each)
+		{
+			_ws_read_websocket(ws, in);
+		}
+	}
+
+	if (!read_each)
+	{
+		_ws_read_websocket(ws, in);
+	}
+}
+
+///
+/// Makes the websocket look connected again after being closed.
+///
+static void reset_closed(ws_t ws)
+{
+	struct evbuffer *out = bufferevent_get_output(ws->bev);
+
+	evbuffer_drain(out, evbuffer_get_length(out));
+	ws->state = WS_STATE_CONNECTED;
+	ws->sent_close = 0;
+	ws->recv_aborted = 0;
+	ws->in_msg = 0;
+}
+
+static int check_closed(ws_t ws)
+{
+	if (!ws->sent_close)
+	{
+		libws_test_FAILURE("Expected the connection to be closed");
+		return -1;
+	}
+
+	libws_test_SUCCESS("Connection was closed");
+	return 0;
+}
+
+static int check_msg(test_msg_t *m, int count, const char *expected, size_t len)
+{
+	if ((m->count != count) || (m->len != len) || memcmp(m->data, expected, len))
+	{
+		libws_test_FAILURE("Got %d messages of %llu bytes, expected %d messages of %lu bytes",
+							m->count, m->len, count, len);
+		return -1;
+	}
+
+	libws_test_SUCCESS("Got the expected message of %lu bytes", len);
+	return 0;
+}
+
+int TEST_ws_read_websocket(int argc, char *argv[])
+{
+	int ret = 0;
+	size_t i;
+	size_t len;
+	size_t parts;
+	ws_base_t base = NULL;
+	ws_t ws = NULL;
+	test_msg_t m;
+	char text[300];
+	unsigned char frames[1024];
+	const unsigned char mask[4] = { 0x37, 0xfa, 0x21, 0x3d };
+
+	libws_test_HEADLINE("TEST_ws_read_websocket");
+
+	if (libws_test_init(argc, argv)) return -1;
+
+	if (ws_global_init(&base))
+	{
+		libws_test_FAILURE("Failed to init global state");
+		return -1;
+	}
+
+	if (ws_init(&ws, base))
+	{
+		libws_test_FAILURE("Failed to init websocket state");
+		ret = -1;
+		goto fail;
+	}
+
+	if (!(ws->bev = bufferevent_socket_new(base->ev_base, -1, 0)))
+	{
+		libws_test_FAILURE("Failed to create bufferevent");
+		ret = -1;
+		goto fail;
+	}
+
+	for (i = 0; i < sizeof(text); i++)
+	{
+		text[i] = 'a' + (i % 26);
+	}
+
+	ws_set_onmsg_cb(ws, onmsg, &m);
+
+	for (parts = 1; parts <= 7; parts++)
+	{
+		libws_test_STATUS("Masked text frame in %lu parts", parts);
+		memset(&m, 0, sizeof(m));
+		len = pack_frame(frames, 1, WS_OPCODE_TEXT_0X1, text, sizeof(text), mask);
+		feed(ws, frames, len, parts, 1);
+		ret |= check_msg(&m, 1, text, sizeof(text));
+
+		libws_test_STATUS("Complete masked text frame over %lu chains", parts);
+		memset(&m, 0, sizeof(m));
+		len = pack_frame(frames, 1, WS_OPCODE_TEXT_0X1, text, sizeof(text), mask);
+		feed(ws, frames, len, parts, 0);
+		ret |= check_msg(&m, 1, text, sizeof(text));
+	}
+
+	libws_test_STATUS("Several complete messages in one read");
+	memset(&m, 0, sizeof(m));
+	len = pack_frame(frames, 1, WS_OPCODE_BINARY_0X2, text, 10, mask);
+	len += pack_frame(&frames[len], 1, WS_OPCODE_TEXT_0X1, NULL, 0, mask);
+	len += pack_frame(&frames[len], 1, WS_OPCODE_TEXT_0X1, text, 77, mask);
+	feed(ws, frames, len, 1, 0);
+	ret |= check_msg(&m, 3, text, 77);
+
+	libws_test_STATUS("Fragmented message with an interjected ping in 5 parts");
+	memset(&m, 0, sizeof(m));
+	len = pack_frame(frames, 0, WS_OPCODE_TEXT_0X1, text, 13, mask);
+	len += pack_frame(&frames[len], 1, WS_OPCODE_PING_0X9, NULL, 0, mask);
+	len += pack_frame(&frames[len], 0, WS_OPCODE_CONTINUATION_0X0, &text[13], 130, mask);
+	len += pack_frame(&frames[len], 1, WS_OPCODE_CONTINUATION_0X0, &text[143], 57, mask);
+	feed(ws, frames, len, 5, 1);
+	ret |= check_msg(&m, 1, text, 200);
+
+	libws_test_STATUS("Fragmented message is built in the contiguous message buffer");
+	memset(&m, 0, sizeof(m));
+	feed(ws, frames, len, 2, 1);
+	ret |= check_msg(&m, 1, text, 200);
+
+	if (m.msg != ws->msg_buf)
+	{
+		libws_test_FAILURE("Message was not delivered from the message buffer");
+		ret |= -1;
+	}
+
+	libws_test_STATUS("Receive buffers are reused with a custom frame callback");
+	{
+		struct evbuffer *frame_data;
+
+		memset(&m, 0, sizeof(m));
+		ws_set_onmsg_cb(ws, NULL, NULL);
+		ws_set_onmsg_frame_cb(ws, onframe_data, &m);
+		feed(ws, frames, len, 3, 1);
+		ret |= check_msg(&m, 0, text, 200);
+
+		frame_data = ws->frame_data;
+
+		memset(&m, 0, sizeof(m));
+		feed(ws, frames, len, 4, 1);
+		ret |= check_msg(&m, 0, text, 200);
+
+		if (!frame_data || (ws->frame_data != frame_data))
+		{
+			libws_test_FAILURE("Frame data buffer was replaced");
+			ret |= -1;
+		}
+
+		ws_set_onmsg_frame_cb(ws, NULL, NULL);
+	}
+
+	libws_test_STATUS("Complete message is delivered as segments");
+	memset(&m, 0, sizeof(m));
+	ws_set_onmsg_iov_cb(ws, onmsg_iov, &m);
+	len = pack_frame(frames, 1, WS_OPCODE_TEXT_0X1, text, sizeof(text), mask);
+	feed(ws, frames, len, 3, 0);
+	ret |= check_msg(&m, 1, text, sizeof(text));
+
+	if (!(m.binary & 2))
+	{
+		libws_test_FAILURE("Expected the message in several segments");
+		ret |= -1;
+	}
+
+	libws_test_STATUS("Fragmented message is delivered as segments");
+	memset(&m, 0, sizeof(m));
+	len = pack_frame(frames, 0, WS_OPCODE_BINARY_0X2, text, 100, mask);
+	len += pack_frame(&frames[len], 1, WS_OPCODE_CONTINUATION_0X0, &text[100], 150, mask);
+	feed(ws, frames, len, 4, 1);
+	ret |= check_msg(&m, 1, text, 250);
+
+	if (!(m.binary & 1))
+	{
+		libws_test_FAILURE("Expected a binary message");
+		ret |= -1;
+	}
+
+	ws_set_onmsg_iov_cb(ws, NULL, NULL);
+
+	libws_test_STATUS("Custom frame data callback gets unmasked data");
+	memset(&m, 0, sizeof(m));
+	ws_set_onmsg_cb(ws, NULL, NULL);
+	ws_set_onmsg_frame_data_cb(ws, onframe_data, &m);
+	len = pack_frame(frames, 1, WS_OPCODE_BINARY_0X2, text, 250, mask);
+	feed(ws, frames, len, 3, 1);
+	ret |= check_msg(&m, 0, text, 250);
+
+	libws_test_STATUS("Pausing reading from the message callback");
+	memset(&m, 0, sizeof(m));
+	m.pause = 1;
+	ws_set_onmsg_frame_data_cb(ws, NULL, NULL);
+	ws_set_onmsg_cb(ws, onmsg, &m);
+	len = pack_frame(frames, 1, WS_OPCODE_TEXT_0X1, text, 10, mask);
+	len += pack_frame(&frames[len], 1, WS_OPCODE_TEXT_0X1, text, 20, mask);
+	len += pack_frame(&frames[len], 1, WS_OPCODE_TEXT_0X1, text, 30, mask);
+	feed(ws, frames, len, 2, 0);
+	ret |= check_msg(&m, 1, text, 10);
+
+	if (!ws_is_reading_paused(ws) 
+	 || (evbuffer_get_length(bufferevent_get_input(ws->bev)) == 0))
+	{
+		libws_test_FAILURE("Expected the rest of the data to be left unread");
+		ret |= -1;
+	}
+
+	libws_test_STATUS("Resuming reading processes the buffered data");
+	m.pause = 0;
+	ws->connect_state = WS_CONNECT_STATE_HANDSHAKE_COMPLETE;
+	bufferevent_setcb(ws->bev, onread, NULL, NULL, ws);
+	ws_resume_reading(ws);
+	event_base_loop(base->ev_base, EVLOOP_NONBLOCK);
+	ret |= check_msg(&m, 3, text, 30);
+
+	libws_test_STATUS("Too big frame closes the connection and is skipped");
+	memset(&m, 0, sizeof(m));
+	ws->state = WS_STATE_CONNECTED;
+	ws_set_max_recv_frame_size(ws, 100);
+	len = pack_frame(frames, 1, WS_OPCODE_TEXT_0X1, text, 150, mask);
+	len += pack_frame(&frames[len], 1, WS_OPCODE_TEXT_0X1, text, 10, mask);
+	feed(ws, frames, len, 3, 1);
+	ret |= check_msg(&m, 0, text, 0);
+	ret |= check_closed(ws);
+
+	if (evbuffer_get_length(bufferevent_get_input(ws->bev)) || ws->recv_skip_len)
+	{
+		libws_test_FAILURE("Expected the frames to be skipped");
+		ret |= -1;
+	}
+
+	libws_test_STATUS("Too big fragmented message closes the connection");
+	memset(&m, 0, sizeof(m));
+	reset_closed(ws);
+	ws_set_max_recv_frame_size(ws, 0);
+	ws_set_max_message_size(ws, 100);
+	len = pack_frame(frames, 0, WS_OPCODE_TEXT_0X1, text, 60, mask);
+	len += pack_frame(&frames[len], 1, WS_OPCODE_CONTINUATION_0X0, text, 60, mask);
+	feed(ws, frames, len, 1, 0);
+	ret |= check_msg(&m, 0, text, 0);
+	ret |= check_closed(ws);
+
+	libws_test_STATUS("Message within the max message size");
+	memset(&m, 0, sizeof(m));
+	reset_closed(ws);
+	len = pack_frame(frames, 0, WS_OPCODE_TEXT_0X1, text, 60, mask);
+	len += pack_frame(&frames[len], 1, WS_OPCODE_CONTINUATION_0X0, &text[60], 40, mask);
+	feed(ws, frames, len, 2, 1);
+	ret |= check_msg(&m, 1, text, 100);
+	ws_set_max_message_size(ws, 0);
+
+	libws_test_STATUS("Exceeding the max buffered data closes the connection");
+	memset(&m, 0, sizeof(m));
+	reset_closed(ws);
+	ws_set_max_recv_buffered(ws, 100);
+	len = pack_frame(frames, 0, WS_OPCODE_TEXT_0X1, text, 60, mask);
+	len += pack_frame(&frames[len], 0, WS_OPCODE_CONTINUATION_0X0, text, 60, mask);
+	feed(ws, frames, len, 1, 0);
+	ret |= check_msg(&m, 0, text, 0);
+	ret |= check_closed(ws);
+
+	libws_test_STATUS("Complete message with invalid UTF8 is not delivered");
+	{
+		char invalid[] = { 'a', (char)0xc3, 'b' };
+
+		memset(&m, 0, sizeof(m));
+		reset_closed(ws);
+		ws_set_max_recv_buffered(ws, 0);
+		len = pack_frame(frames, 1, WS_OPCODE_TEXT_0X1, invalid, sizeof(invalid), mask);
+		feed(ws, frames, len, 1, 0);
+		ret |= check_msg(&m, 0, text, 0);
+		ret |= check_closed(ws);
+
+		if (evbuffer_get_length(bufferevent_get_input(ws->bev)))
+		{
+			libws_test_FAILURE("Expected the invalid message to be drained");
+			ret |= -1;
+		}
+	}
+
+	libws_test_STATUS("A huge announced payload length is not reserved up front");
+	{
+		unsigned char huge[] =
+		{
+			0x01, 0x80 | 127, 0, 0, 0x01, 0, 0, 0, 0, 0,
+			0x37, 0xfa, 0x21, 0x3d,
+			'a' ^ 0x37, 'b' ^ 0xfa, 'c' ^ 0x21, 'd' ^ 0x3d
+		};
+
+		memset(&m, 0, sizeof(m));
+		reset_closed(ws);
+		feed(ws, huge, sizeof(huge), 1, 0);
+
+		if (ws->sent_close || (ws->msg_buf_size > WS_RECV_RESERVE_MAX)
+		 || (ws->msg_buf_len != 4))
+		{
+			libws_test_FAILURE("Reserved %lu bytes for 4 received bytes",
+								ws->msg_buf_size);
+			ret |= -1;
+		}
+		else
+		{
+			libws_test_SUCCESS("Reserved %lu bytes for 4 received bytes",
+								ws->msg_buf_size);
+		}
+
+		ws->has_header = 0;
+		ws->in_msg = 0;
+		ws->msg_contiguous = 0;
+	}
+
+fail:
+	ws_destroy(&ws);
+	ws_global_destroy(&base);
+
+	return ret;
+}
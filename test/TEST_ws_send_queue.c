@@ -0,0 +1,534 @@
+#include "libws_test_helpers.h"
+#include "libws.h"
+#include "libws_private.h"
+#include "libws_log.h"
+#include <string.h>
+#include <stdlib.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+
+typedef struct expected_frame_s
+{
+	int opcode;
+	int fin;
+	size_t len;
+	unsigned char first;		///< First payload byte, if any.
+} expected_frame_t;
+
+///
+/// Takes the frames from the send buffer one by one, letting the
+/// scheduler refill it in between, and compares them to #expected.
+///
+static int check_frames(ws_t ws, const expected_frame_t *expected, size_t count)
+{
+	struct evbuffer *out = bufferevent_get_output(ws->bev);
+	size_t i = 0;
+
+	while (evbuffer_get_length(out) > 0)
+	{
+		unsigned char *buf = evbuffer_pullup(out, -1);
+		size_t buf_len = evbuffer_get_length(out);
+		size_t header_len;
+		ws_header_t h;
+		unsigned char first = 0;
+
+		if (ws_unpack_header(&h, &header_len, buf, buf_len)
+			!= WS_PARSE_STATE_SUCCESS)
+		{
+			libws_test_FAILURE("Failed to parse sent frame header");
+			return -1;
+		}
+
+		if (h.payload_len > 0)
+		{
+			first = buf[header_len] ^ ((uint8_t *)&h.mask)[0];
+		}
+
+		if ((i >= count)
+		 || (h.opcode != expected[i].opcode)
+		 || (h.fin != expected[i].fin)
+		 || (h.payload_len != expected[i].len)
+		 || (h.payload_len && (first != expected[i].first)))
+		{
+			libws_test_FAILURE("Unexpected frame %lu: opcode 0x%x, fin %d, "
+								"length %llu", i, h.opcode, h.fin, h.payload_len);
+			return -1;
+		}
+
+		evbuffer_drain(out, header_len + (size_t)h.payload_len);
+		_ws_sendq_pump(ws);
+		i++;
+	}
+
+	if (i != count)
+	{
+		libws_test_FAILURE("Got %lu frames, expected %lu", i, count);
+		return -1;
+	}
+
+	libws_test_SUCCESS("Got the %lu expected frames", count);
+	return 0;
+}
+
+static int onproduce(ws_t ws, char *buf, size_t *len, void *arg)
+{
+	*len = 0;
+	return 1;
+}
+
+static int dropped_count;
+static uint64_t dropped_len;
+
+static void ondropped(ws_t ws, char *msg, uint64_t len, int binary, void *arg)
+{
+	dropped_count++;
+	dropped_len = len;
+}
+
+int TEST_ws_send_queue(int argc, char *argv[])
+{
+	int ret = 0;
+	size_t i;
+	ws_base_t base = NULL;
+	ws_t ws = NULL;
+	unsigned char data[300];
+
+	libws_test_HEADLINE("TEST_ws_send_queue");
+
+	if (libws_test_init(argc, argv)) return -1;
+
+	if (ws_global_init(&base))
+	{
+		libws_test_FAILURE("Failed to init global state");
+		return -1;
+	}
+
+	if (ws_init(&ws, base))
+	{
+		libws_test_FAILURE("Failed to init websocket state");
+		ret = -1;
+		goto fail;
+	}
+
+	if (!(ws->bev = bufferevent_socket_new(base->ev_base, -1, 0)))
+	{
+		libws_test_FAILURE("Failed to create bufferevent");
+		ret = -1;
+		goto fail;
+	}
+
+	ws->state = WS_STATE_CONNECTED;
+
+	if (_ws_track_send_completions(ws))
+	{
+		libws_test_FAILURE("Failed to track send completions");
+		ret = -1;
+		goto fail;
+	}
+
+	// Only the socket may remove data from the send buffer otherwise.
+	evbuffer_unfreeze(bufferevent_get_output(ws->bev), 1);
+
+	for (i = 0; i < sizeof(data); i++)
+	{
+		data[i] = (unsigned char)i;
+	}
+
+	libws_test_STATUS("Control frames and priorities overtake queued data");
+	{
+		const expected_frame_t expected[] =
+		{
+			{ WS_OPCODE_BINARY_0X2, 0, 64, 0 },
+			{ WS_OPCODE_PING_0X9, 1, 4, 'p' },
+			{ WS_OPCODE_CONTINUATION_0X0, 0, 64, 64 },
+			{ WS_OPCODE_CONTINUATION_0X0, 0, 64, 128 },
+			{ WS_OPCODE_CONTINUATION_0X0, 1, 8, 192 },
+			{ WS_OPCODE_TEXT_0X1, 1, 10, 250 },
+			{ WS_OPCODE_BINARY_0X2, 1, 20, 200 },
+		};
+
+		ws_set_max_frame_size(ws, 64);
+		ws_set_send_queue(ws, 1);
+
+		if (ws_send_msg_prio(ws, (char *)data, 200, 1, WS_SEND_PRIORITY_LOW)
+		 || ws_send_msg_ex(ws, (char *)&data[200], 20, 1)
+		 || ws_send_msg_prio(ws, (char *)&data[250], 10, 0, WS_SEND_PRIORITY_HIGH))
+		{
+			libws_test_FAILURE("Failed to queue messages");
+			ret = -1;
+			goto fail;
+		}
+
+		// The first fragment is in the send buffer already.
+		if ((ws_get_send_queue_msgs(ws) != 3)
+		 || (ws_get_send_queue_bytes(ws) != (136 + 20 + 10 + 64 + 6)))
+		{
+			libws_test_FAILURE("Expected 3 queued messages and 236 bytes, got %lu "
+								"and %llu", ws_get_send_queue_msgs(ws),
+								ws_get_send_queue_bytes(ws));
+			ret |= -1;
+		}
+
+		if (ws_send_ping_ex(ws, "ping", 4))
+		{
+			libws_test_FAILURE("Failed to send ping in between fragments");
+			ret = -1;
+			goto fail;
+		}
+
+		ret |= check_frames(ws, expected, sizeof(expected) / sizeof(expected[0]));
+
+		if (ws_get_send_queue_msgs(ws) || ws_get_send_queue_bytes(ws))
+		{
+			libws_test_FAILURE("Expected the send queue to be empty");
+			ret |= -1;
+		}
+	}
+
+	libws_test_STATUS("Messages that have not begun by their deadline are dropped");
+	{
+		struct timeval expired = { 0, 0 };
+		struct timeval later = { 60, 0 };
+		const expected_frame_t expected[] =
+		{
+			{ WS_OPCODE_BINARY_0X2, 0, 64, 0 },
+			{ WS_OPCODE_CONTINUATION_0X0, 0, 64, 64 },
+			{ WS_OPCODE_CONTINUATION_0X0, 0, 64, 128 },
+			{ WS_OPCODE_CONTINUATION_0X0, 1, 8, 192 },
+			{ WS_OPCODE_BINARY_0X2, 1, 20, 200 },
+		};
+
+		ws_set_onsend_dropped_cb(ws, ondropped, NULL);
+
+		if (ws_send_msg_ex(ws, (char *)data, 200, 1)
+		 || ws_send_msg_deadline(ws, (char *)&data[250], 10, 1, &expired)
+		 || ws_send_msg_deadline(ws, (char *)&data[200], 20, 1, &later))
+		{
+			libws_test_FAILURE("Failed to queue messages");
+			ret = -1;
+			goto fail;
+		}
+
+		ret |= check_frames(ws, expected, sizeof(expected) / sizeof(expected[0]));
+
+		if ((ws_get_send_dropped(ws) != 1) || (dropped_count != 1)
+		 || (dropped_len != 10) || ws_get_send_queue_msgs(ws))
+		{
+			libws_test_FAILURE("Expected the expired message to be dropped, "
+								"%llu dropped", ws_get_send_dropped(ws));
+			ret |= -1;
+		}
+		else
+		{
+			libws_test_SUCCESS("The expired message was dropped");
+		}
+	}
+
+	libws_test_STATUS("Messages are dropped at their deadline while the send buffer is stalled");
+	{
+		struct timeval soon = { 0, 20000 };
+		const expected_frame_t expected[] =
+		{
+			{ WS_OPCODE_BINARY_0X2, 0, 64, 0 },
+			{ WS_OPCODE_CONTINUATION_0X0, 0, 64, 64 },
+			{ WS_OPCODE_CONTINUATION_0X0, 0, 64, 128 },
+			{ WS_OPCODE_CONTINUATION_0X0, 1, 8, 192 },
+		};
+
+		dropped_count = 0;
+		dropped_len = 0;
+
+		// Don't let the loop try to write to the missing socket.
+		bufferevent_disable(ws->bev, EV_WRITE);
+
+		if (ws_send_msg_ex(ws, (char *)data, 200, 1)
+		 || ws_send_msg_deadline(ws, (char *)&data[250], 10, 1, &soon))
+		{
+			libws_test_FAILURE("Failed to queue messages");
+			ret = -1;
+			goto fail;
+		}
+
+		// Nothing drains the send buffer, so only a timer can drop it.
+		for (i = 0; (i < 100) && !dropped_count; i++)
+		{
+			event_base_loop(base->ev_base, EVLOOP_ONCE);
+		}
+
+		bufferevent_enable(ws->bev, EV_WRITE);
+
+		if ((dropped_count != 1) || (dropped_len != 10) 
+		 || (ws_get_send_queue_msgs(ws) != 1))
+		{
+			libws_test_FAILURE("Expected the expired message to be dropped, "
+								"%d dropped", dropped_count);
+			ret |= -1;
+		}
+		else
+		{
+			libws_test_SUCCESS("The expired message was dropped");
+		}
+
+		ret |= check_frames(ws, expected, sizeof(expected) / sizeof(expected[0]));
+	}
+
+	libws_test_STATUS("A newer message with the same key replaces a waiting one");
+	{
+		const expected_frame_t expected[] =
+		{
+			{ WS_OPCODE_BINARY_0X2, 0, 64, 0 },
+			{ WS_OPCODE_CONTINUATION_0X0, 0, 64, 64 },
+			{ WS_OPCODE_CONTINUATION_0X0, 0, 64, 128 },
+			{ WS_OPCODE_CONTINUATION_0X0, 1, 8, 192 },
+			{ WS_OPCODE_BINARY_0X2, 1, 12, 280 & 0xff },
+			{ WS_OPCODE_BINARY_0X2, 1, 5, 100 },
+		};
+
+		if (ws_send_msg_keyed(ws, (char *)data, 200, 1, 1)
+		 || ws_send_msg_keyed(ws, (char *)&data[250], 10, 1, 2)
+		 || ws_send_msg_keyed(ws, (char *)&data[100], 5, 1, 3)
+		 || ws_send_msg_keyed(ws, (char *)&data[280], 12, 1, 2))
+		{
+			libws_test_FAILURE("Failed to queue messages");
+			ret = -1;
+			goto fail;
+		}
+
+		if ((ws_get_send_queue_msgs(ws) != 3) || (ws_get_send_conflated(ws) != 1))
+		{
+			libws_test_FAILURE("Expected 3 queued messages and 1 replaced, got %lu "
+								"and %llu", ws_get_send_queue_msgs(ws),
+								ws_get_send_conflated(ws));
+			ret |= -1;
+		}
+
+		ret |= check_frames(ws, expected, sizeof(expected) / sizeof(expected[0]));
+	}
+
+	libws_test_STATUS("Batched messages are queued in order");
+	{
+		const ws_msg_desc_t msgs[] =
+		{
+			{ (char *)&data[10], 10, 1 },
+			{ (char *)data, 100, 1 },
+			{ (char *)&data[20], 5, 0 },
+		};
+		const expected_frame_t expected[] =
+		{
+			{ WS_OPCODE_BINARY_0X2, 0, 64, 0 },
+			{ WS_OPCODE_CONTINUATION_0X0, 0, 64, 64 },
+			{ WS_OPCODE_CONTINUATION_0X0, 0, 64, 128 },
+			{ WS_OPCODE_CONTINUATION_0X0, 1, 8, 192 },
+			{ WS_OPCODE_BINARY_0X2, 1, 10, 10 },
+			{ WS_OPCODE_BINARY_0X2, 0, 64, 0 },
+			{ WS_OPCODE_CONTINUATION_0X0, 1, 36, 64 },
+			{ WS_OPCODE_TEXT_0X1, 1, 5, 20 },
+		};
+
+		if (ws_send_msg_ex(ws, (char *)data, 200, 1)
+		 || ws_send_msgs(ws, msgs, sizeof(msgs) / sizeof(msgs[0]), NULL))
+		{
+			libws_test_FAILURE("Failed to queue messages");
+			ret = -1;
+			goto fail;
+		}
+
+		ret |= check_frames(ws, expected, sizeof(expected) / sizeof(expected[0]));
+	}
+
+	libws_test_STATUS("Messages from several buffers are queued in order");
+	{
+		const ws_iovec_t iov[] =
+		{
+			{ &data[30], 4 },
+			{ &data[34], 6 },
+		};
+		const expected_frame_t expected[] =
+		{
+			{ WS_OPCODE_BINARY_0X2, 0, 64, 0 },
+			{ WS_OPCODE_CONTINUATION_0X0, 0, 64, 64 },
+			{ WS_OPCODE_CONTINUATION_0X0, 0, 64, 128 },
+			{ WS_OPCODE_CONTINUATION_0X0, 1, 8, 192 },
+			{ WS_OPCODE_BINARY_0X2, 1, 10, 30 },
+		};
+
+		if (ws_send_msg_ex(ws, (char *)data, 200, 1)
+		 || ws_send_msg_iov(ws, iov, 2, 1))
+		{
+			libws_test_FAILURE("Failed to queue messages");
+			ret = -1;
+			goto fail;
+		}
+
+		if (ws_send_stream(ws, 1, onproduce, NULL) != -1)
+		{
+			libws_test_FAILURE("Expected a stream not to jump ahead of the queue");
+			ret |= -1;
+		}
+
+		ret |= check_frames(ws, expected, sizeof(expected) / sizeof(expected[0]));
+	}
+
+	libws_test_STATUS("Paced messages are spread out evenly");
+	{
+		struct timeval start;
+		struct timeval end;
+		struct timeval delay;
+		struct evbuffer *out = bufferevent_get_output(ws->bev);
+		const expected_frame_t expected[] =
+		{
+			{ WS_OPCODE_BINARY_0X2, 1, 10, 0 },
+		};
+
+		ws_set_send_pacing(ws, 20, 0);
+		evutil_gettimeofday(&start, NULL);
+
+		for (i = 0; i < 3; i++)
+		{
+			if (ws_send_msg_ex(ws, (char *)data, 10, 1))
+			{
+				libws_test_FAILURE("Failed to queue messages");
+				ret = -1;
+				goto fail;
+			}
+		}
+
+		// Only the first message may begin right away.
+		delay = ws_get_send_pacing_delay(ws);
+
+		if ((ws_get_send_queue_msgs(ws) != 2) || !evutil_timerisset(&delay))
+		{
+			libws_test_FAILURE("Expected 2 messages to wait, got %lu",
+								ws_get_send_queue_msgs(ws));
+			ret |= -1;
+		}
+
+		for (i = 0; i < 3; i++)
+		{
+			ret |= check_frames(ws, expected, 1);
+
+			// The timer may fire a little early and be rearmed.
+			while (ws_get_send_queue_msgs(ws) && !evbuffer_get_length(out))
+			{
+				event_base_loop(base->ev_base, EVLOOP_ONCE);
+			}
+		}
+
+		evutil_gettimeofday(&end, NULL);
+		evutil_timersub(&end, &start, &delay);
+
+		// 2 intervals of 50ms, allowing for a coarse clock.
+		if (evbuffer_get_length(out) || ws_get_send_queue_msgs(ws)
+		 || (delay.tv_sec == 0 && delay.tv_usec < 90000))
+		{
+			libws_test_FAILURE("Expected the messages to be paced, took %ld.%06ld s",
+								(long)delay.tv_sec, (long)delay.tv_usec);
+			ret |= -1;
+		}
+		else
+		{
+			libws_test_SUCCESS("The messages were paced, took %ld.%06ld s",
+								(long)delay.tv_sec, (long)delay.tv_usec);
+		}
+
+		ws_set_send_pacing(ws, 0, 0);
+	}
+
+	libws_test_STATUS("Adaptive fragments shrink as the send buffer fills");
+	{
+		size_t sizes[3];
+		struct evbuffer *out = bufferevent_get_output(ws->bev);
+		char *filler = calloc(1, 16000);
+
+		ws_set_max_frame_size(ws, 0);
+		ws_set_adaptive_fragment_size(ws, 1);
+
+		// Without a TCP socket the window defaults to the fixed size.
+		sizes[0] = _ws_send_fragment_size(ws);
+		evbuffer_add(out, filler, 10000);
+		sizes[1] = _ws_send_fragment_size(ws);
+		evbuffer_add(out, filler, 6000);
+		sizes[2] = _ws_send_fragment_size(ws);
+		evbuffer_drain(out, evbuffer_get_length(out));
+		free(filler);
+
+		if ((sizes[0] != WS_STREAM_FRAGMENT_SIZE)
+		 || (sizes[1] != (WS_STREAM_FRAGMENT_SIZE - 10000))
+		 || (sizes[2] != WS_ADAPTIVE_FRAGMENT_MIN))
+		{
+			libws_test_FAILURE("Unexpected fragment sizes %lu, %lu, %lu",
+								sizes[0], sizes[1], sizes[2]);
+			ret |= -1;
+		}
+		else
+		{
+			libws_test_SUCCESS("Got fragment sizes %lu, %lu, %lu",
+								sizes[0], sizes[1], sizes[2]);
+		}
+
+		ws_set_max_frame_size(ws, 64);
+		ws_set_adaptive_fragment_size(ws, 0);
+	}
+
+	libws_test_STATUS("Many small messages are framed for a single write");
+	{
+		struct evbuffer *out = bufferevent_get_output(ws->bev);
+
+		ws_set_max_frame_size(ws, 0);
+
+		for (i = 0; i < 20; i++)
+		{
+			if (ws_send_msg_ex(ws, (char *)&data[i * 10], 10, 1))
+			{
+				libws_test_FAILURE("Failed to queue messages");
+				ret = -1;
+				goto fail;
+			}
+		}
+
+		// 2 byte header and 4 byte mask for each.
+		if (ws_get_send_queue_msgs(ws) 
+		 || (evbuffer_get_length(out) != (20 * (10 + 6))))
+		{
+			libws_test_FAILURE("Expected all messages in the send buffer, "
+								"%lu still queued", ws_get_send_queue_msgs(ws));
+			ret |= -1;
+		}
+		else
+		{
+			libws_test_SUCCESS("All messages are in the send buffer");
+		}
+
+		evbuffer_drain(out, evbuffer_get_length(out));
+		ws_set_max_frame_size(ws, 64);
+	}
+
+	libws_test_STATUS("Queued messages are released on shutdown");
+	{
+		if (ws_send_msg_ex(ws, (char *)data, 200, 1)
+		 || ws_send_msg_ex(ws, (char *)data, 200, 1))
+		{
+			libws_test_FAILURE("Failed to queue messages");
+			ret = -1;
+			goto fail;
+		}
+
+		_ws_sendq_clear(ws);
+
+		if (ws_get_send_queue_msgs(ws) || (ws->send_state != WS_SEND_STATE_NONE))
+		{
+			libws_test_FAILURE("Expected the send queue to be empty");
+			ret |= -1;
+		}
+		else
+		{
+			libws_test_SUCCESS("The send queue was cleared");
+		}
+	}
+
+fail:
+	ws_destroy(&ws);
+	ws_global_destroy(&base);
+
+	return ret;
+}
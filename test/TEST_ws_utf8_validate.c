@@ -1,5 +1,8 @@
 #include "libws_test_helpers.h"
+#include "libws.h"
 #include "libws_utf8.h"
+#include "libws_cpu.h"
+#include "libws_mask.h"
 #include <stdio.h>
 #include <string.h>
 
@@ -172,15 +175,145 @@ static int test_utf8_valid()
 	return ret;
 }
 
+static uint32_t rand_state = 1;
+
+static uint32_t test_rand()
+{
+	rand_state = rand_state * 1103515245 + 12345;
+	return (rand_state >> 8);
+}
+
+///
+/// Creates a mostly valid string, with an occasional bad byte.
+///
+static size_t make_utf8_str(unsigned char *buf, size_t size, int bad)
+{
+	size_t len = 0;
+	const char *chars[] = 
+	{
+		"{\"key\": 123, \"value\": \"abcdefghijklmnopqrstuvwxyz\"}", 
+		"\xc2\xb5", "\xc3\x9f", "\xe1\xbd\xb9", "\xef\xbf\xbd", 
+		"\xed\x9f\xbf", "\xf0\x9f\x98\x80", "\xf4\x8f\xbf\xbf"
+	};
+	const unsigned char bad_bytes[] = { 0x80, 0xbf, 0xc0, 0xe0, 0xed, 0xf4, 0xf5, 0xff };
+
+	while (1)
+	{
+		const char *c = chars[test_rand() % (sizeof(chars) / sizeof(chars[0]))];
+		size_t clen = strlen(c);
+
+		if ((len + clen) > size)
+			break;
+
+		memcpy(&buf[len], c, clen);
+		len += clen;
+	}
+
+	if (bad && len)
+	{
+		buf[test_rand() % len] = bad_bytes[test_rand() % sizeof(bad_bytes)];
+	}
+
+	return len;
+}
+
+///
+/// Makes sure the SIMD validators give the same result as the DFA,
+/// also when the string is split at arbitrary places.
+///
+static int test_utf8_impl(int features)
+{
+	int n;
+	unsigned char buf[300];
+	unsigned char masked[300];
+	unsigned char unmasked[300];
+	const uint32_t mask = 0xa5c3e10f;
+
+	_ws_utf8_init(features);
+	libws_test_STATUS("Compare %s validator to the DFA", _ws_utf8_impl_name());
+
+	for (n = 0; n < 2000; n++)
+	{
+		size_t split;
+		size_t len = make_utf8_str(buf, 1 + (test_rand() % sizeof(buf)), (n % 3) == 0);
+		ws_utf8_state_t expected = WS_UTF8_ACCEPT;
+		ws_utf8_state_t s = WS_UTF8_ACCEPT;
+
+		// End in the middle of a character sometimes.
+		if (((n % 5) == 1) && (len > 0))
+		{
+			len--;
+		}
+
+		_ws_utf8_init(0);
+		ws_utf8_validate(&expected, (char *)buf, len);
+		_ws_utf8_init(features);
+
+		split = len ? (test_rand() % len) : 0;
+		ws_utf8_validate(&s, (char *)buf, split);
+
+		if (s != WS_UTF8_REJECT)
+		{
+			ws_utf8_validate(&s, (char *)&buf[split], len - split);
+		}
+
+		if (s != expected)
+		{
+			print_utf8_str((char *)buf, len);
+			libws_test_FAILURE("Expected \"%u\" but got \"%u\" when split at %lu", 
+								expected, s, split);
+			return -1;
+		}
+
+		// Unmask and validate in one go, both in place and to another buffer.
+		memcpy(masked, buf, len);
+		ws_mask_payload(mask, (char *)masked, len);
+
+		s = WS_UTF8_ACCEPT;
+		_ws_utf8_unmask_validate(&s, mask, 0, (char *)unmasked, (char *)masked, split);
+		_ws_utf8_unmask_validate(&s, mask, split, (char *)&masked[split], 
+								(char *)&masked[split], len - split);
+		memcpy(&unmasked[split], &masked[split], len - split);
+
+		if ((s != expected) || memcmp(unmasked, buf, len))
+		{
+			print_utf8_str((char *)buf, len);
+			libws_test_FAILURE("Unmask and validate: expected \"%u\" but got \"%u\" "
+								"when split at %lu", expected, s, split);
+			return -1;
+		}
+	}
+
+	libws_test_SUCCESS("Same result as the DFA");
+	return 0;
+}
+
 int TEST_ws_utf8_validate(int argc, char **argv)
 {
 	int ret = 0;
+	int features = _ws_cpu_features();
 
 	libws_test_HEADLINE("TEST_ws_utf8_validate");
 
 	ret |= test_utf8_overlong();
 	ret |= test_utf8_valid();
 
+	ret |= test_utf8_impl(0);
+
+	if (features & WS_CPU_SSE41)
+	{
+		ret |= test_utf8_impl(WS_CPU_SSE41);
+	}
+
+	if (features & WS_CPU_AVX2)
+	{
+		ret |= test_utf8_impl(WS_CPU_SSE41 | WS_CPU_AVX2);
+	}
+
+	_ws_utf8_init(features);
+	ret |= test_utf8_overlong();
+	ret |= test_utf8_valid();
+
 	return ret;
 }
 